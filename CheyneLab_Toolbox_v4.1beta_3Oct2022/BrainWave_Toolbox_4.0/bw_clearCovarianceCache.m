@@ -0,0 +1,29 @@
+function bw_clearCovarianceCache(dsName)
+%       bw_clearCovarianceCache
+%
+%   function bw_clearCovarianceCache(dsName)
+%
+%   DESCRIPTION: Deletes the covariance matrices cached in the ANALYSIS
+%   directory of dataset dsName by bw_makeVS and bw_makeEventRelated.
+%   Cached matrices are recomputed automatically if the dataset is
+%   rewritten - call this to force them to be recomputed.
+%   dsName can be a cell array of dataset names.
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+    if ~iscell(dsName)
+        dsName = {dsName};
+    end
+
+    for k=1:numel(dsName)
+        files = dir(fullfile(dsName{k},'ANALYSIS','*.bwcov'));
+        for j=1:numel(files)
+            delete(fullfile(dsName{k},'ANALYSIS',files(j).name));
+        end
+        if ~isempty(files)
+            fprintf('removed %d cached covariance files from %s\n', numel(files), dsName{k});
+        end
+    end
+
+end
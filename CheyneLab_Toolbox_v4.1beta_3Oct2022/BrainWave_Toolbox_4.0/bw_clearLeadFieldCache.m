@@ -0,0 +1,41 @@
+function bw_clearLeadFieldCache(dsName)
+%       bw_clearLeadFieldCache
+%
+%   function bw_clearLeadFieldCache(dsName)
+%
+%   DESCRIPTION: Deletes the lead field (forward solution) stores saved by
+%   bw_makeEventRelated and bw_makeDifferential (all images, including a
+%   single active window) in the LEADFIELDS directory next to dataset dsName
+%   (stores are shared by all datasets in the same directory), as well as
+%   stores left in the dataset ANALYSIS directory by earlier versions.
+%   A new store is created automatically if the head model, sensor
+%   geometry or reconstruction grid changes, so old stores are not used
+%   again - call this to free disk space.
+%   dsName can be a cell array of dataset names.
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+    if ~iscell(dsName)
+        dsName = {dsName};
+    end
+
+    for k=1:numel(dsName)
+        % remove trailing separator so fileparts returns the parent directory
+        ds = dsName{k};
+        if ~isempty(ds) && ds(end) == filesep
+            ds = ds(1:end-1);
+        end
+        storeDirs = {fullfile(fileparts(ds),'LEADFIELDS'), fullfile(ds,'ANALYSIS')};
+        for i=1:numel(storeDirs)
+            files = dir(fullfile(storeDirs{i},'*.bwlf'));
+            for j=1:numel(files)
+                delete(fullfile(storeDirs{i},files(j).name));
+            end
+            if ~isempty(files)
+                fprintf('removed %d lead field files from %s\n', numel(files), storeDirs{i});
+            end
+        end
+    end
+
+end
@@ -30,6 +30,8 @@ function bw_combine_datasets(startPath)
             end
         end
 
+        % release cached datasets in case saveName is being overwritten
+        bw_flushDsCache;
         bw_combineDs(fileList, saveName);
         
         % in case mex function fails
@@ -50,6 +50,8 @@ function bw_concatenate_datasets(startPath)
 
         % call mex function to concatenate data - will check file limit
         fprintf('Concatenating data ...\n')
+        % release cached datasets in case saveName is being overwritten
+        bw_flushDsCache;
         bw_concatenateDs(fileList, saveName);
             
         % in case mex function fails
@@ -1,7 +1,7 @@
-function errorFlag = bw_epochDs(dsName, newDsName, latencies, badChannels, epochWindow, bandpass, lineFilter, downSample, saveAverage, useExtraSamples, deidentify)
+function errorFlag = bw_epochDs(dsName, newDsName, latencies, badChannels, epochWindow, bandpass, lineFilter, downSample, saveAverage, useExtraSamples, deidentify, sequentialRead, filterContinuous, antiAlias, numThreads)
 %       bw_epochDs
 %
-%   function errorFlag = bw_epochDs(dsName, newDsName, latencies, badChannels, epochWindow, bandpass, lineFilter, downSample, saveAverage, useExtraSamples, deidentify)
+%   function errorFlag = bw_epochDs(dsName, newDsName, latencies, badChannels, epochWindow, bandpass, lineFilter, downSample, saveAverage, useExtraSamples, deidentify, sequentialRead, filterContinuous, antiAlias, numThreads)
 %
 %   DESCRIPTION: Using the full path name of the .con, a given epoch time
 %   window and a list of the valid channel list indices, this function will
@@ -9,6 +9,14 @@ function errorFlag = bw_epochDs(dsName, newDsName, latencies, badChannels, epoch
 %   dsName. This function will return a value other then 0 if an error
 %   occured.
 %
+%   sequentialRead (optional, default = 1) extracts all epochs in a single forward pass 
+%   through each channel of the continuous data. Set to 0 to read each epoch separately.
+%   filterContinuous (optional, default = 0) applies the bandpass and line filters once to 
+%   the entire continuous recording and then cuts the epochs (useExtraSamples is ignored).
+%   antiAlias (optional, default = 0) lowpass filters data below the new Nyquist frequency 
+%   when downSample > 1 instead of simply dropping samples.
+%   numThreads (optional, default = 1) number of threads used to filter and write trials.
+%
 % (c) D. Cheyne, 2011. All rights reserved.
 % This software is for RESEARCH USE ONLY. Not approved for clinical use.
 
@@ -26,7 +34,8 @@ if ctf_info(4) > 1  % make sure is one trial ds
 end
 sampleRate = ctf_info(5);
 
-numTrials = length(latencies);
+% latencies must be a row vector
+latencies = latencies(:)';
 
 preTrigPts = abs(epochWindow(1) * sampleRate);
 postTrigPts = abs(epochWindow(2) * sampleRate);  
@@ -59,6 +68,34 @@ else
     deidentify = 0;
 end
 
+if ~exist('sequentialRead','var')
+    sequentialRead = 1;
+end
+if sequentialRead
+    sequentialRead = 1;
+else
+    sequentialRead = 0;
+end
+if ~exist('filterContinuous','var')
+    filterContinuous = 0;
+end
+if filterContinuous
+    filterContinuous = 1;
+else
+    filterContinuous = 0;
+end
+if ~exist('antiAlias','var')
+    antiAlias = 0;
+end
+if antiAlias
+    antiAlias = 1;
+else
+    antiAlias = 0;
+end
+if ~exist('numThreads','var')
+    numThreads = 1;
+end
+
 if preTrigPts == 0
     preTime = 0;
 else
@@ -72,12 +109,15 @@ end
 %     fprintf('Pre-filtering data from %g to %g Hz\n', bandpass);
 % end
 
+% release cached datasets in case newDsName is being overwritten
+bw_flushDsCache;
+
 % mex function does the rest...
-if ~isempty(badChannels)
-    errorFlag = bw_CTFEpochDs(dsName, newDsName, latencies', epochWindow, saveAverage, filterData, bandpass, lineFilter, downSample, useExpandedWindow, deidentify, badChannels); 
-else
-    errorFlag = bw_CTFEpochDs(dsName, newDsName, latencies', epochWindow, saveAverage, filterData, bandpass, lineFilter, downSample, useExpandedWindow, deidentify);
+% pass empty bad channel list to allow optional flags
+if isempty(badChannels)
+    badChannels = {};
 end
+errorFlag = bw_CTFEpochDs(dsName, newDsName, latencies, epochWindow, saveAverage, filterData, bandpass, lineFilter, downSample, useExpandedWindow, deidentify, badChannels, sequentialRead, filterContinuous, antiAlias, numThreads); 
 
 
 end
@@ -0,0 +1,20 @@
+function bw_flushDsCache
+%       bw_flushDsCache
+%
+%   function bw_flushDsCache
+%
+%   DESCRIPTION: Releases dataset parameters and open .meg4 files that are
+%   cached between calls by the CTF reading mex functions. Clearing each
+%   mex function runs its mexAtExit handler which frees the cache.
+%   Call this before writing, deleting or overwriting a dataset that may
+%   already have been read (required on Windows where mapped files cannot
+%   be deleted, and on other platforms a mapped .meg4 that is truncated
+%   can crash Matlab).
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+    clear bw_CTFGetHeader bw_CTFGetParams bw_CTFGetSensors bw_CTFGetChannelLabels
+    clear bw_CTFGetChannelData bw_CTFGetMultiChannelData bw_getCTFData bw_CTFGetAverage bw_makeVS bw_makeMultiVS
+
+end
@@ -83,6 +83,8 @@ function [imagesetName] = bw_generate_group_SAM_images(groupPath, list, list2, p
                     else
                         fprintf('***********************************************************************************\n');
                         fprintf('creating combined dataset --> %s for for common weights covariance calculation...\n\n', combinedDsName);
+                        % release cached datasets in case combinedDsName is being overwritten
+                        bw_flushDsCache;
                         bw_combineDs({dsName, contrastDsName}, combinedDsName);
                     end  
 
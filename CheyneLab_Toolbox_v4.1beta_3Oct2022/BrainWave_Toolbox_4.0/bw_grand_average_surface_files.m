@@ -15,12 +15,12 @@ numSubjects = size(filelist,1);
 
 % check file length
 file = char( filelist(1,:) );
-t = load(file);
+t = bw_read_surface_image(file);
 ave = zeros(length(t),1);
 
 for j=1:numSubjects
     file = char( filelist(j,:) );
-    t = load(file);
+    t = bw_read_surface_image(file);
     ave = ave + t;
 end
 ave = ave ./ numSubjects;
@@ -184,9 +184,9 @@ uimenu(FILE_MENU,'label','Close','Accelerator','W','separator','on','Callback',@
             fprintf('Converting Vox File coordinates to voxel list...\n');
             coordType = 1;
             % convert vox file to vlist
-            fid = fopen(listFile,'r');
-            numVoxels = fscanf(fid, '%d',1);
-            voxels = fscanf(fid,'%lf',[6 numVoxels])';
+            [voxPos, voxNormals] = bw_read_vox_file(listFile);
+            voxels = [voxPos voxNormals];
+            numVoxels = size(voxels,1);
             % for now assume .vox file is in ANALYSIS directory
             % go two directories up to get dsName      
             a = strfind(pathname, filesep);
@@ -200,7 +200,6 @@ uimenu(FILE_MENU,'label','Close','Accelerator','W','separator','on','Callback',@
                 s = sprintf('%s    %6.1f %6.1f %6.1f    %8.3f %8.3f %8.3f', dsName, voxels(i,:) );
                 list(i,:) = cellstr(s);
             end
-            fclose(fid);
                    
             set(include_listbox,'string',list);
  
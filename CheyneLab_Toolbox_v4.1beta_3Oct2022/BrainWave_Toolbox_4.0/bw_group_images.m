@@ -679,6 +679,8 @@ end
             else
                 fprintf('***********************************************************************************\n');
                 fprintf('creating combined dataset --> %s for for common weights covariance calculation...\n\n', combinedDsName);
+                % release cached datasets in case combinedDsName is being overwritten
+                bw_flushDsCache;
                 bw_combineDs({dsName1, dsName2}, combinedDsName);
                 % D. Cheyne 3.4 copy any head models from the first
                 % dataset to the combined dataset, assuming these are always same subject. 
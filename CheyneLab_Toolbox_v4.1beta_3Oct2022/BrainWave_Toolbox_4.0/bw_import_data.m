@@ -1711,17 +1711,10 @@ function [badTrialCount, badChannelCount, badChannelList] = scanTrials
             end
 
             if lineFilterData == 1   
-                f1 = -lineFilterWidth;
-                f2 = lineFilterWidth;
-                for n=1:4   % remove fundamental and 1st 3 harmonics
-                    f1 = f1 + lineFilterFreq;
-                    f2 = f2 + lineFilterFreq;
-                    if f2 < data_params.sampleRate / 2.0;
-                        % just filter segment without extra samples for now...
-                        y = bw_filter(trial, data_params.sampleRate, [f1 f2],4,1,1); 
-                        trial = y;                   
-                    end
-                end
+                % remove fundamental and 1st 3 harmonics in one pass
+                % just filter segment without extra samples for now...
+                y = bw_filter(trial, data_params.sampleRate, [0 0], 4, 1, 0, lineFilterFreq, lineFilterWidth); 
+                trial = y;                   
             end
 
             % truncate extra samples before checking for artifacts
@@ -3045,6 +3038,8 @@ function createDataset(raw_dataName, saveName, epoch_params)
             [Na, Le, Re] = updateHeadPosition;  % get mean fiducials - only valid when useMean enabled
 
             % apply new head position to new dataset      
+            % release cached datasets in case saveName is being overwritten
+            bw_flushDsCache;
             bw_CTFChangeHeadPos(saveName, Na.mean, Le.mean, Re.mean); 
 
             epoch_params.headPosition = [Na, Le, Re]; % Anton 2021/06/16 - adding head position to epoch parameters
@@ -44,7 +44,12 @@ if ~isWriteable
 end
 
 % check data range for covariance file
-covHeader = bw_CTFGetHeader(covDsName);
+% covDsName can be a cell array of datasets - covariance is computed for all trials combined (e.g., common weights)
+if iscell(covDsName)
+    covHeader = bw_CTFGetHeader(covDsName{1});
+else
+    covHeader = bw_CTFGetHeader(covDsName);
+end
 ctfmin = covHeader.epochMinTime;
 ctfmax = covHeader.epochMaxTime;
 clear covHeader
@@ -183,60 +188,58 @@ switch params.beam.use
             bmin = dsmin;
             bmax = dsmax;
         end
-        addlat=0;
-        diffList={};
-        latList={};
         
         fprintf('Computing differential beamformer images (no. steps = %d)...\n', params.beam.no_step);
         
-        for n=1:params.beam.no_step + 1
-            
-            activeWindow=[params.beam.activeStart+addlat params.beam.activeEnd+addlat];
-            baselineWindow=[params.beam.baselineStart params.beam.baselineEnd];
+        % active window for each step
+        addlat = (0:params.beam.no_step)' * params.beam.active_step;
+        activeWindow=[params.beam.activeStart+addlat params.beam.activeEnd+addlat];
+        baselineWindow=[params.beam.baselineStart params.beam.baselineEnd];
             
-            if params.beam.use == 'Z'
-                fprintf('Computing pseudo-Z images (active window = %g to %g s) from dataset %s\n',activeWindow, dsName);
+        if params.beam.use == 'Z'
+            fprintf('Computing pseudo-Z images (active window = %g to %g s) from dataset %s\n',activeWindow(1,1), activeWindow(end,2), dsName);
 
-                imageType = 1;
-                samUnits = 3;
-            elseif params.beam.use == 'T'
+            imageType = 1;
+            samUnits = 3;
+        elseif params.beam.use == 'T'
 
-                if (params.beam.baselineStart < bmin || params.beam.baselineStart > bmax ||...
-                    params.beam.baselineEnd < bmin || params.beam.baselineEnd > bmax)
-                    fprintf('\n*** Baseline window outside of trial boundaries\n');
-                    return;
-                end
-                fprintf('Computing pseudo-T images (active window (%g to %g s) minus baseline window (%g to %g s) from dataset %s\n',... 
-                    activeWindow,baselineWindow, dsName);
-                imageType = 2;
-                samUnits = 4;            
-            elseif params.beam.use == 'F'
-                if (params.beam.baselineStart < bmin || params.beam.baselineStart > bmax ||...
-                    params.beam.baselineEnd < bmin || params.beam.baselineEnd > bmax)
-                    fprintf('\n*** Baseline window outside of trial boundaries\n');
-                    return;
-                end
-                fprintf('Computing pseudo-F images for active window (%g to %g s) divided by baseline window (%g to %g s) from dataset %s\n',... 
-                    activeWindow, baselineWindow, dsName);
-                imageType = 3;
-                samUnits = 5;            
-            else
-                fprintf('unknown beamformer option \n');
+            if (params.beam.baselineStart < bmin || params.beam.baselineStart > bmax ||...
+                params.beam.baselineEnd < bmin || params.beam.baselineEnd > bmax)
+                fprintf('\n*** Baseline window outside of trial boundaries\n');
+                return;
+            end
+            fprintf('Computing pseudo-T images (active window (%g to %g s) minus baseline window (%g to %g s) from dataset %s\n',... 
+                activeWindow(1,1), activeWindow(end,2), baselineWindow, dsName);
+            imageType = 2;
+            samUnits = 4;            
+        elseif params.beam.use == 'F'
+            if (params.beam.baselineStart < bmin || params.beam.baselineStart > bmax ||...
+                params.beam.baselineEnd < bmin || params.beam.baselineEnd > bmax)
+                fprintf('\n*** Baseline window outside of trial boundaries\n');
                 return;
             end
+            fprintf('Computing pseudo-F images for active window (%g to %g s) divided by baseline window (%g to %g s) from dataset %s\n',... 
+                activeWindow(1,1), activeWindow(end,2), baselineWindow, dsName);
+            imageType = 3;
+            samUnits = 5;            
+        else
+            fprintf('unknown beamformer option \n');
+            return;
+        end
         
-            [imageList] = bw_makeDifferential(dsName, covDsName, params.hdmFile,...
-            params.useHdmFile, params.filter, params.boundingBox,...
-            params.stepSize,  params.voxFile, useVoxFile, useNormals, params.sphere, params.noise,...
-            regularization, imageType, activeWindow, baselineWindow,...
-            params.rms, bidirectional, useCovAsControl,  params.outputFormat); 
+        % all steps are computed in one call - the covariance of all active
+        % windows is computed in one pass of the data.  With sharedWeights
+        % all steps use the same weights (all active windows and baseline
+        % combined), otherwise the weights for each step are computed from
+        % its own active and baseline window
+        sharedWeights = double(isfield(params.beam,'sharedWeights') && params.beam.sharedWeights);
+        [imageList] = bw_makeDifferential(dsName, covDsName, params.hdmFile,...
+        params.useHdmFile, params.filter, params.boundingBox,...
+        params.stepSize,  params.voxFile, useVoxFile, useNormals, params.sphere, params.noise,...
+        regularization, imageType, activeWindow, baselineWindow,...
+        params.rms, bidirectional, useCovAsControl,  params.outputFormat, 0, sharedWeights); 
         
-            diffList{n} = imageList(1,:);
-            addlat=addlat+params.beam.active_step;
-            
-            fprintf('...done.\n\n');
-        end    
-        imageList = char(diffList);
+        fprintf('...done.\n\n');
         
 end
 
@@ -0,0 +1,180 @@
+function [timeVec, vs_data, computed_normals] = bw_make_multi_vs(dsName, covDsName, voxels, normals, params)
+%
+% function [timeVec vs_data computed_normals] = bw_make_multi_vs(dsName, covDsName, voxels, normals, params)
+%
+%   DESCRIPTION: batched version of bw_make_vs. Computes virtual sensors for
+%   a list of voxels (voxels = [nvoxels x 3] array) with one call to the mex
+%   function so that the covariance and inverse covariance are only computed
+%   once and the weights are applied to the data in a single step.
+%   Pass normals as an [nvoxels x 3] array for fixed orientations or an
+%   empty array to compute optimized orientations, which are returned in
+%   computed_normals ([nvoxels x 3]).
+%
+%   returns vs_data as an [nsamples x nvoxels] array, or [nsamples x ntrials x nvoxels]
+%   if params.vs_parameters.saveSingleTrials is set.
+%
+%   If bw_makeMultiVS is not compiled for this platform each voxel is computed
+%   with bw_make_vs (same results, without the shared covariance and weights).
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+    timeVec = [];
+    vs_data = [];
+    computed_normals = [];
+
+    isWriteable = bw_isWriteable(dsName);
+    if ~isWriteable
+        return;
+    end
+
+    if size(voxels,2) ~= 3
+        fprintf('voxel list must be an [nvoxels x 3] array\n');
+        return;
+    end
+    
+    % bw_make_vs adds the dataset path to the head model file name
+    vs_params = params;
+
+    if (params.beamformer_parameters.useHdmFile)
+        params.beamformer_parameters.hdmFile=fullfile(dsName,params.beamformer_parameters.hdmFile);
+
+        if ~exist(params.beamformer_parameters.hdmFile,'file')
+            beep;
+            fprintf('Head model file %s does not exist\n', params.beamformer_parameters.hdmFile);
+            return;
+        end
+    end
+
+    if isempty(normals)
+        useNormal = 0;
+        normals = repmat([1 0 0], size(voxels,1), 1);
+    else
+        if ~isequal(size(normals), size(voxels))
+            fprintf('normal list must be the same size as voxel list\n');
+            return;
+        end
+        useNormal = 1;
+    end
+
+    if params.beamformer_parameters.useBaselineWindow
+        baseline(1) = params.beamformer_parameters.baseline(1);
+        baseline(2) = params.beamformer_parameters.baseline(2);
+        baselineData = 1;
+    else
+        baseline(1) = 0.0;
+        baseline(2) = 0.0;
+        baselineData = 0;
+    end
+
+    if params.vs_parameters.rms
+        computeRMS = 1;
+    else
+        computeRMS = 0;
+    end
+
+    if params.vs_parameters.pseudoZ
+        normalizeWeights = 1;
+    else
+        normalizeWeights = 0;
+    end
+
+    if ~params.beamformer_parameters.filterData
+        params.beamformer_parameters.filter(1) = 0.0;
+        params.beamformer_parameters.filter(2) = 0.0;
+    end
+
+    if params.beamformer_parameters.useReverseFilter
+        bidirectional = 1;
+    else
+        bidirectional = 0;
+    end
+
+    covWindow=params.beamformer_parameters.covWindow;
+    % check that covariance window has been set
+    if ( covWindow(1) == 0 && covWindow(2) == 0)
+        beep;
+        fprintf('Covariance window settings are invalid (%f to %f seconds)\n',covWindow);
+        return;
+    end
+
+    if ~params.beamformer_parameters.useRegularization
+        regularization = 0.0;
+    else
+        regularization = params.beamformer_parameters.regularization;
+    end
+
+    if params.vs_parameters.saveSingleTrials
+        saveSingleTrials = 1;
+    else
+        saveSingleTrials = 0;
+    end
+
+    % MAKE VS USING MEX FILE
+    if exist('bw_makeMultiVS','file') == 3
+        dvoxels = double(voxels);
+        dnormals = double(normals);
+
+        [timeVec, vs_data, computed_normals] = bw_makeMultiVS(dsName, covDsName, params.beamformer_parameters.hdmFile, params.beamformer_parameters.useHdmFile,...
+            params.beamformer_parameters.filter, dvoxels, dnormals, useNormal, covWindow, baseline, baselineData, params.beamformer_parameters.sphere, ...
+            normalizeWeights, params.beamformer_parameters.noise, regularization, computeRMS, bidirectional, saveSingleTrials );
+    else
+        fprintf('bw_makeMultiVS not found - computing virtual sensors for each voxel\n');
+        vs_params.vs_parameters.autoFlip = 0;   % applied below to all voxels
+        nvoxels = size(voxels,1);
+        computed_normals = zeros(nvoxels,3);
+        for k=1:nvoxels
+            if useNormal
+                normal = normals(k,:);
+            else
+                normal = [];
+            end
+            [timeVec, vs, normal] = bw_make_vs(dsName, covDsName, voxels(k,:), normal, vs_params);
+            if isempty(vs)
+                timeVec = [];
+                vs_data = [];
+                computed_normals = [];
+                return;
+            end
+            computed_normals(k,:) = normal(:,1)';
+            if saveSingleTrials
+                vs_data(:,:,k) = vs;
+            else
+                vs_data(:,k) = vs(:,1);
+            end
+        end
+    end
+
+    % autoflip - applied to each voxel using the average amplitude at the flip latency
+
+    if params.vs_parameters.autoFlip && ~params.vs_parameters.rms
+        ds_info = bw_CTFGetParams(dsName);
+        sampleRate = ds_info(5);
+        fprintf('Autoflip enabled...\n');
+
+        t = params.vs_parameters.autoFlipLatency;
+        x = round(t * sampleRate);
+        flipSample = x + ds_info(2);
+        if (flipSample < 1 || flipSample > size(vs_data,1) )
+            fprintf('*** Warning: auto-flip latency out of range (t = %g s, sample %d) ***\n', t, flipSample);
+        else
+            nvoxels = size(voxels,1);
+            for k=1:nvoxels
+                if saveSingleTrials
+                    amp = mean(vs_data(flipSample,:,k));
+                else
+                    amp = vs_data(flipSample,k);
+                end
+                if (params.vs_parameters.autoFlipPolarity == 1 && amp < 0) || (params.vs_parameters.autoFlipPolarity ~= 1 && amp > 0)
+                    computed_normals(k,:) = computed_normals(k,:) * -1.0;
+                    if saveSingleTrials
+                        vs_data(:,:,k) = vs_data(:,:,k) * -1.0;
+                    else
+                        vs_data(:,k) = vs_data(:,k) * -1.0;
+                    end
+                end
+            end
+        end
+    end
+
+end
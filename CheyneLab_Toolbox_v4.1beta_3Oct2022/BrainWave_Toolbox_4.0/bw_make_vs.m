@@ -10,6 +10,11 @@ function [timeVec, vs_data, computed_normal] = bw_make_vs(dsName, covDsName, vox
 %   optionally, a computed normal (normal and useNormal). If a set normal
 %   vector is not used, the function will compute it's own and return in in
 %   computed_normal.
+%   If params.beamformer_parameters.regularization is a vector of values
+%   the covariance is read once and the virtual sensor is computed for each
+%   value (the regularized covariance is inverted and the virtual sensor
+%   recomputed for each value) and returned as
+%   vs_data(:,:,k) and computed_normal(:,k) for the k-th value.
 %
 % (c) D. Cheyne, 2011. All rights reserved. 
 % This software is for RESEARCH USE ONLY. Not approved for clinical use.
@@ -147,21 +152,24 @@ function [timeVec, vs_data, computed_normal] = bw_make_vs(dsName, covDsName, vox
         t = params.vs_parameters.autoFlipLatency;
         x = round(t * sampleRate);
         flipSample = x + ds_info(2);
-        if (flipSample < 1 || flipSample > length(vs_data) )
+        if (flipSample < 1 || flipSample > size(vs_data,1) )
             fprintf('*** Warning: auto-flip latency out of range (t = %g s, sample %d) ***\n', t, flipSample);
         else
-            amp = vs_data(flipSample);
-            if params.vs_parameters.autoFlipPolarity == 1  % if positive make negative so doesn't flip negative peak
-                if (amp < 0)
-                    fprintf('...flipping source orientation to be positive at t = %g s (sample %d)\n', t, flipSample);
-                    computed_normal = computed_normal * -1.0;
-                    vs_data = vs_data * -1.0;
-                end
-            else
-                if (amp > 0)
-                    fprintf('...flipping source orientation to be negative at t = %g s (sample %d)\n', t, flipSample);
-                    computed_normal = computed_normal * -1.0;
-                    vs_data = vs_data * -1.0;
+            % flip each regularization value separately
+            for k=1:size(vs_data,3)
+                amp = vs_data(flipSample,1,k);
+                if params.vs_parameters.autoFlipPolarity == 1  % if positive make negative so doesn't flip negative peak
+                    if (amp < 0)
+                        fprintf('...flipping source orientation to be positive at t = %g s (sample %d)\n', t, flipSample);
+                        computed_normal(:,k) = computed_normal(:,k) * -1.0;
+                        vs_data(:,:,k) = vs_data(:,:,k) * -1.0;
+                    end
+                else
+                    if (amp > 0)
+                        fprintf('...flipping source orientation to be negative at t = %g s (sample %d)\n', t, flipSample);
+                        computed_normal(:,k) = computed_normal(:,k) * -1.0;
+                        vs_data(:,:,k) = vs_data(:,:,k) * -1.0;
+                    end
                 end
             end
         end
@@ -1,5 +1,5 @@
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-%% function bw_mesh2vox(matfile, meshFile, voxFile, [useFaces])
+%% function bw_mesh2vox(matfile, meshFile, voxFile, [useFaces], [binaryVox])
 %%
 %% script to read VTK surface file from Jason (native coordinates)
 %% rotate into .mri frame of reference and write vertex locations and their
@@ -13,6 +13,8 @@
 %%
 %% Option:        
 %% useFaces       - use face centers as voxels/normals instead of vertices. 
+%% binaryVox      - write binary vox file (default = 1).  Set to 0 to write
+%%                  ASCII vox file (see bw_write_vox_file)
 %% 
 %% Output:
 %% voxFile        - name of output file
@@ -23,10 +25,11 @@
 %% updated for BrainWave Dec, 2013
 %% 
 %%  Dec 2013 - added option to read multiple mesh formats and combine meshes
+%%  Oct 2022 - vox file is written in binary format by default
 %%
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
-function bw_mesh2vox(matfile, meshFile, voxFile, useFaces)
+function bw_mesh2vox(matfile, meshFile, voxFile, useFaces, binaryVox)
 
 global BW_VERSION
 
@@ -44,6 +47,10 @@ if ~exist('useFaces','var')
     useFaces = 0;
 end
 
+if ~exist('binaryVox','var')
+    binaryVox = 1;
+end
+
 % read one or multiple meshes
 
 % make a pseudo progress bar so user knows something is happening
@@ -177,17 +184,10 @@ end
 
 fprintf('writing %d voxels to vox file %s \n',nvoxels, voxFile);
 
-fid = fopen(voxFile,'w');
-if (fid == -1)
-    fprintf('failed to open file %s\n',voxFile);
+if ~bw_write_vox_file(voxFile, voxels, normals, binaryVox)
+    delete(wbh);
     return;
 end
-fprintf(fid,'%d\n', nvoxels);
-for i=1:nvoxels
-    fprintf(fid,'%.2f\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\n',voxels(i,1:3), normals(i,1:3));        
-end
-
-fclose(fid);
 
 
 % *** save a vtk file of the mesh corresponding to this vox file with same
@@ -28,7 +28,7 @@ showDist = perm_options.showDist;
 for j=1:numSubjects
     file = strtrim(char( filelist(j,:) ));
     fprintf('reading file %s\n', file);
-    data(j,:) = load(file);
+    data(j,:) = bw_read_surface_image(file);
 end
 
 % build unthresholded average 
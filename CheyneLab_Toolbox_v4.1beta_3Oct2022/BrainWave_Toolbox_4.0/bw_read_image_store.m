@@ -0,0 +1,114 @@
+function [data, header] = bw_read_image_store(storeFile, mode, index)
+%       BW_READ_IMAGE_STORE
+%
+%   function [data, header] = bw_read_image_store(storeFile, [mode], [index])
+%
+%   DESCRIPTION: Reads a 4D image store (.bwimg) saved by bw_makeEventRelated
+%   or bw_makeDifferential (outputFormat = 2).  The store holds all images
+%   of a series (voxels x latencies) in chunks so that one image or one
+%   voxel time course can be read without reading the whole file.
+%
+%   mode    'all'    - (default) returns data [numVoxels x numLatencies]
+%           'image'  - returns image at latency number index [numVoxels x 1]
+%           'voxel'  - returns time course of voxel number index [numLatencies x 1]
+%           'header' - returns header only (data = [])
+%
+%   header  structure with numVoxels, numLatencies, latencies (s), voxels and
+%           normals [numVoxels x 3] (cm), isSurface, units (SAM unit code),
+%           boundingBox [xmin xmax ymin ymax zmin zmax] and stepSize (cm).
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+if ~exist('mode','var')
+    mode = 'all';
+end
+
+data = [];
+
+% store is written in native byte order - check byte order flag
+fid = fopen(storeFile, 'r', 'ieee-le');
+if fid == -1
+    error('Could not open image store %s', storeFile);
+end
+identity = transpose(fread(fid,8,'*char'));
+if ~strncmp(identity,'BWIMG01',7)
+    fclose(fid);
+    error('%s doesn''t look like a BrainWave image store file.', storeFile);
+end
+if fread(fid,1,'int32') ~= 1
+    fclose(fid);
+    fid = fopen(storeFile, 'r', 'ieee-be');
+    fseek(fid, 12, 'bof');
+end
+
+header.numVoxels = fread(fid,1,'int32');
+header.numLatencies = fread(fid,1,'int32');
+chunkVoxels = fread(fid,1,'int32');
+chunkLatencies = fread(fid,1,'int32');
+header.isSurface = fread(fid,1,'int32');
+header.units = fread(fid,1,'int32');
+fread(fid,1,'int32');
+header.boundingBox = transpose(fread(fid,6,'double'));
+header.stepSize = fread(fid,1,'double');
+latencyOffset = fread(fid,1,'int64');
+voxelOffset = fread(fid,1,'int64');
+dataOffset = fread(fid,1,'int64');
+
+fseek(fid, latencyOffset, 'bof');
+header.latencies = fread(fid,header.numLatencies,'double');
+fseek(fid, voxelOffset, 'bof');
+vox = fread(fid,[6 header.numVoxels],'double');
+header.voxels = transpose(vox(1:3,:));
+header.normals = transpose(vox(4:6,:));
+
+numVoxelChunks = ceil(header.numVoxels / chunkVoxels);
+numLatencyChunks = ceil(header.numLatencies / chunkLatencies);
+chunkBytes = chunkVoxels * chunkLatencies * 4;
+
+switch mode
+    case 'header'
+
+    case 'image'
+        if index < 1 || index > header.numLatencies
+            fclose(fid);
+            error('latency index %d out of range (1 to %d)', index, header.numLatencies);
+        end
+        % one block of chunkVoxels values in each chunk of this row
+        cl = floor((index-1) / chunkLatencies);
+        offset = dataOffset + cl * numVoxelChunks * chunkBytes + mod(index-1, chunkLatencies) * chunkVoxels * 4;
+        fseek(fid, offset, 'bof');
+        precision = sprintf('%d*float32=>double', chunkVoxels);
+        data = fread(fid, numVoxelChunks * chunkVoxels, precision, (chunkLatencies-1) * chunkVoxels * 4);
+        data = data(1:header.numVoxels);
+
+    case 'voxel'
+        if index < 1 || index > header.numVoxels
+            fclose(fid);
+            error('voxel index %d out of range (1 to %d)', index, header.numVoxels);
+        end
+        % every chunkVoxels'th value in one chunk of each row
+        cv = floor((index-1) / chunkVoxels);
+        data = zeros(numLatencyChunks * chunkLatencies, 1);
+        for cl=0:numLatencyChunks-1
+            offset = dataOffset + (cl * numVoxelChunks + cv) * chunkBytes + mod(index-1, chunkVoxels) * 4;
+            fseek(fid, offset, 'bof');
+            data(cl*chunkLatencies+1:(cl+1)*chunkLatencies) = fread(fid, chunkLatencies, 'float32=>double', (chunkVoxels-1) * 4);
+        end
+        data = data(1:header.numLatencies);
+
+    case 'all'
+        fseek(fid, dataOffset, 'bof');
+        data = fread(fid, chunkVoxels * chunkLatencies * numVoxelChunks * numLatencyChunks, 'float32=>double');
+        data = reshape(data, [chunkVoxels chunkLatencies numVoxelChunks numLatencyChunks]);
+        data = reshape(permute(data, [1 3 2 4]), [chunkVoxels * numVoxelChunks chunkLatencies * numLatencyChunks]);
+        data = data(1:header.numVoxels, 1:header.numLatencies);
+
+    otherwise
+        fclose(fid);
+        error('unknown mode %s', mode);
+end
+
+fclose(fid);
+
+end
@@ -0,0 +1,58 @@
+function data = bw_read_surface_image(file)
+%       BW_READ_SURFACE_IMAGE
+%
+%   function data = bw_read_surface_image(file)
+%
+%   DESCRIPTION: Reads a surface (vertex) image saved by bw_makeEventRelated
+%   or bw_makeDifferential and returns a column vector with one value per
+%   vertex.  The format is selected by the file extension:
+%       .f32    raw float32 overlay (little-endian, one value per vertex)
+%       .w      Freesurfer overlay
+%       other   plain text file, one value per line (.txt)
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+data = [];
+
+[~, ~, ext] = bw_fileparts(file);
+
+switch ext
+    case '.f32'
+        fid = fopen(file,'r','ieee-le');
+        if (fid == -1)
+            fprintf('failed to open file <%s>\n',file);
+            return;
+        end
+        data = fread(fid,inf,'float32=>double');
+        fclose(fid);
+
+    case '.w'
+        fid = fopen(file,'r','ieee-be');
+        if (fid == -1)
+            fprintf('failed to open file <%s>\n',file);
+            return;
+        end
+        fread(fid,1,'int16');     % latency (unused)
+        b = fread(fid,3,'uint8');
+        numVertices = b(1)*65536 + b(2)*256 + b(3);
+        % 3-byte vertex index and big-endian float for each vertex
+        raw = fread(fid,[7 numVertices],'uint8=>uint8');
+        fclose(fid);
+        idx = double(raw(1,:))*65536 + double(raw(2,:))*256 + double(raw(3,:));
+        vals = typecast(reshape(flipud(raw(4:7,:)),[],1),'single');
+        data = zeros(max([idx numVertices-1])+1,1);
+        data(idx+1) = double(vals);
+
+    otherwise
+        fid = fopen(file,'r');
+        if (fid == -1)
+            fprintf('failed to open file <%s>\n',file);
+            return;
+        end
+        C = textscan(fid,'%f');
+        fclose(fid);
+        data = cell2mat(C);
+end
+
+end
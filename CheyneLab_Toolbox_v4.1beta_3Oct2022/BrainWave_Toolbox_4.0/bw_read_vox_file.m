@@ -0,0 +1,53 @@
+function [voxels, normals] = bw_read_vox_file(voxFile)
+%       BW_READ_VOX_FILE
+%
+%   function [voxels, normals] = bw_read_vox_file(voxFile)
+%
+%   DESCRIPTION: Reads a voxel (vertex) list file (.vox) and returns the
+%   voxel positions and normals in cm (each [numVoxels x 3]).  Binary vox
+%   files (written by bw_write_vox_file) and ASCII vox files (number of
+%   voxels followed by x y z nx ny nz on each line) are detected
+%   automatically.  Returns empty arrays on error.
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+voxels = [];
+normals = [];
+
+fid = fopen(voxFile,'r');
+if (fid == -1)
+    fprintf('failed to open file <%s>\n',voxFile);
+    return;
+end
+
+ident = fread(fid,8,'uint8=>char')';
+if length(ident) == 8 && strcmp(ident,['BWVOX01' char(0)])
+    % binary format - files are written in native byte order
+    endianCheck = fread(fid,1,'int32');
+    if endianCheck ~= 1
+        fprintf('vox file <%s> was written on a computer with different byte order\n',voxFile);
+        fclose(fid);
+        return;
+    end
+    numVoxels = fread(fid,1,'int32');
+    voxels = fread(fid,[3 numVoxels],'double')';
+    normals = fread(fid,[3 numVoxels],'double')';
+else
+    frewind(fid);
+    numVoxels = fscanf(fid,'%d',1);
+    data = fscanf(fid,'%lf',[6 numVoxels])';
+    if ~isempty(data)
+        voxels = data(:,1:3);
+        normals = data(:,4:6);
+    end
+end
+fclose(fid);
+
+if isempty(numVoxels) || size(voxels,1) ~= numVoxels || size(normals,1) ~= numVoxels
+    fprintf('error reading vox file <%s>\n',voxFile);
+    voxels = [];
+    normals = [];
+end
+
+end
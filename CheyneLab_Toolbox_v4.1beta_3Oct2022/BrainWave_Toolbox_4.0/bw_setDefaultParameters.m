@@ -70,7 +70,7 @@ function [params] = bw_setDefaultParameters(dsName)
     params.beamformer_parameters.voxFile='';
     params.beamformer_parameters.useVoxFile=0;
     params.beamformer_parameters.useVoxNormals=0;
-    params.beamformer_parameters.outputFormat=0;       % for surface images (0 = ASCII (.txt), 1 = freesurfer overlay (.w)
+    params.beamformer_parameters.outputFormat=0;       % for surface images (0 = ASCII (.txt), 1 = freesurfer overlay (.w), 2 = 4D image store (.bwimg) for all images, 3 = raw float32 overlay (.f32))
     
     params.beamformer_parameters.hdmFile='';
     params.beamformer_parameters.useHdmFile=0;
@@ -85,6 +85,7 @@ function [params] = bw_setDefaultParameters(dsName)
     params.beamformer_parameters.beam.activeEnd = 0.0;
     params.beamformer_parameters.beam.active_step=0.0;
     params.beamformer_parameters.beam.no_step=0;
+    params.beamformer_parameters.beam.sharedWeights=0;          % 1 = all steps use the same weights, 0 = weights for each step (both computed in one pass)
     params.beamformer_parameters.beam.baselineStart=0;
     params.beamformer_parameters.beam.baselineEnd=0;
     params.beamformer_parameters.beam.latencyList = '';        % new in version 2.2
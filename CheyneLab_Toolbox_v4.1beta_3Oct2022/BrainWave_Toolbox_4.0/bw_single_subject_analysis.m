@@ -981,14 +981,10 @@ FILE_MENU=uimenu('Label','File');
         if params.beamformer_parameters.useVoxFile
             meshName = char(meshNames(selected_surface));
             mesh = meshes.(meshName);       
-            voxels = [mesh.meg_vertices mesh.normals];
             [~,name,~] =  fileparts(meshFile);
             voxFile = sprintf('%s_%s.vox',name, meshName);
             fprintf('writing voxel coordinates to vox file %s...\n', voxFile);
-            fid = fopen(voxFile,'w');
-            fprintf(fid,'%d\n', size(voxels,1));
-            fclose(fid);
-            dlmwrite(voxFile, voxels, '-append','delimiter','\t');            
+            bw_write_vox_file(voxFile, mesh.meg_vertices, mesh.normals);
             params.beamformer_parameters.voxFile = voxFile;
             
         else   
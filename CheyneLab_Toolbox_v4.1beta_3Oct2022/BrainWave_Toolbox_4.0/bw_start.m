@@ -358,6 +358,8 @@ TOOLS_MENU=uimenu('Label','Tools');
             end
         end
                         
+        % release cached datasets in case saveName is being overwritten
+        bw_flushDsCache;
         bw_combineDs(fileList, saveName);
                 
     end
@@ -233,7 +233,7 @@ SHOW_INFLATED_CHECK = uicontrol('style','checkbox','units', 'normalized',...
         
         file = fullfile(pathname,filename);    
         
-        overlayData = load(file);
+        overlayData = bw_read_surface_image(file);
         set(ph, 'facevertexcdata', overlayData(:) );
         
    end
@@ -1619,15 +1619,11 @@ VIEW_OPTIONS_TEXT = uicontrol('style','text','fontsize',11,'units','normalized',
         
         currentfilename = deblank(char(FILE_LIST(IMAGE_NO,:)));
         
-        fid1 = fopen(currentfilename,'r');
-        if (fid1 == -1)
-            fprintf('failed to open file <%s>\n',currentfilename);
+        % reads .txt, .w or .f32 overlays
+        vertexColors = bw_read_surface_image(currentfilename);
+        if isempty(vertexColors)
             return;
         end
-        C = textscan(fid1,'%f');
-        fclose(fid1);
-        
-        vertexColors=cell2mat(C);
         
         % adjust vertexColor list to match left/right hemisphere display size
         
@@ -230,7 +230,8 @@ SHOW_INFLATED_CHECK = uicontrol('style','checkbox','units', 'normalized',...
    function load_data_callback(src, evt)
         
         [filename, pathname]=uigetfile(...
-            {'*.txt','ASCII Overlay file (*.txt)'; '*.thickness', 'Freesurfer Binary Overlay File (*.thickness)';...
+            {'*.txt','ASCII Overlay file (*.txt)'; '*.f32','Float32 Overlay file (*.f32)';...
+             '*.thickness', 'Freesurfer Binary Overlay File (*.thickness)';...
              '*.mat', 'Surface File (*.mat)';'*', 'Any File'},'Select file(s)...', 'Multiselect', 'on');
         if isequal(filename,0) || isequal(pathname,0)
             file = [];
@@ -310,7 +311,7 @@ SHOW_INFLATED_CHECK = uicontrol('style','checkbox','units', 'normalized',...
             [p n e] = fileparts(file);
             
             % load overlay file
-            if strcmp(e, '.txt') || strcmp(e, '.thickness')
+            if strcmp(e, '.txt') || strcmp(e, '.f32') || strcmp(e, '.thickness')
                 
                 % surface must be open already to display overlays on
                 if isempty(surface)
@@ -319,8 +320,8 @@ SHOW_INFLATED_CHECK = uicontrol('style','checkbox','units', 'normalized',...
                 end
                 
                 % read file
-                if strcmp(e, '.txt')
-                    overlayData = load(file);
+                if strcmp(e, '.txt') || strcmp(e, '.f32')
+                    overlayData = bw_read_surface_image(file);
                 else
                     [~, meshData] = bw_readMeshFile(file);
                     overlayData = meshData.curv;
@@ -1836,15 +1837,11 @@ VIEW_OPTIONS_TEXT = uicontrol('style','text','fontsize',11,'units','normalized',
         elseif ~isempty(FILE_LIST)
             currentfilename = deblank(char(FILE_LIST(IMAGE_NO,:)));
         
-            fid1 = fopen(currentfilename,'r');
-            if (fid1 == -1)
-                fprintf('failed to open file <%s>\n',currentfilename);
+            % reads .txt, .w or .f32 overlays
+            vertexColors = bw_read_surface_image(currentfilename);
+            if isempty(vertexColors)
                 return;
             end
-            C = textscan(fid1,'%f');
-            fclose(fid1);
-
-            vertexColors=cell2mat(C);
         
         else
             vertexColors=zeros((surface.numLeftVertices + surface.numRightVertices), 1);
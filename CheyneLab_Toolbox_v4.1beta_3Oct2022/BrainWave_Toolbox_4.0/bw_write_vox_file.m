@@ -0,0 +1,56 @@
+function success = bw_write_vox_file(voxFile, voxels, normals, binary)
+%       BW_WRITE_VOX_FILE
+%
+%   function success = bw_write_vox_file(voxFile, voxels, normals, [binary])
+%
+%   DESCRIPTION: Writes voxel (vertex) positions and normals in cm (each
+%   [numVoxels x 3]) to a vox file for bw_makeEventRelated and
+%   bw_makeDifferential.
+%
+%   binary = 1 (default) writes a binary vox file that is read without
+%   parsing text (native byte order):
+%       char[8]   'BWVOX01'
+%       int32     1 (byte order check)
+%       int32     numVoxels
+%       double    positions [x y z] for each voxel
+%       double    normals [x y z] for each voxel
+%   binary = 0 writes the ASCII format (number of voxels, then
+%   x y z nx ny nz on each line).  Both formats are read by
+%   bw_read_vox_file.
+%
+% (c) D. Cheyne, 2022. All rights reserved.
+% This software is for RESEARCH USE ONLY. Not approved for clinical use.
+
+success = 0;
+
+if ~exist('binary','var')
+    binary = 1;
+end
+
+numVoxels = size(voxels,1);
+if size(normals,1) ~= numVoxels
+    fprintf('number of normals does not match number of voxels\n');
+    return;
+end
+
+fid = fopen(voxFile,'w');
+if (fid == -1)
+    fprintf('failed to open file %s\n',voxFile);
+    return;
+end
+
+if binary
+    fwrite(fid,['BWVOX01' char(0)],'uint8');
+    fwrite(fid,[1 numVoxels],'int32');
+    fwrite(fid,double(voxels(:,1:3))','double');
+    fwrite(fid,double(normals(:,1:3))','double');
+else
+    fprintf(fid,'%d\n', numVoxels);
+    fprintf(fid,'%.2f\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\n',[voxels(:,1:3) normals(:,1:3)]');
+end
+
+if fclose(fid) == 0
+    success = 1;
+end
+
+end
@@ -0,0 +1,920 @@
+// *************************************
+// bfEngine.h
+//
+// blocked beamformer weight and projection engine.
+//
+// Voxels are processed in tiles. For each tile the forward solutions (lead fields) for two tangential
+// orientations are stored as the columns of L [numSensors x 2*tileSize] and C^-1 L is computed with a single
+// BLAS-3 matrix product. The 2x2 terms L'C^-1 L for each voxel only need dot products, and the weights for
+// the tile are linear combinations of the columns of C^-1 L.  Data for any number of latencies (or samples)
+// are then projected through the weights of the whole tile with one matrix product  Y = D * W
+// where D is [numPoints x numSensors].
+//
+// Weights are the standard LCMV (minimum-variance) weights:
+//		fixed orientation		w = C^-1 b / (b' C^-1 b)
+//		optimized orientation	orientation that minimizes b' C^-1 b in the tangential plane (maximum power)
+//		RMS (vector)			W = C^-1 L (L' C^-1 L)^-1, output is sqrt(y1^2 + y2^2)
+// and are scaled by 1 / (noiseRMS * |w|) if normalized (pseudo-Z).
+//
+// uses BLAS from Matlab (libmwblas) - add -lmwblas to mex link line.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - per-voxel lead field and weight loops run on a thread pool (threadPool.h) - add -lpthread to mex link line
+//		1.2  - event-related images read lead fields from persistent store (leadFieldStore.h) if available
+//		1.3  - added computeDifferentialImages() (pseudo-Z, T and F) - replaces computeDifferential() in bwlib
+//		1.4  - computeEventRelatedImages() computes weights for all voxels once and then projects blocks of latencies,
+//			   passing each block to an image writer thread (imageWriter.h) instead of returning all images
+//		1.5  - each block of event-related images is computed for all voxels with a single matrix product directly into
+//			   the image writer buffers (projectImageBlock) instead of one product per tile of voxels
+//		1.6  - computeEventRelatedImages() frees all buffers on every error return (average and latency sampling moved
+//			   to getEventRelatedData).  Voxels with no valid weights are documented as zero in the images
+//		1.7  - baseline window samples from getBaselineWindow() (shared with bw_makeMultiVS)
+//			   getEventRelatedData() uses one heap copy of ds_params for reading trials instead of a stack copy per trial
+//
+// ************************************
+
+#ifndef BFENGINE_H
+#define BFENGINE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mex.h"
+#include "blas.h"
+#include "threadPool.h"
+#include "leadFieldStore.h"
+#include "imageWriter.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/BWFilter.h"
+#include "../../../ctflib/headers/sourceUtils.h"
+#include "../../../bwlib/bwlib.h"
+
+#define BF_ENGINE_TILE_SIZE		256
+#define BF_ENGINE_CHUNK_SIZE	8		// voxels per thread pool task
+
+typedef struct bf_engine
+{
+	int			numSensors;
+	int			numChannels;
+	int			tileSize;
+	int			type;
+	bool		normalized;
+	double		noiseRMS;
+	vectorCart	sphereOrigin;
+	double		*icov;			// [numSensors x numSensors] inverse covariance
+	double		*lead;			// [numSensors x 2*tileSize] forward solutions for tile
+	const double *leadStore;	// precomputed forward solutions for tile (NULL = compute)
+	double		*ilead;			// C^-1 * lead
+	double		*weights;		// [numSensors x numRows] weights for tile (two columns per voxel for RMS)
+	double		*forward;		// [numChannels x numThreads] forward solution for one dipole
+	double		*proj;			// [numPoints x numRows] projected data
+	int			numProj;
+	bool		*valid;			// false if weights could not be computed for voxel
+	thread_pool	*pool;			// NULL = single threaded
+} bf_engine;
+
+
+static void freeBeamformerEngine( bf_engine &e )
+{
+	free(e.icov);
+	free(e.lead);
+	free(e.ilead);
+	free(e.weights);
+	free(e.forward);
+	free(e.proj);
+	free(e.valid);
+	memset( &e, 0, sizeof(bf_engine) );
+}
+
+static bool initBeamformerEngine( bf_engine &e, ds_params &params, double **icovArray, bf_params &bparams, int tileSize, thread_pool *pool )
+{
+	int n = params.numSensors;
+	int numThreads = (pool == NULL) ? 1 : pool->numThreads;
+
+	memset( &e, 0, sizeof(bf_engine) );
+	e.numSensors = n;
+	e.numChannels = params.numChannels;
+	e.pool = pool;
+	e.tileSize = tileSize;
+	e.type = bparams.type;
+	e.normalized = bparams.normalized;
+	e.noiseRMS = bparams.noiseRMS;
+	e.sphereOrigin.x = bparams.sphereX;
+	e.sphereOrigin.y = bparams.sphereY;
+	e.sphereOrigin.z = bparams.sphereZ;
+
+	if (e.normalized && e.noiseRMS <= 0.0)
+	{
+		mexPrintf("noiseRMS must be greater than zero for normalized weights\n");
+		return (false);
+	}
+
+	e.icov = (double *)malloc( sizeof(double) * n * n );
+	e.lead = (double *)malloc( sizeof(double) * n * tileSize * 2 );
+	e.ilead = (double *)malloc( sizeof(double) * n * tileSize * 2 );
+	e.weights = (double *)malloc( sizeof(double) * n * tileSize * 2 );
+	e.forward = (double *)malloc( sizeof(double) * params.numChannels * numThreads );
+	e.valid = (bool *)malloc( sizeof(bool) * tileSize );
+	if ( e.icov == NULL || e.lead == NULL || e.ilead == NULL || e.weights == NULL || e.forward == NULL || e.valid == NULL )
+	{
+		mexPrintf("memory allocation failed for beamformer engine\n");
+		freeBeamformerEngine(e);
+		return (false);
+	}
+
+	// column major copy - element (i,j) at [i + j*n]
+	for (int i=0; i<n; i++)
+		for (int j=0; j<n; j++)
+			e.icov[i + j * n] = icovArray[i][j];
+
+	return (true);
+}
+
+static int getWeightsPerVoxel( bf_engine &e )
+{
+	return ( e.type == BF_TYPE_RMS ? 2 : 1 );
+}
+
+// tangential basis for voxel relative to sphere origin - e1 = r x z (or r x x if voxel is on z axis), e2 = r x e1
+static bool getTangentialBasis( vectorCart voxel, vectorCart origin, vectorCart &e1, vectorCart &e2 )
+{
+	vectorCart	r;
+
+	r.x = voxel.x - origin.x;
+	r.y = voxel.y - origin.y;
+	r.z = voxel.z - origin.z;
+	double rlen = sqrt( r.x * r.x + r.y * r.y + r.z * r.z );
+	if ( rlen < 1e-6 )
+		return (false);
+	r.x /= rlen;
+	r.y /= rlen;
+	r.z /= rlen;
+
+	if ( fabs(r.z) < 0.99 )
+	{
+		e1.x = r.y;
+		e1.y = -r.x;
+		e1.z = 0.0;
+	}
+	else
+	{
+		e1.x = 0.0;
+		e1.y = r.z;
+		e1.z = -r.y;
+	}
+	e1 = unitVector(e1);
+	e2.x = r.y * e1.z - r.z * e1.y;
+	e2.y = r.z * e1.x - r.x * e1.z;
+	e2.z = r.x * e1.y - r.y * e1.x;
+
+	return (true);
+}
+
+// lead field columns for voxel v of tile - thread selects forward solution buffer
+static void computeVoxelLeadField( bf_engine &e, ds_params &params, vectorCart *voxels, vectorCart *normals, int v, int thread )
+{
+	dip_params	dip;
+	vectorCart	e1;
+	vectorCart	e2;
+
+	int n = e.numSensors;
+	int numBasis = (e.type == BF_TYPE_FIXED) ? 1 : 2;
+	double *forward = e.forward + (size_t)thread * e.numChannels;
+
+	dip.moment = 1.0;		// forward solution per nAm
+	e.valid[v] = getTangentialBasis( voxels[v], e.sphereOrigin, e1, e2 );
+	if (e.type == BF_TYPE_FIXED)
+	{
+		double len = sqrt( normals[v].x * normals[v].x + normals[v].y * normals[v].y + normals[v].z * normals[v].z );
+		if (len > 0.0)
+		{
+			e1 = unitVector( normals[v] );
+			e.valid[v] = true;
+		}
+		else
+			e.valid[v] = false;
+	}
+
+	dip.xpos = voxels[v].x;
+	dip.ypos = voxels[v].y;
+	dip.zpos = voxels[v].z;
+	for (int k=0; k<numBasis; k++)
+	{
+		double *col = e.lead + (size_t)(v * numBasis + k) * n;
+		if ( !e.valid[v] )
+		{
+			memset( col, 0, sizeof(double) * n );
+			continue;
+		}
+		if ( e.leadStore != NULL )
+		{
+			memcpy( col, e.leadStore + (size_t)(v * numBasis + k) * n, sizeof(double) * n );
+			continue;
+		}
+		dip.xori = (k == 0) ? e1.x : e2.x;
+		dip.yori = (k == 0) ? e1.y : e2.y;
+		dip.zori = (k == 0) ? e1.z : e2.z;
+		computeForwardSolution( params, dip, forward, false, params.gradientOrder, false, false);
+		memcpy( col, forward, sizeof(double) * n );
+	}
+}
+
+// weights for voxel v of tile from columns of L and C^-1 L
+static void computeVoxelWeights( bf_engine &e, vectorCart *voxels, vectorCart *normals, int v )
+{
+	vectorCart	e1;
+	vectorCart	e2;
+
+	int n = e.numSensors;
+	int numBasis = (e.type == BF_TYPE_FIXED) ? 1 : 2;
+
+	double *l1 = e.lead + (size_t)(v * numBasis) * n;
+	double *z1 = e.ilead + (size_t)(v * numBasis) * n;
+	double *w1 = e.weights + (size_t)(v * getWeightsPerVoxel(e)) * n;
+	double *w2 = (e.type == BF_TYPE_RMS) ? w1 + n : NULL;
+
+	double a = 0.0;
+	for (int i=0; i<n; i++)
+		a += l1[i] * z1[i];
+
+	if (e.valid[v] && e.type == BF_TYPE_FIXED)
+	{
+		if (a > 0.0)
+		{
+			for (int i=0; i<n; i++)
+				w1[i] = z1[i] / a;
+			normals[v] = unitVector( normals[v] );
+		}
+		else
+			e.valid[v] = false;
+	}
+	else if (e.valid[v])
+	{
+		double *l2 = l1 + n;
+		double *z2 = z1 + n;
+		double b = 0.0;
+		double c = 0.0;
+		for (int i=0; i<n; i++)
+		{
+			b += l1[i] * z2[i];
+			c += l2[i] * z2[i];
+		}
+		double det = a * c - b * b;
+
+		if (det <= 0.0)
+			e.valid[v] = false;
+		else if (e.type == BF_TYPE_RMS)
+		{
+			for (int i=0; i<n; i++)
+			{
+				w1[i] = (  c * z1[i] - b * z2[i] ) / det;
+				w2[i] = ( -b * z1[i] + a * z2[i] ) / det;
+			}
+		}
+		else
+		{
+			// optimal orientation maximizes power 1 / (o' L' C^-1 L o) - eigenvector of smallest eigenvalue of L' C^-1 L
+			double lambda = (a + c) * 0.5 - sqrt( (a - c) * (a - c) * 0.25 + b * b );
+			double c1 = b;
+			double c2 = lambda - a;
+			if ( fabs(lambda - c) > fabs(c2) )
+			{
+				c1 = lambda - c;
+				c2 = b;
+			}
+			double len = sqrt( c1 * c1 + c2 * c2 );
+			if ( len < 1e-30 )
+			{
+				c1 = (a < c) ? 1.0 : 0.0;
+				c2 = (a < c) ? 0.0 : 1.0;
+			}
+			else
+			{
+				c1 /= len;
+				c2 /= len;
+			}
+
+			getTangentialBasis( voxels[v], e.sphereOrigin, e1, e2 );
+			vectorCart o;
+			o.x = c1 * e1.x + c2 * e2.x;
+			o.y = c1 * e1.y + c2 * e2.y;
+			o.z = c1 * e1.z + c2 * e2.z;
+
+			// keep largest component of orientation positive so result doesn't depend on basis
+			double maxVal = o.x;
+			if ( fabs(o.y) > fabs(maxVal) )
+				maxVal = o.y;
+			if ( fabs(o.z) > fabs(maxVal) )
+				maxVal = o.z;
+			if (maxVal < 0.0)
+			{
+				c1 = -c1;
+				c2 = -c2;
+				o.x = -o.x;
+				o.y = -o.y;
+				o.z = -o.z;
+			}
+			normals[v] = o;
+
+			// forward solution and weights are linear in orientation
+			double power = c1 * c1 * a + 2.0 * c1 * c2 * b + c2 * c2 * c;
+			if (power > 0.0)
+			{
+				for (int i=0; i<n; i++)
+					w1[i] = ( c1 * z1[i] + c2 * z2[i] ) / power;
+			}
+			else
+				e.valid[v] = false;
+		}
+	}
+
+	if (e.valid[v] && e.normalized)
+	{
+		double wnorm = 0.0;
+		for (int i=0; i<n; i++)
+		{
+			wnorm += w1[i] * w1[i];
+			if (w2 != NULL)
+				wnorm += w2[i] * w2[i];
+		}
+		wnorm = sqrt(wnorm) * e.noiseRMS;
+		if (wnorm > 0.0)
+		{
+			for (int i=0; i<n; i++)
+			{
+				w1[i] /= wnorm;
+				if (w2 != NULL)
+					w2[i] /= wnorm;
+			}
+		}
+		else
+			e.valid[v] = false;
+	}
+
+	// voxels with no valid solution are set to zero
+	if ( !e.valid[v] )
+	{
+		memset( w1, 0, sizeof(double) * n );
+		if (w2 != NULL)
+			memset( w2, 0, sizeof(double) * n );
+	}
+}
+
+typedef struct bf_tile_task
+{
+	bf_engine		*e;
+	ds_params		*params;
+	vectorCart		*voxels;
+	vectorCart		*normals;
+	int				numVoxels;
+} bf_tile_task;
+
+static void leadFieldTask( int task, int thread, void *arg )
+{
+	bf_tile_task *t = (bf_tile_task *)arg;
+	int v1 = (task + 1) * BF_ENGINE_CHUNK_SIZE;
+	if (v1 > t->numVoxels)
+		v1 = t->numVoxels;
+	for (int v=task * BF_ENGINE_CHUNK_SIZE; v<v1; v++)
+		computeVoxelLeadField( *t->e, *t->params, t->voxels, t->normals, v, thread );
+}
+
+// weights do not use per-thread buffers - thread index is not needed
+static void weightsTask( int task, int /* thread */, void *arg )
+{
+	bf_tile_task *t = (bf_tile_task *)arg;
+	int v1 = (task + 1) * BF_ENGINE_CHUNK_SIZE;
+	if (v1 > t->numVoxels)
+		v1 = t->numVoxels;
+	for (int v=task * BF_ENGINE_CHUNK_SIZE; v<v1; v++)
+		computeVoxelWeights( *t->e, t->voxels, t->normals, v );
+}
+
+// compute weights for numVoxels (<= tileSize) voxels. For fixed orientation normals are input, for optimized
+// orientation the computed orientations are returned in normals. Lead fields are copied from e.leadStore if set.
+// Returns number of weight columns.
+// Voxel loops are run on the engine thread pool (if any) - each voxel writes only its own columns.
+static int computeTileWeights( bf_engine &e, ds_params &params, vectorCart *voxels, vectorCart *normals, int numVoxels )
+{
+	bf_tile_task	t;
+
+	int n = e.numSensors;
+	int numBasis = (e.type == BF_TYPE_FIXED) ? 1 : 2;
+	int numRows = numVoxels * getWeightsPerVoxel(e);
+	int numChunks = (numVoxels + BF_ENGINE_CHUNK_SIZE - 1) / BF_ENGINE_CHUNK_SIZE;
+
+	t.e = &e;
+	t.params = &params;
+	t.voxels = voxels;
+	t.normals = normals;
+	t.numVoxels = numVoxels;
+
+	// lead fields for tile
+	runPoolTasks( e.pool, numChunks, leadFieldTask, &t );
+
+	// C^-1 L for the whole tile
+	char		transN = 'N';
+	double		one = 1.0;
+	double		zero = 0.0;
+	ptrdiff_t	m = n;
+	ptrdiff_t	cols = numVoxels * numBasis;
+	dgemm( &transN, &transN, &m, &cols, &m, &one, e.icov, &m, e.lead, &m, &zero, e.ilead, &m );
+
+	runPoolTasks( e.pool, numChunks, weightsTask, &t );
+
+	return (numRows);
+}
+
+// project data [numPoints x numSensors] (column major) through weights [numSensors x numRows] for numVoxels voxels.
+// Results for each voxel are written to out[v * ldOut + i] (i = 0..numPoints-1), RMS is combined and
+// scalar output is rectified if requested.
+static bool projectWeights( bf_engine &e, const double *weights, int numVoxels, const double *data, int numPoints, bool rectify,
+							double *out, size_t ldOut )
+{
+	int numRows = numVoxels * getWeightsPerVoxel(e);
+
+	if ( e.numProj < numPoints )
+	{
+		free(e.proj);
+		e.proj = (double *)malloc( sizeof(double) * numPoints * e.tileSize * 2 );
+		if (e.proj == NULL)
+		{
+			e.numProj = 0;
+			mexPrintf("memory allocation failed for beamformer projection\n");
+			return (false);
+		}
+		e.numProj = numPoints;
+	}
+
+	char		transN = 'N';
+	double		one = 1.0;
+	double		zero = 0.0;
+	ptrdiff_t	m = numPoints;
+	ptrdiff_t	k = e.numSensors;
+	ptrdiff_t	cols = numRows;
+	dgemm( &transN, &transN, &m, &cols, &k, &one, data, &m, weights, &k, &zero, e.proj, &m );
+
+	for (int v=0; v<numVoxels; v++)
+	{
+		double *dest = out + (size_t)v * ldOut;
+		if (e.type == BF_TYPE_RMS)
+		{
+			double *y1 = e.proj + (size_t)(v * 2) * numPoints;
+			double *y2 = y1 + numPoints;
+			for (int i=0; i<numPoints; i++)
+				dest[i] = sqrt( y1[i] * y1[i] + y2[i] * y2[i] );
+		}
+		else
+		{
+			double *y = e.proj + (size_t)v * numPoints;
+			if (rectify)
+				for (int i=0; i<numPoints; i++)
+					dest[i] = fabs( y[i] );
+			else
+				memcpy( dest, y, sizeof(double) * numPoints );
+		}
+	}
+
+	return (true);
+}
+
+// project data through weights for tile (see projectWeights)
+static bool projectTile( bf_engine &e, int numVoxels, const double *data, int numPoints, bool rectify, double *out, size_t ldOut )
+{
+	return ( projectWeights( e, e.weights, numVoxels, data, numPoints, rectify, out, ldOut ) );
+}
+
+// images for numPoints latencies of data [ldData x numSensors] (column major, first latency at data[0]) through weights
+// [numSensors x numRows] of all numVoxels voxels, computed with one matrix product  Y' = W' D'  [numRows x numPoints].
+// Scalar outputs are computed directly into images (image j at images + j * numVoxels) and rectified if requested.
+// For RMS both outputs of each voxel are computed into work [2 * numVoxels x numPoints] and combined into images.
+static void projectImageBlock( bf_engine &e, const double *weights, int numVoxels, const double *data, int ldData, int numPoints,
+							   bool rectify, double *images, double *work )
+{
+	int numRows = numVoxels * getWeightsPerVoxel(e);
+	double *proj = (e.type == BF_TYPE_RMS) ? work : images;
+
+	char		transT = 'T';
+	double		one = 1.0;
+	double		zero = 0.0;
+	ptrdiff_t	m = numRows;
+	ptrdiff_t	cols = numPoints;
+	ptrdiff_t	k = e.numSensors;
+	ptrdiff_t	ld = ldData;
+	dgemm( &transT, &transT, &m, &cols, &k, &one, weights, &k, data, &ld, &zero, proj, &m );
+
+	size_t numValues = (size_t)numVoxels * numPoints;
+	if (e.type == BF_TYPE_RMS)
+	{
+		for (size_t i=0; i<numValues; i++)
+			images[i] = sqrt( work[2 * i] * work[2 * i] + work[2 * i + 1] * work[2 * i + 1] );
+	}
+	else if (rectify)
+	{
+		for (size_t i=0; i<numValues; i++)
+			images[i] = fabs( images[i] );
+	}
+}
+
+// open lead field store for all voxels of image (see leadFieldStore.h)
+static void openEngineLeadFieldStore( bf_engine &e, lf_store &store, char *dsName, ds_params &params, int numVoxels,
+									  vectorCart *voxelList, vectorCart *normalList )
+{
+	int numBasis = (e.type == BF_TYPE_FIXED) ? 1 : 2;
+	double origin[3] = { e.sphereOrigin.x, e.sphereOrigin.y, e.sphereOrigin.z };
+	openLeadFieldStore( store, dsName, params, numBasis, origin, numVoxels, voxelList, (e.type == BF_TYPE_FIXED) ? normalList : NULL );
+}
+
+// computeTileWeights() for voxels v0 to v0+numVoxels-1 of image - lead fields are read from the store if it exists,
+// otherwise they are computed and saved to the store.
+static int computeStoredTileWeights( bf_engine &e, lf_store &store, ds_params &params, vectorCart *voxelList, vectorCart *normalList,
+									 int v0, int numVoxels )
+{
+	int numBasis = (e.type == BF_TYPE_FIXED) ? 1 : 2;
+
+	e.leadStore = (store.lead == NULL) ? NULL : store.lead + (size_t)v0 * numBasis * e.numSensors;
+	int numRows = computeTileWeights( e, params, voxelList + v0, normalList + v0, numVoxels );
+	writeLeadFieldStore( store, e.lead, numVoxels * numBasis );
+	e.leadStore = NULL;
+
+	return (numRows);
+}
+
+// source power w' C w for each voxel of tile (summed over both weight vectors for RMS).  cw is [numSensors x numRows] work array
+static void computeTilePower( bf_engine &e, int numVoxels, const double *cov, double *cw, double *power )
+{
+	int n = e.numSensors;
+	int numRows = numVoxels * getWeightsPerVoxel(e);
+
+	char		transN = 'N';
+	double		one = 1.0;
+	double		zero = 0.0;
+	ptrdiff_t	m = n;
+	ptrdiff_t	cols = numRows;
+	dgemm( &transN, &transN, &m, &cols, &m, &one, cov, &m, e.weights, &m, &zero, cw, &m );
+
+	for (int v=0; v<numVoxels; v++)
+	{
+		power[v] = 0.0;
+		for (int r=v * getWeightsPerVoxel(e); r<(v + 1) * getWeightsPerVoxel(e); r++)
+			for (int i=0; i<n; i++)
+				power[v] += e.weights[i + (size_t)r * n] * cw[i + (size_t)r * n];
+	}
+}
+
+// baseline samples bstart to bend-1 - window times are rounded to the nearest sample and the end sample is included.
+// Returns the whole epoch if not baselined and false if the window is outside of the data
+static bool getBaselineWindow( ds_params &params, bf_params &bparams, int &bstart, int &bend )
+{
+	bstart = 0;
+	bend = params.numSamples;
+	if (!bparams.baselined)
+		return (true);
+
+	bstart = params.numPreTrig + (int)floor( bparams.baselineWindowStart * params.sampleRate + 0.5 );
+	bend = params.numPreTrig + (int)floor( bparams.baselineWindowEnd * params.sampleRate + 0.5 ) + 1;
+
+	return ( bstart >= 0 && bend <= params.numSamples && bend - bstart >= 1 );
+}
+
+// sample the filtered and baselined average (or plus-minus average) of all trials at each latency into
+// latencyData [numLatencies x numSensors].  Temporary buffers are freed in one place for all exits
+static bool getEventRelatedData( char *dsName, ds_params &params, filter_params &fparams, bf_params &bparams,
+								 int numSensors, int *sensorIndex, int numLatencies, double *latencyList,
+								 bool computePlusMinus, double *latencyData )
+{
+	bool ok = true;
+	int numSamples = params.numSamples;
+
+	int *latencySample = (int *)malloc( sizeof(int) * numLatencies );
+	double *filterBuffer = (double *)malloc( sizeof(double) * numSamples );
+	double **trialData = (double **)calloc( params.numChannels, sizeof(double *) );
+	double **aveData = (double **)calloc( params.numChannels, sizeof(double *) );
+	ds_params *tParams = (ds_params *)malloc( sizeof(ds_params) );		// readMEGTrialData and readMEGDataAverage overwrite params
+	if ( latencySample == NULL || filterBuffer == NULL || trialData == NULL || aveData == NULL || tParams == NULL )
+	{
+		mexPrintf("memory allocation failed for event-related data\n");
+		ok = false;
+	}
+	for (int k=0; ok && k<params.numChannels; k++)
+	{
+		trialData[k] = (double *)malloc( sizeof(double) * numSamples );
+		aveData[k] = (double *)calloc( numSamples, sizeof(double) );
+		if ( trialData[k] == NULL || aveData[k] == NULL )
+		{
+			mexPrintf("memory allocation failed for event-related data\n");
+			ok = false;
+		}
+	}
+
+	for (int j=0; ok && j<numLatencies; j++)
+	{
+		latencySample[j] = params.numPreTrig + (int)floor( latencyList[j] * params.sampleRate + 0.5 );
+		if (latencySample[j] < 0 || latencySample[j] >= numSamples)
+		{
+			mexPrintf("latency %g s is outside of data range\n", latencyList[j]);
+			ok = false;
+		}
+	}
+
+	int bstart = 0;
+	int bend = numSamples;
+	if ( ok && !getBaselineWindow( params, bparams, bstart, bend ) )
+	{
+		mexPrintf("invalid baseline window (%g to %g s)\n", bparams.baselineWindowStart, bparams.baselineWindowEnd);
+		ok = false;
+	}
+
+	// average or plus-minus average of all trials
+	if (ok && computePlusMinus)
+	{
+		mexPrintf("computing plus-minus average of %d trials...\n", params.numTrials);
+		for (int trial=0; ok && trial<params.numTrials; trial++)
+		{
+			*tParams = params;
+			if ( !readMEGTrialData( dsName, *tParams, trialData, trial, params.gradientOrder, false) )
+			{
+				mexPrintf("Error reading .meg4 file\n");
+				ok = false;
+				break;
+			}
+			double sign = (trial % 2) ? -1.0 : 1.0;
+			for (int k=0; k<numSensors; k++)
+				for (int i=0; i<numSamples; i++)
+					aveData[sensorIndex[k]][i] += sign * trialData[sensorIndex[k]][i];
+		}
+		for (int k=0; ok && k<numSensors; k++)
+			for (int i=0; i<numSamples; i++)
+				aveData[sensorIndex[k]][i] /= (double)params.numTrials;
+	}
+	else if (ok)
+	{
+		*tParams = params;
+		if ( !readMEGDataAverage( dsName, *tParams, aveData, -1, 0) )
+		{
+			mexPrintf("Error returned from readMEGDataAverage...\n");
+			ok = false;
+		}
+	}
+
+	for (int k=0; ok && k<numSensors; k++)
+	{
+		double *src = aveData[sensorIndex[k]];
+		if (fparams.enable)
+			applyFilter( src, filterBuffer, numSamples, &fparams);
+		else
+			memcpy( filterBuffer, src, sizeof(double) * numSamples );
+
+		double mean = 0.0;
+		if (bparams.baselined)
+		{
+			for (int i=bstart; i<bend; i++)
+				mean += filterBuffer[i];
+			mean /= (double)(bend - bstart);
+		}
+		for (int j=0; j<numLatencies; j++)
+			latencyData[j + (size_t)k * numLatencies] = filterBuffer[latencySample[j]] - mean;
+	}
+
+	for (int k=0; k<params.numChannels; k++)
+	{
+		if (trialData != NULL)
+			free(trialData[k]);
+		if (aveData != NULL)
+			free(aveData[k]);
+	}
+	free(trialData);
+	free(aveData);
+	free(filterBuffer);
+	free(latencySample);
+	free(tParams);
+
+	return (ok);
+}
+
+// event-related images - replaces computeEventRelated() in bwlib.
+// The filtered and baselined average (or plus-minus average) is computed in one pass over the data and sampled at
+// each latency to form D [numLatencies x numSensors].  Weights for all voxels are computed one tile at a time and
+// kept, then the images for each block of writer.blockSize latencies are computed with a single product of the
+// weights of all voxels and the block of D (see projectImageBlock) and passed to the writer, so memory used for
+// images does not depend on the number of latencies.
+// Voxels with no valid weights (e.g., at the sphere origin) have zero weights, so their value is 0.0 in every image.
+// The number of such voxels is printed.
+static bool computeEventRelatedImages( image_writer &writer, char *dsName, ds_params &params, filter_params &fparams, bf_params &bparams,
+									   double **icovArray, int numVoxels, vectorCart *voxelList, vectorCart *normalList,
+									   int numLatencies, double *latencyList, bool computePlusMinus, bool nonRectified, int numThreads )
+{
+	bf_engine		e;
+	thread_pool		pool;
+	lf_store		store;
+	double			*latencyData = NULL;
+	double			*weights = NULL;
+	double			*work = NULL;
+	int				sensorIndex[MAX_CHANNELS];
+	bool			engineReady = false;
+	bool			ok = true;
+
+	int numSensors = 0;
+	for (int k=0; k<params.numChannels; k++)
+		if ( params.channel[k].isSensor )
+			sensorIndex[numSensors++] = k;
+	if (numSensors != params.numSensors)
+	{
+		mexPrintf("number of primary sensors does not agree with dataset header\n");
+		return (false);
+	}
+
+	latencyData = (double *)malloc( sizeof(double) * numLatencies * numSensors );
+	if ( latencyData == NULL )
+	{
+		mexPrintf("memory allocation failed for event-related data\n");
+		return (false);
+	}
+	ok = getEventRelatedData( dsName, params, fparams, bparams, numSensors, sensorIndex, numLatencies, latencyList,
+							  computePlusMinus, latencyData );
+
+	// weights for all voxels, one tile of voxels at a time
+	int tileSize = (numVoxels < BF_ENGINE_TILE_SIZE) ? numVoxels : BF_ENGINE_TILE_SIZE;
+	int blockSize = writer.blockSize;
+	createThreadPool( pool, numThreads );
+	if (ok)
+	{
+		mexPrintf("computing images using %d threads\n", pool.numThreads);
+		ok = engineReady = initBeamformerEngine( e, params, icovArray, bparams, tileSize, &pool );
+	}
+
+	if (ok)
+	{
+		size_t numWeights = (size_t)numSensors * numVoxels * getWeightsPerVoxel(e);
+		weights = (double *)malloc( sizeof(double) * numWeights );
+		if (e.type == BF_TYPE_RMS)
+			work = (double *)malloc( sizeof(double) * blockSize * numVoxels * 2 );
+		if (weights == NULL || (e.type == BF_TYPE_RMS && work == NULL))
+		{
+			mexPrintf("memory allocation failed for event-related images\n");
+			ok = false;
+		}
+	}
+
+	if (ok)
+	{
+		// lead fields are read from store for this grid, or saved to it as they are computed
+		openEngineLeadFieldStore( e, store, dsName, params, numVoxels, voxelList, normalList );
+
+		int numInvalid = 0;
+		for (int v0=0; v0<numVoxels; v0+=tileSize)
+		{
+			int nv = (numVoxels - v0 < tileSize) ? numVoxels - v0 : tileSize;
+			int numRows = computeStoredTileWeights( e, store, params, voxelList, normalList, v0, nv );
+			memcpy( weights + (size_t)v0 * getWeightsPerVoxel(e) * numSensors, e.weights, sizeof(double) * numSensors * numRows );
+			for (int v=0; v<nv; v++)
+				if ( !e.valid[v] )
+					numInvalid++;
+		}
+		if (numInvalid > 0)
+			mexPrintf("could not compute weights for %d voxels (image values set to zero)\n", numInvalid);
+		closeLeadFieldStore( store );
+	}
+
+	// images for blocks of latencies - the writer saves each block while the next one is computed
+	for (int j0=0; ok && j0<numLatencies; j0+=blockSize)
+	{
+		int nj = (numLatencies - j0 < blockSize) ? numLatencies - j0 : blockSize;
+
+		double **images = getImageWriterBlock( writer );
+		if ( images == NULL )
+		{
+			ok = false;
+			break;
+		}
+
+		projectImageBlock( e, weights, numVoxels, latencyData + j0, numLatencies, nj, !nonRectified, images[0], work );
+		submitImageWriterBlock( writer, j0, nj );
+	}
+
+	// single cleanup for all exits
+	free(weights);
+	free(work);
+	free(latencyData);
+	if (engineReady)
+		freeBeamformerEngine(e);
+	destroyThreadPool( pool );
+
+	return (ok);
+}
+
+// differential images - replaces computeDifferential() in bwlib.
+// Weights are computed (without normalization) from icovArray - the inverse of the regularized covariance for the
+// combined active and baseline windows, or the active window for pseudo-Z.  For each voxel the source power
+// P = w' C w in the active and baseline windows and the projected noise N = noiseRMS^2 w' w give
+//		pseudo-Z	sqrt( Pa / N )
+//		pseudo-T	(Pa - Pb) / (2 N)
+//		pseudo-F	Pa / Pb
+// (Vrba and Robinson, 2001).  For RMS (vector) weights power is summed over both orientations.  Images are computed
+// for each of numActive active window covariances (column major [numSensors x numSensors]) with the same weights.
+static bool computeDifferentialImages( double **imageData, char *dsName, ds_params &params, bf_params &bparams, double **icovArray,
+									   int numActive, double **activeCov, double *baselineCov, int imageType,
+									   int numVoxels, vectorCart *voxelList, vectorCart *normalList, int numThreads )
+{
+	bf_engine		e;
+	bf_params		wparams;
+	thread_pool		pool;
+	lf_store		store;
+
+	if ( imageType != BF_IMAGE_PSEUDO_Z && baselineCov == NULL )
+	{
+		mexPrintf("baseline covariance required for pseudo-T and pseudo-F images\n");
+		return (false);
+	}
+	if ( imageType != BF_IMAGE_PSEUDO_F && bparams.noiseRMS <= 0.0 )
+	{
+		mexPrintf("noiseRMS must be greater than zero for pseudo-Z and pseudo-T images\n");
+		return (false);
+	}
+
+	wparams = bparams;
+	wparams.normalized = false;
+
+	int tileSize = (numVoxels < BF_ENGINE_TILE_SIZE) ? numVoxels : BF_ENGINE_TILE_SIZE;
+	createThreadPool( pool, numThreads );
+	mexPrintf("computing images using %d threads\n", pool.numThreads);
+	if ( !initBeamformerEngine( e, params, icovArray, wparams, tileSize, &pool ) )
+	{
+		destroyThreadPool( pool );
+		return (false);
+	}
+
+	double *cw = (double *)malloc( sizeof(double) * e.numSensors * tileSize * 2 );
+	double *activePower = (double *)malloc( sizeof(double) * tileSize );
+	double *baselinePower = (double *)malloc( sizeof(double) * tileSize );
+	if ( cw == NULL || activePower == NULL || baselinePower == NULL )
+	{
+		mexPrintf("memory allocation failed for differential images\n");
+		free(cw);
+		free(activePower);
+		free(baselinePower);
+		freeBeamformerEngine(e);
+		destroyThreadPool( pool );
+		return (false);
+	}
+
+	openEngineLeadFieldStore( e, store, dsName, params, numVoxels, voxelList, normalList );
+
+	int n = e.numSensors;
+	double noiseVar = bparams.noiseRMS * bparams.noiseRMS;
+	int numInvalid = 0;
+	for (int v0=0; v0<numVoxels; v0+=tileSize)
+	{
+		int nv = (numVoxels - v0 < tileSize) ? numVoxels - v0 : tileSize;
+
+		computeStoredTileWeights( e, store, params, voxelList, normalList, v0, nv );
+		if (imageType != BF_IMAGE_PSEUDO_Z)
+			computeTilePower( e, nv, baselineCov, cw, baselinePower );
+
+		for (int v=0; v<nv; v++)
+			if ( !e.valid[v] )
+				numInvalid++;
+
+		for (int j=0; j<numActive; j++)
+		{
+			computeTilePower( e, nv, activeCov[j], cw, activePower );
+			for (int v=0; v<nv; v++)
+			{
+				double noise = 0.0;
+				for (int r=v * getWeightsPerVoxel(e); r<(v + 1) * getWeightsPerVoxel(e); r++)
+					for (int i=0; i<n; i++)
+						noise += e.weights[i + (size_t)r * n] * e.weights[i + (size_t)r * n];
+				noise *= noiseVar;
+
+				double val = 0.0;
+				if ( e.valid[v] )
+				{
+					if (imageType == BF_IMAGE_PSEUDO_Z)
+						val = (noise > 0.0 && activePower[v] > 0.0) ? sqrt( activePower[v] / noise ) : 0.0;
+					else if (imageType == BF_IMAGE_PSEUDO_T)
+						val = (noise > 0.0) ? (activePower[v] - baselinePower[v]) / (2.0 * noise) : 0.0;
+					else
+						val = (baselinePower[v] > 0.0) ? activePower[v] / baselinePower[v] : 0.0;
+				}
+				imageData[j][v0 + v] = val;
+			}
+		}
+	}
+	if (numInvalid > 0)
+		mexPrintf("could not compute weights for %d voxels (set to zero)\n", numInvalid);
+
+	closeLeadFieldStore( store );
+	free(cw);
+	free(activePower);
+	free(baselinePower);
+	freeBeamformerEngine(e);
+	destroyThreadPool( pool );
+
+	return (true);
+}
+
+#endif
@@ -17,6 +17,10 @@
 //	[useExpandedWindow]   - flag to indicate whether to use expanded filter window. Ignored if filter off.\n\n");		
 //	[deidentify]			- don't copy text fields that may contain patient name.\n\n");
 //	[badChanneList]       - [nchannels x 5 chars] character array of MEG channel names to be excluded.\n");
+//	[sequentialRead]      - flag to read each channel once in a single forward pass over sorted latencies (default = 1)\n");
+//	[filterContinuous]    - flag to filter each channel once over the entire continuous record before cutting epochs (default = 0)\n");
+//	[antiAlias]           - flag to lowpass filter before downsampling (default = 0 - samples are dropped)\n");
+//	[numThreads]          - number of threads used to filter and write trials (default = 1)\n");
 //
 // returns
 //	errCode = 0    - no errors detected
@@ -34,6 +38,35 @@
 //				2.6  - recompiled with separate ctflib and bwlib
 //              2.7  - Version 3.0beta - fixed bug in saving with expanded filter window - April 23 / 2015
 //              2.8  - Version 3.3 modification - added lineFilter option - pass lineFilterFreq == 0 to disable  Dec 14 / 2016
+//              2.9  - added sequentialRead option - epochs are extracted in a single forward sweep per channel
+//                     over sorted latencies instead of one seek per channel per epoch. Output is identical. Oct 2022
+//              3.0  - read input using meg4Reader.h - 64 bit file offsets and multi-segment (.1_meg4 ...) datasets.
+//                     64 bit offsets for output trials.
+//              3.1  - added filterContinuous option - each channel is filtered once over the whole recording
+//                     and epochs are cut from the filtered data. useExpandedWindow is ignored in this mode.
+//              3.2  - line filter uses single notch filter bank for all harmonics (see notchBank.h)
+//              3.3  - added antiAlias option - downsampled channels are computed by an anti-alias FIR
+//                     decimator (see decimator.h) instead of dropping samples
+//              3.4  - added numThreads option - trials are filtered and written by multiple threads, each with
+//                     its own input file and buffers. Trials are written at fixed offsets and averages are summed
+//                     in thread order so output is the same as single-threaded.
+//              3.5  - newDsName and latencies can be cell arrays to epoch several conditions in one pass through
+//                     the raw data. Epochs for all conditions are read and filtered together and each trial is
+//                     written to the dataset for its condition.
+//              3.6  - read errors stop epoching in all modes and no dataset is saved (err = -1).
+//                     sequentialRead is on by default (same default as bw_epochDs.m)
+//              3.7  - output .meg4 is split into segments of less than 2 GB (name.meg4, name.1_meg4 ...) as
+//                     written by the CTF software - see createMEG4Output() in meg4Reader.h. Write errors are
+//                     detected and no dataset is saved.
+//              3.8  - filterContinuous checks for read errors and writes each output trial once in trial order
+//                     (was one seek and write per channel per epoch)
+//                     worker threads copy the main filter instead of rebuilding it (coefficients were never freed)
+//                     fixed epoch boundary check when downsampling (was using number of output samples)
+//              3.9  - all returns free buffers and close the input and output files (see cleanupEpochDs)
+//                     trials for a thread that cannot be started are processed by the main thread
+//                     line filter settings from build_line_filter() (same as bw_filter)
+//                     removed cell array newDsName and latencies (3.5) - no callers epoch several conditions
+//                     with the same settings. One dataset is saved per call
 //
 // ************************************
 
@@ -41,26 +74,95 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "string.h"
 #include "../../../ctflib/headers/datasetUtils.h"
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
+#include "meg4Reader.h"
+#include "notchBank.h"
+#include "decimator.h"
 
-#define VERSION_NO 2.7
+#define VERSION_NO 3.9
+
+#define MAX_EPOCH_BUFFER_BYTES	268435456	// max. memory for trial blocks in sequentialRead mode (256 MB)
+#define EPOCH_READ_CHUNK		1048576		// min. number of samples read per channel at one time in sequentialRead mode
+#define MAX_EPOCH_THREADS		32
 
 int				*windowData;                      
 int				*channelData;  
 int				*trialBlock;
+int				*batchBlock;
+meg4_file		inputMEG4;
+int				*readBuffer;
+int				*continuousData;
 
 double			*aveBlock;
 double			*outBuffer;
 double			*inBuffer;
+double			*decimInput;
+double			*decimOutput;
+
+int				*epochStartSample;		// first sample of each epoch (not including filter window)
+int				*epochTrialIndex;		// trial number in output dataset or -1 if excluded
+int				*sortedEpochs;			// valid epochs in output trial order (sorted by start sample for sequentialRead)
+bool			badChannelIndex[MAX_CHANNELS];
 
 ds_params		dsParams;
 ds_params		newParams;
 
+// filter settings used by processEpochChannel()
+filter_params 	fparams;
+notch_bank_params	notchParams;
+decimator_params	decimator;
+
+bool			preFilter;
+bool            lineFilter;
+int				preFilterPts;
+int				windowPts;
+int				downSample;
+bool			antiAlias;
+bool			saveAverageFlag;
+int				numWorkerTrials;
+meg4_output		outMEG4;
+
+// buffers and filter used by one thread to process epochs
+typedef struct epoch_worker
+{
+	int				threadIndex;
+	int				numThreads;
+	bool			readError;
+
+	int				*windowData;
+	int				*trialBlock;
+	double			*aveBlock;		// sum of this thread's trials (threaded mode only)
+	double			*inBuffer;
+	double			*outBuffer;
+	double			*decimInput;
+	double			*decimOutput;
+	filter_params	*filter;
+
+	meg4_file		meg4;			// each thread reads from its own file handle
+} epoch_worker;
+
+epoch_worker		mainWorker;		// uses global buffers in single threaded modes
+epoch_worker		*workers;
+filter_params		workerFilters[MAX_EPOCH_THREADS];
+pthread_mutex_t		writeMutex;
+
 extern "C" 
 {
+
+void	filterChannelData( epoch_worker &w, const int *src, int *dest, int numPts );
+void	downSampleChannel( epoch_worker &w, const int *src, int k, int *dest );
+void	processEpochChannel( epoch_worker &w, const int *window, int k, int *dest );
+bool	initEpochWorker( epoch_worker &w, int thread, int numThreads, const char *dsName );
+void	freeEpochWorker( epoch_worker &w );
+void	*epochWorkerThread( void *arg );
+int		compareEpochStart( const void *a, const void *b );
+bool	createDsDirectory( const char *name );
+void	cleanupEpochDs( char *dsName, char *newDsName, int numBadChannels, char **badChannelNames );
+
 void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 { 
     
@@ -71,7 +173,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	char			newDsBaseName[256];	
 	
 	int				numBadChannels;
-	char			**badChannelNames;
+	char			**badChannelNames = NULL;
 	char			file[256];	
 	char			file2[256];
 
@@ -91,32 +193,51 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	int				numLatencies;
 	double          *latencies;
 	double			*err;
-	FILE			*fp;	
 	FILE			*fp2;
 
-	int				preFilterPts;
 	double          highPass;
 	double          lowPass;
 	double			epochStart;
 	double			epochEnd;
 
-	bool			preFilter = false;
-    bool            lineFilter = false;
 	bool			saveAverage = false;
+	bool			sequentialRead = true;
+	bool			filterContinuous = false;
+	bool			readError = false;
+	bool			writeError = false;
+	int				numThreads = 1;
     
-	bool			badChannelIndex[MAX_CHANNELS];
-	int				downSample = 1;
 	int				useExpandedWindow = 0;
 	int				deidentify_data = 0;
     
 	double          lineFilterFreq = 0.0;
     double          lineFilterWidth = 3.0;
     
-	filter_params 	fparams;
-    filter_params   lf1params;
-    filter_params   lf2params;
-    filter_params   lf3params;
-    filter_params   lf4params;
+	// globals have to be reset on each call
+	preFilter = false;
+	lineFilter = false;
+	downSample = 1;
+	antiAlias = false;
+	
+	// buffers and files are released by cleanupEpochDs() for both normal and error returns
+	windowData = NULL;
+	channelData = NULL;
+	trialBlock = NULL;
+	batchBlock = NULL;
+	readBuffer = NULL;
+	continuousData = NULL;
+	aveBlock = NULL;
+	outBuffer = NULL;
+	inBuffer = NULL;
+	decimInput = NULL;
+	decimOutput = NULL;
+	epochStartSample = NULL;
+	epochTrialIndex = NULL;
+	sortedEpochs = NULL;
+	decimator.coeffs = NULL;
+	inputMEG4.numSegments = 0;
+	inputMEG4.sampleBuffer = NULL;
+	outMEG4.numSegments = 0;
     
 	/* Check for proper number of arguments */
 	
@@ -127,7 +248,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("bw_CTFEpochDs ver. %.1f (c) Douglas Cheyne, PhD. 2010. All rights reserved.\n", VERSION_NO); 
 		mexPrintf("Incorrect number of input or output arguments\n");
 		mexPrintf("Usage:\n"); 
-		mexPrintf("   err = bw_CTFEpochDs(dsName, newDsName, latencies, [epochStart, epochEnd], saveAverage, filterData, [highPass lowPass], lineFilterFreq, downSample, {useExpandedWIndow}, {deidentify}, {badChannelList} )\n\n");
+		mexPrintf("   err = bw_CTFEpochDs(dsName, newDsName, latencies, [epochStart, epochEnd], saveAverage, filterData, [highPass lowPass], lineFilterFreq, downSample, {useExpandedWIndow}, {deidentify}, {badChannelList}, {sequentialRead}, {filterContinuous}, {antiAlias}, {numThreads} )\n\n");
 		mexPrintf("   [dsName]              - name of raw data (single trial) CTF dataset to epoch\n");
 		mexPrintf("   [newDsName]           - output name for epoched data (use *.ds extension!) \n");
 		mexPrintf("   [latencies]           - row vector of event latencies in seconds.\n");
@@ -141,6 +262,10 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("   [useExpandedWindow]   - Filter using extended data segments Ignored if filter off.\n\n");
 		mexPrintf("   [deidentify]			- don't copy text fields that may contain patient name.\n\n");
 		mexPrintf("   [badChanneList]       - [nchannels x 5 chars] character array of MEG channel names to be excluded.\n");
+		mexPrintf("   [sequentialRead]      - read each channel in one forward pass over sorted latencies (faster for large files, default = 1).\n");
+		mexPrintf("   [filterContinuous]    - filter each channel once over the continuous data then cut epochs (faster for overlapping epochs, default = 0).\n");
+		mexPrintf("   [antiAlias]           - apply anti-alias lowpass filter when downsampling (default = 0).\n");
+		mexPrintf("   [numThreads]          - number of threads used to process trials (default = 1). Ignored if filterContinuous is set.\n");
 		mexPrintf(" \n");
 		return;
     }
@@ -168,28 +293,28 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
   	if (status != 0) 
     		mexWarnMsgTxt("Not enough space. String is truncated.");   
 	
-  	if (mxIsChar(prhs[1]) != 1)
+	if (mxIsChar(prhs[1]) != 1)
 		mexErrMsgTxt("Input must be a string.");
 	
-  	/* Input must be a row vector. */
-  	if (mxGetM(prhs[1]) != 1)
+	/* Input must be a row vector. */
+	if (mxGetM(prhs[1]) != 1)
 		mexErrMsgTxt("Input must be a row vector.");
 	
-  	/* Get the length of the input string. */
-  	buflen = (mxGetM(prhs[1]) * mxGetN(prhs[1])) + 1;
+	/* Get the length of the input string. */
+	buflen = (mxGetM(prhs[1]) * mxGetN(prhs[1])) + 1;
 	
 	/* Allocate memory for input and output strings. */
-  	newDsName = (char *)mxCalloc(buflen, sizeof(char));
+	newDsName = (char *)mxCalloc(buflen, sizeof(char));
 	
-  	/* Copy the string data from prhs[0] into a C string input_buf. */
-  	status = mxGetString(prhs[1], newDsName, buflen);
-  	if (status != 0) 
-		mexWarnMsgTxt("Not enough space. String is truncated.");    	
-
-	if (mxGetM(prhs[2]) != 1 )
+	/* Copy the string data from prhs[0] into a C string input_buf. */
+	status = mxGetString(prhs[1], newDsName, buflen);
+	if (status != 0) 
+		mexWarnMsgTxt("Not enough space. String is truncated.");
+	
+	if (mxGetM(prhs[2]) != 1 && !mxIsEmpty(prhs[2]))
 		mexErrMsgTxt("Input [2] must be a row vector of latencies.");
 	latencies = mxGetPr(prhs[2]);
-	numLatencies = mxGetN(prhs[2]);
+	numLatencies = (int)mxGetNumberOfElements(prhs[2]);
 
 	if (mxGetM(prhs[3]) != 1 || mxGetN(prhs[3]) != 2)
 		mexErrMsgTxt("Input [3] must be a row vector [epochStart epochEnd].");
@@ -248,47 +373,49 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		}
 	}
 	
-	plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL); 
-	err = mxGetPr(plhs[0]);
-	err[0] = 0;
-
+	if (nrhs > 12)
+	{
+		dataPtr = mxGetPr(prhs[12]);
+		sequentialRead = (int)dataPtr[0];
+	}
 	
-	// first make sure we can create datset folder 
+	if (nrhs > 13)
+	{
+		dataPtr = mxGetPr(prhs[13]);
+		filterContinuous = (int)dataPtr[0];
+	}
 	
-	sprintf(msg,"creating new dataset %s...\n", newDsName );	
-	mexPrintf(msg);
-		
-	int result;
-#if _WIN32||WIN64
-	result = mkdir(newDsName);
-#else
-	result = mkdir(newDsName, S_IRUSR | S_IWUSR | S_IXUSR );
-#endif
+	if (nrhs > 14)
+	{
+		dataPtr = mxGetPr(prhs[14]);
+		antiAlias = (int)dataPtr[0];
+	}
 	
-	if ( result != 0 ) 
+	if (nrhs > 15)
 	{
-		mexPrintf("** overwriting existing directory %s ...\n", newDsName);
-		sprintf(cmd,"rm -r %s",newDsName);
-		system(cmd);
-#if _WIN32||WIN64
-		mkdir(newDsName);
-#else
-		mkdir(newDsName, S_IRUSR | S_IWUSR | S_IXUSR );
-#endif
+		dataPtr = mxGetPr(prhs[15]);
+		numThreads = (int)dataPtr[0];
+		if (numThreads < 1)
+			numThreads = 1;
+		if (numThreads > MAX_EPOCH_THREADS)
+			numThreads = MAX_EPOCH_THREADS;
 	}
 	
+	plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL); 
+	err = mxGetPr(plhs[0]);
+	err[0] = 0;
+
+	
+	// first make sure we can create datset folders
 	
-	// make sure directory is readable 
-	sprintf(cmd,"chmod a+rX %s",newDsName);
-	system(cmd);
+	createDsDirectory( newDsName );
 		
 	// get dataset info
     if ( !readMEGResFile( dsName, dsParams ) )
     {
 		mexPrintf("Error reading res4 file ...\n");
 		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
     }
 	sprintf(msg, "Epoching dataset: %s\n", dsName);
@@ -310,8 +437,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	{
 		mexPrintf("Cannot epoch CTF dataset with more than one trial\n");
 		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
 
@@ -353,8 +479,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
             {
                 mexPrintf("Could not build filter.  Exiting\n");
                 err[0] = -1;
-                mxFree(dsName);
-                mxFree(newDsName);
+                cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
                 return;
             }
         }
@@ -363,82 +488,22 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
         if (lineFilter)
         {
             mexPrintf("Notch filtering powerline (%.1f Hz) and harmonics...\n", lineFilterFreq);
-            lf1params.type = BW_BANDREJECT;
-            lf1params.bidirectional = true;
-            lf1params.hc = lineFilterFreq + lineFilterWidth;
-            lf1params.lc = lineFilterFreq - lineFilterWidth;
-            lf1params.fs = dsParams.sampleRate;
-            lf1params.order = 4;	//
-            lf1params.ncoeff = 0;				// init filter
-              
-            lf1params.enable = true;
-            if (build_filter (&lf1params) == -1)
+            if (build_line_filter (&notchParams, lineFilterFreq, lineFilterWidth, dsParams.sampleRate, true) == -1)
             {
               mexPrintf("Could not build band reject filter.  Exiting\n");
               err[0] = -1;
-              mxFree(dsName);
-              mxFree(newDsName);
+              cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
               return;
             }
-            
-            lf2params.type = BW_BANDREJECT;
-            lf2params.bidirectional = true;
-            lf2params.hc = (lineFilterFreq * 2.0) + lineFilterWidth;
-            lf2params.lc = (lineFilterFreq * 2.0) - lineFilterWidth;
-            lf2params.fs = dsParams.sampleRate;
-            lf2params.order = 4;	//
-            lf2params.ncoeff = 0;				// init filter
-            
-            lf2params.enable = true;
-            if (build_filter (&lf2params) == -1)
-            {
-                mexPrintf("Could not build band reject filter.  Exiting\n");
-                err[0] = -1;
-                mxFree(dsName);
-                mxFree(newDsName);
-                return;
-            }
-            
-            lf3params.type = BW_BANDREJECT;
-            lf3params.bidirectional = true;
-            lf3params.hc = (lineFilterFreq * 3.0) + lineFilterWidth;
-            lf3params.lc = (lineFilterFreq * 3.0) - lineFilterWidth;
-            lf3params.fs = dsParams.sampleRate;
-            lf3params.order = 4;	//
-            lf3params.ncoeff = 0;				// init filter
-            
-            lf3params.enable = true;
-            if (build_filter (&lf3params) == -1)
-            {
-                mexPrintf("Could not build band reject filter.  Exiting\n");
-                err[0] = -1;
-                mxFree(dsName);
-                mxFree(newDsName);
-                return;
-            }
-            
-            lf4params.type = BW_BANDREJECT;
-            lf4params.bidirectional = true;
-            lf4params.hc = (lineFilterFreq * 4.0) + lineFilterWidth;
-            lf4params.lc = (lineFilterFreq * 4.0) - lineFilterWidth;
-            lf4params.fs = dsParams.sampleRate;
-            lf4params.order = 4;	//
-            lf4params.ncoeff = 0;				// init filter
-            
-            lf4params.enable = true;
-            if (build_filter (&lf4params) == -1)
-            {
-                mexPrintf("Could not build band reject filter.  Exiting\n");
-                err[0] = -1;
-                mxFree(dsName);
-                mxFree(newDsName);
-                return;
-            }
-            
-        
         }
         
-		if (useExpandedWindow)
+		if (filterContinuous)
+		{
+			// no edge effects except at beginning and end of recording
+			preFilterPts = 0;
+			mexPrintf("Pre-filtering continuous data from %g to %g Hz \n", highPass, lowPass);
+		}
+		else if (useExpandedWindow)
 		{
 			preFilterPts = int(numSamples / 2);
 			mexPrintf("Pre-filtering data from %g to %g Hz using epoch window expanded by %d points \n",
@@ -456,6 +521,26 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
         
     }
 	
+	// anti-alias filter for downsampling needs halfLength extra samples on either side of epoch
+	if (antiAlias && downSample > 1)
+	{
+		if (build_decimator (&decimator, downSample) == -1)
+		{
+			mexPrintf("Could not build anti-alias filter.  Exiting\n");
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
+		}
+		preFilterPts += decimator.halfLength;
+		
+		double cutoff = decimator.cutoff * dsParams.sampleRate;
+		if (newParams.lowPass == 0.0 || newParams.lowPass > cutoff)
+			newParams.lowPass = cutoff;
+		mexPrintf("Anti-alias filtering at %g Hz before downsampling\n", cutoff);
+	}
+	else
+		antiAlias = false;
+	
 	// data is ch1 all samples, ch2 allsamples....
 	// easiest is to read in one channel at a time and write out epoch
 	
@@ -466,8 +551,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	{
 		mexPrintf("memory allocation failed for channel data buffer\n");
 		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
 	// make larger buffer to write out one trial at a time
@@ -476,9 +560,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	{
 		mexPrintf("memory allocation failed for trialBlock data buffer\n");
 		err[0] = -1;
-		free(channelData);
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
 	
@@ -488,100 +570,93 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	{
 		mexPrintf("memory allocation failed for aveBlock data buffer\n");
 		err[0] = -1;
-		free(channelData);
-		free(trialBlock);
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
 	
-	int windowPts = numSamples + (preFilterPts * 2);
+	windowPts = numSamples + (preFilterPts * 2);
 	
-	if (preFilter || lineFilter)
+	// filter buffers must hold entire channel if filtering continuous data
+	if ( !(preFilter || lineFilter) )
+		filterContinuous = false;
+	int filterPts = filterContinuous ? dsParams.numSamples : windowPts;
+	
+	if (preFilter || lineFilter || antiAlias)
 	{
 		windowData = (int *)malloc( sizeof(int) * windowPts);
 		if ( windowData == NULL)
 		{
 			mexPrintf("memory allocation failed for windowData  buffer\n");
 			err[0] = -1;
-			free(channelData);
-			free(trialBlock);
-			free(aveBlock);
-			mxFree(dsName);
-			mxFree(newDsName);
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
+		}
+	}
+	
+	if (antiAlias)
+	{
+		decimInput = (double *)malloc( sizeof(double) * windowPts );
+		decimOutput = (double *)malloc( sizeof(double) * numSamples );
+		if ( decimInput == NULL || decimOutput == NULL)
+		{
+			mexPrintf("memory allocation failed for decimation buffers\n");
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 			return;
 		}
-		inBuffer = (double *)malloc( sizeof(double) * windowPts );
+	}
+	
+	if (preFilter || lineFilter)
+	{
+		inBuffer = (double *)malloc( sizeof(double) * filterPts );
 		if ( inBuffer == NULL)
 		{
 			mexPrintf("memory allocation failed for inBuffer\n");
 			err[0] = -1;
-			free(channelData);
-			free(trialBlock);
-			free(aveBlock);
-			mxFree(dsName);
-			mxFree(newDsName);
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 			return;
 		}
-		outBuffer = (double *)malloc( sizeof(double) * windowPts );
+		outBuffer = (double *)malloc( sizeof(double) * filterPts );
 		if ( outBuffer == NULL)
 		{
 			mexPrintf("memory allocation failed for outBuffer\n");
 			err[0] = -1;
-			free(channelData);
-			free(trialBlock);
-			free(aveBlock);
-			mxFree(dsName);
-			mxFree(newDsName);
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 			return;
 		}
 	}
 	
+	mainWorker.windowData = windowData;
+	mainWorker.trialBlock = trialBlock;
+	mainWorker.inBuffer = inBuffer;
+	mainWorker.outBuffer = outBuffer;
+	mainWorker.decimInput = decimInput;
+	mainWorker.decimOutput = decimOutput;
+	mainWorker.filter = &fparams;
+	
 	// get filenames without path or ext..
 	removeFilePath( dsName, dsBaseName);
 	dsBaseName[strlen(dsBaseName)-3] = '\0';
-	removeFilePath( newDsName, newDsBaseName);
-	newDsBaseName[strlen(newDsBaseName)-3] = '\0';
-	
 	
 	// open existing data..
+	// streamed with fread - large datasets may not fit in the address space if mapped
 
-	sprintf(file, "%s%s%s.meg4", dsName, FILE_SEPARATOR, dsBaseName );
-
-	if ( ( fp = fopen( file, "rb") ) == NULL )
+	if ( !openMEG4File( dsName, dsParams, inputMEG4, false ) )
 	{
 		mexPrintf("couldn't open meg4 file for reading\n");
 		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
 	
-	// create the ds directory and meg4 file with header
+	// create the ds directory - meg4 file is created once the number of trials is known
 	if ( !createMEG4File( newDsName ) )
 	{
-		mexPrintf("Error creating new dataset \n");
+		mexPrintf("couldn't create dataset %s\n", newDsName);
 		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
 		return;
 	}
-		
-	// create the .meg4 file and write header
-	sprintf(file, "%s%s%s.meg4", newDsName, FILE_SEPARATOR, newDsBaseName );
-	
-	if ( ( fp2 = fopen( file, "wb") ) == NULL )
-	{
-		mexPrintf("couldn't open meg4 file for writing\n");
-		err[0] = -1;
-		mxFree(dsName);
-		mxFree(newDsName);
-		return;
-	}
-	
-	// write 8 byte header
-	sprintf(tStr, "MEG41CP");
-	fwrite(tStr, sizeof( char ), 8, fp2 );
 	
 	mexPrintf("extracting epochs ...  \n");
 	mexEvalString("drawnow");
@@ -635,10 +710,19 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	newParams.numPreTrig = (int)(preTrigPts / downSample);
 	
 	
-	int lineCount = 0;
+	// get epoch boundaries and output trial order
+	epochStartSample = (int *)malloc( sizeof(int) * numLatencies);
+	epochTrialIndex = (int *)malloc( sizeof(int) * numLatencies);
+	sortedEpochs = (int *)malloc( sizeof(int) * numLatencies);
+	if ( epochStartSample == NULL || epochTrialIndex == NULL || sortedEpochs == NULL)
+	{
+		mexPrintf("memory allocation failed for epoch lists\n");
+		err[0] = -1;
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+		return;
+	}
+	
 	int numTrials = 0;
-    mexPrintf("Writing trials:\n" );
-
 	for (int i=0; i<numLatencies; i++)
 	{
 		// ** D. Cheyne fixed rounding error in version 3.6beta
@@ -647,144 +731,417 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		int startSample = (int)(fval + 0.5);
 		startSample -=  preTrigPts;
 		
-		int endSample = startSample + newParams.numSamples;
+		// ** boundary check must use number of input samples - newParams.numSamples is after downsampling
+		int endSample = startSample + numSamples;
+		epochStartSample[i] = startSample;
 		if ( (startSample - preFilterPts) < 0 || (endSample + preFilterPts) > dsParams.numSamples)
 		{
 			mexPrintf("\n**excluding trial %d (sample %d to sample %d) -- exceeds data boundaries**\n", i+1, startSample, endSample);
 			mexEvalString("drawnow");
+			epochTrialIndex[i] = -1;
 			continue;
 		}
-		//		sprintf(msg,"reading trial %d at t = %.4f s (sample %d to %d)\n", i+1, latencies[i], startSample, endSample);
-		//		mexPrintf(msg);
-		//		mexEvalString("drawnow");
-		if (lineCount++ == 40)
+		epochTrialIndex[i] = numTrials;
+		sortedEpochs[numTrials++] = i;
+	}
+	
+	int trialBlockSize = newParams.numSamples * newParams.numChannels;
+	
+	// create the meg4 file(s) - large datasets are split into segments of less than 2 GB
+	if ( !createMEG4Output( newDsName, newParams.numChannels, newParams.numSamples, numTrials, outMEG4 ) )
+	{
+		mexPrintf("couldn't create meg4 file for %s\n", newDsName);
+		err[0] = -1;
+		cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+		return;
+	}
+	
+	int lineCount = 0;
+	if (filterContinuous)
+		mexPrintf("Filtering channels:\n" );
+	else
+		mexPrintf("Writing trials:\n" );
+
+	if (filterContinuous)
+	{
+		// filter each channel once over the entire recording and cut the epochs into a block of output trials,
+		// then write the block in trial order. If the trials do not all fit in the buffer, each channel is
+		// filtered once for each block of trials
+		int batchSize = (int)( MAX_EPOCH_BUFFER_BYTES / ( sizeof(int) * (double)trialBlockSize ) );
+		if (batchSize > numTrials)
+			batchSize = numTrials;
+		if (batchSize < 1)
+			batchSize = 1;
+		
+		continuousData = (int *)malloc( sizeof(int) * dsParams.numSamples );
+		batchBlock = (int *)malloc( sizeof(int) * (size_t)trialBlockSize * batchSize );
+		if ( continuousData == NULL || batchBlock == NULL )
 		{
-			mexPrintf("\n");
-			mexEvalString("drawnow");
-			lineCount = 0;
+			mexPrintf("memory allocation failed for continuous data buffers\n");
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
 		}
-				
-		mexPrintf("%d ", i+1);
-		mexEvalString("drawnow");
 		
-		// read from input and write to output ds
-		// - assume no byte swapping is needed here if not converting to Tesla
+		int numPasses = (numTrials + batchSize - 1) / batchSize;
+		if (numPasses > 1)
+			mexPrintf("(filtering in %d passes of %d trials)\n", numPasses, batchSize);
 		
-		//  -- jump to trial offset	
-		int idx = 0;
-		for (int k=0; k<dsParams.numChannels; k++)
+		for (int first=0; !readError && first<numTrials; first+=batchSize)
 		{
-			// go to the beginning of the epoch for this channel
-			int epochOffset = (k * dsParams.numSamples) + startSample - preFilterPts;
-			
-			int byteOffset = ( epochOffset * sizeof(int) ) + 8; // include ID string
-			
-			fseek( fp, byteOffset, SEEK_SET);
+			int last = first + batchSize;
+			if (last > numTrials)
+				last = numTrials;
 			
-			// if skipping this channel (i.e., bad channel) read data then 
-			// simply don't write it to the meg4.  
-			if ( badChannelIndex[k] )
+			int outChannel = 0;
+			for (int k=0; k<dsParams.numChannels; k++)
 			{
-//				mexPrintf("Excluding data for bad channel %s \n", dsParams.channel[k].name );
-//				mexEvalString("drawnow");		
-				continue;
-			}	
+				if ( badChannelIndex[k] )
+					continue;
 				
-            // bug fix April 20, * if prefilter was on,  non-MEG channels were being shifted in time..
-			// since was skipping this section for all non analog channels
-            if (preFilter || lineFilter )
-            {
-
-                fread( windowData, sizeof(int), windowPts, fp);
-            
-                // ** don't filter digital channels
-                // filter data - need to byte swap and convert to floating point
-                if (dsParams.channel[k].isSensor || dsParams.channel[k].isReference || dsParams.channel[k].isEEG )
-                {
-                    for (int j=0; j<windowPts; j++)
-                    {
-                        int iVal = ToHost(windowData[j]);
-                        inBuffer[j] = double(iVal);
-                    }
-                    
-                    if (preFilter)
-                    {
-                        applyFilter( inBuffer, outBuffer, windowPts, &fparams);
-                        for (int j=0; j<windowPts; j++)
-                            inBuffer[j] = outBuffer[j];
-                    }
-                    if (lineFilter)
-                    {
-                        if (lf1params.hc < (dsParams.sampleRate * 0.5) )
-                        {
-                            applyFilter( inBuffer, outBuffer, windowPts, &lf1params);
-                            for (int j=0; j<windowPts; j++)
-                                inBuffer[j] = outBuffer[j];
-                        }
-                        if (lf2params.hc < (dsParams.sampleRate * 0.5) )
-                        {
-                            applyFilter( inBuffer, outBuffer, windowPts, &lf2params);
-                            for (int j=0; j<windowPts; j++)
-                                inBuffer[j] = outBuffer[j];
-                        }
-                        if (lf3params.hc < (dsParams.sampleRate * 0.5) )
-                        {
-                            applyFilter( inBuffer, outBuffer, windowPts, &lf3params);
-                            for (int j=0; j<windowPts; j++)
-                                inBuffer[j] = outBuffer[j];
-                        }
-                        if (lf4params.hc < (dsParams.sampleRate * 0.5) )
-                        {
-                            applyFilter( inBuffer, outBuffer, windowPts, &lf4params);
-                            for (int j=0; j<windowPts; j++)
-                                inBuffer[j] = outBuffer[j];
-                        }
-                    }
-                    
-                    // convert back to byte swapped integer data...
-                    for (int j=0; j<windowPts; j++)
-                    {
-                        int iVal = (int)inBuffer[j];
-                        windowData[j] = ToFile(iVal);
-                    }
-                }
-                // copy epoch window to output array
-                for (int j=0; j<numSamples; j++)
-                    channelData[j] = windowData[j+preFilterPts];
- 			}
-			else
-				fread( channelData, sizeof(int), numSamples, fp);
-			
-			// create output data - downsample data here...
+				if (lineCount++ == 20)
+				{
+					mexPrintf("\n");
+					lineCount = 0;
+				}
+				mexPrintf("%s ", dsParams.channel[k].name);
+				mexEvalString("drawnow");
+				
+				if ( !readMEG4RawSamples( inputMEG4, 0, k, 0, dsParams.numSamples, continuousData) )
+				{
+					mexPrintf("\nerror reading channel %s from %s\n", dsParams.channel[k].name, dsName);
+					readError = true;
+					break;
+				}
+				
+				// ** don't filter digital channels
+				if ( dsParams.channel[k].isSensor || dsParams.channel[k].isReference || dsParams.channel[k].isEEG )
+					filterChannelData( mainWorker, continuousData, continuousData, dsParams.numSamples);
+				
+				// copy epochs to output trial blocks - downsample data here...
+				for (int e=first; e<last; e++)
+				{
+					int i = sortedEpochs[e];
+					int *dest = batchBlock + (size_t)(e - first) * trialBlockSize + outChannel * newParams.numSamples;
+					downSampleChannel( mainWorker, continuousData + epochStartSample[i], k, dest);
+				}
+				outChannel++;
+			}
+			if (readError)
+				break;
 			
-			for (int j=0; j<newParams.numSamples; j++)
-				trialBlock[idx++] = channelData[j*downSample];
+			// epochs are in latency order so trials are written sequentially
+			for (int e=first; e<last; e++)
+			{
+				int i = sortedEpochs[e];
+				int *block = batchBlock + (size_t)(e - first) * trialBlockSize;
+				
+				if (saveAverage)
+				{
+					double *avePtr = aveBlock;
+					for (int j=0;j< trialBlockSize; j++)
+					{
+						int iVal = ToHost(block[j]);
+						avePtr[j] += double(iVal);
+					}
+				}
+				
+				writeMEG4Samples( outMEG4, epochTrialIndex[i], 0, block, trialBlockSize);
+			}
+		}
+	}
+	else if (numThreads > 1 && numTrials > 1)
+	{
+		// each thread filters every numThreads'th trial and writes it at its offset in the output file.
+		// Thread t always processes the same trials, so the summed averages do not depend on timing
+		if (numThreads > numTrials)
+			numThreads = numTrials;
+		
+		numWorkerTrials = numTrials;
+		saveAverageFlag = saveAverage;
+		
+		workers = (epoch_worker *)malloc( sizeof(epoch_worker) * numThreads );
+		if ( workers == NULL )
+		{
+			mexPrintf("memory allocation failed for worker threads\n");
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
+		}
+		
+		int numWorkers = 0;
+		for (int t=0; t<numThreads; t++)
+		{
+			if ( !initEpochWorker( workers[t], t, numThreads, dsName ) )
+				break;
+			numWorkers++;
+		}
+		
+		if (numWorkers < numThreads)
+		{
+			mexPrintf("could not allocate buffers for %d threads\n", numThreads);
+			for (int t=0; t<numWorkers; t++)
+				freeEpochWorker( workers[t] );
+			free(workers);
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
 		}
 		
-		// ** note have to write blocks with size based on new params since channel count may have decreased
+		mexPrintf("(using %d threads)\n", numThreads);
+		mexEvalString("drawnow");
+		
+		pthread_t	threads[MAX_EPOCH_THREADS];
+		bool		threadStarted[MAX_EPOCH_THREADS];
+		pthread_mutex_init( &writeMutex, NULL );
 		
+		for (int t=0; t<numThreads; t++)
+			threadStarted[t] = ( pthread_create( &threads[t], NULL, epochWorkerThread, (void *)&workers[t] ) == 0 );
 		
-		if (saveAverage)
+		// trials for threads that could not be started are processed here - output is the same
+		for (int t=0; t<numThreads; t++)
 		{
-			for (int j=0;j< newParams.numSamples * newParams.numChannels; j++)
+			if ( !threadStarted[t] )
 			{
-				int iVal = ToHost(trialBlock[j]);
-				aveBlock[j] += double(iVal);
+				mexPrintf("could not start thread %d - processing its trials in main thread\n", t+1);
+				epochWorkerThread( (void *)&workers[t] );
 			}
 		}
+		for (int t=0; t<numThreads; t++)
+		{
+			if ( threadStarted[t] )
+				pthread_join( threads[t], NULL );
+		}
 		
-		fwrite( trialBlock, sizeof(int), newParams.numSamples*newParams.numChannels, fp2);
-		numTrials++;
+		pthread_mutex_destroy( &writeMutex );
 		
-	}	
-
-	newParams.numTrials = numTrials;
+		// can only call mex functions from main thread
+		for (int e=0; e<numTrials; e++)
+		{
+			if (lineCount++ == 40)
+			{
+				mexPrintf("\n");
+				lineCount = 0;
+			}
+			mexPrintf("%d ", sortedEpochs[e]+1);
+		}
+		
+		for (int t=0; t<numThreads; t++)
+		{
+			if ( workers[t].readError )
+			{
+				mexPrintf("\nerror reading data in thread %d\n", t+1);
+				readError = true;
+			}
+			if (saveAverage)
+			{
+				for (int j=0;j< trialBlockSize; j++)
+					aveBlock[j] += workers[t].aveBlock[j];
+			}
+			freeEpochWorker( workers[t] );
+		}
+		free(workers);
+	}
+	else if (sequentialRead)
+	{
+		// read each channel once in a forward sweep over the sorted epochs and scatter the epochs
+		// into a block of output trials, then write the block at the trials' offsets in the output file
+		qsort( sortedEpochs, numTrials, sizeof(int), compareEpochStart);
+		
+		int batchSize = (int)( MAX_EPOCH_BUFFER_BYTES / ( sizeof(int) * (double)trialBlockSize ) );
+		if (batchSize > numTrials)
+			batchSize = numTrials;
+		if (batchSize < 1)
+			batchSize = 1;
+		
+		int readBufferSize = windowPts;
+		if (readBufferSize < EPOCH_READ_CHUNK)
+			readBufferSize = EPOCH_READ_CHUNK;
+		
+		batchBlock = (int *)malloc( sizeof(int) * (size_t)trialBlockSize * batchSize );
+		readBuffer = (int *)malloc( sizeof(int) * readBufferSize );
+		if ( batchBlock == NULL || readBuffer == NULL )
+		{
+			mexPrintf("memory allocation failed for sequential read buffers\n");
+			err[0] = -1;
+			cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+			return;
+		}
+		
+		for (int first=0; !readError && first<numTrials; first+=batchSize)
+		{
+			int last = first + batchSize;
+			if (last > numTrials)
+				last = numTrials;
+			
+			int outChannel = 0;
+			for (int k=0; !readError && k<dsParams.numChannels; k++)
+			{
+				if ( badChannelIndex[k] )
+					continue;
+				
+				int bufStart = 0;
+				int bufLen = 0;
+				for (int e=first; e<last; e++)
+				{
+					int windowStart = epochStartSample[ sortedEpochs[e] ] - preFilterPts;
+					
+					// read forward if window is not in buffer - keep any overlap with previous window
+					if ( bufLen == 0 || windowStart + windowPts > bufStart + bufLen )
+					{
+						int overlap = 0;
+						if ( bufLen > 0 && windowStart < bufStart + bufLen )
+						{
+							overlap = bufStart + bufLen - windowStart;
+							memmove( readBuffer, readBuffer + (windowStart - bufStart), sizeof(int) * overlap );
+						}
+						int readLen = readBufferSize;
+						if (windowStart + readLen > dsParams.numSamples)
+							readLen = dsParams.numSamples - windowStart;
+						readLen -= overlap;
+						
+						if ( !readMEG4RawSamples( inputMEG4, 0, k, windowStart + overlap, readLen, readBuffer + overlap) )
+						{
+							mexPrintf("\nerror reading channel %s from %s\n", dsParams.channel[k].name, dsName);
+							readError = true;
+							break;
+						}
+						
+						bufStart = windowStart;
+						bufLen = overlap + readLen;
+					}
+					
+					int *dest = batchBlock + (size_t)(e - first) * trialBlockSize + outChannel * newParams.numSamples;
+					processEpochChannel( mainWorker, readBuffer + (windowStart - bufStart), k, dest );
+				}
+				outChannel++;
+			}
+			if (readError)
+				break;
+			
+			for (int e=first; e<last; e++)
+			{
+				int i = sortedEpochs[e];
+				int *block = batchBlock + (size_t)(e - first) * trialBlockSize;
+				
+				if (lineCount++ == 40)
+				{
+					mexPrintf("\n");
+					mexEvalString("drawnow");
+					lineCount = 0;
+				}
+				mexPrintf("%d ", i+1);
+				
+				if (saveAverage)
+				{
+					double *avePtr = aveBlock;
+					for (int j=0;j< trialBlockSize; j++)
+					{
+						int iVal = ToHost(block[j]);
+						avePtr[j] += double(iVal);
+					}
+				}
+				
+				// trials are written in original latency order
+				writeMEG4Samples( outMEG4, epochTrialIndex[i], 0, block, trialBlockSize);
+			}
+			mexEvalString("drawnow");
+		}
+	}
+	else
+	{
+		for (int i=0; i<numLatencies; i++)
+		{
+			if (epochTrialIndex[i] == -1)
+				continue;
+			
+			int startSample = epochStartSample[i];
+			
+			//		sprintf(msg,"reading trial %d at t = %.4f s (sample %d to %d)\n", i+1, latencies[i], startSample, endSample);
+			//		mexPrintf(msg);
+			//		mexEvalString("drawnow");
+			if (lineCount++ == 40)
+			{
+				mexPrintf("\n");
+				mexEvalString("drawnow");
+				lineCount = 0;
+			}
+					
+			mexPrintf("%d ", i+1);
+			mexEvalString("drawnow");
+			
+			// read from input and write to output ds
+			// - assume no byte swapping is needed here if not converting to Tesla
+			
+			//  -- jump to trial offset	
+			int idx = 0;
+			for (int k=0; k<dsParams.numChannels; k++)
+			{
+				// if skipping this channel (i.e., bad channel) don't read data
+				// and simply don't write it to the meg4.  
+				if ( badChannelIndex[k] )
+					continue;
+				
+				// read from the beginning of the epoch for this channel
+				// bug fix April 20, * if prefilter was on,  non-MEG channels were being shifted in time..
+				// since was skipping this section for all non analog channels
+				if (preFilter || lineFilter || antiAlias)
+				{
+					if ( !readMEG4RawSamples( inputMEG4, 0, k, startSample - preFilterPts, windowPts, windowData) )
+						readError = true;
+					else
+						processEpochChannel( mainWorker, windowData, k, trialBlock + idx );
+				}
+				else
+				{
+					if ( !readMEG4RawSamples( inputMEG4, 0, k, startSample, numSamples, channelData) )
+						readError = true;
+					else
+						processEpochChannel( mainWorker, channelData, k, trialBlock + idx );
+				}
+				if (readError)
+				{
+					mexPrintf("\nerror reading channel %s from %s\n", dsParams.channel[k].name, dsName);
+					break;
+				}
+				idx += newParams.numSamples;
+			}
+			if (readError)
+				break;
+			
+			// ** note have to write blocks with size based on new params since channel count may have decreased
+			
+			if (saveAverage)
+			{
+				double *avePtr = aveBlock;
+				for (int j=0;j< trialBlockSize; j++)
+				{
+					int iVal = ToHost(trialBlock[j]);
+					avePtr[j] += double(iVal);
+				}
+			}
+			
+			// trials are in latency order so are written sequentially
+			writeMEG4Samples( outMEG4, epochTrialIndex[i], 0, trialBlock, trialBlockSize);
+		}
+	}
 	
 	mexPrintf("\n");
-	mexEvalString("drawnow");
 	
-	fclose(fp);
-	fclose(fp2);
+	closeMEG4File(inputMEG4);
+	if ( !closeMEG4Output(outMEG4) )
+	{
+		mexPrintf("error writing %s\n", outMEG4.fileName);
+		writeError = true;
+	}
+	
+	if (readError)
+		mexPrintf("error reading %s ... epoched dataset not saved\n", dsName);
+	else if (writeError)
+		mexPrintf("error writing epoched data ... dataset not saved\n");
+	if (readError || writeError)
+		err[0] = -1;
+	mexEvalString("drawnow");
 	
 	if (deidentify_data)
 	{
@@ -797,142 +1154,369 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		sprintf(newParams.operator_id,"removed");
 	}
 	
-	if ( !writeMEGResFile(newDsName, newParams) )
-	{
-		mexPrintf("WARNING: error occurred writing new res4 file... dataset may be invalid \n");
-		err[0] = -1;
-	}	
-	
-	//  Copy the head coil (.hc) since CTF software needs this		
-	mexPrintf("copying head coil file ...\n");
-    #if _WIN32||WIN64
-        sprintf(cmd, "copy %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, newDsName, FILE_SEPARATOR, newDsBaseName );
-    #else
-        sprintf(cmd, "cp %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, newDsName, FILE_SEPARATOR, newDsBaseName );
-    #endif
-	system(cmd);
-
-	if (saveAverage)
+	// write header, head coil file and average
+	if (!readError && !writeError)
 	{
-		char aveFileName[256];
-		char aveFileBaseName[256];
+		removeFilePath( newDsName, newDsBaseName);
+		newDsBaseName[strlen(newDsBaseName)-3] = '\0';
 		
-		// divide and convert back to integer
-		// *** note - should really scale data and gains here to a slightly lower LSB
-		//            as is done in the CTF software
-		for (int j=0;j<numSamples*dsParams.numChannels; j++)
+		newParams.numTrials = numTrials;
+		if ( !writeMEGResFile(newDsName, newParams) )
 		{
-			int iVal = (int)(aveBlock[j] / numTrials);
-			trialBlock[j] = ToFile(iVal);
-		}
-		
-		newDsName[strlen(newDsName)-3] = '\0';
-		sprintf(aveFileName,"%s-average.ds", newDsName);
-
-		mexPrintf("Saving average as: %s\n", aveFileName);
-		
-		sprintf(msg,"creating new dataset %s...\n", aveFileName );	
-		mexPrintf(msg);
+			mexPrintf("WARNING: error occurred writing new res4 file... dataset may be invalid \n");
+			err[0] = -1;
+		}	
 		
-#if _WIN32||WIN64
-		result = mkdir(aveFileName);
-#else
-		result = mkdir(aveFileName, S_IRUSR | S_IWUSR | S_IXUSR );
-#endif
+		//  Copy the head coil (.hc) since CTF software needs this		
+		mexPrintf("copying head coil file ...\n");
+	    #if _WIN32||WIN64
+	        sprintf(cmd, "copy %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, newDsName, FILE_SEPARATOR, newDsBaseName );
+	    #else
+	        sprintf(cmd, "cp %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, newDsName, FILE_SEPARATOR, newDsBaseName );
+	    #endif
+		system(cmd);
 		
-		if ( result != 0 ) 
+		if (saveAverage && numTrials == 0)
+			mexPrintf("No valid trials for %s - average not saved\n", newDsName);
+		else if (saveAverage)
 		{
-			mexPrintf("** overwriting existing directory %s ...\n", aveFileName);
-			sprintf(cmd,"rm -r %s",aveFileName);
-			system(cmd);
-#if _WIN32||WIN64
-			mkdir(aveFileName);
-#else
-			mkdir(aveFileName, S_IRUSR | S_IWUSR | S_IXUSR );
-#endif
+			char aveFileName[256];
+			char aveFileBaseName[256];
+			double *avePtr = aveBlock;
+			
+			// divide and convert back to integer
+			// *** note - should really scale data and gains here to a slightly lower LSB
+			//            as is done in the CTF software
+			for (int j=0;j<trialBlockSize; j++)
+			{
+				int iVal = (int)(avePtr[j] / numTrials);
+				trialBlock[j] = ToFile(iVal);
+			}
+			
+			newDsName[strlen(newDsName)-3] = '\0';
+			sprintf(aveFileName,"%s-average.ds", newDsName);
+			
+			mexPrintf("Saving average as: %s\n", aveFileName);
+			
+			createDsDirectory( aveFileName );
+			
+			// create the ds directory and meg4 file with header
+			if ( !createMEG4File( aveFileName ) )
+			{
+				mexPrintf("Error creating new dataset \n");
+				err[0] = -1;
+			}
+			
+			// create the .meg4 file and write header
+			removeFilePath( aveFileName, aveFileBaseName);
+			aveFileBaseName[strlen(aveFileBaseName)-3] = '\0';
+			
+			sprintf(file, "%s%s%s.meg4", aveFileName, FILE_SEPARATOR, aveFileBaseName );
+			if ( ( fp2 = fopen( file, "wb") ) == NULL )
+			{
+				mexPrintf("couldn't open meg4 file for writing\n");
+				err[0] = -1;
+			}
+			
+			if (err[0] == 0)
+			{
+				// write 8 byte header
+				sprintf(tStr, "MEG41CP");
+				fwrite(tStr, sizeof( char ), 8, fp2 );
+				fwrite( trialBlock, sizeof(int), trialBlockSize, fp2);
+				
+				fclose(fp2);
+				
+				// everything is same except ntrials now == 1
+				
+				newParams.numTrials = 1;
+				if ( !writeMEGResFile(aveFileName, newParams) )
+				{
+					mexPrintf("WARNING: error occurred writing new res4 file... dataset may be invalid \n");
+					err[0] = -1;
+				}	
+				
+				//  Copy the head coil (.hc) since CTF software needs this		
+				mexPrintf("copying head coil file ...\n");
+	            #if _WIN32||WIN64
+	                sprintf(cmd, "copy %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, aveFileName, FILE_SEPARATOR, aveFileBaseName );
+	            #else
+	                sprintf(cmd, "cp %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, aveFileName, FILE_SEPARATOR, aveFileBaseName );
+	            #endif
+				system(cmd);
+			}
 		}
+	}
 		
-		// make sure directory is readable 
-		sprintf(cmd,"chmod a+rX %s",aveFileName);
-		system(cmd);
 	
-		// create the ds directory and meg4 file with header
-		if ( !createMEG4File( aveFileName ) )
+	mexPrintf("cleaning up...\n");
+
+	cleanupEpochDs( dsName, newDsName, numBadChannels, badChannelNames );
+
+	mexPrintf("done...\n");
+	
+	return;
+}
+    
+// filter numPts samples of one channel from src into dest (byte swapped integer data). src and dest can be the same array
+void filterChannelData( epoch_worker &w, const int *src, int *dest, int numPts )
+{
+	// need to byte swap and convert to floating point
+	for (int j=0; j<numPts; j++)
+	{
+		int iVal = ToHost(src[j]);
+		w.inBuffer[j] = double(iVal);
+	}
+	
+	// notch filter bank is applied in place - no copies between filter stages
+	double *filtData = w.inBuffer;
+	if (preFilter)
+	{
+		applyFilter( w.inBuffer, w.outBuffer, numPts, w.filter);
+		filtData = w.outBuffer;
+	}
+	if (lineFilter)
+		applyNotchBank( filtData, filtData, numPts, &notchParams);
+	
+	// convert back to byte swapped integer data...
+	for (int j=0; j<numPts; j++)
+	{
+		int iVal = (int)filtData[j];
+		dest[j] = ToFile(iVal);
+	}
+}
+
+// filter (if enabled) and downsample one channel of an epoch into dest
+// window contains windowPts samples starting preFilterPts before the epoch and is not modified
+void processEpochChannel( epoch_worker &w, const int *window, int k, int *dest )
+{
+	const int *src = window + preFilterPts;
+	
+	// ** don't filter digital channels
+	if ( (preFilter || lineFilter) && (dsParams.channel[k].isSensor || dsParams.channel[k].isReference || dsParams.channel[k].isEEG) )
+	{
+		filterChannelData( w, window, w.windowData, windowPts);
+		src = w.windowData + preFilterPts;
+	}
+	
+	// copy epoch to output array - downsample data here...
+	downSampleChannel( w, src, k, dest);
+}
+
+// downsample one channel of an epoch starting at src into dest (newParams.numSamples samples)
+// if antiAlias is set src must have decimator.halfLength valid samples before and after the epoch
+void downSampleChannel( epoch_worker &w, const int *src, int k, int *dest )
+{
+	// ** don't filter digital channels
+	if ( antiAlias && (dsParams.channel[k].isSensor || dsParams.channel[k].isReference || dsParams.channel[k].isEEG) )
+	{
+		int h = decimator.halfLength;
+		int numPts = (newParams.numSamples - 1) * downSample + (2 * h) + 1;
+		for (int j=0; j<numPts; j++)
 		{
-			mexPrintf("Error creating new dataset \n");
-			err[0] = -1;
+			int iVal = ToHost(src[j-h]);
+			w.decimInput[j] = double(iVal);
 		}
 		
-		// create the .meg4 file and write header
-		removeFilePath( aveFileName, aveFileBaseName);
-		aveFileBaseName[strlen(aveFileBaseName)-3] = '\0';
-
-		sprintf(file, "%s%s%s.meg4", aveFileName, FILE_SEPARATOR, aveFileBaseName );
-		if ( ( fp2 = fopen( file, "wb") ) == NULL )
+		decimateSamples( w.decimInput + h, w.decimOutput, newParams.numSamples, &decimator);
+		
+		for (int j=0; j<newParams.numSamples; j++)
 		{
-			mexPrintf("couldn't open meg4 file for writing\n");
-			err[0] = -1;
+			int iVal = (int)floor(w.decimOutput[j] + 0.5);
+			dest[j] = ToFile(iVal);
 		}
+	}
+	else
+	{
+		for (int j=0; j<newParams.numSamples; j++)
+			dest[j] = src[j*downSample];
+	}
+}
+
+// allocate buffers, filter and input file for one worker thread - called from main thread
+bool initEpochWorker( epoch_worker &w, int thread, int numThreads, const char *dsName )
+{
+	int trialBlockSize = newParams.numSamples * newParams.numChannels;
+	
+	w.threadIndex = thread;
+	w.numThreads = numThreads;
+	w.readError = false;
+	w.windowData = (int *)malloc( sizeof(int) * windowPts );
+	w.trialBlock = (int *)malloc( sizeof(int) * trialBlockSize );
+	w.aveBlock = (double *)calloc( trialBlockSize, sizeof(double) );
+	w.inBuffer = (double *)malloc( sizeof(double) * windowPts );
+	w.outBuffer = (double *)malloc( sizeof(double) * windowPts );
+	w.decimInput = (double *)malloc( sizeof(double) * windowPts );
+	w.decimOutput = (double *)malloc( sizeof(double) * newParams.numSamples );
+	w.meg4.numSegments = 0;
+	w.meg4.sampleBuffer = NULL;
+	
+	// each thread uses its own copy of the filter built by the main thread.  The coefficients are
+	// not rebuilt (ncoeff is kept) so no filter memory is allocated for the worker
+	workerFilters[thread] = fparams;
+	w.filter = &workerFilters[thread];
+	
+	if ( w.windowData == NULL || w.trialBlock == NULL || w.aveBlock == NULL || w.inBuffer == NULL ||
+		 w.outBuffer == NULL || w.decimInput == NULL || w.decimOutput == NULL )
+	{
+		freeEpochWorker( w );
+		return (false);
+	}
+	if ( !openMEG4File( dsName, dsParams, w.meg4, false ) )
+	{
+		freeEpochWorker( w );
+		return (false);
+	}
+	return (true);
+}
+
+void freeEpochWorker( epoch_worker &w )
+{
+	free( w.windowData );
+	free( w.trialBlock );
+	free( w.aveBlock );
+	free( w.inBuffer );
+	free( w.outBuffer );
+	free( w.decimInput );
+	free( w.decimOutput );
+	closeMEG4File( w.meg4 );
+}
+
+// thread function - processes output trials threadIndex, threadIndex + numThreads ...
+// must not call any mex or matlab functions
+void *epochWorkerThread( void *arg )
+{
+	epoch_worker &w = *(epoch_worker *)arg;
+	int trialBlockSize = newParams.numSamples * newParams.numChannels;
+	
+	for (int e=w.threadIndex; e<numWorkerTrials; e+=w.numThreads)
+	{
+		int i = sortedEpochs[e];
+		int startSample = epochStartSample[i];
 		
-		if (err[0] == 0)
+		int idx = 0;
+		for (int k=0; k<dsParams.numChannels; k++)
 		{
-			// write 8 byte header
-			sprintf(tStr, "MEG41CP");
-			fwrite(tStr, sizeof( char ), 8, fp2 );
-			fwrite( trialBlock, sizeof(int), newParams.numSamples*dsParams.numChannels, fp2);
-			
-			fclose(fp2);
-
-			// everything is same except ntrials now == 1
+			if ( badChannelIndex[k] )
+				continue;
 			
-			newParams.numTrials = 1;
-			if ( !writeMEGResFile(aveFileName, newParams) )
+			if ( !readMEG4RawSamples( w.meg4, 0, k, startSample - preFilterPts, windowPts, w.windowData) )
 			{
-				mexPrintf("WARNING: error occurred writing new res4 file... dataset may be invalid \n");
-				err[0] = -1;
-			}	
-					
-			//  Copy the head coil (.hc) since CTF software needs this		
-			mexPrintf("copying head coil file ...\n");
-            #if _WIN32||WIN64
-                sprintf(cmd, "copy %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, aveFileName, FILE_SEPARATOR, aveFileBaseName );
-            #else
-                sprintf(cmd, "cp %s%s%s.hc %s%s%s.hc", dsName, FILE_SEPARATOR, dsBaseName, aveFileName, FILE_SEPARATOR, aveFileBaseName );
-            #endif
-			system(cmd);
+				w.readError = true;
+				return (NULL);
+			}
+			processEpochChannel( w, w.windowData, k, w.trialBlock + idx );
+			idx += newParams.numSamples;
 		}
-	
-	}
 		
+		if (saveAverageFlag)
+		{
+			double *avePtr = w.aveBlock;
+			for (int j=0;j< trialBlockSize; j++)
+			{
+				int iVal = ToHost(w.trialBlock[j]);
+				avePtr[j] += double(iVal);
+			}
+		}
+		
+		pthread_mutex_lock( &writeMutex );
+		writeMEG4Samples( outMEG4, epochTrialIndex[i], 0, w.trialBlock, trialBlockSize);
+		pthread_mutex_unlock( &writeMutex );
+	}
 	
-	mexPrintf("cleaning up...\n");
+	return (NULL);
+}
+
+// qsort comparison for sorting epochs by start sample - keeps latency order for equal start samples
+int compareEpochStart( const void *a, const void *b )
+{
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	
+	if ( epochStartSample[i] != epochStartSample[j] )
+		return ( epochStartSample[i] < epochStartSample[j] ? -1 : 1 );
+	return ( i - j );
+}
 
-	free(channelData);	
+// free buffers, close input and output files and free input strings.  Used for all returns after
+// the arguments are read - buffers not yet allocated are NULL and closed files have no segments
+void cleanupEpochDs( char *dsName, char *newDsName, int numBadChannels, char **badChannelNames )
+{
+	free(windowData);
+	free(channelData);
 	free(trialBlock);
+	free(batchBlock);
+	free(readBuffer);
+	free(continuousData);
 	free(aveBlock);
+	free(outBuffer);
+	free(inBuffer);
+	free(decimInput);
+	free(decimOutput);
+	free(epochStartSample);
+	free(epochTrialIndex);
+	free(sortedEpochs);
+	free_decimator(&decimator);
 	
-	if (preFilter)
-	{	
-		free(windowData);
-		free(inBuffer);
-		free(outBuffer);
-	}	
-
-	if ( numBadChannels > 0)
-	{
-		for (int i=0; i<numBadChannels;  i++) 
-			mxFree(badChannelNames[i]);	
+	windowData = NULL;
+	channelData = NULL;
+	trialBlock = NULL;
+	batchBlock = NULL;
+	readBuffer = NULL;
+	continuousData = NULL;
+	aveBlock = NULL;
+	outBuffer = NULL;
+	inBuffer = NULL;
+	decimInput = NULL;
+	decimOutput = NULL;
+	epochStartSample = NULL;
+	epochTrialIndex = NULL;
+	sortedEpochs = NULL;
+	
+	// output files are closed without checking for write errors - normal returns close them first
+	closeMEG4File(inputMEG4);
+	closeMEG4Output(outMEG4);
+	
+	for (int i=0; i<numBadChannels;  i++) 
+		mxFree(badChannelNames[i]);	
+	if (badChannelNames != NULL)
 		mxFree(badChannelNames);
-	}
 	
 	mxFree(dsName);
 	mxFree(newDsName);
+}
 
-	mexPrintf("done...\n");
+// create dataset directory - removes existing directory with the same name
+bool createDsDirectory( const char *name )
+{
+	char	cmd[256];
+	int		result;
 	
-	return;
+	mexPrintf("creating new dataset %s...\n", name );
+	
+#if _WIN32||WIN64
+	result = mkdir(name);
+#else
+	result = mkdir(name, S_IRUSR | S_IWUSR | S_IXUSR );
+#endif
+	
+	if ( result != 0 ) 
+	{
+		mexPrintf("** overwriting existing directory %s ...\n", name);
+		sprintf(cmd,"rm -r %s",name);
+		system(cmd);
+#if _WIN32||WIN64
+		result = mkdir(name);
+#else
+		result = mkdir(name, S_IRUSR | S_IWUSR | S_IXUSR );
+#endif
+	}
+	
+	// make sure directory is readable 
+	sprintf(cmd,"chmod a+rX %s",name);
+	system(cmd);
+	
+	return (result == 0);
 }
     
 }
-
-
@@ -16,6 +16,7 @@
 //
 //				2.5  - recompiled with separate ctflib and bwlib
 //			    2.6  - May, 2020 - removed filtering as it was not used
+//				2.7  - dataset params are cached between calls (see dsCache.h)
 // ************************************
 
 #include "mex.h"
@@ -24,8 +25,9 @@
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
 #include "../../../bwlib/bwlib.h"
+#include "dsCache.h"
 
-#define VERSION_NO 2.6
+#define VERSION_NO 2.7
 
 double	**aveTrialData;
 ds_params		dsParams;
@@ -89,7 +91,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
     		mexWarnMsgTxt("Not enough space. String is truncated.");        
 
 	// get dataset info
-    if ( !readMEGResFile( dsName, dsParams ) )
+    if ( !readCachedResFile( dsName, dsParams ) )
     {
 		mexPrintf("Error reading res4 file ...\n");
 		return;
@@ -10,6 +10,9 @@
 //	
 //
 //		revisions:  copy of ctf_GetChannelData
+//		1.2  - dataset params and .meg4 file are cached between calls (see dsCache.h).  Data at the saved
+//			   gradient is read directly from the cached .meg4 file.  Fixed channel name check.
+//		1.3  - supports datasets larger than 2 GB and multi-segment (.1_meg4 ...) .meg4 files
 //
 // ************************************
 
@@ -17,8 +20,10 @@
 #include "string.h"
 #include "../../../ctflib/headers/datasetUtils.h"
 #include "../../../ctflib/headers/BWFilter.h"
+#include "meg4Reader.h"
+#include "dsCache.h"
 
-#define VERSION_NO 1.1
+#define VERSION_NO 1.3
 
 double	*bw_dataBuffer;
 double	*bw_filterBuffer;
@@ -115,7 +120,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexWarnMsgTxt("Not enough space. String is truncated.");        
 	
 	// get dataset info
-    if ( !readMEGResFile( dsName, dsParams ) )
+    if ( !readCachedResFile( dsName, dsParams ) )
     {
 		mexPrintf("Error reading res4 file ...\n");
 		return;
@@ -169,18 +174,18 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		gradient = -1;
 	}
 
-	bool foundChannel = false;
+	int channelIndex = -1;
 	
 	for (int j=0; j<dsParams.numChannels; j++)
 	{
-		if (strncmp(dsParams.channel[j].name,channelName, strlen(channelName) ))
+		if (!strncmp(dsParams.channel[j].name,channelName, strlen(channelName) ))
 		{
-			foundChannel = true;
+			channelIndex = j;
 			break;
 		}
 	}
 	
-	if (!foundChannel)
+	if (channelIndex == -1)
 	{
 		mexPrintf("Couldn't find channel [%s]...", channelName);
 		return;
@@ -243,11 +248,20 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		}
 	}
 
+	// if saved gradient requested can read directly from cached .meg4 file
+	meg4_file *meg4 = NULL;
+	if (gradient == -1 || gradient == dsParams.gradientOrder)
+		meg4 = getCachedMEG4File( dsName );
+	
 	idx = 0;		
 	for (int j=0; j<dsParams.numTrials; j++)
 	{
-	
-		if ( !readMEGChannelData( dsName, dsParams, channelName, bw_dataBuffer, j, gradient) )  // get all trials 
+		if (meg4 != NULL)
+		{
+			if ( !readMEG4ChannelSamples( *meg4, j, channelIndex, 0, dsParams.numSamples, dsParams.channel[channelIndex].gain, bw_dataBuffer) )
+				mexWarnMsgTxt("readMEG4ChannelSamples() returned error... data may not be valid");
+		}
+		else if ( !readMEGChannelData( dsName, dsParams, channelName, bw_dataBuffer, j, gradient) )  // get all trials 
 		{
 			mexWarnMsgTxt("readMEGChannelData() returned error... data may not be valid");
 		}
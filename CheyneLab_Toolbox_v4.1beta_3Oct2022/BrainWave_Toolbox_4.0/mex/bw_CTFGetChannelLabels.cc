@@ -6,14 +6,16 @@
 //		revisions:
 //
 //		D. Cheyne, Nov, 2012  - needed for scanning trigger channels
+//		1.1  - dataset params are cached between calls (see dsCache.h)
 //
 // ************************************
 #include "mex.h"
 #include "string.h"
 #include "../../../ctflib/headers/datasetUtils.h"
+#include "dsCache.h"
 
 // Version
-#define VERSION_NO 1.0
+#define VERSION_NO 1.1
 
 ds_params		CTF_Labels_dsParams;
 
@@ -74,7 +76,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexWarnMsgTxt("Not enough space. String is truncated.");        
 
 	// get dataset info
-    if ( !readMEGResFile( fileName, CTF_Labels_dsParams ) )
+    if ( !readCachedResFile( fileName, CTF_Labels_dsParams ) )
     {
 		mexErrMsgTxt("Error reading res4 file for virtual sensors\n");
 		return;
@@ -15,13 +15,15 @@
 //
 //		2.4    - renamed version of CTFGetParams.cc for Brainwave - no other changes except don't show copyright each time
 //		2.5		Dec, 2013 - copied version for BrainWave - renamed bw_CTFGetHeader to avoid confusion with old routine (CTFGetParams)
+//		2.6		Oct, 2022 - dataset params are cached between calls (see dsCache.h)
 // ************************************
 
 #include "mex.h"
 #include <string.h>
 #include "../../../ctflib/headers/datasetUtils.h"
+#include "dsCache.h"
 
-#define VERSION_NO 2.5
+#define VERSION_NO 2.6
 
 #define NUMBER_OF_FIELDS (sizeof(field_names)/sizeof(*field_names))
 #define NUMBER_OF_CHANNEL_FIELDS (sizeof(channel_field_names)/sizeof(*channel_field_names))
@@ -108,7 +110,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	plhs[0] = mxCreateStructArray(2, dims,NUMBER_OF_FIELDS, field_names); 
 
 	
-    if ( !readMEGResFile( fileName, dsParams ) )
+    if ( !readCachedResFile( fileName, dsParams ) )
     {
 		mexErrMsgTxt("Error reading res4 file for sensors\n");
     }
@@ -0,0 +1,406 @@
+// *************************************
+// mex routine to read data for a list of channels in one pass through the dataset
+//
+// calling syntax is:
+// [timeVec data] = bw_CTFGetMultiChannelData(datasetName, channelNames, [highPass lowPass], gradient, [firstTrial lastTrial], [firstSample lastSample]);
+//
+// returns
+//      timeVec = [nsamples x 1] vector of sample times
+//      data = [nsamples x ntrials x nchannels] array of data for selected channels, trials and samples
+//      timeVec and data are empty if an error occurs
+//
+// Replaces loops over bw_CTFGetChannelData - the .meg4 file is read once in file order (trial by trial, with
+// channels in dataset order) instead of once per channel, and each channel is filtered as it is read.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - return empty arrays on error (outputs were not assigned)
+//
+// ************************************
+
+#include "mex.h"
+#include "string.h"
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/BWFilter.h"
+#include "meg4Reader.h"
+#include "dsCache.h"
+
+#define VERSION_NO 1.1
+
+double	*bw_dataBuffer;
+double	*bw_filterBuffer;
+double	**bw_trialArray;
+int		*bw_channelIndex;
+int		*bw_readOrder;
+ds_params		dsParams;
+
+extern "C"
+{
+void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
+{
+
+	double			*data;
+	double			*timeVec;
+	char			*dsName;
+	char			**channelNames;
+	int				numChannels;
+	int				buflen;
+	int				status;
+  	char			msg[256];
+
+	double          *val;
+	int             gradient;
+	double          highPass;
+	double          lowPass;
+	int				firstTrial;
+	int				lastTrial;
+	int				firstSample;
+	int				lastSample;
+
+	bool			filterData;
+	double			*dataPtr;
+
+	filter_params 	fparams;
+
+	/* Check for proper number of arguments */
+	int n_inputs = 2;
+	int n_outputs = 2;
+	if ( nlhs != n_outputs | nrhs < n_inputs)
+	{
+		mexPrintf("bw_CTFGetMultiChannelData ver. %.1f (c) Douglas Cheyne, PhD. 2022. All rights reserved.\n", VERSION_NO);
+		mexPrintf("Incorrect number of input or output arguments\n");
+		mexPrintf("Usage:\n");
+		mexPrintf("   [timeBase data] = bw_CTFGetMultiChannelData(datasetName, channelNames, [highPass lowPass], [gradient], [firstTrial lastTrial], [firstSample lastSample])\n");
+		mexPrintf("   [datasetName]     - name of CTF dataset\n");
+		mexPrintf("   [channelNames]    - cell array of channel names (e.g., {'MLC24', 'MRC24'})\n\n");
+		mexPrintf("Options:\n");
+		mexPrintf("   [highPass lowpass]        data bandwidth in Hz, default = bandpass of saved data (pass [] for no filter)\n");
+		mexPrintf("   [gradient]                data gradient (0=raw, 1=1st, 2=2nd, 3=3rd, 4=3rd+adaptive) default = gradient of saved data\n");
+		mexPrintf("   [firstTrial lastTrial]    range of trials to return (1 = first trial), default = all trials\n");
+		mexPrintf("   [firstSample lastSample]  range of samples to return (1 = first sample), default = all samples\n");
+		mexPrintf("   returns data as [nsamples x ntrials x nchannels] array.\n");
+		mexPrintf(" \n");
+		return;
+	}
+
+	// outputs are empty if returning on error - replaced once the data has been read
+	plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+	plhs[1] = mxCreateDoubleMatrix(0, 0, mxREAL);
+
+	/* get file name */
+
+  	/* Input must be a string. */
+  	if (mxIsChar(prhs[0]) != 1)
+    		mexErrMsgTxt("Input must be a string.");
+
+  	/* Input must be a row vector. */
+  	if (mxGetM(prhs[0]) != 1)
+    		mexErrMsgTxt("Input must be a row vector.");
+
+  	/* Get the length of the input string. */
+  	buflen = (mxGetM(prhs[0]) * mxGetN(prhs[0])) + 1;
+
+	/* Allocate memory for input and output strings. */
+  	dsName = (char *)mxCalloc(buflen, sizeof(char));
+
+  	/* Copy the string data from prhs[0] into a C string input_buf. */
+  	status = mxGetString(prhs[0], dsName, buflen);
+  	if (status != 0)
+    		mexWarnMsgTxt("Not enough space. String is truncated.");
+
+	/* get channel names - also accept a single channel name */
+	if (mxIsCell(prhs[1]))
+	{
+		numChannels = mxGetNumberOfElements(prhs[1]);
+		channelNames = (char **)mxCalloc(numChannels + 1, sizeof(char*));
+		for (int i=0; i<numChannels; i++)
+		{
+			if (!mxIsChar( mxGetCell(prhs[1],i)))
+				mexErrMsgTxt("channel list must be cell string array");
+			channelNames[i] = mxArrayToString( mxGetCell(prhs[1],i));
+		}
+	}
+	else if (mxIsChar(prhs[1]))
+	{
+		numChannels = 1;
+		channelNames = (char **)mxCalloc(1, sizeof(char*));
+		channelNames[0] = mxArrayToString( prhs[1] );
+	}
+	else
+		mexErrMsgTxt("channel list must be cell string array");
+
+	if (numChannels < 1)
+		mexErrMsgTxt("channel list is empty");
+
+	// get dataset info
+    if ( !readCachedResFile( dsName, dsParams ) )
+    {
+		mexPrintf("Error reading res4 file ...\n");
+		return;
+    }
+
+	if ( dsParams.numChannels == 0 || dsParams.numSamples == 0 || dsParams.numTrials == 0)
+	{
+		sprintf(msg, "Error reading dataset dimensions %s\n", dsName);
+		mexPrintf(msg);
+		return;
+	}
+
+	mexPrintf("dataset:  %s, (%d trials, %d samples, %d sensors, epoch time = %g to %g s)\n",
+			  dsName, dsParams.numTrials, dsParams.numSamples, dsParams.numSensors, dsParams.epochMinTime, dsParams.epochMaxTime);
+	mexEvalString("drawnow");
+
+	filterData = false;
+	lowPass = dsParams.lowPass;
+	highPass = dsParams.highPass;
+	if (nrhs > 2 && !mxIsEmpty(prhs[2]))
+	{
+		if (mxGetM(prhs[2]) != 1 || mxGetN(prhs[2]) != 2)
+			mexErrMsgTxt("Input 3 must be a row vector [hipass lowpass].");
+		dataPtr = mxGetPr(prhs[2]);
+		highPass = dataPtr[0];
+		lowPass = dataPtr[1];
+		filterData = true;
+		if ( highPass > lowPass)
+		{
+			mexPrintf("invalid filter settings");
+			return;
+		}
+
+		if ( lowPass > dsParams.sampleRate / 2.0 )
+		{
+			mexPrintf("low-pass filter cutoff exceeds Nyquist...");
+			return;
+		}
+	}
+
+	gradient = -1;
+	if (nrhs > 3 && !mxIsEmpty(prhs[3]))
+	{
+		val = mxGetPr(prhs[3]);
+		gradient = (int)*val;
+	}
+
+	firstTrial = 0;
+	lastTrial = dsParams.numTrials - 1;
+	if (nrhs > 4 && !mxIsEmpty(prhs[4]))
+	{
+		if (mxGetNumberOfElements(prhs[4]) != 2)
+			mexErrMsgTxt("Input 5 must be a row vector [firstTrial lastTrial].");
+		dataPtr = mxGetPr(prhs[4]);
+		firstTrial = (int)dataPtr[0] - 1;
+		lastTrial = (int)dataPtr[1] - 1;
+		if (firstTrial < 0 || lastTrial >= dsParams.numTrials || firstTrial > lastTrial)
+		{
+			mexPrintf("invalid trial range (dataset has %d trials)\n", dsParams.numTrials);
+			return;
+		}
+	}
+
+	firstSample = 0;
+	lastSample = dsParams.numSamples - 1;
+	if (nrhs > 5 && !mxIsEmpty(prhs[5]))
+	{
+		if (mxGetNumberOfElements(prhs[5]) != 2)
+			mexErrMsgTxt("Input 6 must be a row vector [firstSample lastSample].");
+		dataPtr = mxGetPr(prhs[5]);
+		firstSample = (int)dataPtr[0] - 1;
+		lastSample = (int)dataPtr[1] - 1;
+		if (firstSample < 0 || lastSample >= dsParams.numSamples || firstSample > lastSample)
+		{
+			mexPrintf("invalid sample range (dataset has %d samples per trial)\n", dsParams.numSamples);
+			return;
+		}
+	}
+
+	int numTrials = lastTrial - firstTrial + 1;
+	int numSamples = lastSample - firstSample + 1;
+
+	bw_channelIndex = (int *)malloc( sizeof(int) * numChannels );
+	bw_readOrder = (int *)malloc( sizeof(int) * numChannels );
+	if (bw_channelIndex == NULL || bw_readOrder == NULL)
+	{
+		mexPrintf("memory allocation failed for channel index arrays");
+		return;
+	}
+
+	for (int i=0; i<numChannels; i++)
+	{
+		bw_channelIndex[i] = -1;
+		for (int j=0; j<dsParams.numChannels; j++)
+		{
+			if (!strncmp(dsParams.channel[j].name,channelNames[i], strlen(channelNames[i]) ))
+			{
+				bw_channelIndex[i] = j;
+				break;
+			}
+		}
+		if (bw_channelIndex[i] == -1)
+		{
+			mexPrintf("Couldn't find channel [%s]...", channelNames[i]);
+			free(bw_channelIndex);
+			free(bw_readOrder);
+			return;
+		}
+	}
+
+	// read channels in the order they are stored in the dataset so each trial is read sequentially
+	for (int i=0; i<numChannels; i++)
+	{
+		int j = i;
+		for (; j>0 && bw_channelIndex[ bw_readOrder[j-1] ] > bw_channelIndex[i]; j--)
+			bw_readOrder[j] = bw_readOrder[j-1];
+		bw_readOrder[j] = i;
+	}
+
+	// if filtering, whole trial is filtered to avoid edge effects in selected sample range
+	int readStart = filterData ? 0 : firstSample;
+	int readSamples = filterData ? dsParams.numSamples : numSamples;
+
+	bw_dataBuffer = (double *)malloc( sizeof(double) * dsParams.numSamples );
+	bw_filterBuffer = (double *)malloc( sizeof(double) * dsParams.numSamples );
+	if (bw_dataBuffer == NULL || bw_filterBuffer == NULL)
+	{
+		mexPrintf("memory allocation failed for data buffers");
+		return;
+	}
+
+	if (!filterData)
+	{
+		fparams.enable = false;
+		mexPrintf("filter off...\n");
+	}
+	else
+	{
+		fparams.enable = true;
+		if ( highPass == 0.0 )
+			fparams.type = BW_LOWPASS;
+		else
+			fparams.type = BW_BANDPASS;
+
+		fparams.bidirectional = true;
+		fparams.hc = lowPass;
+		fparams.lc = highPass;
+		fparams.fs = dsParams.sampleRate;
+		fparams.order = 4;
+		fparams.ncoeff = 0;
+
+		if (build_filter (&fparams) == -1)
+		{
+			mexPrintf("Could not build filter.\n");
+			return;
+		}
+	}
+
+	// if saved gradient requested can read directly from cached .meg4 file,
+	// otherwise read all channels for each trial with gradient conversion
+	meg4_file *meg4 = NULL;
+	if (gradient == -1 || gradient == dsParams.gradientOrder)
+		meg4 = getCachedMEG4File( dsName );
+
+	bw_trialArray = NULL;
+	if (meg4 == NULL)
+	{
+		bw_trialArray = (double **)malloc( sizeof(double *) * dsParams.numChannels );
+		if (bw_trialArray == NULL)
+		{
+			mexPrintf("memory allocation failed for trial array");
+			return;
+		}
+		for (int k=0; k<dsParams.numChannels; k++)
+		{
+			bw_trialArray[k] = (double *)malloc( sizeof(double) * dsParams.numSamples );
+			if (bw_trialArray[k] == NULL)
+			{
+				mexPrintf("memory allocation failed for trial array");
+				return;
+			}
+		}
+	}
+
+	// allocate memory for Matlab return vectors
+	//
+
+	mxDestroyArray(plhs[0]);
+	plhs[0] = mxCreateDoubleMatrix(numSamples, 1, mxREAL);
+	timeVec = mxGetPr(plhs[0]);
+	double dwel = 1.0 / dsParams.sampleRate;
+
+	for (int j=0; j<numSamples; j++)
+		timeVec[j] = (double)(dsParams.epochMinTime + ((j + firstSample) * dwel) );
+
+	mwSize dims[3];
+	dims[0] = numSamples;
+	dims[1] = numTrials;
+	dims[2] = numChannels;
+	mxDestroyArray(plhs[1]);
+	plhs[1] = mxCreateNumericArray(3, dims, mxDOUBLE_CLASS, mxREAL);
+
+	data = mxGetPr(plhs[1]);
+
+	mexPrintf("getting data for %d channels, %d trials, %d samples from %s (BW %g to %g Hz, gradient = %d)...\n",
+			  numChannels, numTrials, numSamples, dsName, highPass, lowPass, gradient);
+	mexEvalString("drawnow");
+
+	for (int j=0; j<numTrials; j++)
+	{
+		int trial = firstTrial + j;
+
+		if (meg4 == NULL)
+		{
+			if ( !readMEGTrialData( dsName, dsParams, bw_trialArray, trial, gradient, false) )
+				mexWarnMsgTxt("readMEGTrialData() returned error... data may not be valid");
+		}
+
+		for (int i=0; i<numChannels; i++)
+		{
+			int ch = bw_readOrder[i];
+			int channelIndex = bw_channelIndex[ch];
+			double *src = bw_dataBuffer;
+
+			if (meg4 != NULL)
+			{
+				if ( !readMEG4ChannelSamples( *meg4, trial, channelIndex, readStart, readSamples, dsParams.channel[channelIndex].gain, bw_dataBuffer) )
+					mexWarnMsgTxt("readMEG4ChannelSamples() returned error... data may not be valid");
+			}
+			else
+				src = bw_trialArray[channelIndex] + readStart;
+
+			if (filterData)
+			{
+				applyFilter( src, bw_filterBuffer, readSamples, &fparams);
+				src = bw_filterBuffer;
+			}
+
+			// data is [samples x trials x channels] in column major order
+			double *dest = data + ( (size_t)ch * numTrials + j ) * numSamples;
+			for (int k=0; k<numSamples; k++)
+				dest[k] = src[firstSample - readStart + k];
+		}
+	}
+
+	if (bw_trialArray != NULL)
+	{
+		for (int k=0; k<dsParams.numChannels; k++)
+			free(bw_trialArray[k]);
+		free(bw_trialArray);
+	}
+	free(bw_filterBuffer);
+	free(bw_dataBuffer);
+	free(bw_channelIndex);
+	free(bw_readOrder);
+
+	for (int i=0; i<numChannels; i++)
+		mxFree(channelNames[i]);
+	mxFree(channelNames);
+	mxFree(dsName);
+
+	return;
+
+}
+
+}
+
+
@@ -15,12 +15,14 @@
 //
 //		2.4    - renamed version of CTFGetParams.cc for Brainwave - no other changes except don't show copyright each time
 //				2.5  - recompiled with separate ctflib and bwlib
+//				2.6  - dataset params are cached between calls (see dsCache.h)
 // ************************************
 
 #include "mex.h"
 #include "../../../ctflib/headers/datasetUtils.h"
+#include "dsCache.h"
 
-#define VERSION_NO 2.5
+#define VERSION_NO 2.6
 ds_params	dsParams;
 
 extern "C" 
@@ -92,7 +94,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	/* Call the subroutine */   
     // get dataset info
-    if ( !readMEGResFile( fileName, dsParams ) )
+    if ( !readCachedResFile( fileName, dsParams ) )
     {
 		mexErrMsgTxt("Error reading res4 file for virtual sensors\n");
     }
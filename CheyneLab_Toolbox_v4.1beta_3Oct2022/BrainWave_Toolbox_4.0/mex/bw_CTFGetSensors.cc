@@ -10,13 +10,15 @@
 //      1.4		- revised for version 1.4 - includes reference channels if second argument == 1
 //
 //				2.5  - recompiled with separate ctflib and bwlib
+//				2.6  - dataset params are cached between calls (see dsCache.h)
 // ************************************
 #include "mex.h"
 #include "string.h"
 #include "../../../ctflib/headers/datasetUtils.h"
+#include "dsCache.h"
 
 // Version
-#define VERSION_NO 2.5
+#define VERSION_NO 2.6
 
 ds_params		dsParams;
 
@@ -90,7 +92,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexWarnMsgTxt("Not enough space. String is truncated.");        
 
 	// get dataset info
-    if ( !readMEGResFile( fileName, dsParams ) )
+    if ( !readCachedResFile( fileName, dsParams ) )
     {
 		mexErrMsgTxt("Error reading res4 file for virtual sensors\n");
 		return;
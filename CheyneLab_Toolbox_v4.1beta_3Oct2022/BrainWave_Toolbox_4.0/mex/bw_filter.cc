@@ -13,14 +13,17 @@
 //		1.2	 - modified to be consistent with ctf_BWFilter.cc - fixed order and adds bandreject option
 //
 //      version 3.3 Dec 2016 - modified to adjust order for bidirectional - more consistent with CTF DataEditor filter
+//		1.3  - added lineFilterFreq option - removes line frequency and harmonics in one pass (see notchBank.h)
+//		1.4  - line filter uses fixed order from build_line_filter() - was using bandpass order (halved if bidirectional)
 // ************************************
 
 #include "mex.h"
 #include "string.h"
 #include "../../../ctflib/headers/datasetUtils.h"
 #include "../../../ctflib/headers/BWFilter.h"
+#include "notchBank.h"
 
-#define VERSION_NO 1.2
+#define VERSION_NO 1.4
 
 double	*buffer;
 
@@ -43,8 +46,12 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
     int             maxOrder = 8;           // will limit coeffs to 4th order
 	bool			bidirectional = true;
 	bool			bandreject = false;
+	double			lineFilterFreq = 0.0;
+	double			lineFilterWidth = 3.0;
+	bool			bandFilter = true;
 	
 	filter_params 	fparams;
+	notch_bank_params	notchParams;
 
 	/* Check for proper number of arguments */
 	int n_inputs = 3;
@@ -62,6 +69,9 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("   [order]           - specify filter order. (4th order recommended)\n");
 		mexPrintf("   [bidirectional]   - if true filter is bidirectional (two-pass non-phase shifting). Default = true\n");
 		mexPrintf("   [bandreject]      - if true filter is band-reject. Default = band-pass\n");
+		mexPrintf("   [lineFilterFreq]  - if > 0 also remove this line frequency and harmonics up to the 4th. Pass [0 0] for [hipass lowpass] for line filter only\n");
+		mexPrintf("   [lineFilterWidth] - width of line filter notches (+/- Hz). Default = 3 Hz\n");
+		mexPrintf("                       line filter notches are 4th order and do not depend on [order].\n");
 		mexPrintf(" \n");
 		return;
 	}
@@ -102,6 +112,18 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		bandreject = (int)*val;
 	}
 
+	if (nrhs > 6)
+	{
+		val = mxGetPr(prhs[6]);
+		lineFilterFreq = *val;
+	}
+
+	if (nrhs > 7)
+	{
+		val = mxGetPr(prhs[7]);
+		lineFilterWidth = *val;
+	}
+
 	plhs[0] = mxCreateDoubleMatrix(1, numSamples, mxREAL);
 	fdata = mxGetPr(plhs[0]);
 	
@@ -112,8 +134,12 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	if ( highPass == 0.0 && lowPass == 0.0)
 	{
-		mexPrintf("invalid filter settings\n");
-		return;
+		if (lineFilterFreq <= 0.0)
+		{
+			mexPrintf("invalid filter settings\n");
+			return;
+		}
+		bandFilter = false;
 	}
 	
 	if ( highPass == 0.0 )
@@ -164,10 +190,22 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	fparams.ncoeff = 0;
 	
 	
-	if (build_filter (&fparams) == -1)
+	if (bandFilter)
 	{
-		mexPrintf("memory allocation failed for trial array\n");
-		return;
+		if (build_filter (&fparams) == -1)
+		{
+			mexPrintf("memory allocation failed for trial array\n");
+			return;
+		}
+	}
+	
+	if (lineFilterFreq > 0.0)
+	{
+		if (build_line_filter (&notchParams, lineFilterFreq, lineFilterWidth, sampleRate, bidirectional) == -1)
+		{
+			mexPrintf("invalid line filter settings\n");
+			return;
+		}
 	}
 	
 	
@@ -181,7 +219,16 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	for (int k=0; k< numSamples; k++)
 		buffer[k] = data[k];
 	
-	applyFilter( buffer, fdata, numSamples, &fparams);
+	if (bandFilter)
+		applyFilter( buffer, fdata, numSamples, &fparams);
+	else
+	{
+		for (int k=0; k< numSamples; k++)
+			fdata[k] = buffer[k];
+	}
+	
+	if (lineFilterFreq > 0.0)
+		applyNotchBank( fdata, fdata, numSamples, &notchParams);
 	 
 	free(buffer);
 
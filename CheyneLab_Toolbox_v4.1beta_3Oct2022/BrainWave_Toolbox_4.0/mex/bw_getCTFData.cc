@@ -8,14 +8,19 @@
 //		datasetName:	name of CTF dataset
 //		startSample:	offset from beginning of trial (1st sample = zero!).
 //		numSamples:		number of samples to return;
+//		downSample:		(optional) decimate by this factor using anti-alias filter
 //
 // returns
-//      data = [numSamples x numSensors] matrix of data in Tesla with gradient of saved data...
+//      data = [numSamples/downSample x numSensors] matrix of data in Tesla with gradient of saved data...
 //		** this returns primary sensor data only ***
 //             
 //		(c) Douglas O. Cheyne, 2010-2012  All rights reserved.
 //
 //		revisions:
+//		1.1  - read from memory-mapped .meg4 file (falls back to fread if mapping not available)
+//		1.2  - dataset params and .meg4 file are cached between calls (see dsCache.h)
+//		1.3  - supports datasets larger than 2 GB and multi-segment (.1_meg4 ...) .meg4 files
+//		1.4  - added downSample option - anti-aliased decimation (see decimator.h)
 //
 // ****************************************************************************************************
 
@@ -24,13 +29,15 @@
 #include "../../../ctflib/headers/datasetUtils.h"
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
+#include "meg4Reader.h"
+#include "dsCache.h"
+#include "decimator.h"
 
-#define VERSION_NO 1.0
-
-double	*chanBuffer;
-int		*sampleBuffer;
+#define VERSION_NO 1.4
 
 ds_params		CTF_Data_dsParams;
+decimator_params	CTF_Data_decimator;
+double			*CTF_Data_chanBuffer;
 
 extern "C" 
 {
@@ -41,9 +48,6 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	double			*dPtr;
 	char			*dsName;
 	char            channelName[256];
-	char			megName[256];
-	char			baseName[256];
-	char			s[256];
 		
 	int				buflen;
 	int				status;
@@ -51,11 +55,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	unsigned int	n; 
   	char			msg[256];
 	
-	int				idx;
 	int				startSample = 0;
 	int				numSamples = 0;
 	
 	bool			allChannels = 0;
+	int				downSample = 1;
 	
 	double          *val;
 	
@@ -71,11 +75,12 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("bw_getCTFData ver. %.1f (c) Douglas Cheyne, PhD. 2012. All rights reserved.\n", VERSION_NO); 
 		mexPrintf("Incorrect number of input or output arguments\n");
 		mexPrintf("Usage:\n"); 
-		mexPrintf("   data = bw_getCTFData(datasetName, startSample, numSamples, {allchannels}) \n");
+		mexPrintf("   data = bw_getCTFData(datasetName, startSample, numSamples, {allchannels}, {downSample}) \n");
 		mexPrintf("   [datasetName]        - name of dataset\n");
 		mexPrintf("   [startSample]        - sample from beginning of trial (1st sample = zero!)\n");
 		mexPrintf("   [numSamples]         - sample length to get \n");
 		mexPrintf("   [allChannels]        - if == 1, return all channels (default: returns primary sensors only) \n");
+		mexPrintf("   [downSample]         - return every nth sample after anti-alias filtering (default = 1) \n");
 		
 		mexPrintf(" \n");
 		return;
@@ -114,8 +119,16 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		allChannels = (int)*val;
 	}
 	
+	if (nrhs > 4)
+	{
+		val = mxGetPr(prhs[4]);
+		downSample = (int)*val;
+		if (downSample < 1)
+			downSample = 1;
+	}
+	
 	// get dataset info
-    if ( !readMEGResFile( dsName, CTF_Data_dsParams ) )
+    if ( !readCachedResFile( dsName, CTF_Data_dsParams ) )
     {
 		mexPrintf("Error reading res4 file ...\n");
 		return;
@@ -134,82 +147,103 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	else
 		nchans = CTF_Data_dsParams.numSensors;
 			
-	plhs[0] = mxCreateDoubleMatrix(numSamples, nchans, mxREAL);
+	int numOut = numSamples / downSample;
+	
+	plhs[0] = mxCreateDoubleMatrix(numOut, nchans, mxREAL);
 	data = mxGetPr(plhs[0]);
 	
 		// mexPrintf("getting data from %s (sample %d to %d)\n", dsName, startSample, startSample+numSamples-1);
 
-	chanBuffer = (double *)malloc( sizeof(double) * CTF_Data_dsParams.numSamples );
-	if (chanBuffer == NULL)
+	// open data file and start reading...
+	//
+	meg4_file *meg4 = getCachedMEG4File( dsName );
+	if ( meg4 == NULL )
 	{
-		mexPrintf("memory allocation failed for chanBuffer array");
+		mxFree(dsName);
 		return;
 	}
-
-	sampleBuffer = (int *)malloc( sizeof(int) * CTF_Data_dsParams.numSamples );
-	if (sampleBuffer == NULL)
+	
+	if (downSample == 1)
 	{
-		mexPrintf("memory allocation failed for sampleBuffer array");
+		// decode each channel directly into the output array
+		dPtr = data;
+		for (int k=0; k<CTF_Data_dsParams.numChannels; k++)
+		{
+			if (CTF_Data_dsParams.channel[k].isSensor || allChannels == 1)
+			{
+				double thisGain =  CTF_Data_dsParams.channel[k].gain;
+				
+				if ( !readMEG4ChannelSamples( *meg4, 0, k, startSample, numSamples, thisGain, dPtr ) )
+				{
+					mexPrintf("error reading data for channel %s\n", CTF_Data_dsParams.channel[k].name);
+					break;
+				}
+				dPtr += numSamples;
+			}
+		}
+		mxFree(dsName);
 		return;
 	}
 	
-	removeFilePath( dsName, baseName);
-	baseName[strlen(baseName)-3] = '\0';
-	
-	sprintf(megName, "%s%s%s.meg4", dsName, FILE_SEPARATOR, baseName );
-		
-	FILE *fp;
-	// open data file and start reading...
-	//
-	if ( ( fp = fopen( megName, "rb") ) == NULL )
+	// decimate - read halfLength extra samples on each side of segment for filter, 
+	// repeating first and last samples of the trial if segment is near either end
+	if ( build_decimator( &CTF_Data_decimator, downSample ) == -1 )
 	{
+		mexPrintf("Could not build anti-alias filter\n");
+		mxFree(dsName);
 		return;
 	}
 	
-	fread( s, sizeof( char ), 8, fp );
-	if ( strncmp( s, "MEG4CPT", 7 ) && strncmp( s, "MEG41CP", 7 )  )
+	int h = CTF_Data_decimator.halfLength;
+	int bufferPts = numSamples + (2 * h);
+	int firstSample = startSample - h;
+	int readStart = (firstSample < 0) ? 0 : firstSample;
+	int readEnd = startSample + numSamples + h;
+	if (readEnd > CTF_Data_dsParams.numSamples)
+		readEnd = CTF_Data_dsParams.numSamples;
+	int offset = readStart - firstSample;
+	
+	CTF_Data_chanBuffer = (double *)malloc( sizeof(double) * bufferPts );
+	if ( CTF_Data_chanBuffer == NULL )
 	{
-		mexPrintf("%s does not appear to be a valid CTF meg4 file\n", megName);
+		mexPrintf("memory allocation failed for channel buffer\n");
+		free_decimator( &CTF_Data_decimator );
+		mxFree(dsName);
 		return;
 	}
 	
-	// num trial bytes per channel 
-	int numBytesPerChannel = CTF_Data_dsParams.numSamples * sizeof(int);
-	
-	idx=0;
+	dPtr = data;
 	for (int k=0; k<CTF_Data_dsParams.numChannels; k++)
 	{
 		if (CTF_Data_dsParams.channel[k].isSensor || allChannels == 1)
 		{
 			double thisGain =  CTF_Data_dsParams.channel[k].gain;
 			
-			// go to sample offset
-			
-			int bytesToStart = startSample * sizeof(int);
-			fseek(fp, bytesToStart, SEEK_CUR);
-			
-			fread( sampleBuffer, sizeof(int), numSamples, fp);
+			if ( !readMEG4ChannelSamples( *meg4, 0, k, readStart, readEnd - readStart, thisGain, CTF_Data_chanBuffer + offset ) )
+			{
+				mexPrintf("error reading data for channel %s\n", CTF_Data_dsParams.channel[k].name);
+				break;
+			}
+			for (int j=0; j<offset; j++)
+				CTF_Data_chanBuffer[j] = CTF_Data_chanBuffer[offset];
+			for (int j=offset + readEnd - readStart; j<bufferPts; j++)
+				CTF_Data_chanBuffer[j] = CTF_Data_chanBuffer[offset + readEnd - readStart - 1];
 			
-			for (int j=0; j<numSamples; j++)
+			// ** don't filter digital channels
+			if ( CTF_Data_dsParams.channel[k].isSensor || CTF_Data_dsParams.channel[k].isReference || CTF_Data_dsParams.channel[k].isEEG )
+				decimateSamples( CTF_Data_chanBuffer + h, dPtr, numOut, &CTF_Data_decimator );
+			else
 			{
-				 double d = ToHost( (int)sampleBuffer[j] );
-				 data[idx++] = d / thisGain;
+				for (int j=0; j<numOut; j++)
+					dPtr[j] = CTF_Data_chanBuffer[h + j*downSample];
 			}
-			int bytesToSkip = (CTF_Data_dsParams.numSamples - numSamples - startSample) * sizeof(int);
-			fseek(fp, bytesToSkip, SEEK_CUR);			
+			dPtr += numOut;
 		}
-		else
-			fseek(fp, numBytesPerChannel, SEEK_CUR);
-		
 	}
 	
+	free( CTF_Data_chanBuffer );
+	free_decimator( &CTF_Data_decimator );
 
-
-	fclose(fp);
-	
-	free(chanBuffer);
-	free(sampleBuffer);
-	
 	mxFree(dsName);
 	 
 	return;
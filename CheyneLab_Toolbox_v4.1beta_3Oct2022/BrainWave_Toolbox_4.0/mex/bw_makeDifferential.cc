@@ -17,6 +17,38 @@
 //                   -  additional arguments to makeDifferential for covariance data - leave turned off for now...
 //				2.5  - recompiled with separate ctflib and bwlib
 //              2.7  - vers 3.0beta - added code and print statement that alternate dataset is being used for baseline covariance
+//				2.8  - images computed with beamformer engine (bfEngine.h) instead of computeDifferential. Covariance for
+//					   active, baseline and combined windows computed in a single pass of each dataset (covAccumulator.h)
+//					   added optional numThreads argument (default = all processors)
+//				2.9  - activeWindow can be a list of windows [numWindows x 2] - images for all windows are computed with the
+//					   same weights (active windows and baseline combined) and written in one call. Covariance of sliding
+//					   windows is updated incrementally.  Returns list of file names for more than one window.
+//				3.0  - filter can be a list of bands [numBands x 2] - each trial is read once and passed through all band
+//					   filters (filter bank) and images are computed for each band in one call.
+//				3.1  - covDsName can be a cell array of dataset names - covariance is computed for all trials combined
+//					   without writing a combined dataset (see checkCombinedDatasets() in covAccumulator.h)
+//				3.2  - outputFormat = 2 saves the images for all active windows of each band in a single chunked 4D
+//					   image store (.bwimg) indexed by the start of each active window (see imageStore.h)
+//				3.3  - surface images are formatted in memory and written with one fwrite per file (see surfaceWriter.h).
+//					   added outputFormat = 3 - raw float32 overlay (.f32)
+//				3.4  - voxFile can be binary (.vox written by bw_mesh2vox) or ASCII - format is detected when the file is
+//					   read (see voxFile.h)
+//				3.5  - covariance is inverted in the same way as computeCovarianceMatrices() (see invertCovarianceMatrix()
+//					   in covCache.h) instead of a pseudo-inverse
+//				3.6  - a single active window and band with one covariance dataset is computed with computeDifferential()
+//					   (or computeDifferentialMultiDs() for useCovAsControl) in bwlib as before version 2.8, so existing
+//					   single images are unchanged.  Lists of windows or bands, and lists of covariance datasets, use the
+//					   beamformer engine - covariance is accumulated in one pass with the mean of each window removed for
+//					   each trial (see covAccumulator.h), so images may differ from computeDifferential() by small
+//					   numerical differences.
+//				3.7  - buffers are freed and an error is returned if the covariance can't be inverted (see freeDifferentialArrays)
+//				3.8  - all images (including a single active window and band) are computed with the beamformer engine - the
+//					   covariance accumulator uses the same windows and covariance as getSensorCovariance() in bwlib, and
+//					   weights use the mean of the active and baseline covariance as computeDifferential() (replaces 3.6).
+//					   Compile with -DCHECK_BWLIB_COVARIANCE to compare each window covariance with getSensorCovariance()
+//				3.9  - added optional sharedWeights argument - sharedWeights = 0 computes the weights for each active window
+//					   from that window and the baseline (same images as one call per window) with the covariance of all
+//					   windows from one pass of the data.  All buffers are freed on return (see freeDifferentialArrays)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "mex.h"
@@ -34,8 +66,14 @@
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
 #include "../../../bwlib/bwlib.h"
+#include "covAccumulator.h"
+#include "covCache.h"
+#include "bfEngine.h"
+#include "imageStore.h"
+#include "surfaceWriter.h"
+#include "voxFile.h"
 
-#define VERSION_NO 2.5
+#define VERSION_NO 3.9
 
 double			**imageData; 
 double			**covArray;
@@ -45,6 +83,105 @@ vectorCart		*normalList;
 ds_params		dsParams;
 ds_params       covDsParams;
 
+// covariance buffers - windows are listed as active windows followed by baseline
+double			*windowStart;
+double			*windowEnd;
+cov_accumulator	*dsAcc;
+cov_accumulator	*covAcc;
+cov_accumulator	**weightAccs;
+int				*weightWindows;
+double			**activeCov;
+double			*baselineCov;
+double			*weightCov;
+
+// output file names - one per band and active window
+char			**saveNames;
+
+// free all buffers (NULL or zero accumulators are skipped) - numActive image and covariance arrays, numBands accumulators
+static void freeDifferentialArrays( int numActive, int numBands, int numSensors )
+{
+	for (int i=0; imageData != NULL && i<numActive; i++)
+		free(imageData[i]);
+	free(imageData);
+	imageData = NULL;
+	for (int j=0; saveNames != NULL && j<numBands * numActive; j++)
+		free(saveNames[j]);
+	free(saveNames);
+	saveNames = NULL;
+	for (int b=0; b<numBands; b++)
+	{
+		if (dsAcc != NULL)
+			freeCovAccumulator( dsAcc[b] );
+		if (covAcc != NULL)
+			freeCovAccumulator( covAcc[b] );
+	}
+	free(dsAcc);
+	free(covAcc);
+	dsAcc = NULL;
+	covAcc = NULL;
+	for (int j=0; activeCov != NULL && j<numActive; j++)
+		free(activeCov[j]);
+	free(activeCov);
+	activeCov = NULL;
+	free(baselineCov);
+	free(weightCov);
+	free(windowStart);
+	free(windowEnd);
+	free(weightAccs);
+	free(weightWindows);
+	baselineCov = NULL;
+	weightCov = NULL;
+	windowStart = NULL;
+	windowEnd = NULL;
+	weightAccs = NULL;
+	weightWindows = NULL;
+	freeCovarianceArrays( covArray, icovArray, numSensors );
+	covArray = NULL;
+	icovArray = NULL;
+	free(voxelList);
+	free(normalList);
+	voxelList = NULL;
+	normalList = NULL;
+}
+
+#ifdef CHECK_BWLIB_COVARIANCE
+// compare covariance from the accumulator with getSensorCovariance() in bwlib for the same window
+bool getSensorCovariance( char *dsName, double wStart, double wEnd, double **covArray, filter_params &fparams );
+
+static void checkLibraryCovariance( char *name, double wStart, double wEnd, double *cov, int numSensors, filter_params &fparams )
+{
+	double **libCov = (double **)calloc( numSensors, sizeof(double *) );
+	bool valid = ( libCov != NULL );
+	for (int i=0; valid && i<numSensors; i++)
+		if ( ( libCov[i] = (double *)malloc( sizeof(double) * numSensors ) ) == NULL )
+			valid = false;
+
+	if ( valid && getSensorCovariance( name, wStart, wEnd, libCov, fparams ) )
+	{
+		double maxDiff = 0.0;
+		double maxVal = 0.0;
+		for (int i=0; i<numSensors; i++)
+		{
+			for (int j=0; j<numSensors; j++)
+			{
+				if ( fabs( libCov[i][j] - cov[i + j * numSensors] ) > maxDiff )
+					maxDiff = fabs( libCov[i][j] - cov[i + j * numSensors] );
+				if ( fabs( libCov[i][j] ) > maxVal )
+					maxVal = fabs( libCov[i][j] );
+			}
+		}
+		mexPrintf("covariance check %s (%g to %g s): max difference from getSensorCovariance() = %g (relative %g)\n",
+				  name, wStart, wEnd, maxDiff, maxVal > 0.0 ? maxDiff / maxVal : 0.0);
+	}
+	else
+		mexPrintf("covariance check %s (%g to %g s): getSensorCovariance() failed\n", name, wStart, wEnd);
+
+	for (int i=0; libCov != NULL && i<numSensors; i++)
+		free(libCov[i]);
+	free(libCov);
+}
+#endif
+
 extern "C" 
 {
 void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
@@ -54,6 +191,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	double			*dataPtr;	
 	char			*dsName;
 	char			*covDsName;
+	char			**covDsNames;
+	int				numCovDs;
 	char			*hdmFile;
     char			*voxFileName;
 	
@@ -81,11 +220,15 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	double			lowPass;		
 	double			highPass;
+	double			*bandHighPass;
+	double			*bandLowPass;
+	int				numBands;
 	double			minTime;
 	double			maxTime;
 	
-	double			activeStartTime;
-	double			activeEndTime;
+	double			*activeStartTime;
+	double			*activeEndTime;
+	int				numActive;
 	double			baselineStartTime;
 	double			baselineEndTime;
 	
@@ -97,11 +240,13 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	bool			useVoxFile = false;
 	bool			useVoxNormals = true;
 	
-    int             outputFormat = 0;  // 0 = CIVET *.txt, 2 = Freesurfer overlay *.w
+    int             outputFormat = 0;  // 0 = CIVET *.txt, 1 = Freesurfer overlay *.w, 2 = 4D image store *.bwimg, 3 = float32 *.f32
 
     
 	bool			useReverseFilter = true;
 	bool			useCovAsControl = false;
+	int				numThreads = 0;	   // 0 = use all processors
+	bool			sharedWeights = true;	// false = weights for each active window from that window and baseline
 	
 	double			xMin;     
 	double			xMax;
@@ -117,18 +262,42 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	bf_params		bparams;
 	filter_params 	fparams;
+	filter_params	*bandFilter;
 	
+ 	// buffers from a previous call have been freed
+	imageData = NULL;
+	covArray = NULL;
+	icovArray = NULL;
+	voxelList = NULL;
+	normalList = NULL;
+	windowStart = NULL;
+	windowEnd = NULL;
+	dsAcc = NULL;
+	covAcc = NULL;
+	weightAccs = NULL;
+	weightWindows = NULL;
+	activeCov = NULL;
+	baselineCov = NULL;
+	weightCov = NULL;
+	saveNames = NULL;
+
  	/* Check for proper number of arguments */
 	int n_inputs = 20;
 	int n_outputs = 1;
  	mexPrintf("bw_makeDifferential ver. %.1f (c) Douglas Cheyne, PhD. 2010. All rights reserved.\n", VERSION_NO); 
-	if ( nlhs != n_outputs | nrhs != n_inputs)
+	if ( nlhs != n_outputs | nrhs < n_inputs)
 	{
 		mexPrintf("\nincorrect number of input or output arguments for bw_makeDifferential  ...\n");
 		mexPrintf("\nCalling syntax:\n"); 
 		mexPrintf("[fileName] = bw_makeDifferential(dsName, covDsName, hdmFileName, useHdmFile, filter, boundingBox, stepSize, voxelFileName, useVoxFile, useVoxNormals,\n");
-		mexPrintf("   sphere, noiseRMS, regularization, imageType, activeWindow, baselineWindow, computeRMS, useReversingFilter, useCovAsControl, outputFormat\n");
-		mexPrintf("\n returns: filename of image file saved to disk \n");
+		mexPrintf("   sphere, noiseRMS, regularization, imageType, activeWindow, baselineWindow, computeRMS, useReversingFilter, useCovAsControl, outputFormat, {numThreads}, {sharedWeights}\n");
+		mexPrintf("\n filter may be a list of bands [numBands x 2] to compute images for each band in one pass of the data\n");
+		mexPrintf("\n activeWindow may be a list of windows [numWindows x 2] to compute a series of images in one pass of the data\n");
+		mexPrintf(" sharedWeights = 1 (default) computes all windows with the same weights (active windows and baseline combined),\n");
+		mexPrintf(" sharedWeights = 0 computes the weights for each window from that window and the baseline (same as one call per window)\n");
+		mexPrintf("\n outputFormat = 2 saves the images for each band in one 4D image store (.bwimg) - read with bw_read_image_store.m\n");
+		mexPrintf(" outputFormat = 3 saves surface images as raw float32 overlays (.f32) - read with bw_read_surface_image.m\n");
+		mexPrintf("\n returns: filename of image file saved to disk (list of file names for more than one active window) \n");
 		return;
 	}
 
@@ -147,17 +316,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	
 	///////////////////////////////////
-	// get covariance datasest name - may be same as dsName
-  	if (mxIsChar(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a string for covDsName dataset name.");
- 	if (mxGetM(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a row vector.");
-   	// Get the length of the input string.
-  	buflen = (mxGetM(prhs[1]) * mxGetN(prhs[1])) + 1;
-  	covDsName = (char *)mxCalloc(buflen, sizeof(char));
-  	status = mxGetString(prhs[1], covDsName, buflen);  	// Copy the string into a C string
- 	if (status != 0)
-		mexWarnMsgTxt("Not enough space for covDsName. String is truncated.");
+	// get covariance datasest name - may be same as dsName, or cell array of datasets to combine
+	numCovDs = getDatasetList(prhs[1], &covDsNames);
+	if (numCovDs < 1)
+		mexErrMsgTxt("Input [1] must be a string or cell array of strings for covariance dataset name(s).");
+	covDsName = covDsNames[0];
 
 	///////////////////////////////////
 	// get headModel file name
@@ -183,11 +346,17 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	val = mxGetPr(prhs[3]);
 	useHdmFile = (int)*val;
 	
-	if (mxGetM(prhs[4]) != 1 || mxGetN(prhs[4]) != 2)
-		mexErrMsgTxt("Input [4] must be a row vector [hipass lowpass].");
+	if (mxGetM(prhs[4]) < 1 || mxGetN(prhs[4]) != 2)
+		mexErrMsgTxt("Input [4] must be a row vector [hipass lowpass] or list of bands [numBands x 2].");
+	numBands = mxGetM(prhs[4]);
+	bandHighPass = (double *)mxCalloc(numBands, sizeof(double));
+	bandLowPass = (double *)mxCalloc(numBands, sizeof(double));
 	dataPtr = mxGetPr(prhs[4]);
-	highPass = dataPtr[0];
-	lowPass = dataPtr[1];
+	for (int b=0; b<numBands; b++)
+	{
+		bandHighPass[b] = dataPtr[b];
+		bandLowPass[b] = dataPtr[b + numBands];
+	}
 
 	if (mxGetM(prhs[5]) != 1 || mxGetN(prhs[5]) != 6)
 		mexErrMsgTxt("Input [5] must be row vector [xmin xmax ymin ymax zmin zmax]");
@@ -238,11 +407,17 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	val = mxGetPr(prhs[13]);
 	imageType = (int)*val;
 	
-	if (mxGetM(prhs[14]) != 1 || mxGetN(prhs[14]) != 2)
-		mexErrMsgTxt("Input [14] must be a row vector [activeWindowStart activeWindowEnd].");
+	if (mxGetM(prhs[14]) < 1 || mxGetN(prhs[14]) != 2)
+		mexErrMsgTxt("Input [14] must be a row vector [activeWindowStart activeWindowEnd] or list of windows [numWindows x 2].");
+	numActive = mxGetM(prhs[14]);
+	activeStartTime = (double *)mxCalloc(numActive, sizeof(double));
+	activeEndTime = (double *)mxCalloc(numActive, sizeof(double));
 	dataPtr = mxGetPr(prhs[14]);
-	activeStartTime = dataPtr[0];
-	activeEndTime = dataPtr[1];
+	for (int j=0; j<numActive; j++)
+	{
+		activeStartTime[j] = dataPtr[j];
+		activeEndTime[j] = dataPtr[j + numActive];
+	}
 	
 	if (mxGetM(prhs[15]) != 1 || mxGetN(prhs[15]) != 2)
 		mexErrMsgTxt("Input [15] must be a row vector [baselineWindowStart baselineWindowEnd].");
@@ -261,6 +436,17 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
     val = mxGetPr(prhs[19]);
 	outputFormat = (int)*val;
+
+	if (nrhs > 20)
+	{
+		val = mxGetPr(prhs[20]);
+		numThreads = (int)*val;
+	}
+	if (nrhs > 21)
+	{
+		val = mxGetPr(prhs[21]);
+		sharedWeights = (int)*val;
+	}
     
 	////////////////////////////////////////////////
 	// setup directory paths and filenames
@@ -289,11 +475,14 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 			  dsName, dsParams.numTrials, dsParams.numSamples, dsParams.numSensors, dsParams.epochMinTime, dsParams.epochMaxTime);
 	mexEvalString("drawnow");
 		
-    if (activeStartTime < dsParams.epochMinTime || activeEndTime > dsParams.epochMaxTime)
-    {
-        mexPrintf("Active window values (%g to %g seconds) exceeds data length (%g to %g seconds)\n", activeStartTime, activeEndTime, dsParams.epochMinTime, dsParams.epochMaxTime);
-        return;
-    }
+	for (int j=0; j<numActive; j++)
+	{
+		if (activeStartTime[j] < dsParams.epochMinTime || activeEndTime[j] > dsParams.epochMaxTime)
+		{
+			mexPrintf("Active window values (%g to %g seconds) exceeds data length (%g to %g seconds)\n", activeStartTime[j], activeEndTime[j], dsParams.epochMinTime, dsParams.epochMaxTime);
+			return;
+		}
+	}
     
     if (useCovAsControl)
     {
@@ -348,84 +537,69 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("units = nanoAmpere-meter\n");
 	mexEvalString("drawnow");
 
-	// setup filter 
-	if ( highPass == 0 && lowPass == 0)
+	// setup filter for each band
+	bandFilter = (filter_params *)mxCalloc(numBands, sizeof(filter_params));
+	for (int b=0; b<numBands; b++)
 	{
-		bparams.hiPass = dsParams.highPass;			// still need to know bandpass of data!
-		bparams.lowPass = dsParams.lowPass;
-		fparams.hc = bparams.lowPass;			// fparams used to determine bandpass and get name for covariance files etc...
-		fparams.lc = bparams.hiPass;
-		fparams.enable = false;
-		printf("**No filter specified. Using bandpass of dataset (%g to %g Hz)\n", bparams.hiPass, bparams.lowPass);
-	}
-	else
-	{
-		bparams.hiPass = highPass;  
-		bparams.lowPass = lowPass;
-		fparams.enable = true;
-		if ( bparams.hiPass == 0.0 )
-			fparams.type = BW_LOWPASS;
-		else
-			fparams.type = BW_BANDPASS;
-		fparams.bidirectional = useReverseFilter;
-		fparams.hc = bparams.lowPass;
-		fparams.lc = bparams.hiPass;
-		fparams.fs = dsParams.sampleRate;
-		fparams.order = 4;	// 
-		fparams.ncoeff = 0;				// init filter
-		
-		if (build_filter (&fparams) == -1)
+		highPass = bandHighPass[b];
+		lowPass = bandLowPass[b];
+		memset( &fparams, 0, sizeof(filter_params) );
+		if ( highPass == 0 && lowPass == 0)
 		{
-			mexPrintf("Could not build filter.  Exiting\n");
-			return;
+			bparams.hiPass = dsParams.highPass;			// still need to know bandpass of data!
+			bparams.lowPass = dsParams.lowPass;
+			fparams.hc = bparams.lowPass;			// fparams used to determine bandpass and get name for covariance files etc...
+			fparams.lc = bparams.hiPass;
+			fparams.enable = false;
+			printf("**No filter specified. Using bandpass of dataset (%g to %g Hz)\n", bparams.hiPass, bparams.lowPass);
 		}
-		
-		if (fparams.bidirectional)
-			mexPrintf("Applying filter from %g to %g Hz (bidirectional)\n", bparams.hiPass, bparams.lowPass);
 		else
-			mexPrintf("Applying filter from %g to %g Hz (non-bidirectional)\n", bparams.hiPass, bparams.lowPass);
+		{
+			bparams.hiPass = highPass;  
+			bparams.lowPass = lowPass;
+			fparams.enable = true;
+			if ( bparams.hiPass == 0.0 )
+				fparams.type = BW_LOWPASS;
+			else
+				fparams.type = BW_BANDPASS;
+			fparams.bidirectional = useReverseFilter;
+			fparams.hc = bparams.lowPass;
+			fparams.lc = bparams.hiPass;
+			fparams.fs = dsParams.sampleRate;
+			fparams.order = 4;	// 
+			fparams.ncoeff = 0;				// init filter
+
+			if (build_filter (&fparams) == -1)
+			{
+				mexPrintf("Could not build filter.  Exiting\n");
+				return;
+			}
 
+			if (fparams.bidirectional)
+				mexPrintf("Applying filter from %g to %g Hz (bidirectional)\n", bparams.hiPass, bparams.lowPass);
+			else
+				mexPrintf("Applying filter from %g to %g Hz (non-bidirectional)\n", bparams.hiPass, bparams.lowPass);
+
+		}
+		// actual band used for file names
+		bandHighPass[b] = bparams.hiPass;
+		bandLowPass[b] = bparams.lowPass;
+		bandFilter[b] = fparams;
 	}
 	
    	if ( useVoxFile )
 	{
-		fp = fopen(voxFileName, "r");
-		if (fp == NULL)
+		numVoxels = readVoxFile( voxFileName, &voxelList, &normalList );
+		if (numVoxels < 0)
 		{
-			mexPrintf("Couldn't open voxfile  %s\n", voxFileName);
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
-		fgets(s, 256, fp);
-		sscanf(s, "%d", &numVoxels);
 		
 		if (useVoxNormals)
 			mexPrintf("Computing images for %d voxels specified in %s (with cortical constraints) \n", numVoxels, voxFileName);
 		else
 			mexPrintf("Computing images for %d voxels specified in %s (without cortical constraints) \n", numVoxels, voxFileName);
-		
-		voxelList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
-		if ( voxelList == NULL)
-		{
-			mexPrintf("Could not allocate memory for voxel lists\n");
-			return;
-		}
-		
-		normalList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
-		if ( normalList == NULL)
-		{
-			mexPrintf("Could not allocate memory for normal lists\n");
-			return;
-		}
-		
-		for (int i=0; i < numVoxels; i++)
-		{
-		    fgets(s, 256, fp);
-		    sscanf(s, "%lf %lf %lf %lf %lf %lf",
-				   &voxelList[i].x, &voxelList[i].y, &voxelList[i].z,
-				   &normalList[i].x, &normalList[i].y, &normalList[i].z);
-		}
-		
-		fclose(fp);
 	}
 	else
 	{
@@ -454,6 +628,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		if ( voxelList == NULL)
 		{
 			mexPrintf("Could not allocate memory for voxel lists\n");
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
 		
@@ -461,6 +636,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		if ( normalList == NULL)
 		{
 			mexPrintf("Could not allocate memory for voxel lists\n");
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
 		
@@ -499,51 +675,52 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	////////////////////////////////////////////////////////////////////////
 	// filename always start with this...
 
-	sprintf(imageFileBaseName, "image");	
-		
-	sprintf(imageFileBaseName, "%s,%g-%gHz", imageFileBaseName, bparams.hiPass, bparams.lowPass);
+	// band is added for each band - "image,%g-%gHz" + imageFileSuffix
  	////////////////////////////////////////////////////////////////////////
 
+	char imageFileSuffix[256];
+	strcpy(imageFileSuffix, "");
 	
 	char addName[256];
 	if (useVoxFile)
 	{
 		removeFilePath(voxFileName, s);
 		removeDotExtension(s, addName);
-		sprintf(imageFileBaseName, "%s,_vox_%s",imageFileBaseName, addName);
+		sprintf(imageFileSuffix, "%s,_vox_%s",imageFileSuffix, addName);
 		if (!useVoxNormals)
-			sprintf(imageFileBaseName,"%s_NC", imageFileBaseName);
+			sprintf(imageFileSuffix,"%s_NC", imageFileSuffix);
 	}
 	
 	if (useCovAsControl)
 	{
 		removeFilePath(covDsName, s);
 		removeDotExtension(s, addName);
-		sprintf(imageFileBaseName, "%s,bDs_%s",imageFileBaseName, addName);
+		sprintf(imageFileSuffix, "%s,bDs_%s",imageFileSuffix, addName);
+		if (numCovDs > 1)
+			sprintf(imageFileSuffix, "%s+%d",imageFileSuffix, numCovDs - 1);
+	}
+	else if (numCovDs > 1)
+	{
+		removeFilePath(covDsName, s);
+		removeDotExtension(s, addName);
+		sprintf(imageFileSuffix, "%s,cDs_%s+%d",imageFileSuffix, addName, numCovDs - 1);
 	}
 	if (regularization > 0.0)
-		sprintf(imageFileBaseName,"%s,reg=%g", imageFileBaseName, regularization);
+		sprintf(imageFileSuffix,"%s,reg=%g", imageFileSuffix, regularization);
 	
 	if (computeRMS)
-		sprintf(imageFileBaseName,"%s_RMS", imageFileBaseName);
+		sprintf(imageFileSuffix,"%s_RMS", imageFileSuffix);
 	
 	char outFileName[256];
 	
-	if ( imageType == BF_IMAGE_PSEUDO_Z ) 
-		sprintf(outFileName, "%s_A=%g_%g_Z", imageFileBaseName, activeStartTime, activeEndTime);
-	else if ( imageType == BF_IMAGE_PSEUDO_T )
-		sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_T", imageFileBaseName, activeStartTime, activeEndTime, baselineStartTime, baselineEndTime);  
-	else
-		sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_F", imageFileBaseName, activeStartTime, activeEndTime, baselineStartTime, baselineEndTime);  
-	
+	// allocate memory for one image per active window
 	
-	// allocate memory for a single image - could be more (e.g., sliding window...)
-	
-	int numLatencies = 1;
-	imageData = (double **)malloc( sizeof(double *) * numLatencies );
+	int numLatencies = numActive;
+	imageData = (double **)calloc( numLatencies, sizeof(double *) );
 	if (imageData == NULL)
 	{
 		mexPrintf("memory allocation failed for imageData array");
+		freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 		return;
 	}
 	for (int i = 0; i < numLatencies; i++)
@@ -552,41 +729,159 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		if ( imageData[i] == NULL)
 		{
 			mexPrintf( "memory allocation failed for imageData array" );
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
 	}
+	saveNames = (char **)calloc( numBands * numActive, sizeof(char *) );
+	for (int j=0; saveNames != NULL && j<numBands * numActive; j++)
+	{
+		if ( ( saveNames[j] = (char *)malloc( sizeof(char) * 256 ) ) == NULL )
+			break;
+	}
+	if ( saveNames == NULL || saveNames[numBands * numActive - 1] == NULL )
+	{
+		mexPrintf( "memory allocation failed for file names" );
+		freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		return;
+	}
 	
 	// generate image...
 	// Nov 19, 2010 - added option to pass a different covariance dataset - for now just set option off and pass dsName
 	//
 	if ( imageType == BF_IMAGE_PSEUDO_Z ) 
-		mexPrintf("computing single state image for active window %g to %g s\n", activeStartTime, activeEndTime); 
+		mexPrintf("computing single state image for active window %g to %g s\n", activeStartTime[0], activeEndTime[numActive-1]); 
 	else
-		mexPrintf("computing differential image for active window %g to %g s and baseline window %g to %g s \n", activeStartTime, activeEndTime, baselineStartTime, baselineEndTime);
+		mexPrintf("computing differential image for active window %g to %g s and baseline window %g to %g s \n", activeStartTime[0], activeEndTime[numActive-1], baselineStartTime, baselineEndTime);
+	if (numActive > 1)
+		mexPrintf("(%d active windows, %s)\n", numActive, sharedWeights ? "same weights for all windows" : "weights computed for each window");
 	mexEvalString("drawnow");
 
 	
+	// covariance for active windows, baseline and combined windows - each dataset is read once
+	// windows are listed as active windows followed by baseline
+	int numSensors = dsParams.numSensors;
+	windowStart = (double *)malloc( sizeof(double) * (numActive + 1) );
+	windowEnd = (double *)malloc( sizeof(double) * (numActive + 1) );
+	weightAccs = (cov_accumulator **)malloc( sizeof(cov_accumulator *) * (numActive + 1) );
+	weightWindows = (int *)malloc( sizeof(int) * (numActive + 1) );
+	dsAcc = (cov_accumulator *)calloc( numBands, sizeof(cov_accumulator) );
+	covAcc = (cov_accumulator *)calloc( numBands, sizeof(cov_accumulator) );
+	int				numWeightWindows;
+	bool			useCovDs = useCovAsControl || numCovDs > 1 || strcmp(dsName, covDsName);
+
+	if ( useCovDs )
+	{
+		// covariance dataset or list of datasets to combine
+		if ( !checkCombinedDatasets( numCovDs, covDsNames, covDsParams ) )
+		{
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+			return;
+		}
+		if ( covDsParams.numSensors != numSensors || covDsParams.sampleRate != dsParams.sampleRate )
+		{
+			mexPrintf("Covariance dataset %s has different number of sensors or sample rate...\n", covDsName);
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+			return;
+		}
+	}
+
+	activeCov = (double **)calloc( numActive, sizeof(double *) );
+	baselineCov = (double *)malloc( sizeof(double) * numSensors * numSensors );
+	weightCov = (double *)malloc( sizeof(double) * numSensors * numSensors );
+	covArray = (double **)calloc( numSensors, sizeof(double *) );
+	icovArray = (double **)calloc( numSensors, sizeof(double *) );
+	if ( dsAcc == NULL || covAcc == NULL || windowStart == NULL || windowEnd == NULL || weightAccs == NULL || weightWindows == NULL ||
+		 activeCov == NULL || baselineCov == NULL || weightCov == NULL || covArray == NULL || icovArray == NULL )
+	{
+		mexPrintf("memory allocation failed for covariance arrays\n");
+		freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		return;
+	}
+	for (int j=0; j<numActive; j++)
+	{
+		activeCov[j] = (double *)malloc( sizeof(double) * numSensors * numSensors );
+		if ( activeCov[j] == NULL )
+		{
+			mexPrintf("memory allocation failed for covariance arrays\n");
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+			return;
+		}
+		windowStart[j] = activeStartTime[j];
+		windowEnd[j] = activeEndTime[j];
+	}
+	windowStart[numActive] = baselineStartTime;
+	windowEnd[numActive] = baselineEndTime;
+	for (int i=0; i<numSensors; i++)
+	{
+		covArray[i] = (double *)malloc( sizeof(double) * numSensors );
+		icovArray[i] = (double *)malloc( sizeof(double) * numSensors );
+		if ( covArray[i] == NULL || icovArray[i] == NULL )
+		{
+			mexPrintf("memory allocation failed for covariance arrays\n");
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+			return;
+		}
+	}
+
+	if (numBands > 1)
+		mexPrintf("computing covariance for %d frequency bands\n", numBands);
+
 	if (useCovAsControl)
 	{
 		mexPrintf("using alternate dataset (%s) for SAM baseline window\n", covDsName);
         mexEvalString("drawnow");
-		if ( !computeDifferentialMultiDs(imageData, dsName, dsParams, covDsName, fparams, bparams, regularization, numVoxels,
-								  voxelList, normalList, activeStartTime, activeEndTime, baselineStartTime, baselineEndTime, imageType) )
+	}
+
+	// accumulators for all bands are filled in one pass of each dataset
+	if (useCovAsControl)
+	{
+		// active windows from dsName, baseline window from covDsName, weights from all combined
+		for (int b=0; b<numBands; b++)
+		{
+			if ( !initCovAccumulator( dsAcc[b], dsParams, numActive, windowStart, windowEnd ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+			if ( !initCovAccumulator( covAcc[b], covDsParams, 1, &windowStart[numActive], &windowEnd[numActive] ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+		}
+		if ( !accumulateCovarianceBank( dsAcc, numBands, dsName, dsParams, bandFilter ) || 
+			 !accumulateCovarianceDatasets( covAcc, numBands, numCovDs, covDsNames, covDsParams, bandFilter ) )
 		{
-			mexPrintf( "error returned from computeDifferentialMultiDs\n" );
+			mexPrintf( "error computing covariance matrices\n" );
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
 	}
 	else
 	{
-		if ( !computeDifferential(imageData, dsName, dsParams, covDsName, true, fparams, bparams, regularization, numVoxels,
-								  voxelList, normalList, activeStartTime, activeEndTime, baselineStartTime, baselineEndTime, imageType) )
+		// active and baseline windows from dsName, weights from active and baseline windows of covDsName
+		for (int b=0; b<numBands; b++)
+		{
+			if ( !initCovAccumulator( dsAcc[b], dsParams, numActive + 1, windowStart, windowEnd ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+			if ( useCovDs && !initCovAccumulator( covAcc[b], covDsParams, numActive + 1, windowStart, windowEnd ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+		}
+		if ( !accumulateCovarianceBank( dsAcc, numBands, dsName, dsParams, bandFilter ) || 
+			 ( useCovDs && !accumulateCovarianceDatasets( covAcc, numBands, numCovDs, covDsNames, covDsParams, bandFilter ) ) )
 		{
-			mexPrintf( "error returned from computeDifferential\n" );
+			mexPrintf( "error computing covariance matrices\n" );
+			freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
 			return;
 		}
 	}
-	mexEvalString("drawnow");
 
 	// save image to file
 	int	samType;
@@ -597,128 +892,225 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	else
 		samType = SAM_UNIT_SPMF;
 
+	int numImages = numBands * numActive;
+
+	for (int b=0; b<numBands; b++)
+	{
+		bparams.hiPass = bandHighPass[b];
+		bparams.lowPass = bandLowPass[b];
+		sprintf(imageFileBaseName, "image,%g-%gHz%s", bandHighPass[b], bandLowPass[b], imageFileSuffix);
+		if (numBands > 1)
+			mexPrintf("computing images for band %g to %g Hz\n", bandHighPass[b], bandLowPass[b]);
+
+		if (useCovAsControl)
+		{
+			for (int j=0; j<numActive; j++)
+			{
+				getWindowCovariance( activeCov[j], dsAcc[b], j );
+				weightAccs[j] = &dsAcc[b];
+				weightWindows[j] = j;
+			}
+			getWindowCovariance( baselineCov, covAcc[b], 0 );
+			weightAccs[numActive] = &covAcc[b];
+			weightWindows[numActive] = 0;
+		}
+		else
+		{
+			for (int j=0; j<numActive; j++)
+				getWindowCovariance( activeCov[j], dsAcc[b], j );
+			getWindowCovariance( baselineCov, dsAcc[b], numActive );
+			for (int j=0; j<=numActive; j++)
+			{
+				weightAccs[j] = useCovDs ? &covAcc[b] : &dsAcc[b];
+				weightWindows[j] = j;
+			}
+		}
+
+#ifdef CHECK_BWLIB_COVARIANCE
+		for (int j=0; j<numActive; j++)
+			checkLibraryCovariance( dsName, activeStartTime[j], activeEndTime[j], activeCov[j], numSensors, bandFilter[b] );
+		if ( !useCovAsControl || numCovDs == 1 )
+			checkLibraryCovariance( useCovAsControl ? covDsName : dsName, baselineStartTime, baselineEndTime, baselineCov, numSensors, bandFilter[b] );
+#endif
+
+		// weights are computed as in computeDifferential() in bwlib - the mean of the active and baseline window
+		// covariance (of covDsName if different), or the active window only for single state images. Shared weights
+		// combine all active windows and are inverted once, otherwise each window uses its own active window and baseline
+		int numWeightSets = sharedWeights ? 1 : numActive;
+		int setSize = sharedWeights ? numActive : 1;
+		for (int k=0; k<numWeightSets; k++)
+		{
+			int first = k * setSize;
+
+			if (sharedWeights)
+			{
+				numWeightWindows = ( imageType == BF_IMAGE_PSEUDO_Z ) ? numActive : numActive + 1;
+				getMeanCovariance( weightCov, numWeightWindows, weightAccs, weightWindows );
+			}
+			else
+			{
+				cov_accumulator	*pairAccs[2] = { weightAccs[k], weightAccs[numActive] };
+				int				pairWindows[2] = { weightWindows[k], weightWindows[numActive] };
+				numWeightWindows = ( imageType == BF_IMAGE_PSEUDO_Z ) ? 1 : 2;
+				getMeanCovariance( weightCov, numWeightWindows, pairAccs, pairWindows );
+			}
+
+			for (int i=0; i<numSensors; i++)
+				for (int j=0; j<numSensors; j++)
+					covArray[i][j] = weightCov[i + j * numSensors];
+
+			if ( !invertCovarianceMatrix( covArray, icovArray, numSensors, regularization ) )
+			{
+				freeDifferentialArrays( numActive, numBands, numSensors );
+				mexErrMsgTxt("Error inverting covariance matrix");
+			}
+
+			if ( !computeDifferentialImages( &imageData[first], dsName, dsParams, bparams, icovArray, setSize, &activeCov[first], baselineCov,
+											 imageType, numVoxels, voxelList, normalList, numThreads ) )
+			{
+				mexPrintf( "error returned from computeDifferentialImages\n" );
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+		}
+		mexEvalString("drawnow");
+
+		// save all windows for this band in one 4D image store
+		if (outputFormat == 2)
+		{
+			img_store	store;
+			double		boundingBox[6] = {xMin, xMax, yMin, yMax, zMin, zMax};
+
+			if ( imageType == BF_IMAGE_PSEUDO_Z ) 
+				sprintf(outFileName, "%s_A=%g_%g_Z", imageFileBaseName, activeStartTime[0], activeEndTime[numActive-1]);
+			else if ( imageType == BF_IMAGE_PSEUDO_T )
+				sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_T", imageFileBaseName, activeStartTime[0], activeEndTime[numActive-1], baselineStartTime, baselineEndTime);  
+			else
+				sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_F", imageFileBaseName, activeStartTime[0], activeEndTime[numActive-1], baselineStartTime, baselineEndTime);  
+
 #if _WIN32||WIN64
-	sprintf(filename, "%s\\%s", analysisDir, outFileName);
+			sprintf(savename, "%s\\%s%s", analysisDir, outFileName, IMG_STORE_EXT);
 #else
-	sprintf(filename, "%s/%s", analysisDir, outFileName);
+			sprintf(savename, "%s/%s%s", analysisDir, outFileName, IMG_STORE_EXT);
 #endif
-	
+			mexPrintf("Saving %d images in 4D image store %s\n", numActive, savename);
+			if ( !createImageStore( store, savename, numVoxels, numActive, activeStartTime, voxelList, normalList,
+								   useVoxFile, samType, boundingBox, stepSize ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
+			writeImageStore( store, imageData, numActive );
+			if ( !closeImageStore( store ) )
+			{
+				freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+				return;
+			}
 
-	if (!useVoxFile)
-	{
-        sprintf(savename, "%s.svl", filename);
-		mexPrintf("Saving image in CTF .svl format as %s\n", savename);
-		saveVolumeAsSvl(savename, voxelList, imageData[0], numVoxels, xMin, xMax, yMin, yMax, zMin, zMax, stepSize, SAM_UNIT_SPMZ);
-    }
-    else
-    {
-        if (outputFormat == 0) // plain text file (for BrainView)
-        {
-            sprintf(savename, "%s.txt", filename);
-            mexPrintf("Saving image in ASCII text file %s\n", savename);
-            fp = fopen(savename, "w");
-            if ( fp == NULL)
-            {
-                mexPrintf("Couldn't open ASCII file %s\n", savename);
-                return;
-            }
-            for (int voxel=0; voxel<numVoxels; voxel++)
-                fprintf(fp, "%g\n",imageData[0][voxel]);
-            fclose(fp);
-        }
-        else if (outputFormat == 1) // freesurfer .w format
-        {
-            unsigned int num;
-            unsigned char byte1;
-            unsigned char byte2;
-            unsigned char byte3;
-            sprintf(savename, "%s.w", filename);
-            mexPrintf("Saving image as Freesurfer Overlay file %s\n", savename);
-            fp = fopen(savename, "wb");
-            if ( fp == NULL)
-            {
-                mexPrintf("Couldn't open file %s\n", savename);
-                return;
-            }
-            // write unused latency value type int16
-            unsigned short temps = 0;
-            unsigned short sval = ToFile(temps);
-            fwrite(&sval,  sizeof(unsigned short), 1, fp);
-            
-            // write numvoxels and each voxel index as a 3-byte integer
-            // have to byte swap to big-endian
-            num = numVoxels;
-            byte1 = num & 0xff;
-            byte2 = (num >> 8) & 0xff;
-            byte3 = (num >> 16) & 0xff;
-            fwrite(&byte3,  sizeof(unsigned char), 1, fp);
-            fwrite(&byte2,  sizeof(unsigned char), 1, fp);
-            fwrite(&byte1,  sizeof(unsigned char), 1, fp);
-            
-            for (int voxel=0; voxel<numVoxels; voxel++)
-            {
-                num = voxel;
-                byte1 = num & 0xff;
-                byte2 = (num >> 8) & 0xff;
-                byte3 = (num >> 16) & 0xff;
-                fwrite(&byte3,  sizeof(unsigned char), 1, fp);
-                fwrite(&byte2,  sizeof(unsigned char), 1, fp);
-                fwrite(&byte1,  sizeof(unsigned char), 1, fp);
-                float temp = imageData[0][voxel];
-                float fval = ToFile((float)temp);
-                
-                fwrite(&fval, sizeof(float),1, fp);
-            }
-            fclose(fp);
-        }
-        else
-        {
-            mexPrintf("Unknown file format code for surface (%d) .. no files written \n", outputFormat);
-            return;
-        }
-    
-    }
-	
-	plhs[0] = mxCreateString(savename);
-	
-	///////////////////////////////////
-	// change for version 2.5 - always save vox file
+			for (int j=0; j<numActive; j++)
+				sprintf(saveNames[b * numActive + j], "%s", savename);
+		}
+
+		for (int j=0; j<numActive && outputFormat != 2; j++)
+		{
+			if ( imageType == BF_IMAGE_PSEUDO_Z ) 
+				sprintf(outFileName, "%s_A=%g_%g_Z", imageFileBaseName, activeStartTime[j], activeEndTime[j]);
+			else if ( imageType == BF_IMAGE_PSEUDO_T )
+				sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_T", imageFileBaseName, activeStartTime[j], activeEndTime[j], baselineStartTime, baselineEndTime);  
+			else
+				sprintf(outFileName, "%s_A=%g_%g,B=%g_%g_F", imageFileBaseName, activeStartTime[j], activeEndTime[j], baselineStartTime, baselineEndTime);  
 
 #if _WIN32||WIN64
-	sprintf(filename,"%s\\%s.vox", analysisDir, imageFileBaseName);
+			sprintf(filename, "%s\\%s", analysisDir, outFileName);
 #else
-	sprintf(filename,"%s/%s.vox", analysisDir, imageFileBaseName);
+			sprintf(filename, "%s/%s", analysisDir, outFileName);
+#endif
+
+
+			if (!useVoxFile)
+			{
+		        sprintf(savename, "%s.svl", filename);
+				mexPrintf("Saving image in CTF .svl format as %s\n", savename);
+				saveVolumeAsSvl(savename, voxelList, imageData[j], numVoxels, xMin, xMax, yMin, yMax, zMin, zMax, stepSize, SAM_UNIT_SPMZ);
+		    }
+		    else
+		    {
+		        if (outputFormat == 0) // plain text file (for BrainView)
+		        {
+		            sprintf(savename, "%s.txt", filename);
+		            mexPrintf("Saving image in ASCII text file %s\n", savename);
+		            if ( !saveSurfaceText( savename, imageData[j], numVoxels ) )
+		            {
+		                mexPrintf("Couldn't write ASCII file %s\n", savename);
+		                freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		                return;
+		            }
+		        }
+		        else if (outputFormat == 1) // freesurfer .w format
+		        {
+		            sprintf(savename, "%s.w", filename);
+		            mexPrintf("Saving image as Freesurfer Overlay file %s\n", savename);
+		            if ( !saveSurfaceOverlay( savename, imageData[j], numVoxels ) )
+		            {
+		                mexPrintf("Couldn't write file %s\n", savename);
+		                freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		                return;
+		            }
+		        }
+		        else if (outputFormat == 3) // raw float32 overlay
+		        {
+		            sprintf(savename, "%s.f32", filename);
+		            mexPrintf("Saving image as float32 overlay file %s\n", savename);
+		            if ( !saveSurfaceFloat32( savename, imageData[j], numVoxels ) )
+		            {
+		                mexPrintf("Couldn't write file %s\n", savename);
+		                freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		                return;
+		            }
+		        }
+		        else
+		        {
+		            mexPrintf("Unknown file format code for surface (%d) .. no files written \n", outputFormat);
+		            freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+		            return;
+		        }
+
+		    }
+
+			sprintf(saveNames[b * numActive + j], "%s", savename);
+		}
+
+		///////////////////////////////////
+		// change for version 2.5 - always save vox file (for each band)
+
+#if _WIN32||WIN64
+		sprintf(filename,"%s\\%s.vox", analysisDir, imageFileBaseName);
+#else
+		sprintf(filename,"%s/%s.vox", analysisDir, imageFileBaseName);
 #endif
     
-    printf("writing vox file with computed orientations to %s\n", filename);
-    
-    fp = fopen(filename, "w");
-    if ( fp == NULL)
-    {
-        mexPrintf("Couldn't open voxel file %s\n", filename);
-        return;
-    }
+	    printf("writing vox file with computed orientations to %s\n", filename);
     
-    fprintf(fp, "%d\n", numVoxels);
-    for (int i=0; i< numVoxels; i++)
-    {
-        fprintf(fp, "%.2f\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\n", 
-                voxelList[i].x, voxelList[i].y, voxelList[i].z,
-                normalList[i].x, normalList[i].y, normalList[i].z);
-    }
-    return;
-	
+	    if ( !writeVoxFile( filename, numVoxels, voxelList, normalList ) )
+	    {
+	        mexPrintf("Couldn't write voxel file %s\n", filename);
+	        freeDifferentialArrays( numActive, numBands, dsParams.numSensors );
+	        return;
+	    }
+	}
+
+	if (numImages > 1)
+		plhs[0] = mxCreateCharMatrixFromStrings(numImages, (const char **)saveNames);
+	else
+		plhs[0] = mxCreateString(saveNames[0]);
+
 	///////////////////////////////////
 	// free temporary arrays for this routine
 
-	for (int i = 0; i < numLatencies; i++)
-		free(imageData[i]);
-	free(imageData);
-	
-	free(voxelList);
-	free(normalList);
-	
+	freeDifferentialArrays( numActive, numBands, numSensors );
+
 	mxFree(dsName);
+	freeDatasetList(numCovDs, covDsNames);
 	mxFree(hdmFile);
 	
     mexPrintf("... all done\n");
@@ -17,6 +17,29 @@
 //				2.5  - recompiled with separate ctflib and bwlib
 //				2.6  - recompiled with change to computeEventRelated - now takes vector of latencies.
 //				2.7  - changed arguments to take covDsName and voxFile params for surface imaging
+//				2.8  - covariance matrices are cached in covDs ANALYSIS directory (see covCache.h)
+//				2.9  - images computed with blocked weight and projection engine (bfEngine.h) instead of computeEventRelated
+//				3.0  - added optional numThreads argument (default = all processors)
+//				3.1  - lead fields saved to and read from persistent store in dataset ANALYSIS directory (see leadFieldStore.h)
+//				3.2  - regularization can be a vector of values - images are computed for all values in one call
+//				3.3  - covDsName can be a cell array of dataset names - covariance is computed for all trials combined
+//					   without writing a combined dataset (see checkCombinedDatasets() in covAccumulator.h)
+//				3.4  - outputFormat = 2 saves all images in a single chunked 4D image store (.bwimg) instead of
+//					   one file per latency (see imageStore.h)
+//				3.5  - images are computed in blocks of latencies and saved by a background writer thread while the next
+//					   block is computed (see imageWriter.h) - memory used for images no longer depends on the number of
+//					   latencies.  Mean image is accumulated as blocks are computed.
+//				3.6  - surface images are formatted in memory and written with one fwrite per file (see surfaceWriter.h).
+//					   added outputFormat = 3 - raw float32 overlay (.f32)
+//				3.7  - voxFile can be binary (.vox written by bw_mesh2vox) or ASCII - format is detected when the file is
+//					   read (see voxFile.h)
+//				3.8  - recompiled with change to computeEventRelatedImages - each block of latencies is computed for all
+//					   voxels with a single weights x data product (see bfEngine.h)
+//				3.9  - regularization sweep reads the unregularized covariance once and inverts it for each value in the same
+//					   way as computeCovarianceMatrices() (see invertCovarianceMatrix() in covCache.h) so reg = [r] and
+//					   reg = r create the same images.  Each value is a full inversion with its own weights.
+//				4.0  - sweep gets the covariance without inverting it (see getCombinedCovariance() in covCache.h).  Buffers are
+//					   freed and an error is returned if the covariance can't be computed or inverted
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "mex.h"
@@ -34,10 +57,16 @@
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
 #include "../../../bwlib/bwlib.h"
+#include "covCache.h"
+#include "bfEngine.h"
+#include "imageStore.h"
+#include "imageWriter.h"
+#include "surfaceWriter.h"
+#include "voxFile.h"
 
-#define VERSION_NO 2.7
+#define VERSION_NO 4.0
 
-double			**imageData; 
+double			*meanImage; 
 double			**covArray;
 double			**icovArray;
 vectorCart		*voxelList;
@@ -46,6 +75,93 @@ vectorCart		*normalList;
 char			**fileList;
 ds_params		dsParams;
 
+// free covariance, voxel and file name buffers at exit (numFiles = 0 if fileList is not allocated yet)
+static void freeEventRelatedArrays( int numFiles )
+{
+	freeCovarianceArrays( covArray, icovArray, dsParams.numSensors );
+	covArray = NULL;
+	icovArray = NULL;
+	free(voxelList);
+	free(normalList);
+	voxelList = NULL;
+	normalList = NULL;
+	for (int i=0; i<numFiles; i++)
+		free(fileList[i]);
+	if (numFiles > 0)
+		free(fileList);
+	fileList = NULL;
+}
+
+// output settings passed to the image writer thread
+typedef struct er_output
+{
+	int				outputFormat;
+	bool			useVoxFile;
+	bool			computeMean;
+	int				numVoxels;
+	vectorCart		*voxelList;
+	double			boundingBox[6];
+	double			stepSize;
+	char			**imageList;		// file name for each latency
+	double			*meanImage;			// sum of images (computeMean)
+	img_store		*store;				// outputFormat = 2
+} er_output;
+
+// add extension for output format to filename
+static void getImageFileName( char *savename, char *filename, er_output *output )
+{
+	if (!output->useVoxFile)
+		sprintf(savename, "%s.svl", filename);
+	else if (output->outputFormat == 0)
+		sprintf(savename, "%s.txt", filename);
+	else if (output->outputFormat == 1)
+		sprintf(savename, "%s.w", filename);
+	else
+		sprintf(savename, "%s.f32", filename);
+}
+
+// save image as CTF .svl (volume), plain text (for BrainView), freesurfer overlay .w or float32 .f32 (surface)
+// runs in image writer thread - no mex calls
+static bool saveImageFile( char *savename, double *image, er_output *output )
+{
+	double	*bb = output->boundingBox;
+
+	if (!output->useVoxFile)
+	{
+		saveVolumeAsSvl(savename, output->voxelList, image, output->numVoxels, bb[0], bb[1], bb[2], bb[3], bb[4], bb[5], output->stepSize, SAM_UNIT_SPMZ);
+		return (true);
+	}
+	else if (output->outputFormat == 0) // plain text file (for BrainView)
+		return ( saveSurfaceText( savename, image, output->numVoxels ) );
+	else if (output->outputFormat == 1) // freesurfer .w format
+		return ( saveSurfaceOverlay( savename, image, output->numVoxels ) );
+	else
+		return ( saveSurfaceFloat32( savename, image, output->numVoxels ) );
+}
+
+// image writer function - saves images for latencies first .. first+count-1, or adds them to the mean
+static bool writeEventRelatedBlock( int first, int count, double **images, void *arg )
+{
+	er_output *output = (er_output *)arg;
+
+	if (output->computeMean)
+	{
+		for (int i=0; i<count; i++)
+			for (int voxel=0; voxel<output->numVoxels; voxel++)
+				output->meanImage[voxel] += images[i][voxel];
+		return (true);
+	}
+
+	if (output->outputFormat == 2)
+		return ( writeImageStore( *output->store, images, count ) );
+
+	for (int i=0; i<count; i++)
+		if ( !saveImageFile( output->imageList[first + i], images[i], output ) )
+			return (false);
+
+	return (true);
+}
+
 extern "C" 
 {
 void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
@@ -55,6 +171,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	double			*dataPtr;	
 	char			*dsName;
 	char			*covDsName;
+	char			**covDsNames;
+	int				numCovDs;
 	char			*hdmFile;
 	char			*voxFileName;
 	
@@ -66,6 +184,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	char			filename[256];
 	char			savename[256];
 	char			imageFileBaseName[256];
+	char			imageFilePrefix[256];
+	char			imageFileSuffix[256];
 	char			analysisDir[256];
 	char			cmd[256];
 	char			s[256];
@@ -91,6 +211,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	double			wEnd;
 	
 	double			regularization = 0.0;
+	double			*regList;
+	int				numReg = 1;
 	
 	bool			nonRectified = false;
 	bool			computePlusMinus = false;
@@ -103,7 +225,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	bool			useReverseFilter = true;
 	
-    int             outputFormat = 0;  // 0 = CIVET *.txt, 2 = Freesurfer overlay *.w
+    int             outputFormat = 0;  // 0 = CIVET *.txt, 1 = Freesurfer overlay *.w, 2 = 4D image store *.bwimg, 3 = float32 *.f32
+	int				numThreads = 0;	   // 0 = use all processors
 	
 	double			xMin;     
 	double			xMax;
@@ -125,13 +248,16 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	int n_inputs = 24;
 	int n_outputs = 2;
  	mexPrintf("bw_makeEventRelated ver. %.1f (c) Douglas Cheyne, PhD. 2010. All rights reserved.\n", VERSION_NO);
-	if ( nlhs != n_outputs | nrhs != n_inputs)
+	if ( nlhs != n_outputs | nrhs < n_inputs)
 	{
 		mexPrintf("\nincorrect number of input or output arguments for bw_makeEventRelated  ...\n");
 		mexPrintf("\nCalling syntax:\n"); 
 		mexPrintf("[listFile fileNames] = bw_makeEventRelated(datasetName, covarianceDsName, hdmFileName, useHdmFile, filter, boundingBox, stepSize, \n");
 		mexPrintf("                   covWindow, voxelFileName, useVoxFile, useVoxNormals, baselineWindow, useBaselineWindow, sphere, noiseRMS, regularization, \n");
-		mexPrintf("                  numLatencies, latencyList, nonRectified, computeRMS, computePlusMinus, computeMean, useReverseFilter, outputFormat)\n");
+		mexPrintf("                  numLatencies, latencyList, nonRectified, computeRMS, computePlusMinus, computeMean, useReverseFilter, outputFormat, {numThreads})\n");
+		mexPrintf("\n   [numThreads] - number of threads used to compute images (default = 0 = all processors) \n");
+		mexPrintf("\n   outputFormat = 2 saves all images in one 4D image store (.bwimg) - read with bw_read_image_store.m \n");
+		mexPrintf("   outputFormat = 3 saves surface images as raw float32 overlays (.f32) - read with bw_read_surface_image.m \n");
 		mexPrintf("\n returns: name of the .list file and an array of names of files saved to disk. \n");
 		return;
 	}
@@ -150,17 +276,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexWarnMsgTxt("Not enough space. String is truncated.");        
 			
 	///////////////////////////////////
-	// get covariance datasest name - may be same as dsName
-  	if (mxIsChar(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a string for covariance dataset name.");
- 	if (mxGetM(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a row vector.");
-   	// Get the length of the input string.
-  	buflen = (mxGetM(prhs[1]) * mxGetN(prhs[1])) + 1;
-  	covDsName = (char *)mxCalloc(buflen, sizeof(char));
-  	status = mxGetString(prhs[1], covDsName, buflen);  	// Copy the string into a C string
- 	if (status != 0)
-		mexWarnMsgTxt("Not enough space. String is truncated.");
+	// get covariance datasest name - may be same as dsName, or cell array of datasets to combine
+	numCovDs = getDatasetList(prhs[1], &covDsNames);
+	if (numCovDs < 1)
+		mexErrMsgTxt("Input [1] must be a string or cell array of strings for covariance dataset name(s).");
+	covDsName = covDsNames[0];
 	
 	///////////////////////////////////
 	// get headModel file name 
@@ -256,8 +376,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	bparams.noiseRMS = *val;
 	bparams.normalized = true;
 	
-	val = mxGetPr(prhs[15]);
-	regularization = *val;
+	numReg = (int)mxGetNumberOfElements(prhs[15]);
+	if (numReg < 1)
+		mexErrMsgTxt("Input [15] must be a regularization value or vector of values.");
+	regList = mxGetPr(prhs[15]);
+	regularization = regList[0];
 
 	val = mxGetPr(prhs[16]);
 	numLatencies = (int)*val;
@@ -286,6 +409,12 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
     val = mxGetPr(prhs[23]);
 	outputFormat = (int)*val;
 
+	if (nrhs > 24)
+	{
+		val = mxGetPr(prhs[24]);
+		numThreads = (int)*val;
+	}
+
 
 	////////////////////////////////////////////////
 	// setup directory paths and filenames
@@ -457,43 +586,14 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
    	if ( useVoxFile )
 	{
-		fp = fopen(voxFileName, "r");
-		if (fp == NULL)
-		{
-			mexPrintf("Couldn't open voxfile  %s\n", voxFileName);
+		numVoxels = readVoxFile( voxFileName, &voxelList, &normalList );
+		if (numVoxels < 0)
 			return;
-		}
-		fgets(s, 256, fp);
-		sscanf(s, "%d", &numVoxels);
 		
 		if (useVoxNormals)
 			mexPrintf("Computing images for %d voxels specified in %s (with cortical constraints) \n", numVoxels, voxFileName);
 		else
 			mexPrintf("Computing images for %d voxels specified in %s (without cortical constraints) \n", numVoxels, voxFileName);
-			
-		voxelList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
-		if ( voxelList == NULL)
-		{
-			mexPrintf("Could not allocate memory for voxel lists\n");
-			return;
-		}
-		
-		normalList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
-		if ( normalList == NULL)
-		{
-			mexPrintf("Could not allocate memory for normal lists\n");
-			return;
-		}
-		
-		for (int i=0; i < numVoxels; i++)
-		{
-		    fgets(s, 256, fp);
-		    sscanf(s, "%lf %lf %lf %lf %lf %lf",
-				   &voxelList[i].x, &voxelList[i].y, &voxelList[i].z,
-				   &normalList[i].x, &normalList[i].y, &normalList[i].z);
-		}
-		
-		fclose(fp);
 	}
 	else
 	{
@@ -579,49 +679,55 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		if (!useVoxNormals)
 			sprintf(imageFileBaseName,"%s_NC", imageFileBaseName);
 	}
-	if ( strcmp(dsName,covDsName) )
+	if ( strcmp(dsName,covDsName) || numCovDs > 1 )
 	{
 		removeFilePath(covDsName, s);
 		removeDotExtension(s, addName);
 		sprintf(imageFileBaseName, "%s,cDs_%s",imageFileBaseName, addName);
+		if (numCovDs > 1)
+			sprintf(imageFileBaseName, "%s+%d",imageFileBaseName, numCovDs - 1);
 	}
-	if (regularization > 0.0)
-		sprintf(imageFileBaseName,"%s,reg=%g", imageFileBaseName, regularization);
+	// regularization is inserted between prefix and suffix for each regularization value
+	sprintf(imageFilePrefix, "%s", imageFileBaseName);
+	imageFileSuffix[0] = '\0';
 
 	if (nonRectified)
-		sprintf(imageFileBaseName,"%s_NR", imageFileBaseName);
+		strcat(imageFileSuffix, "_NR");
 	
 	if (computeRMS)
-		sprintf(imageFileBaseName,"%s_RMS", imageFileBaseName);
+		strcat(imageFileSuffix, "_RMS");
 	
 	if (computePlusMinus)
-		sprintf(imageFileBaseName,"%s_PM", imageFileBaseName);
+		strcat(imageFileSuffix, "_PM");
 	
 	if (computeMean)
-		sprintf(imageFileBaseName,"%s_MEAN", imageFileBaseName);
+		strcat(imageFileSuffix, "_MEAN");
 	
 
-	mexPrintf("computing %d by %d covariance matrix (BW %g to %g Hz) for window %g %g s (reg. = %g) from dataset %s\n",
-			  dsParams.numSensors, dsParams.numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, regularization, covDsName);
-	mexEvalString("drawnow");
-
-	// get covariance... - need to remove anglewindow args from library function...
-	computeCovarianceMatrices(covArray, icovArray, dsParams.numSensors, covDsName, fparams, wStart, wEnd, wStart, wEnd, false, regularization);
-	
-	// allocate memory for all images...
-	imageData = (double **)malloc( sizeof(double *) * numLatencies );
-	if (imageData == NULL)
+	if (numReg > 1)
 	{
-		mexPrintf("memory allocation failed for imageData array");
-		return;
+		mexPrintf("computing %d by %d covariance matrix (BW %g to %g Hz) for window %g %g s for %d regularization values from dataset %s\n",
+				  dsParams.numSensors, dsParams.numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, numReg, covDsName);
+		mexEvalString("drawnow");
+
+		// regularization sweep - read unregularized covariance once and invert for each value
+		if ( !getCombinedCovariance(covArray, dsParams.numSensors, numCovDs, covDsNames, fparams, wStart, wEnd) )
+		{
+			freeEventRelatedArrays( 0 );
+			mexErrMsgTxt("Error computing covariance matrix");
+		}
 	}
-	for (int i = 0; i < numLatencies; i++)
+	else
 	{
-		imageData[i] = (double *)malloc( sizeof(double) * numVoxels );
-		if ( imageData[i] == NULL)
+		mexPrintf("computing %d by %d covariance matrix (BW %g to %g Hz) for window %g %g s (reg. = %g) from dataset %s\n",
+				  dsParams.numSensors, dsParams.numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, regularization, covDsName);
+		mexEvalString("drawnow");
+
+		// get covariance... - reads from cache if previously computed with same settings
+		if ( !getCombinedCovarianceMatrices(covArray, icovArray, dsParams.numSensors, numCovDs, covDsNames, fparams, wStart, wEnd, regularization) )
 		{
-			mexPrintf( "memory allocation failed for imageData array" );
-			return;
+			freeEventRelatedArrays( 0 );
+			mexErrMsgTxt("Error computing covariance matrices");
 		}
 	}
 	
@@ -631,9 +737,15 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	else
 		numImages = numLatencies;
 
+	if (useVoxFile && (outputFormat < 0 || outputFormat > 3))
+	{
+		mexPrintf("Unknown file format code for surface (%d) .. no files written \n", outputFormat);
+		return;
+	}
+
     // create character array of image filenames
-	fileList = (char **)malloc(sizeof(char *) * numImages);
-	for (int i=0; i<numImages; i++)
+	fileList = (char **)malloc(sizeof(char *) * numImages * numReg);
+	for (int i=0; i<numImages * numReg; i++)
 	{
 		fileList[i] = (char *)malloc(sizeof(char) * 256);
 		if (fileList[i] == NULL)
@@ -643,225 +755,240 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		}
 	}
 	
-	// generate images...
-	if ( !computeEventRelated(imageData, dsName, dsParams, fparams, bparams, covArray, icovArray, numVoxels,
-							voxelList, normalList, numLatencies, latencyList, computePlusMinus, nonRectified) )
+	char **listFileNames = (char **)malloc(sizeof(char *) * numReg);
+	for (int r=0; r<numReg; r++)
+		listFileNames[r] = (char *)malloc(sizeof(char) * 256);
+
+	for (int r=0; r<numReg; r++)
 	{
-		mexPrintf( "error returned from computeEventRelated\n" );
-		return;			
-	}
+		regularization = regList[r];
+		sprintf(imageFileBaseName, "%s", imageFilePrefix);
+		if (regularization > 0.0)
+			sprintf(imageFileBaseName, "%s,reg=%g", imageFilePrefix, regularization);
+		strcat(imageFileBaseName, imageFileSuffix);
 
-	double startLatency;
-	double	endLatency;
-	
-	startLatency = latencyList[0];
-	endLatency = latencyList[numLatencies-1];
-	
-	char listFileName[256];
-	sprintf(listFileName, "");
-	    
-    ///////////// compute the mean image and write to single file
-	if (computeMean) 
-	{		
-        // average all time points and put in array index zero
-        
-		mexPrintf("Computing mean image across latencies..\n");		
-		for (int i=1; i<numLatencies; i++)
+		if (numReg > 1)
 		{
-			for (int voxel=0; voxel<numVoxels; voxel++)
-				imageData[0][voxel] += imageData[i][voxel];
+			mexPrintf("computing images for regularization = %g\n", regularization);
+			mexEvalString("drawnow");
+			if ( !invertCovarianceMatrix( covArray, icovArray, dsParams.numSensors, regularization ) )
+			{
+				for (int k=0; k<numReg; k++)
+					free(listFileNames[k]);
+				free(listFileNames);
+				freeEventRelatedArrays( numImages * numReg );
+				mexErrMsgTxt("Error inverting covariance matrix");
+			}
 		}
-		for (int voxel=0; voxel<numVoxels; voxel++)
-			imageData[0][voxel] = imageData[0][voxel] / numLatencies;
-		
-        // put latency range in filename
+
+		double startLatency;
+		double	endLatency;
+
+		startLatency = latencyList[0];
+		endLatency = latencyList[numLatencies-1];
+
+		char listFileName[256];
+		sprintf(listFileName, "");
+		char **imageList = fileList + r * numImages;
+
+		// images are saved by the image writer thread as each block of latencies is computed
+		er_output		output;
+		img_store		store;
+		double			boundingBox[6] = {xMin, xMax, yMin, yMax, zMin, zMax};
+
+		memset( &output, 0, sizeof(er_output) );
+		output.outputFormat = outputFormat;
+		output.useVoxFile = useVoxFile;
+		output.computeMean = computeMean;
+		output.numVoxels = numVoxels;
+		output.voxelList = voxelList;
+		for (int k=0; k<6; k++)
+			output.boundingBox[k] = boundingBox[k];
+		output.stepSize = stepSize;
+		output.imageList = imageList;
+		output.store = &store;
+
+		if (computeMean)
+		{
+			// running sum of images across latencies
+			meanImage = (double *)calloc( numVoxels, sizeof(double) );
+			if (meanImage == NULL)
+			{
+				mexPrintf("memory allocation failed for mean image\n");
+				return;
+			}
+			output.meanImage = meanImage;
+		}
+		else if (outputFormat == 2)
+		{
+			// save all images in one 4D image store
 #if _WIN32||WIN64
-	sprintf(filename, "%s\\%s,time=%.3f_%.3f", analysisDir, imageFileBaseName, startLatency, endLatency);
+			sprintf(savename, "%s\\%s%s", analysisDir, imageFileBaseName, IMG_STORE_EXT);
 #else
-	sprintf(filename, "%s/%s,time=%.3f_%.3f", analysisDir, imageFileBaseName, startLatency, endLatency);
+			sprintf(savename, "%s/%s%s", analysisDir, imageFileBaseName, IMG_STORE_EXT);
 #endif
-    }
-    
-    // write out all time points to specified file format
-    
-    for (int i=0; i<numImages; i++)
-    {
-        if (!computeMean)
-        {
-            double latency = latencyList[i];
-            
+			if ( !createImageStore( store, savename, numVoxels, numLatencies, latencyList, voxelList, normalList,
+								   useVoxFile, SAM_UNIT_SPMZ, boundingBox, stepSize ) )
+				return;
+			for (int i=0; i<numImages; i++)
+				sprintf(imageList[i],"%s",savename);
+			sprintf(listFileName, "%s", savename);
+		}
+		else
+		{
+			for (int i=0; i<numImages; i++)
+			{
+				double latency = latencyList[i];
+
 #if _WIN32||WIN64
-        sprintf(filename, "%s\\%s_time=%.3f", analysisDir, imageFileBaseName, latency);
+			sprintf(filename, "%s\\%s_time=%.3f", analysisDir, imageFileBaseName, latency);
 #else
-        sprintf(filename, "%s/%s_time=%.3f", analysisDir, imageFileBaseName, latency);
+			sprintf(filename, "%s/%s_time=%.3f", analysisDir, imageFileBaseName, latency);
 #endif
-      
-        }
-        
-        if (!useVoxFile)
-        {
-            sprintf(savename, "%s.svl", filename);
-            mexPrintf("Saving image in CTF .svl format as %s\n", savename);
-            saveVolumeAsSvl(savename, voxelList, imageData[i], numVoxels, xMin, xMax, yMin, yMax, zMin, zMax, stepSize, SAM_UNIT_SPMZ);
-        }
-        else
-        {
-            if (outputFormat == 0) // plain text file (for BrainView)
-            {
-                sprintf(savename, "%s.txt", filename);
-                mexPrintf("Saving image in ASCII text file %s\n", savename);
-                fp = fopen(savename, "w");
-                if ( fp == NULL)
-                {
-                    mexPrintf("Couldn't open ASCII file %s\n", savename);
-                    return;
-                }
-                for (int voxel=0; voxel<numVoxels; voxel++)
-                    fprintf(fp, "%g\n",imageData[i][voxel]);
-                fclose(fp);
-            }
-            else if (outputFormat == 1) // freesurfer .w format
-            {
-                unsigned int num;
-                unsigned char byte1;
-                unsigned char byte2;
-                unsigned char byte3;
-                sprintf(savename, "%s.w", filename);
-                mexPrintf("Saving image as Freesurfer Overlay file %s\n", savename);
-                fp = fopen(savename, "wb");
-                if ( fp == NULL)
-                {
-                    mexPrintf("Couldn't open file %s\n", savename);
-                    return;
-                }
-                // write unused latency value type int16
-                unsigned short sval = 0;
-                fwrite(&sval,  sizeof(unsigned short), 1, fp);
-                
-                // write numvoxels and each voxel index as a 3-byte integer
-                // have to byte swap to big-endian
-                num = numVoxels;
-                byte1 = num & 0xff;
-                byte2 = (num >> 8) & 0xff;
-                byte3 = (num >> 16) & 0xff;
-                fwrite(&byte3,  sizeof(unsigned char), 1, fp);
-                fwrite(&byte2,  sizeof(unsigned char), 1, fp);
-                fwrite(&byte1,  sizeof(unsigned char), 1, fp);
-                
-                for (int voxel=0; voxel<numVoxels; voxel++)
-                {
-                    num = voxel;
-                    byte1 = num & 0xff;
-                    byte2 = (num >> 8) & 0xff;
-                    byte3 = (num >> 16) & 0xff;
-                    fwrite(&byte3,  sizeof(unsigned char), 1, fp);
-                    fwrite(&byte2,  sizeof(unsigned char), 1, fp);
-                    fwrite(&byte1,  sizeof(unsigned char), 1, fp);
-                    float temp = imageData[i][voxel];
-                    float fval = ToFile((float)temp);
-                    
-                    fwrite(&fval, sizeof(float),1, fp);
-                }
-                fclose(fp);
-            }
-            else
-            {
-                mexPrintf("Unknown file format code for surface (%d) .. no files written \n", outputFormat);
-                return;
-            }
-        }
-        
-        
-        sprintf(fileList[i],"%s",savename);
-    }
-    
-    // if more than one file written - save list of filenames in the .list file in local directory
-		
-    if ( numImages >  1 )
-    {
-			
+				getImageFileName( imageList[i], filename, &output );
+			}
+		}
+
+		// generate images...
+		image_writer writer;
+		if ( !createImageWriter( writer, numVoxels, IMG_WRITER_BLOCK_SIZE, writeEventRelatedBlock, &output ) )
+			return;
+		bool ok = computeEventRelatedImages(writer, dsName, dsParams, fparams, bparams, icovArray, numVoxels,
+								voxelList, normalList, numLatencies, latencyList, computePlusMinus, nonRectified, numThreads);
+		if ( !closeImageWriter( writer ) )
+		{
+			mexPrintf( "error writing image files\n" );
+			ok = false;
+		}
+		if ( !ok )
+		{
+			mexPrintf( "error returned from computeEventRelatedImages\n" );
+			if (computeMean)
+				free(meanImage);
+			else if (outputFormat == 2)
+				freeImageStore( store );
+			return;			
+		}
+
+		///////////// compute the mean image and write to single file
+		if (computeMean) 
+		{		
+			mexPrintf("Computing mean image across latencies..\n");		
+			for (int voxel=0; voxel<numVoxels; voxel++)
+				meanImage[voxel] = meanImage[voxel] / numLatencies;
+
+			// put latency range in filename
 #if _WIN32||WIN64
-	sprintf(listFileName,"%s\\%s.list",analysisDir, imageFileBaseName);
+		sprintf(filename, "%s\\%s,time=%.3f_%.3f", analysisDir, imageFileBaseName, startLatency, endLatency);
 #else
-	sprintf(listFileName,"%s/%s.list",analysisDir, imageFileBaseName);
+		sprintf(filename, "%s/%s,time=%.3f_%.3f", analysisDir, imageFileBaseName, startLatency, endLatency);
 #endif
-        
-        mexPrintf("writing file names to list file %s\n", listFileName);
-        FILE * listFile = fopen(listFileName, "w");
-        if ( listFile == NULL)
-        {
-            mexPrintf("Couldn't open listFile %s\n", listFileName);
-            return;
-        }
-        for (int i=0; i<numLatencies; i++)
-        {
-            removeFilePath(fileList[i], s);
-            fprintf(listFile,"%s\n",s);
-        }
-        fclose(listFile);
-    }		
+			if (outputFormat == 2)
+			{
+				// latency of mean image is start of range
+				sprintf(imageList[0], "%s%s", filename, IMG_STORE_EXT);
+				ok = createImageStore( store, imageList[0], numVoxels, 1, &startLatency, voxelList, normalList,
+									  useVoxFile, SAM_UNIT_SPMZ, boundingBox, stepSize );
+				if (ok)
+				{
+					writeImageStore( store, &meanImage, 1 );
+					ok = closeImageStore( store );
+				}
+			}
+			else
+			{
+				getImageFileName( imageList[0], filename, &output );
+				ok = saveImageFile( imageList[0], meanImage, &output );
+			}
+			free(meanImage);
+			if ( !ok )
+			{
+				mexPrintf("Couldn't save mean image %s\n", imageList[0]);
+				return;
+			}
+		}
+		else if (outputFormat == 2)
+		{
+			if ( !closeImageStore( store ) )
+				return;
+		}
+
+		if (outputFormat == 2)
+			mexPrintf("Saved %d images in 4D image store %s\n", numImages, imageList[0]);
+		else
+			for (int i=0; i<numImages; i++)
+				mexPrintf("Saved image %s\n", imageList[i]);
+
+		// if more than one file written - save list of filenames in the .list file in local directory
+
+		if ( numImages >  1 && outputFormat != 2 )
+		{
 
-	mexEvalString("drawnow");
-	
-    
-    // if successful, return to calling function the filenames a
-	if (numImages > 0)
-	{
-		plhs[0] = mxCreateString(listFileName); 
-		plhs[1] = mxCreateCharMatrixFromStrings(numImages, (const char **)fileList); 
-	}
-	
-	///////////////////////////////////
-    // change for Version 2.5 - always save .vox file...
-	// 
-	
 #if _WIN32||WIN64
-	sprintf(filename,"%s\\%s.vox", analysisDir, imageFileBaseName);
+		sprintf(listFileName,"%s\\%s.list",analysisDir, imageFileBaseName);
 #else
-	sprintf(filename,"%s/%s.vox", analysisDir, imageFileBaseName);
+		sprintf(listFileName,"%s/%s.list",analysisDir, imageFileBaseName);
 #endif
-		
-    mexPrintf("writing vox file with computed orientations to %s\n", filename);
-    
-    fp = fopen(filename, "w");
-    if ( fp == NULL)
-    {
-        mexPrintf("Couldn't open voxel file %s\n", filename);
-        return;
-    }
-    
-    fprintf(fp, "%d\n", numVoxels);
-    for (int i=0; i< numVoxels; i++)
-    {
-        fprintf(fp, "%.2f\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\n", 
-                voxelList[i].x, voxelList[i].y, voxelList[i].z,
-                normalList[i].x, normalList[i].y, normalList[i].z);
-    }
-    fclose(fp);
+
+			mexPrintf("writing file names to list file %s\n", listFileName);
+			FILE * listFile = fopen(listFileName, "w");
+			if ( listFile == NULL)
+			{
+				mexPrintf("Couldn't open listFile %s\n", listFileName);
+				return;
+			}
+			for (int i=0; i<numLatencies; i++)
+			{
+				removeFilePath(imageList[i], s);
+				fprintf(listFile,"%s\n",s);
+			}
+			fclose(listFile);
+		}		
+
+		mexEvalString("drawnow");
+
+		sprintf(listFileNames[r], "%s", listFileName);
+
+		///////////////////////////////////
+		// change for Version 2.5 - always save .vox file...
+		// 
+
+#if _WIN32||WIN64
+		sprintf(filename,"%s\\%s.vox", analysisDir, imageFileBaseName);
+#else
+		sprintf(filename,"%s/%s.vox", analysisDir, imageFileBaseName);
+#endif
+
+		mexPrintf("writing vox file with computed orientations to %s\n", filename);
+
+		if ( !writeVoxFile( filename, numVoxels, voxelList, normalList ) )
+		{
+			mexPrintf("Couldn't write voxel file %s\n", filename);
+			return;
+		}
+	}
+
+	// if successful, return to calling function the filenames and list file name(s)
+	if (numImages > 0)
+	{
+		if (numReg > 1)
+			plhs[0] = mxCreateCharMatrixFromStrings(numReg, (const char **)listFileNames);
+		else
+			plhs[0] = mxCreateString(listFileNames[0]); 
+		plhs[1] = mxCreateCharMatrixFromStrings(numImages * numReg, (const char **)fileList); 
+	}
 	
 	///////////////////////////////////
 	// free temporary arrays for this routine
 
-	for (int i = 0; i < numLatencies; i++)
-		free(imageData[i]);
-	free(imageData);
-	
-	for (int i=0; i <numImages; i++)
-		free(fileList[i]);
-	free(fileList);
-	
-	for (int i = 0; i < dsParams.numSensors; i++)
-		free(covArray[i]);
-	free(covArray);
-	
-	for (int i = 0; i < dsParams.numSensors; i++)
-		free(icovArray[i]);
-	free(icovArray);	
+	for (int r=0; r<numReg; r++)
+		free(listFileNames[r]);
+	free(listFileNames);
 	
-	free(voxelList);
-	free(normalList);
+	freeEventRelatedArrays( numImages * numReg );
 	
 	mxFree(dsName);
+	freeDatasetList(numCovDs, covDsNames);
 	mxFree(hdmFile);
 	
 	return;
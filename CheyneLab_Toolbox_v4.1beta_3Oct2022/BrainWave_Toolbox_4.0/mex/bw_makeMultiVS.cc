@@ -0,0 +1,607 @@
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+//		bw_makeMultiVS
+//
+//		Program to make virtual sensors for a list of voxels using a minimum-variance beamformer
+//      with either optimized scalar or fixed orientation sources
+//
+//      batched version of bw_makeVS - the covariance and inverse are computed (or read from the covariance
+//      cache) once, the weights for all voxels are assembled into one [nvoxels x nsensors] matrix and
+//      applied to the sensor data with a single matrix product.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//				1.0  - first version
+//				1.1  - weights and projection use blocked BLAS engine (bfEngine.h)
+//				1.2  - added optional numThreads argument for computing weights (default = all processors)
+//				1.3  - covDsName can be a cell array of dataset names - covariance is computed for all trials combined
+//					   without writing a combined dataset (see checkCombinedDatasets() in covAccumulator.h)
+//				1.4  - voxels with no valid weights are reported as a count and their virtual sensor data is zero.
+//					   all covariance dataset names are freed
+//				1.5  - baseline window is rounded to the nearest sample with the end sample included (same as bw_makeEventRelated,
+//					   see getBaselineWindow() in bfEngine.h).  Each covariance dataset must have the same number of sensors as the dataset
+//					   Buffers are freed and an error is returned if the covariance can't be computed
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "mex.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#if defined _WIN64 || defined _WIN32
+	#include <pthread.h>//pthread library for windows, added by zhengkai
+#endif
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/BWFilter.h"
+#include "../../../ctflib/headers/sourceUtils.h"
+#include "../../../ctflib/headers/path.h"
+#include "../../../bwlib/bwlib.h"
+#include "dsCache.h"
+#include "covCache.h"
+#include "bfEngine.h"
+
+
+#define VERSION_NO 1.5
+
+double			**covArray;
+double			**icovArray;
+double			**channelData;		// [numChannels][numSamples] data read for one trial or average
+double			*sensorData;		// [numSamples x numSensors] filtered primary sensor data (column major)
+vectorCart		*voxelList;
+vectorCart		*normalList;
+double			*filterBuffer;
+ds_params		dsParams;
+
+extern "C"
+{
+
+bool	getSensorData( int numSensors, int *sensorIndex, filter_params &fparams, bf_params &bparams );
+double	**allocateArray( int rows, int cols );
+void	freeArray( double **array, int rows );
+
+void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
+{
+
+	double			*data;
+	double			*normalVec;
+	double			*time;
+
+	double			*dataPtr;
+	double			*voxelPtr;
+	double			*normalPtr;
+
+	char			*dsName;
+	char			*covDsName;
+	char			**covDsNames;
+	int				numCovDs;
+	char			*hdmFile;
+
+	int				buflen;
+	int				status;
+	char			msg[256];
+	double			*val;
+
+	int				numSamples;
+	int				numSensors;
+	int				numVecs;
+	int				numVoxels;
+	int				sensorIndex[MAX_CHANNELS];
+
+	double          highPass;
+	double          lowPass;
+	bool			bidirectional = true;
+
+	double			minTime;
+	double			maxTime;
+
+	double			wStart;
+	double			wEnd;
+
+	double			regularization = 0.0;
+
+	bool			computeRMS = false;
+	bool			useHdmFile = false;
+	bool			saveSingleTrials = false;
+	bool			useNormal = false;
+	int				numThreads = 0;		// 0 = use all processors
+
+	double			sphereX = 0.0;
+	double			sphereY = 0.0;
+	double			sphereZ = 5.0;
+
+	bf_params		bparams;
+	filter_params 	fparams;
+
+ 	/* Check for proper number of arguments */
+	int n_inputs = 18;
+	int n_outputs = 3;
+	mexPrintf("bw_makeMultiVS ver. %.1f (c) Douglas Cheyne, PhD. 2022. All rights reserved.\n", VERSION_NO);
+	if ( nlhs != n_outputs | nrhs < n_inputs)
+	{
+		mexPrintf("\nincorrect number of input or output arguments for bw_makeMultiVS  ...\n");
+		mexPrintf("\nCalling syntax:\n");
+		mexPrintf("[timeVec data computed_normals] = bw_makeMultiVS(datasetName, covDsName, hdmFileName, useHdmFile, filter, voxelList, normalList, useNormal, covWindow, \n");
+		mexPrintf("         baselineWindow, useBaselineWindow, sphere, normalize, noiseRMS, regularization, computeRMS, useReversingFilter, saveSingleTrials, {numThreads})\n");
+		mexPrintf(" \n");
+		mexPrintf("   [voxelList]  - [nvoxels x 3] array of voxel positions in cm\n");
+		mexPrintf("   [normalList] - [nvoxels x 3] array of source orientations (ignored if useNormal = 0)\n");
+		mexPrintf("   [numThreads] - number of threads used to compute weights (default = 0 = all processors)\n");
+		mexPrintf("\n returns: vector of latencies, [nsamples x nvoxels] array of virtual sensor data ([nsamples x ntrials x nvoxels] for single trials)\n");
+		mexPrintf("          and [nvoxels x 3] array of dipole orientations. \n");
+		mexPrintf("          Data for voxels where weights cannot be computed is set to zero.\n");
+		return;
+	}
+
+	///////////////////////////////////
+	// get datasest name
+  	if (mxIsChar(prhs[0]) != 1)
+		mexErrMsgTxt("Input [0] must be a string.");
+ 	if (mxGetM(prhs[0]) != 1)
+		mexErrMsgTxt("Input [0] must be a row vector.");
+   	// Get the length of the input string.
+  	buflen = (mxGetM(prhs[0]) * mxGetN(prhs[0])) + 1;
+  	dsName = (char *)mxCalloc(buflen, sizeof(char));
+  	status = mxGetString(prhs[0], dsName, buflen);  	// Copy the string into a C string
+ 	if (status != 0)
+		mexErrMsgTxt("Not enough space for dsName. String is truncated.");
+
+	///////////////////////////////////
+	// get covariance datasest name - may be same as dsName, or cell array of datasets to combine
+	numCovDs = getDatasetList(prhs[1], &covDsNames);
+	if (numCovDs < 1)
+		mexErrMsgTxt("Input [1] must be a string or cell array of strings for covariance dataset name(s).");
+	covDsName = covDsNames[0];
+
+	///////////////////////////////////
+	// get headModel file name
+  	if (mxIsChar(prhs[2]) != 1)
+		mexErrMsgTxt("Input [2] must be a string.");
+  	// Get the length of the input string.
+  	buflen = (mxGetM(prhs[2]) * mxGetN(prhs[2])) + 1;
+	if (buflen < 1)
+	{
+		sprintf(msg, "Must pass valid hdm File name.");
+		mexWarnMsgTxt(msg);
+		mxFree(dsName);
+		return;
+	}
+	else
+	{
+		hdmFile = (char *)mxCalloc(buflen, sizeof(char));
+		status = mxGetString(prhs[2], hdmFile, buflen);  	// Copy the string into a C string
+	}
+	if (status != 0)
+		mexErrMsgTxt("Not enough space for head Model filename. String is truncated.");
+
+	val = mxGetPr(prhs[3]);
+	useHdmFile = (int)*val;
+
+	if (mxGetM(prhs[4]) != 1 || mxGetN(prhs[4]) != 2)
+		mexErrMsgTxt("Input [4] must be a row vector [hipass lowpass].");
+	dataPtr = mxGetPr(prhs[4]);
+	highPass = dataPtr[0];
+	lowPass = dataPtr[1];
+
+	numVoxels = mxGetM(prhs[5]);
+	if (numVoxels < 1 || mxGetN(prhs[5]) != 3)
+		mexErrMsgTxt("Input [5] must be a [nvoxels x 3] array of voxel positions.");
+	voxelPtr = mxGetPr(prhs[5]);
+
+	val = mxGetPr(prhs[7]);
+	useNormal = (int)*val;
+
+	normalPtr = NULL;
+	if (useNormal)
+	{
+		if ((int)mxGetM(prhs[6]) != numVoxels || mxGetN(prhs[6]) != 3)
+			mexErrMsgTxt("Input [6] must be a [nvoxels x 3] array of orientations.");
+		normalPtr = mxGetPr(prhs[6]);
+	}
+
+	if (mxGetM(prhs[8]) != 1 || mxGetN(prhs[8]) != 2)
+		mexErrMsgTxt("Input [8] must be a row vector [wStart wEnd].");
+	dataPtr = mxGetPr(prhs[8]);
+	wStart = dataPtr[0];
+	wEnd = dataPtr[1];
+
+	if (mxGetM(prhs[9]) != 1 || mxGetN(prhs[9]) != 2)
+		mexErrMsgTxt("Input [9] must be a row vector [bStart bStart].");
+	dataPtr = mxGetPr(prhs[9]);
+	bparams.baselineWindowStart = dataPtr[0];
+	bparams.baselineWindowEnd = dataPtr[1];
+
+	val = mxGetPr(prhs[10]);
+	bparams.baselined = (int)*val;
+
+	if (mxGetM(prhs[11]) != 1 || mxGetN(prhs[11]) != 3)
+		mexErrMsgTxt("Input [11] must be a row vector [sphereX sphereY sphereZ].");
+	dataPtr = mxGetPr(prhs[11]);
+	sphereX = dataPtr[0];
+	sphereY = dataPtr[1];
+	sphereZ = dataPtr[2];
+
+	val = mxGetPr(prhs[12]);
+	bparams.normalized = (int)*val;
+
+	val = mxGetPr(prhs[13]);
+	bparams.noiseRMS = *val;
+
+	val = mxGetPr(prhs[14]);
+	regularization = *val;
+
+	val = mxGetPr(prhs[15]);
+	computeRMS = (int)*val;
+
+	val = mxGetPr(prhs[16]);
+	bidirectional = (int)*val;
+
+	val = mxGetPr(prhs[17]);
+	saveSingleTrials = (int)*val;
+
+	if (nrhs > 18)
+	{
+		val = mxGetPr(prhs[18]);
+		numThreads = (int)*val;
+	}
+
+	if (bparams.normalized && bparams.noiseRMS <= 0.0)
+		mexErrMsgTxt("noiseRMS must be greater than zero for normalized weights.");
+
+    if ( !readCachedResFile( covDsName, dsParams) )
+	{
+		mexPrintf("Error reading res4 file for %s/n", covDsName);
+		return;
+	}
+	minTime = dsParams.epochMinTime;
+	maxTime = dsParams.epochMaxTime;
+
+	if (wStart < minTime || wEnd > maxTime)
+	{
+		mexPrintf("Covariance window values (%g to %g seconds) exceeds data length (%g to %g seconds)\n", wStart, wEnd, minTime, maxTime);
+		return;
+	}
+
+	if ( !readCachedResFile( dsName, dsParams) )
+	{
+		mexPrintf("Error reading res4 file for %s/n", dsName);
+		return;
+	}
+
+    // reset params
+    minTime = dsParams.epochMinTime;
+	maxTime = dsParams.epochMaxTime;
+
+	numSamples = dsParams.numSamples;
+	numSensors = 0;
+	for (int k=0; k<dsParams.numChannels; k++)
+		if ( dsParams.channel[k].isSensor )
+			sensorIndex[numSensors++] = k;
+
+	if (numSensors != dsParams.numSensors)
+	{
+		mexPrintf("Error: number of primary sensors does not agree with dataset header\n");
+		return;
+	}
+
+	// covariance is indexed by the primary sensors of the dataset
+	ds_params *covParams = (ds_params *)malloc( sizeof(ds_params) );
+	if (covParams == NULL)
+		mexErrMsgTxt("memory allocation failed for covariance dataset parameters");
+	for (int j=0; j<numCovDs; j++)
+	{
+		if ( !readCachedResFile( covDsNames[j], *covParams) || covParams->numSensors != numSensors )
+		{
+			mexPrintf("Error: number of sensors in %s does not agree with %s\n", covDsNames[j], dsName);
+			free(covParams);
+			return;
+		}
+	}
+	free(covParams);
+
+	mexPrintf("dataset:  %s, (%d trials, %d samples, %d sensors, epoch time = %g to %g s)\n",
+			  dsName, dsParams.numTrials, dsParams.numSamples, dsParams.numSensors, dsParams.epochMinTime, dsParams.epochMaxTime);
+
+	// sets sphere origin(s) for each channel used by computeForwardSolution()
+	if ( !init_dsParams( dsParams, &sphereX, &sphereY, &sphereZ, hdmFile, useHdmFile) )
+	{
+		mexErrMsgTxt("Error initializing dsParams and head model\n");
+		return;
+	}
+
+	if (computeRMS)
+	{
+		bparams.type = BF_TYPE_RMS;
+		mexPrintf("Computing RMS (vector) output ...\n");
+	}
+	else if (useNormal)
+	{
+		bparams.type = BF_TYPE_FIXED;
+		mexPrintf("Using fixed orientations...\n");
+	}
+	else
+	{
+		bparams.type = BF_TYPE_OPTIMIZED;
+		mexPrintf("Computing optimized orientations...\n");
+	}
+
+	if (saveSingleTrials)
+	{
+		numVecs = dsParams.numTrials;
+		mexPrintf("creating single trial virtual sensor data for %d voxels (# trials = %d) from dataset %s (Fs = %g Samples/s, duration = %g s)\n",
+				  numVoxels, dsParams.numTrials, dsName, dsParams.sampleRate, (maxTime-minTime) );
+	}
+	else
+	{
+		numVecs = 1;
+		mexPrintf("creating average virtual sensor data for %d voxels from dataset %s (Fs = %g S/s, duration = %g s)\n",
+				  numVoxels, dsName, dsParams.sampleRate, (maxTime-minTime) );
+	}
+
+	bparams.sphereX = sphereX;
+	bparams.sphereY = sphereY;
+	bparams.sphereZ = sphereZ;
+
+	if (useHdmFile)
+		mexPrintf("Using head model file %s (mean sphere = %g %g %g)\n", hdmFile,  bparams.sphereX, bparams.sphereY, bparams.sphereZ);
+	else
+		mexPrintf("Using single sphere %g %g %g\n",  sphereX, sphereY, sphereZ);
+
+	if (bparams.baselined)
+		mexPrintf("Using baseline window for average (%g to %g s)\n",  bparams.baselineWindowStart, bparams.baselineWindowEnd);
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Allocate memory to return vs to Matlab
+	//////////////////////////////////////////////////////////////////////////////////////
+
+	plhs[0] = mxCreateDoubleMatrix(numSamples, 1, mxREAL);
+	time = mxGetPr(plhs[0]);
+
+	if (saveSingleTrials)
+	{
+		mwSize dims[3];
+		dims[0] = numSamples;
+		dims[1] = numVecs;
+		dims[2] = numVoxels;
+		plhs[1] = mxCreateNumericArray(3, dims, mxDOUBLE_CLASS, mxREAL);
+	}
+	else
+		plhs[1] = mxCreateDoubleMatrix(numSamples, numVoxels, mxREAL);
+	data = mxGetPr(plhs[1]);
+
+	plhs[2] = mxCreateDoubleMatrix(numVoxels, 3, mxREAL);
+	normalVec = mxGetPr(plhs[2]);
+
+	if (bparams.normalized)
+		mexPrintf("units = pseudoZ (noiseRMS = %g Tesla/sqrt(Hz))\n", bparams.noiseRMS);
+	else
+		mexPrintf("units = nanoAmpere-meter\n");
+
+	// setup filter
+	if ( highPass == 0 && lowPass == 0)
+	{
+		bparams.hiPass = dsParams.highPass;
+		bparams.lowPass = dsParams.lowPass;
+		fparams.hc = bparams.lowPass;			// fparams used to get name for covariance file!
+		fparams.lc = bparams.hiPass;
+		fparams.enable = false;
+		mexPrintf("**No filter specified. Using bandpass of dataset (%g to %g Hz)\n", bparams.hiPass, bparams.lowPass);
+	}
+	else
+	{
+		bparams.hiPass = highPass;
+		bparams.lowPass = lowPass;
+		fparams.enable = true;
+		if ( bparams.hiPass == 0.0 )
+			fparams.type = BW_LOWPASS;
+		else
+			fparams.type = BW_BANDPASS;
+		fparams.bidirectional = bidirectional;
+		fparams.hc = bparams.lowPass;
+		fparams.lc = bparams.hiPass;
+		fparams.fs = dsParams.sampleRate;
+		fparams.order = 4;	//
+		fparams.ncoeff = 0;				// init filter
+
+		if (build_filter (&fparams) == -1)
+		{
+			mexPrintf("Could not build filter.  Exiting\n");
+			return;
+		}
+
+		if (fparams.bidirectional)
+			mexPrintf("Applying filter from %g to %g Hz (bidirectional)\n", bparams.hiPass, bparams.lowPass);
+		else
+			mexPrintf("Applying filter from %g to %g Hz (non-bidirectional)\n", bparams.hiPass, bparams.lowPass);
+	}
+
+	// generate covariance arrays for primary sensors...
+	//
+	covArray = allocateArray( numSensors, numSensors );
+	icovArray = allocateArray( numSensors, numSensors );
+	if (covArray == NULL || icovArray == NULL)
+	{
+		mexErrMsgTxt("memory allocation failed for covariance array");
+		return;
+	}
+
+	mexPrintf("computing %d by %d covariance matrix (%g to %g Hz) for window %g %g s (reg. = %g) for beamformer weights from dataset %s\n",
+			  numSensors, numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, regularization, covDsName);
+	mexEvalString("drawnow");
+
+	// covariance and inverse are computed once for all voxels
+	if ( !getCombinedCovarianceMatrices(covArray, icovArray, numSensors, numCovDs, covDsNames, fparams, wStart, wEnd, regularization) )
+	{
+		freeArray(covArray, numSensors);
+		freeArray(icovArray, numSensors);
+		mexErrMsgTxt("Error computing covariance matrices");
+	}
+
+	channelData = allocateArray( dsParams.numChannels, numSamples );
+	sensorData = (double *)malloc( sizeof(double) * numSensors * numSamples );
+	filterBuffer = (double *)malloc( sizeof(double) * numSamples );
+	voxelList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
+	normalList = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
+	if ( channelData == NULL || sensorData == NULL || filterBuffer == NULL || voxelList == NULL || normalList == NULL )
+	{
+		mexErrMsgTxt( "memory allocation failed for virtual sensor arrays" );
+		return;
+	}
+
+	for (int v=0; v<numVoxels; v++)
+	{
+		voxelList[v].x = voxelPtr[v];
+		voxelList[v].y = voxelPtr[v + numVoxels];
+		voxelList[v].z = voxelPtr[v + numVoxels * 2];
+
+		normalList[v].x = normalList[v].y = normalList[v].z = 0.0;
+		if (useNormal)
+		{
+			normalList[v].x = normalPtr[v];
+			normalList[v].y = normalPtr[v + numVoxels];
+			normalList[v].z = normalPtr[v + numVoxels * 2];
+		}
+	}
+
+	// weights for all voxels are computed once as a single tile
+	bf_engine	engine;
+	thread_pool	pool;
+	createThreadPool( pool, numThreads );
+	if ( !initBeamformerEngine( engine, dsParams, icovArray, bparams, numVoxels, &pool ) )
+	{
+		destroyThreadPool( pool );
+		return;
+	}
+
+	computeTileWeights( engine, dsParams, voxelList, normalList, numVoxels );
+
+	// projection is one BLAS call per trial - pool no longer needed
+	destroyThreadPool( pool );
+	engine.pool = NULL;
+
+	// voxels with no valid weights have zero weights and virtual sensor data
+	int numInvalid = 0;
+	for (int v=0; v<numVoxels; v++)
+	{
+		if ( !engine.valid[v] )
+			numInvalid++;
+		normalVec[v] = normalList[v].x;
+		normalVec[v + numVoxels] = normalList[v].y;
+		normalVec[v + numVoxels * 2] = normalList[v].z;
+	}
+	if (numInvalid > 0)
+		mexPrintf("could not compute weights for %d of %d voxels (virtual sensor data set to zero)\n", numInvalid, numVoxels);
+
+	// generate VS for all voxels ...
+	for (int trial=0; trial<numVecs; trial++)
+	{
+		ds_params	tParams = dsParams;		// read functions may modify params
+
+		if (saveSingleTrials)
+		{
+			if ( !readMEGTrialData( dsName, tParams, channelData, trial, dsParams.gradientOrder, false) )
+			{
+				mexPrintf("Error reading .meg4 file\n");
+				return;
+			}
+		}
+		else
+		{
+			if ( !readMEGDataAverage( dsName, tParams, channelData, -1, 0) )
+			{
+				mexPrintf("Error returned from readMEGDataAverage...\n");
+				return;
+			}
+		}
+
+		if ( !getSensorData( numSensors, sensorIndex, fparams, bparams) )
+		{
+			mexPrintf("Error *** invalid baseline parameters ***\n");
+			return;
+		}
+
+		// data is [numSamples x numTrials x numVoxels]
+		if ( !projectTile( engine, numVoxels, sensorData, numSamples, false, data + (size_t)trial * numSamples, (size_t)numSamples * numVecs ) )
+			return;
+	}
+
+	for (int i=0; i<numSamples; i++)
+		time[i] = double(i-dsParams.numPreTrig)/dsParams.sampleRate;
+
+	// free memory
+	freeArray(covArray, numSensors);
+	freeArray(icovArray, numSensors);
+	freeArray(channelData, dsParams.numChannels);
+	free(sensorData);
+	free(filterBuffer);
+	free(voxelList);
+	free(normalList);
+	freeBeamformerEngine(engine);
+
+	mxFree(dsName);
+	freeDatasetList(numCovDs, covDsNames);
+	mxFree(hdmFile);
+
+	return;
+
+}
+
+// copy primary sensor channels from channelData to sensorData with filtering and baseline removal
+bool getSensorData( int numSensors, int *sensorIndex, filter_params &fparams, bf_params &bparams )
+{
+	int numSamples = dsParams.numSamples;
+	int bstart;
+	int bend;
+
+	if ( !getBaselineWindow( dsParams, bparams, bstart, bend ) )
+		return (false);
+
+	for (int k=0; k<numSensors; k++)
+	{
+		double *src = channelData[ sensorIndex[k] ];
+		double *dest = sensorData + (size_t)k * numSamples;
+
+		if (fparams.enable)
+			applyFilter( src, dest, numSamples, &fparams);
+		else
+			memcpy( dest, src, sizeof(double) * numSamples );
+
+		if (bparams.baselined)
+		{
+			double mean = 0.0;
+			for (int j=bstart; j<bend; j++)
+				mean += dest[j];
+			mean /= (double)(bend - bstart);
+			for (int j=0; j<numSamples; j++)
+				dest[j] -= mean;
+		}
+	}
+
+	return (true);
+}
+
+double **allocateArray( int rows, int cols )
+{
+	double **array = (double **)malloc( sizeof(double *) * rows );
+	if (array == NULL)
+		return (NULL);
+	for (int i = 0; i < rows; i++)
+	{
+		array[i] = (double *)malloc( sizeof(double) * cols );
+		if ( array[i] == NULL)
+			return (NULL);
+	}
+	return (array);
+}
+
+void freeArray( double **array, int rows )
+{
+	for (int i = 0; i < rows; i++)
+		free(array[i]);
+	free(array);
+}
+
+}
@@ -16,6 +16,17 @@
 //				2.4  - recompiled with library revisions (Nov, 2010)
 //				2.5  - recompiled with separate ctflib and bwlib
 //				2.6  - added flag for bidirectional filter and covDsName
+//				2.7  - dataset params are cached between calls (see dsCache.h)
+//				2.8  - covariance matrices are cached in covDs ANALYSIS directory (see covCache.h)
+//				2.9  - regularization can be a vector of values - VS for all values are returned as
+//					   [numSamples x numTrials x numReg]
+//				3.0  - covDsName can be a cell array of dataset names - covariance is computed for all trials combined
+//					   without writing a combined dataset (see checkCombinedDatasets() in covAccumulator.h)
+//				3.1  - regularization sweep reads the unregularized covariance once and inverts it for each value in the same
+//					   way as computeCovarianceMatrices() (see invertCovarianceMatrix() in covCache.h) so reg = [r] and
+//					   reg = r return the same VS.  Each value is a full inversion and computeVS() is rerun for each value.
+//				3.2  - sweep gets the covariance without inverting it (see getCombinedCovariance() in covCache.h).  Buffers are
+//					   freed and an error is returned if the covariance can't be computed or inverted
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include "mex.h"
@@ -33,15 +44,30 @@
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/path.h"
 #include "../../../bwlib/bwlib.h"
+#include "dsCache.h"
+#include "covCache.h"
 
 
-#define VERSION_NO 2.6
+#define VERSION_NO 3.2
 
 double			**vsData; 
 double			**covArray;
 double			**icovArray;
 ds_params		dsParams;
 
+// free covariance and VS buffers before returning an error (numVecs = 0 if vsData is not allocated yet)
+static void freeVSArrays( int numSensors, int numVecs )
+{
+	freeCovarianceArrays( covArray, icovArray, numSensors );
+	covArray = NULL;
+	icovArray = NULL;
+	for (int i=0; i<numVecs; i++)
+		free(vsData[i]);
+	if (numVecs > 0)
+		free(vsData);
+	vsData = NULL;
+}
+
 extern "C" 
 {
 void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
@@ -55,6 +81,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	
 	char			*dsName;
 	char			*covDsName;
+	char			**covDsNames;
+	int				numCovDs;
 	char			*hdmFile;
 	
 	int				buflen;
@@ -81,6 +109,8 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	double			wEnd;
 	
 	double			regularization = 0.0;
+	double			*regList;
+	int				numReg = 1;
 	
 	bool			computeRMS = false;
 	bool			useHdmFile = false;
@@ -113,6 +143,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexPrintf("[timeVec data computed_normal] = bw_makeVS(datasetName, covDsName, hdmFileName, useHdmFile, filter, voxel, normal, useNormal, covWindow, \n");
 		mexPrintf("         baselineWindow, useBaselineWindow, sphere, normalize, noiseRMS, regularization, computeRMS, useReversingFilter, saveSingleTrials)\n");
 		mexPrintf(" \n");
+		mexPrintf(" regularization can be a vector of values to compute the virtual sensor for each value (returned as [numSamples x numTrials x numReg]).\n");
 		mexPrintf("\n returns: vectors of latencies and values at each latency and the  dipole orientation. \n");
 		return;
 	}
@@ -131,17 +162,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		mexErrMsgTxt("Not enough space for dsName. String is truncated.");
 			
 	///////////////////////////////////
-	// get covariance datasest name - may be same as dsName
-  	if (mxIsChar(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a string for covariance dataset name.");
- 	if (mxGetM(prhs[1]) != 1)
-		mexErrMsgTxt("Input [1] must be a row vector.");
-   	// Get the length of the input string.
-  	buflen = (mxGetM(prhs[1]) * mxGetN(prhs[1])) + 1;
-  	covDsName = (char *)mxCalloc(buflen, sizeof(char));
-  	status = mxGetString(prhs[1], covDsName, buflen);  	// Copy the string into a C string
- 	if (status != 0)
-		mexWarnMsgTxt("Not enough space for covDsName. String is truncated.");
+	// get covariance datasest name - may be same as dsName, or cell array of datasets to combine
+	numCovDs = getDatasetList(prhs[1], &covDsNames);
+	if (numCovDs < 1)
+		mexErrMsgTxt("Input [1] must be a string or cell array of strings for covariance dataset name(s).");
+	covDsName = covDsNames[0];
 	
 	///////////////////////////////////
 	// get headModel file name 
@@ -218,8 +243,11 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	val = mxGetPr(prhs[13]);
 	bparams.noiseRMS = *val;
 
-	val = mxGetPr(prhs[14]);
-	regularization = *val;
+	numReg = (int)mxGetNumberOfElements(prhs[14]);
+	if (numReg < 1)
+		mexErrMsgTxt("Input [14] must be a regularization value or vector of values.");
+	regList = mxGetPr(prhs[14]);
+	regularization = regList[0];
 
 	val = mxGetPr(prhs[15]);
 	computeRMS = (int)*val;
@@ -234,7 +262,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
     // ** new - check covariance data file for data range error
     // ** also add check that sensor number agrees
     
-    if ( !readMEGResFile( covDsName, dsParams) )
+    if ( !readCachedResFile( covDsName, dsParams) )
 	{
 		mexPrintf("Error reading res4 file for %s/n", covDsName);
 		return;
@@ -253,7 +281,7 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	}
     
     
-	if ( !readMEGResFile( dsName, dsParams) )
+	if ( !readCachedResFile( dsName, dsParams) )
 	{
 		mexPrintf("Error reading res4 file for %s/n", dsName);
 		return;
@@ -332,10 +360,19 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 	plhs[0] = mxCreateDoubleMatrix(numSamples, 1, mxREAL); 
 	time = mxGetPr(plhs[0]);
 	
-	plhs[1] = mxCreateDoubleMatrix(numSamples, numVecs, mxREAL); 
+	if (numReg > 1)
+	{
+		mwSize dims[3];
+		dims[0] = numSamples;
+		dims[1] = numVecs;
+		dims[2] = numReg;
+		plhs[1] = mxCreateNumericArray(3, dims, mxDOUBLE_CLASS, mxREAL);
+	}
+	else
+		plhs[1] = mxCreateDoubleMatrix(numSamples, numVecs, mxREAL); 
 	data = mxGetPr(plhs[1]);
 
-	plhs[2] = mxCreateDoubleMatrix(3, 1, mxREAL); 
+	plhs[2] = mxCreateDoubleMatrix(3, numReg, mxREAL); 
 	normalVec = mxGetPr(plhs[2]);
 		
 	if (bparams.normalized)
@@ -414,10 +451,27 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		}
 	}
 	
-	mexPrintf("computing %d by %d covariance matrix (%g to %g Hz) for window %g %g s (reg. = %g) for beamformer weights from dataset %s\n",
-			  numSensors, numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, regularization, covDsName);
-		
-	computeCovarianceMatrices(covArray, icovArray, numSensors, covDsName, fparams, wStart, wEnd, wStart, wEnd, false, regularization);
+	if (numReg > 1)
+	{
+		// regularization sweep - read unregularized covariance once and invert for each value
+		mexPrintf("computing %d by %d covariance matrix (%g to %g Hz) for window %g %g s for %d regularization values for beamformer weights from dataset %s\n",
+				  numSensors, numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, numReg, covDsName);
+		if ( !getCombinedCovariance(covArray, numSensors, numCovDs, covDsNames, fparams, wStart, wEnd) )
+		{
+			freeVSArrays( numSensors, 0 );
+			mexErrMsgTxt("Error computing covariance matrix");
+		}
+	}
+	else
+	{
+		mexPrintf("computing %d by %d covariance matrix (%g to %g Hz) for window %g %g s (reg. = %g) for beamformer weights from dataset %s\n",
+				  numSensors, numSensors, bparams.hiPass, bparams.lowPass, wStart, wEnd, regularization, covDsName);
+		if ( !getCombinedCovarianceMatrices(covArray, icovArray, numSensors, numCovDs, covDsNames, fparams, wStart, wEnd, regularization) )
+		{
+			freeVSArrays( numSensors, 0 );
+			mexErrMsgTxt("Error computing covariance matrices");
+		}
+	}
 
 	vsData = (double **)malloc( sizeof(double *) * numVecs );
 	if (vsData == NULL)
@@ -435,50 +489,56 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray*prhs[] )
 		}
 	}	
 	
-	// generate a VS ...
-	//
-	if (bparams.type == BF_TYPE_FIXED)
-		mexPrintf("creating virtual sensor at location (x=%g y=%g z=%g) with fixed orientation = %.4f %.4f %.4f\n", x, y, z, xo, yo, zo);
-	else if (bparams.type == BF_TYPE_RMS)
-		mexPrintf("creating RMS output of vector virtual sensor at location (x=%g y=%g z=%g)\n", x, y, z);
-	else
-		mexPrintf("creating virtual sensor at location (x=%g y=%g z=%g) with optimized orientation ...", x, y, z);
-
-	computeVS(vsData, dsName, dsParams, fparams, bparams, covArray, icovArray, x, y, z, &xo, &yo, &zo, saveSingleTrials);
-
-	if (bparams.type == BF_TYPE_OPTIMIZED)
-		mexPrintf(" Computed orientation = %.4f %.4f %.4f\n", xo, yo, zo);
-	
 	for (int i=0; i<dsParams.numSamples; i++)
 		time[i] = double(i-dsParams.numPreTrig)/dsParams.sampleRate;
 	
 	int idx = 0;
 	
-	for (int j=0; j<numVecs; j++)
-		for (int i=0; i<dsParams.numSamples; i++)
-			data[idx++] = vsData[j][i];
-		
+	for (int r=0; r<numReg; r++)
+	{
+		if (numReg > 1)
+		{
+			regularization = regList[r];
+			mexPrintf("regularization = %g\n", regularization);
+			if ( !invertCovarianceMatrix( covArray, icovArray, numSensors, regularization ) )
+			{
+				freeVSArrays( numSensors, numVecs );
+				mexErrMsgTxt("Error inverting covariance matrix");
+			}
+		}
+
+		// generate a VS ...
+		//
+		if (bparams.type == BF_TYPE_FIXED)
+			mexPrintf("creating virtual sensor at location (x=%g y=%g z=%g) with fixed orientation = %.4f %.4f %.4f\n", x, y, z, xo, yo, zo);
+		else if (bparams.type == BF_TYPE_RMS)
+			mexPrintf("creating RMS output of vector virtual sensor at location (x=%g y=%g z=%g)\n", x, y, z);
+		else
+			mexPrintf("creating virtual sensor at location (x=%g y=%g z=%g) with optimized orientation ...", x, y, z);
+
+		computeVS(vsData, dsName, dsParams, fparams, bparams, covArray, icovArray, x, y, z, &xo, &yo, &zo, saveSingleTrials);
+
+		if (bparams.type == BF_TYPE_OPTIMIZED)
+			mexPrintf(" Computed orientation = %.4f %.4f %.4f\n", xo, yo, zo);
 	
-	// return optimized orientation vector
-	normalVec[0] = xo;
-	normalVec[1] = yo;
-	normalVec[2] = zo;
+		for (int j=0; j<numVecs; j++)
+			for (int i=0; i<dsParams.numSamples; i++)
+				data[idx++] = vsData[j][i];
+	
+		// return optimized orientation vector
+		normalVec[r*3] = xo;
+		normalVec[r*3+1] = yo;
+		normalVec[r*3+2] = zo;
+	}
 	
 	// free memory
-	for (int i = 0; i < numSensors; i++)
-		free(covArray[i]);
-	free(covArray);
-	for (int i = 0; i < numSensors; i++)
-		free(icovArray[i]);
-	free(icovArray);
-	for (int i = 0; i < numVecs; i++)
-		free(vsData[i]);
-	free(vsData);
+	freeVSArrays( numSensors, numVecs );
 	
 	
 	///////////////////////////////////
 	// free temporary arrays for this routine
 	mxFree(dsName);
+	freeDatasetList(numCovDs, covDsNames);
 	mxFree(hdmFile);
 	
 	return;
@@ -0,0 +1,478 @@
+// *************************************
+// covAccumulator.h
+//
+// single pass covariance for any number of time windows.
+//
+// Each trial of the dataset is read and filtered once and the sums of products of the data in every window
+// are accumulated from the same filtered trial, so the covariance for an active window, a baseline window, their
+// combination, or a list of sliding windows costs a single read of the dataset.  The mean of each window is
+// removed for each trial and sums are accumulated with one BLAS-3 (dsyrk) update per window per trial.
+// Windows may overlap.
+//
+// Window samples and the covariance are defined as in getSensorCovariance() in bwlib, which is used by
+// computeCovarianceMatrices() and computeDifferential(): a window from t1 to t2 s is samples numPreTrig + (int)(t1 * sampleRate)
+// to numPreTrig + (int)(t2 * sampleRate) inclusive, and the covariance is the mean over trials of the covariance of each
+// trial (window mean removed, divided by the window length) - i.e., the sums of products divided by the number of samples summed.
+// The covariance of two or more windows combined is the mean of their covariances (see getMeanCovariance), as for
+// the active and baseline windows in computeDifferential().
+//
+// Sliding windows (a window of the same length as the previous window in the list that starts later but overlaps it)
+// are updated incrementally - the products of the samples leaving the window are subtracted from and the samples
+// entering the window added to running sums, and the window mean is removed from the sums, so each step costs
+// the number of samples stepped rather than the window length.
+//
+// A filter bank (accumulateCovarianceBank) reads each trial once and passes it through each band filter into a
+// separate accumulator, so covariance for several frequency bands also costs a single read of the dataset.
+//
+// A list of datasets (accumulateCovarianceDatasets) is treated as one combined dataset containing the trials of
+// all of them, as if concatenated with bw_combineDs, without writing the combined dataset to disk.  The datasets
+// must pass the same checks as bw_combineDs (checkCombinedDatasets) and all are read with the gradient order
+// of the first dataset.
+//
+// Covariance matrices are returned as [numSensors x numSensors] column major arrays.
+//
+// uses BLAS from Matlab (libmwblas) - add -lmwblas to mex link line.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - incremental update of sliding windows
+//		1.2  - added filter bank (accumulateCovarianceBank)
+//		1.3  - added combined covariance for list of datasets (accumulateCovarianceDatasets)
+//		1.4  - window samples (truncated, not rounded) and covariance (divided by number of samples, not samples - 1) are
+//			   the same as getSensorCovariance() in bwlib.  Combined windows are the mean of the window covariances
+//			   (getMeanCovariance) instead of the pooled covariance
+//
+// ************************************
+
+#ifndef COVACCUMULATOR_H
+#define COVACCUMULATOR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mex.h"
+#include "blas.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/BWFilter.h"
+
+typedef struct cov_accumulator
+{
+	int			numSensors;
+	int			numWindows;
+	int			*windowStart;		// first sample of window
+	int			*windowEnd;			// last sample of window + 1
+	double		**sums;				// [numWindows] sums of products [numSensors x numSensors] (upper triangle)
+	long long	*numPoints;			// samples summed for each window
+	int			maxLength;
+	double		*segment;			// [maxLength x numSensors] data (minus ref) for one window or step
+	double		*raw;				// [numSensors x numSensors] sums of products of current window (upper triangle)
+	double		*colSum;			// [numSensors] sums of current window
+	double		*ref;				// [numSensors] offset removed from data before sums (mean of first window of slide)
+} cov_accumulator;
+
+
+static void freeCovAccumulator( cov_accumulator &acc )
+{
+	for (int w=0; acc.sums != NULL && w<acc.numWindows; w++)
+		free(acc.sums[w]);
+	free(acc.sums);
+	free(acc.windowStart);
+	free(acc.windowEnd);
+	free(acc.numPoints);
+	free(acc.segment);
+	free(acc.raw);
+	free(acc.colSum);
+	free(acc.ref);
+	memset( &acc, 0, sizeof(cov_accumulator) );
+}
+
+// windows are in seconds relative to trial onset (inclusive) - samples are the same as getSensorCovariance() in bwlib
+static bool initCovAccumulator( cov_accumulator &acc, ds_params &params, int numWindows, double *windowStartTime, double *windowEndTime )
+{
+	int n = params.numSensors;
+
+	memset( &acc, 0, sizeof(cov_accumulator) );
+	acc.numSensors = n;
+	acc.numWindows = numWindows;
+	acc.windowStart = (int *)malloc( sizeof(int) * numWindows );
+	acc.windowEnd = (int *)malloc( sizeof(int) * numWindows );
+	acc.numPoints = (long long *)calloc( numWindows, sizeof(long long) );
+	acc.sums = (double **)calloc( numWindows, sizeof(double *) );
+	if ( acc.windowStart == NULL || acc.windowEnd == NULL || acc.numPoints == NULL || acc.sums == NULL )
+	{
+		mexPrintf("memory allocation failed for covariance accumulator\n");
+		freeCovAccumulator(acc);
+		return (false);
+	}
+
+	for (int w=0; w<numWindows; w++)
+	{
+		acc.windowStart[w] = params.numPreTrig + (int)( windowStartTime[w] * params.sampleRate );
+		acc.windowEnd[w] = params.numPreTrig + (int)( windowEndTime[w] * params.sampleRate ) + 1;
+		if ( acc.windowStart[w] < 0 || acc.windowEnd[w] > params.numSamples || acc.windowEnd[w] - acc.windowStart[w] < 2 )
+		{
+			mexPrintf("covariance window %g to %g s is outside of data range or too short\n", windowStartTime[w], windowEndTime[w]);
+			freeCovAccumulator(acc);
+			return (false);
+		}
+		if ( acc.windowEnd[w] - acc.windowStart[w] > acc.maxLength )
+			acc.maxLength = acc.windowEnd[w] - acc.windowStart[w];
+
+		acc.sums[w] = (double *)calloc( (size_t)n * n, sizeof(double) );
+		if ( acc.sums[w] == NULL )
+		{
+			mexPrintf("memory allocation failed for covariance accumulator\n");
+			freeCovAccumulator(acc);
+			return (false);
+		}
+	}
+
+	acc.segment = (double *)malloc( sizeof(double) * acc.maxLength * n );
+	acc.raw = (double *)malloc( sizeof(double) * n * n );
+	acc.colSum = (double *)malloc( sizeof(double) * n );
+	acc.ref = (double *)malloc( sizeof(double) * n );
+	if ( acc.segment == NULL || acc.raw == NULL || acc.colSum == NULL || acc.ref == NULL )
+	{
+		mexPrintf("memory allocation failed for covariance accumulator\n");
+		freeCovAccumulator(acc);
+		return (false);
+	}
+
+	return (true);
+}
+
+// true if window w slides from window w-1 (same length, later start, overlapping)
+static bool isSlidingWindow( cov_accumulator &acc, int w )
+{
+	if (w == 0)
+		return (false);
+	return ( acc.windowEnd[w] - acc.windowStart[w] == acc.windowEnd[w-1] - acc.windowStart[w-1] &&
+			acc.windowStart[w] > acc.windowStart[w-1] && acc.windowStart[w] < acc.windowEnd[w-1] );
+}
+
+// raw += alpha * X' X and colSum += alpha * sum(X) for samples start to end-1, where X = data - ref
+static void addRawProducts( cov_accumulator &acc, double **sensorData, int start, int end, double alpha )
+{
+	int n = acc.numSensors;
+	int len = end - start;
+
+	for (int k=0; k<n; k++)
+	{
+		double *src = sensorData[k] + start;
+		double *dest = acc.segment + (size_t)k * len;
+		double sum = 0.0;
+		for (int i=0; i<len; i++)
+		{
+			dest[i] = src[i] - acc.ref[k];
+			sum += dest[i];
+		}
+		acc.colSum[k] += alpha * sum;
+	}
+
+	char		uplo = 'U';
+	char		trans = 'T';
+	double		one = 1.0;
+	ptrdiff_t	m = n;
+	ptrdiff_t	k = len;
+	dsyrk( &uplo, &trans, &m, &k, &alpha, acc.segment, &k, &one, acc.raw, &m );
+}
+
+// add one trial - sensorData[k] is the (filtered) data for the k-th primary sensor
+static void addTrialToCovAccumulator( cov_accumulator &acc, double **sensorData )
+{
+	int n = acc.numSensors;
+
+	for (int w=0; w<acc.numWindows; w++)
+	{
+		int len = acc.windowEnd[w] - acc.windowStart[w];
+
+		if ( isSlidingWindow( acc, w ) )
+		{
+			// drop samples that left window, add samples that entered
+			addRawProducts( acc, sensorData, acc.windowStart[w-1], acc.windowStart[w], -1.0 );
+			addRawProducts( acc, sensorData, acc.windowEnd[w-1], acc.windowEnd[w], 1.0 );
+		}
+		else
+		{
+			for (int k=0; k<n; k++)
+			{
+				double mean = 0.0;
+				for (int i=acc.windowStart[w]; i<acc.windowEnd[w]; i++)
+					mean += sensorData[k][i];
+				acc.ref[k] = mean / (double)len;
+				acc.colSum[k] = 0.0;
+			}
+			memset( acc.raw, 0, sizeof(double) * n * n );
+			addRawProducts( acc, sensorData, acc.windowStart[w], acc.windowEnd[w], 1.0 );
+		}
+
+		// sums += sum (x - mean)(x - mean)' = raw - colSum colSum' / len
+		for (int j=0; j<n; j++)
+			for (int i=0; i<=j; i++)
+				acc.sums[w][i + j * n] += acc.raw[i + j * n] - acc.colSum[i] * acc.colSum[j] / (double)len;
+
+		acc.numPoints[w] += len;
+	}
+}
+
+// dataset name or cell array of dataset names (combined dataset) from mex input arg.  Returns number of datasets
+// (0 if arg is neither) - names are allocated with mxCalloc
+static int getDatasetList( const mxArray *arg, char ***dsNames )
+{
+	int numDs;
+
+	if ( mxIsChar(arg) )
+		numDs = 1;
+	else if ( mxIsCell(arg) )
+		numDs = mxGetNumberOfElements(arg);
+	else
+		return (0);
+	if (numDs < 1)
+		return (0);
+
+	*dsNames = (char **)mxCalloc(numDs, sizeof(char *));
+	for (int i=0; i<numDs; i++)
+	{
+		const mxArray *element = mxIsCell(arg) ? mxGetCell(arg, i) : arg;
+		if ( element == NULL || !mxIsChar(element) )
+			return (0);
+		int buflen = (mxGetM(element) * mxGetN(element)) + 1;
+		(*dsNames)[i] = (char *)mxCalloc(buflen, sizeof(char));
+		if ( mxGetString(element, (*dsNames)[i], buflen) != 0 )
+			return (0);
+	}
+
+	return (numDs);
+}
+
+// free list of dataset names returned by getDatasetList
+static void freeDatasetList( int numDs, char **dsNames )
+{
+	if ( dsNames == NULL )
+		return;
+	for (int i=0; i<numDs; i++)
+	{
+		if ( dsNames[i] != NULL )
+			mxFree( dsNames[i] );
+	}
+	mxFree( dsNames );
+}
+
+// check that list of datasets can be combined (as in bw_combineDs) and return params of the first dataset
+// with the total number of trials in params.  A single dataset is just read.
+static bool checkCombinedDatasets( int numDs, char **dsNames, ds_params &params )
+{
+	ds_params *tempParams = (ds_params *)malloc( sizeof(ds_params) );
+	if ( tempParams == NULL )
+	{
+		mexPrintf("memory allocation failed for dataset parameters\n");
+		return (false);
+	}
+
+	int totalTrials = 0;
+	double rms = 0.0;
+	bool valid = true;
+	for (int i=0; valid && i<numDs; i++)
+	{
+		if ( !readMEGResFile( dsNames[i], *tempParams ) )
+		{
+			mexPrintf("Error reading res4 file for dataset %s\n", dsNames[i]);
+			valid = false;
+			break;
+		}
+		totalTrials += tempParams->numTrials;
+
+		if (i == 0)
+		{
+			params = *tempParams;
+			continue;
+		}
+
+		// other datasets have to match
+		if (params.numChannels != tempParams->numChannels ||
+			params.numSamples != tempParams->numSamples ||
+			params.sampleRate != tempParams->sampleRate ||
+			params.numPreTrig != tempParams->numPreTrig)
+		{
+			mexPrintf("*** Cannot combine datasets --> collection parameters for dataset %s do match dataset %s\n", dsNames[i-1], dsNames[i]);
+			valid = false;
+			break;
+		}
+
+		// check channel name match and total sensor position differences
+		double temp_rms = 0.0;
+		for (int k=0; k<params.numChannels; k++)
+		{
+			if (strcmp(params.channel[k].name, tempParams->channel[k].name) != 0)
+			{
+				mexPrintf("*** Cannot combine datasets --> channel names do not match for dataset %s and dataset %s\n", dsNames[i-1], dsNames[i]);
+				valid = false;
+				break;
+			}
+			if (params.channel[k].isSensor)
+			{
+				double dx = (params.channel[k].xpos - tempParams->channel[k].xpos);
+				double dy = (params.channel[k].ypos - tempParams->channel[k].ypos);
+				double dz = (params.channel[k].zpos - tempParams->channel[k].zpos);
+				temp_rms += sqrt( (dx*dx) + (dy * dy) + (dz * dz) );
+			}
+		}
+		rms += temp_rms / params.numSensors;
+
+		if (tempParams->gradientOrder != params.gradientOrder)
+			mexPrintf("\n*** Warning: Converting gradient order of dataset %s (g=%d) to match gradient of dataset %s (g=%d) ***\n\n",
+					  dsNames[i], tempParams->gradientOrder, dsNames[0], params.gradientOrder);
+	}
+	free(tempParams);
+
+	if ( !valid )
+		return (false);
+
+	if (numDs > 1)
+	{
+		mexPrintf("combining %d datasets (%d trials) for covariance\n", numDs, totalTrials);
+		mexPrintf("--> Total RMS difference in sensor positions across all datasets is: %.2f cm\n", rms / numDs);
+	}
+	params.numTrials = totalTrials;
+
+	return (true);
+}
+
+// read every trial of each dataset in dsNames once and accumulate all windows for each of numBands filters - accs[b]
+// is filtered with fparams[b]. params are for the first dataset (see checkCombinedDatasets) and all datasets are
+// read with its gradient order.
+static bool accumulateCovarianceDatasets( cov_accumulator *accs, int numBands, int numDs, char **dsNames, ds_params &params,
+										 filter_params *fparams )
+{
+	double		**trialData;
+	double		**sensorData;
+	int			sensorIndex[MAX_CHANNELS];
+
+	int numSensors = 0;
+	for (int k=0; k<params.numChannels; k++)
+		if ( params.channel[k].isSensor )
+			sensorIndex[numSensors++] = k;
+	for (int b=0; b<numBands; b++)
+	{
+		if (numSensors != accs[b].numSensors)
+		{
+			mexPrintf("number of primary sensors in %s does not agree with covariance\n", dsNames[0]);
+			return (false);
+		}
+	}
+
+	ds_params *dParams = (ds_params *)malloc( sizeof(ds_params) );
+	trialData = (double **)calloc( params.numChannels, sizeof(double *) );
+	sensorData = (double **)calloc( numSensors, sizeof(double *) );
+	bool valid = ( dParams != NULL && trialData != NULL && sensorData != NULL );
+	for (int k=0; valid && k<params.numChannels; k++)
+		if ( ( trialData[k] = (double *)malloc( sizeof(double) * params.numSamples ) ) == NULL )
+			valid = false;
+	for (int k=0; valid && k<numSensors; k++)
+		if ( ( sensorData[k] = (double *)malloc( sizeof(double) * params.numSamples ) ) == NULL )
+			valid = false;
+	if ( !valid )
+		mexPrintf("memory allocation failed for covariance data\n");
+
+	for (int d=0; valid && d<numDs; d++)
+	{
+		if (numDs == 1)
+			*dParams = params;
+		else if ( !readMEGResFile( dsNames[d], *dParams ) )
+		{
+			mexPrintf("Error reading res4 file for dataset %s\n", dsNames[d]);
+			valid = false;
+			break;
+		}
+		int numTrials = dParams->numTrials;
+
+		for (int trial=0; trial<numTrials; trial++)
+		{
+			if ( !readMEGTrialData( dsNames[d], *dParams, trialData, trial, params.gradientOrder, false) )
+			{
+				mexPrintf("Error reading .meg4 file for %s\n", dsNames[d]);
+				valid = false;
+				break;
+			}
+			for (int b=0; b<numBands; b++)
+			{
+				for (int k=0; k<numSensors; k++)
+				{
+					if (fparams[b].enable)
+						applyFilter( trialData[sensorIndex[k]], sensorData[k], params.numSamples, &fparams[b]);
+					else
+						memcpy( sensorData[k], trialData[sensorIndex[k]], sizeof(double) * params.numSamples );
+				}
+				addTrialToCovAccumulator( accs[b], sensorData );
+			}
+		}
+	}
+
+	for (int k=0; trialData != NULL && k<params.numChannels; k++)
+		free(trialData[k]);
+	free(trialData);
+	for (int k=0; sensorData != NULL && k<numSensors; k++)
+		free(sensorData[k]);
+	free(sensorData);
+	free(dParams);
+
+	return (valid);
+}
+
+// read every trial of dsName once and accumulate all windows for each of numBands filters - accs[b] is
+// filtered with fparams[b].  All accumulators must be for the same dataset.
+static bool accumulateCovarianceBank( cov_accumulator *accs, int numBands, char *dsName, ds_params &params, filter_params *fparams )
+{
+	return ( accumulateCovarianceDatasets( accs, numBands, 1, &dsName, params, fparams ) );
+}
+
+// read and filter every trial of dsName once and accumulate all windows
+static bool accumulateCovariance( cov_accumulator &acc, char *dsName, ds_params &params, filter_params &fparams )
+{
+	return ( accumulateCovarianceBank( &acc, 1, dsName, params, &fparams ) );
+}
+
+// mean of the covariance of one or more windows (from one or more accumulators) - cov is [numSensors x numSensors].
+// The covariance of each window is its sums of products divided by the number of samples summed (see getSensorCovariance()
+// in bwlib)
+static bool getMeanCovariance( double *cov, int numTerms, cov_accumulator **accs, int *windows )
+{
+	int n = accs[0]->numSensors;
+
+	if (numTerms < 1)
+		return (false);
+
+	memset( cov, 0, sizeof(double) * n * n );
+	for (int t=0; t<numTerms; t++)
+	{
+		cov_accumulator *acc = accs[t];
+		if ( acc->numSensors != n || acc->numPoints[windows[t]] < 1 )
+			return (false);
+		double scale = 1.0 / ( (double)acc->numPoints[windows[t]] * numTerms );
+		for (int j=0; j<n; j++)
+			for (int i=0; i<=j; i++)
+				cov[i + j * n] += acc->sums[windows[t]][i + j * n] * scale;
+	}
+
+	for (int j=0; j<n; j++)
+		for (int i=0; i<j; i++)
+			cov[j + i * n] = cov[i + j * n];
+
+	return (true);
+}
+
+// covariance of a single window
+static bool getWindowCovariance( double *cov, cov_accumulator &acc, int window )
+{
+	cov_accumulator	*accs[1];
+	int				windows[1];
+
+	accs[0] = &acc;
+	windows[0] = window;
+	return ( getMeanCovariance( cov, 1, accs, windows ) );
+}
+
+#endif
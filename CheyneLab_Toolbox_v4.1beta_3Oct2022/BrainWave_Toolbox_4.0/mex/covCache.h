@@ -0,0 +1,290 @@
+// *************************************
+// covCache.h
+//
+// on-disk cache of beamformer covariance and inverse covariance matrices.
+//
+// The covariance used for beamformer weights depends only on the covariance dataset, filter settings, covariance
+// window and regularization.  getCachedCovarianceMatrices() looks for a cache file with these settings in the
+// ANALYSIS directory of the covariance dataset and only calls computeCovarianceMatrices() if no valid file exists,
+// in which case the result is saved for the next call.
+//
+// Cache files are named by their settings (e.g., covDs.ds/ANALYSIS/cov_1-30Hz_-0.5_1.5s_reg0_bi.bwcov) and
+// the header stores the full key including the modification time and size of the .res4 file and of each .meg4
+// segment (see getDsStamp() in dsCache.h), so a dataset that is rewritten (e.g., re-epoched) invalidates its cache files.  Delete the cache files to
+// invalidate them explicitly (see bw_clearCovarianceCache.m).
+//
+// getCombinedCovarianceMatrices() computes the covariance for the trials of a list of datasets (e.g., all conditions
+// for common weights) without writing a combined dataset with bw_combineDs (see covAccumulator.h).  Covariance for
+// combined datasets is not cached.
+//
+// invertCovarianceMatrix() regularizes and inverts a covariance matrix exactly as computeCovarianceMatrices() does,
+// so that regularization sweeps and combined datasets give the same weights as a single call for each value.
+// Sweeps get the unregularized covariance with getCombinedCovariance(), which does not invert it (the covariance
+// may be singular without regularization) and does not write a cache file.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - added getCombinedCovarianceMatrices() for list of datasets
+//		1.2  - temporary file name includes the process id (see tempFile.h)
+//		1.3  - added invertCovarianceMatrix() - combined covariance is inverted with invertMatrix() as in
+//			   computeCovarianceMatrices() instead of the eigendecomposition in covEigen.h (removed)
+//		1.4  - key uses getDsStamp() from dsCache.h - includes all .meg4 segments and nanosecond modification
+//			   times.  Cache files written by earlier versions are recomputed
+//		1.5  - added getCombinedCovariance() (covariance only) and freeCovarianceArrays()
+//
+// ************************************
+
+#ifndef COVCACHE_H
+#define COVCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "mex.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/BWFilter.h"
+#include "../../../ctflib/headers/path.h"
+#include "../../../bwlib/bwlib.h"
+#include "covAccumulator.h"
+#include "dsCache.h"
+#include "tempFile.h"
+
+#define COV_CACHE_IDENT		"BWCOV02"
+#define COV_CACHE_EXT		".bwcov"
+
+typedef struct cov_cache_key
+{
+	char		ident[8];
+	int			numSensors;
+	int			filterEnabled;
+	int			bidirectional;
+	int			filterOrder;
+	double		highPass;
+	double		lowPass;
+	double		wStart;
+	double		wEnd;
+	double		regularization;
+	ds_stamp	stamp;			// .res4 and .meg4 segments of covariance dataset
+} cov_cache_key;
+
+
+// fill in key for these settings - returns false if dataset files can't be found
+static bool getCovCacheKey( cov_cache_key &key, int numSensors, const char *covDsName, filter_params &fparams,
+						   double wStart, double wEnd, double regularization )
+{
+	memset( &key, 0, sizeof(cov_cache_key) );
+	memcpy( key.ident, COV_CACHE_IDENT, 8 );
+	key.numSensors = numSensors;
+	key.filterEnabled = fparams.enable;
+	key.bidirectional = fparams.enable ? fparams.bidirectional : 0;
+	key.filterOrder = fparams.enable ? fparams.order : 0;
+	key.highPass = fparams.lc;
+	key.lowPass = fparams.hc;
+	key.wStart = wStart;
+	key.wEnd = wEnd;
+	key.regularization = regularization;
+
+	// key is compared with memcmp - unused stamp entries stay zero
+	if ( !getDsStamp( covDsName, key.stamp ) || key.stamp.numFiles < 2 )
+		return (false);
+
+	return (true);
+}
+
+static void getCovCacheFileName( const char *covDsName, cov_cache_key &key, char *fileName )
+{
+	const char *filterStr = "nf";
+	if (key.filterEnabled)
+		filterStr = key.bidirectional ? "bi" : "fwd";
+
+	sprintf(fileName, "%s%sANALYSIS%scov_%g-%gHz_%g_%gs_reg%g_%s%s", covDsName, FILE_SEPARATOR, FILE_SEPARATOR,
+			key.highPass, key.lowPass, key.wStart, key.wEnd, key.regularization, filterStr, COV_CACHE_EXT);
+}
+
+// read matrices from cache file - returns false if file doesn't exist or doesn't match key
+static bool readCovCacheFile( const char *fileName, cov_cache_key &key, double **covArray, double **icovArray )
+{
+	cov_cache_key	fileKey;
+	FILE			*fp;
+	bool			valid = true;
+
+	if ( ( fp = fopen( fileName, "rb") ) == NULL )
+		return (false);
+
+	if ( fread( &fileKey, sizeof(cov_cache_key), 1, fp ) != 1 || memcmp( &fileKey, &key, sizeof(cov_cache_key) ) )
+		valid = false;
+
+	for (int i=0; valid && i<key.numSensors; i++)
+		if ( fread( covArray[i], sizeof(double), key.numSensors, fp ) != (size_t)key.numSensors )
+			valid = false;
+	for (int i=0; valid && i<key.numSensors; i++)
+		if ( fread( icovArray[i], sizeof(double), key.numSensors, fp ) != (size_t)key.numSensors )
+			valid = false;
+
+	fclose(fp);
+	return (valid);
+}
+
+// write to temporary file and rename so that a partly written file is never read
+static bool writeCovCacheFile( const char *fileName, cov_cache_key &key, double **covArray, double **icovArray )
+{
+	char		tmpName[1024];
+	char		analysisDir[1024];
+	FILE		*fp;
+	bool		valid = true;
+
+	// make sure ANALYSIS directory exists
+	sprintf(analysisDir, "%s", fileName);
+	char *s = strrchr( analysisDir, FILE_SEPARATOR[0] );
+	if ( s != NULL )
+		*s = '\0';
+	createCacheDirectory( analysisDir );
+
+	getTempFileName( fileName, tmpName );
+	if ( ( fp = fopen( tmpName, "wb") ) == NULL )
+		return (false);
+
+	if ( fwrite( &key, sizeof(cov_cache_key), 1, fp ) != 1 )
+		valid = false;
+	for (int i=0; valid && i<key.numSensors; i++)
+		if ( fwrite( covArray[i], sizeof(double), key.numSensors, fp ) != (size_t)key.numSensors )
+			valid = false;
+	for (int i=0; valid && i<key.numSensors; i++)
+		if ( fwrite( icovArray[i], sizeof(double), key.numSensors, fp ) != (size_t)key.numSensors )
+			valid = false;
+
+	if ( fclose(fp) != 0 )
+		valid = false;
+
+	return ( commitTempFile( tmpName, fileName, valid ) );
+}
+
+// replacement for computeCovarianceMatrices() - reads matrices from cache if available, otherwise computes and saves them
+static bool getCachedCovarianceMatrices( double **covArray, double **icovArray, int numSensors, char *covDsName,
+										filter_params &fparams, double wStart, double wEnd, double regularization )
+{
+	cov_cache_key	key;
+	char			fileName[1024];
+
+	if ( getCovCacheKey( key, numSensors, covDsName, fparams, wStart, wEnd, regularization ) )
+	{
+		getCovCacheFileName( covDsName, key, fileName );
+		if ( readCovCacheFile( fileName, key, covArray, icovArray ) )
+		{
+			mexPrintf("using cached covariance matrix %s\n", fileName);
+			return (true);
+		}
+	}
+	else
+		fileName[0] = '\0';
+
+	if ( !computeCovarianceMatrices(covArray, icovArray, numSensors, covDsName, fparams, wStart, wEnd, wStart, wEnd, false, regularization) )
+		return (false);
+
+	if ( fileName[0] != '\0' && !writeCovCacheFile( fileName, key, covArray, icovArray ) )
+		mexPrintf("could not save covariance cache file %s\n", fileName);
+
+	return (true);
+}
+
+// inverse of covariance [numSensors x numSensors] with regularization (power added to diagonal in Tesla^2) - same as
+// computeCovarianceMatrices(): the diagonal is restored after inversion so covArray is returned unregularized
+static bool invertCovarianceMatrix( double **covArray, double **icovArray, int numSensors, double regularization )
+{
+	double *diagonal = (double *)malloc( sizeof(double) * numSensors );
+	if (diagonal == NULL)
+	{
+		mexPrintf("memory allocation failed for covariance inverse\n");
+		return (false);
+	}
+
+	for (int i=0; i<numSensors; i++)
+	{
+		diagonal[i] = covArray[i][i];
+		covArray[i][i] += regularization;
+	}
+
+	bool valid = invertMatrix( covArray, icovArray, numSensors );
+
+	for (int i=0; i<numSensors; i++)
+		covArray[i][i] = diagonal[i];
+	free(diagonal);
+
+	if (!valid)
+		mexPrintf("could not invert covariance matrix\n");
+
+	return (valid);
+}
+
+// unregularized covariance only (no inverse) for one dataset or a list of datasets combined, computed in one pass
+// with the covariance accumulator (see covAccumulator.h).  Not cached.
+static bool getCombinedCovariance( double **covArray, int numSensors, int numCovDs, char **covDsNames,
+								  filter_params &fparams, double wStart, double wEnd )
+{
+	cov_accumulator	acc;
+
+	ds_params *params = (ds_params *)malloc( sizeof(ds_params) );
+	double *cov = (double *)malloc( sizeof(double) * numSensors * numSensors );
+	if ( params == NULL || cov == NULL )
+	{
+		mexPrintf("memory allocation failed for combined covariance\n");
+		free(params);
+		free(cov);
+		return (false);
+	}
+
+	bool valid = checkCombinedDatasets( numCovDs, covDsNames, *params );
+	if ( valid && params->numSensors != numSensors )
+	{
+		mexPrintf("number of sensors in %s does not agree with dataset\n", covDsNames[0]);
+		valid = false;
+	}
+	if ( valid )
+		valid = initCovAccumulator( acc, *params, 1, &wStart, &wEnd );
+	if ( valid )
+	{
+		valid = accumulateCovarianceDatasets( &acc, 1, numCovDs, covDsNames, *params, &fparams ) && getWindowCovariance( cov, acc, 0 );
+		freeCovAccumulator( acc );
+	}
+	if ( valid )
+	{
+		for (int i=0; i<numSensors; i++)
+			for (int j=0; j<numSensors; j++)
+				covArray[i][j] = cov[i + j * numSensors];
+	}
+
+	free(params);
+	free(cov);
+
+	return (valid);
+}
+
+// covariance for a list of covariance datasets combined - a single dataset uses getCachedCovarianceMatrices()
+static bool getCombinedCovarianceMatrices( double **covArray, double **icovArray, int numSensors, int numCovDs, char **covDsNames,
+										  filter_params &fparams, double wStart, double wEnd, double regularization )
+{
+	if (numCovDs == 1)
+		return ( getCachedCovarianceMatrices( covArray, icovArray, numSensors, covDsNames[0], fparams, wStart, wEnd, regularization ) );
+
+	if ( !getCombinedCovariance( covArray, numSensors, numCovDs, covDsNames, fparams, wStart, wEnd ) )
+		return (false);
+
+	return ( invertCovarianceMatrix( covArray, icovArray, numSensors, regularization ) );
+}
+
+// free covariance and inverse covariance arrays [numSensors] (either may be NULL)
+static void freeCovarianceArrays( double **covArray, double **icovArray, int numSensors )
+{
+	for (int i=0; covArray != NULL && i<numSensors; i++)
+		free(covArray[i]);
+	free(covArray);
+	for (int i=0; icovArray != NULL && i<numSensors; i++)
+		free(icovArray[i]);
+	free(icovArray);
+}
+
+#endif
@@ -0,0 +1,107 @@
+// *************************************
+// decimator.h
+//
+// anti-aliased decimation by an integer factor.
+//
+// Uses a linear phase (zero delay) windowed-sinc lowpass FIR filter with cutoff below the new Nyquist
+// frequency.  Only the retained output samples are computed (equivalent to a polyphase implementation)
+// so the cost is proportional to the number of output samples, not input samples.
+//
+// usage:
+//		decimator_params	dp;
+//		if ( build_decimator( &dp, factor ) == -1 ) ...
+//		decimateSamples( src, dest, numOut, &dp );
+//		free_decimator( &dp );
+//
+// dest[j] is the filtered value at src[j * factor] - src must have dp.halfLength valid samples before
+// src[0] and after src[(numOut-1) * factor].
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//
+// ************************************
+
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#define DECIMATOR_TAPS_PER_FACTOR	16		// one-sided filter length in units of the decimation factor
+#define DECIMATOR_CUTOFF			0.42	// -6 dB cutoff as fraction of output sample rate
+
+typedef struct decimator_params
+{
+	int			factor;
+	int			halfLength;			// filter length is 2 * halfLength + 1
+	double		cutoff;				// cutoff frequency as fraction of input sample rate
+	double		*coeffs;
+} decimator_params;
+
+
+static void free_decimator( decimator_params *dp )
+{
+	if ( dp->coeffs != NULL )
+		free( dp->coeffs );
+	dp->coeffs = NULL;
+	dp->halfLength = 0;
+}
+
+// design filter for decimation by factor - returns -1 on error (same convention as build_filter)
+static int build_decimator( decimator_params *dp, int factor )
+{
+	dp->coeffs = NULL;
+	dp->halfLength = 0;
+	dp->factor = factor;
+
+	if ( factor < 1 )
+		return (-1);
+
+	dp->halfLength = (factor > 1) ? factor * DECIMATOR_TAPS_PER_FACTOR : 0;
+	dp->cutoff = DECIMATOR_CUTOFF / factor;
+
+	int numTaps = 2 * dp->halfLength + 1;
+	dp->coeffs = (double *)malloc( sizeof(double) * numTaps );
+	if ( dp->coeffs == NULL )
+		return (-1);
+
+	if ( factor == 1 )
+	{
+		dp->coeffs[0] = 1.0;
+		return (0);
+	}
+
+	// Blackman windowed sinc, normalized to unity gain at DC
+	double sum = 0.0;
+	for (int k=0; k<numTaps; k++)
+	{
+		double n = k - dp->halfLength;
+		double h = (n == 0.0) ? 2.0 * dp->cutoff : sin( 2.0 * M_PI * dp->cutoff * n ) / ( M_PI * n );
+		double w = 0.42 - 0.5 * cos( 2.0 * M_PI * k / (numTaps - 1) ) + 0.08 * cos( 4.0 * M_PI * k / (numTaps - 1) );
+		dp->coeffs[k] = h * w;
+		sum += dp->coeffs[k];
+	}
+	for (int k=0; k<numTaps; k++)
+		dp->coeffs[k] /= sum;
+
+	return (0);
+}
+
+// compute numOut decimated samples centred on src[0], src[factor], src[2*factor] ...
+static void decimateSamples( const double *src, double *dest, int numOut, decimator_params *dp )
+{
+	int numTaps = 2 * dp->halfLength + 1;
+
+	for (int j=0; j<numOut; j++)
+	{
+		const double *x = src + (j * dp->factor) - dp->halfLength;
+		double y = 0.0;
+		for (int k=0; k<numTaps; k++)
+			y += dp->coeffs[k] * x[k];
+		dest[j] = y;
+	}
+}
+
+#endif
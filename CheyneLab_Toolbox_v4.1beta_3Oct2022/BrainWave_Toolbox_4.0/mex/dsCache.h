@@ -0,0 +1,245 @@
+// *************************************
+// dsCache.h
+//
+// cache of dataset parameters (.res4) and open / mapped .meg4 files that persists across calls to a mex function.
+//
+// entries are keyed by dataset path and the size and modification time (to the nanosecond where the file system
+// provides it) of the .res4 file and of each .meg4 segment.  All files are stat()'ed on every lookup, so a
+// dataset that is rewritten, including a .meg4 rewritten in place, is released (and its mapping dropped) and
+// re-read on the next call.
+//
+// The cache belongs to the mex function that includes this file and is released by mexAtExit when
+// the mex function is cleared (e.g., clear bw_getCTFData or bw_flushDsCache.m).  Call flushDsCache()
+// to release it explicitly.
+//
+// ** note an open mapping prevents the dataset from being deleted or overwritten on Windows, and a .meg4 that is
+//    truncated while mapped can crash Matlab (SIGBUS) on other platforms - always flush the cache (bw_flushDsCache.m)
+//    before writing or deleting a dataset that may have been read by a caching mex function.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - entries are also keyed on size and modification time of the .meg4 segments (nanoseconds where available)
+//
+// ************************************
+
+#ifndef DSCACHE_H
+#define DSCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "mex.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/path.h"
+#include "meg4Reader.h"
+
+#define DS_CACHE_SIZE		4
+#define DS_CACHE_MAX_FILES	(MAX_MEG4_SEGMENTS + 1)		// .res4 and .meg4 segments
+
+typedef struct ds_file_stamp
+{
+	long long		size;
+	long long		modTime;		// seconds
+	long			modTimeNs;		// nanoseconds (0 if not provided by the file system)
+} ds_file_stamp;
+
+typedef struct ds_stamp
+{
+	int				numFiles;		// .res4 followed by each .meg4 segment that exists
+	ds_file_stamp	file[DS_CACHE_MAX_FILES];
+} ds_stamp;
+
+typedef struct ds_cache_entry
+{
+	char			dsName[256];
+	ds_stamp		stamp;
+	unsigned long	lastUsed;
+
+	ds_params		*params;		// malloc'd - ds_params is too large to keep many copies on the stack
+	meg4_file		meg4;
+	bool			meg4Open;
+} ds_cache_entry;
+
+static ds_cache_entry	dsCache[DS_CACHE_SIZE];
+static unsigned long	dsCacheCounter = 0;
+static bool				dsCacheRegistered = false;
+
+
+static void releaseDsCacheEntry( ds_cache_entry &entry )
+{
+	if ( entry.meg4Open )
+		closeMEG4File( entry.meg4 );
+	entry.meg4Open = false;
+
+	if ( entry.params != NULL )
+		free( entry.params );
+	entry.params = NULL;
+
+	entry.dsName[0] = '\0';
+	entry.lastUsed = 0;
+}
+
+// release all cached parameters and .meg4 files
+static void flushDsCache( void )
+{
+	for (int i=0; i<DS_CACHE_SIZE; i++)
+		releaseDsCacheEntry( dsCache[i] );
+}
+
+static bool getDsFileStamp( const char *fileName, ds_file_stamp &stamp )
+{
+#if _WIN32||WIN64
+	struct __stat64		fileInfo;
+	if ( _stat64( fileName, &fileInfo ) != 0 )
+		return (false);
+	stamp.modTimeNs = 0;
+#else
+	struct stat			fileInfo;
+	if ( stat( fileName, &fileInfo ) != 0 )
+		return (false);
+#if defined(__APPLE__)
+	stamp.modTimeNs = (long)fileInfo.st_mtimespec.tv_nsec;
+#else
+	stamp.modTimeNs = (long)fileInfo.st_mtim.tv_nsec;
+#endif
+#endif
+	stamp.size = (long long)fileInfo.st_size;
+	stamp.modTime = (long long)fileInfo.st_mtime;
+	return (true);
+}
+
+// stat the .res4 file and each .meg4 segment (name.meg4, name.1_meg4 ...).  Returns false if there is no .res4 file
+static bool getDsStamp( const char *dsName, ds_stamp &stamp )
+{
+	char			baseName[256];
+	char			fileName[512];
+
+	removeFilePath( (char *)dsName, baseName);
+	baseName[strlen(baseName)-3] = '\0';
+
+	sprintf(fileName, "%s%s%s.res4", dsName, FILE_SEPARATOR, baseName );
+	if ( !getDsFileStamp( fileName, stamp.file[0] ) )
+		return (false);
+	stamp.numFiles = 1;
+
+	for (int seg=0; seg<MAX_MEG4_SEGMENTS; seg++)
+	{
+		if ( seg == 0 )
+			sprintf(fileName, "%s%s%s.meg4", dsName, FILE_SEPARATOR, baseName );
+		else
+			sprintf(fileName, "%s%s%s.%d_meg4", dsName, FILE_SEPARATOR, baseName, seg );
+		if ( !getDsFileStamp( fileName, stamp.file[stamp.numFiles] ) )
+			break;
+		stamp.numFiles++;
+	}
+	return (true);
+}
+
+static bool sameDsStamp( const ds_stamp &a, const ds_stamp &b )
+{
+	if ( a.numFiles != b.numFiles )
+		return (false);
+	for (int i=0; i<a.numFiles; i++)
+	{
+		if ( a.file[i].size != b.file[i].size || a.file[i].modTime != b.file[i].modTime ||
+			 a.file[i].modTimeNs != b.file[i].modTimeNs )
+			return (false);
+	}
+	return (true);
+}
+
+// returns cache entry for this dataset, reading the .res4 file if not cached or if any of its files have changed
+static ds_cache_entry * getDsCacheEntry( const char *dsName )
+{
+	ds_stamp	stamp;
+
+	if ( !dsCacheRegistered )
+	{
+		for (int i=0; i<DS_CACHE_SIZE; i++)
+		{
+			dsCache[i].dsName[0] = '\0';
+			dsCache[i].params = NULL;
+			dsCache[i].meg4Open = false;
+			dsCache[i].lastUsed = 0;
+		}
+		mexAtExit( flushDsCache );
+		dsCacheRegistered = true;
+	}
+
+	if ( strlen(dsName) > 255 || !getDsStamp( dsName, stamp ) )
+		return (NULL);
+
+	// look for valid entry
+	int oldest = 0;
+	for (int i=0; i<DS_CACHE_SIZE; i++)
+	{
+		if ( dsCache[i].params != NULL && !strcmp( dsCache[i].dsName, dsName ) )
+		{
+			if ( sameDsStamp( dsCache[i].stamp, stamp ) )
+			{
+				dsCache[i].lastUsed = ++dsCacheCounter;
+				return ( &dsCache[i] );
+			}
+			// dataset has changed - reload into this slot
+			releaseDsCacheEntry( dsCache[i] );
+			oldest = i;
+			break;
+		}
+		if ( dsCache[i].lastUsed < dsCache[oldest].lastUsed )
+			oldest = i;
+	}
+
+	ds_cache_entry &entry = dsCache[oldest];
+	releaseDsCacheEntry( entry );
+
+	entry.params = (ds_params *)malloc( sizeof(ds_params) );
+	if ( entry.params == NULL )
+		return (NULL);
+
+	if ( !readMEGResFile( (char *)dsName, *entry.params ) )
+	{
+		releaseDsCacheEntry( entry );
+		return (NULL);
+	}
+
+	sprintf( entry.dsName, "%s", dsName );
+	entry.stamp = stamp;
+	entry.lastUsed = ++dsCacheCounter;
+
+	return ( &entry );
+}
+
+// replacement for readMEGResFile() - copies cached parameters into dsParams
+static bool readCachedResFile( const char *dsName, ds_params &dsParams )
+{
+	ds_cache_entry *entry = getDsCacheEntry( dsName );
+	if ( entry == NULL )
+		return ( readMEGResFile( (char *)dsName, dsParams ) );
+
+	memcpy( &dsParams, entry->params, sizeof(ds_params) );
+	return (true);
+}
+
+// returns cached open .meg4 file for this dataset (mapped if possible) or NULL on error.
+// File remains open until the cache entry is released - do not call closeMEG4File() on it.
+static meg4_file * getCachedMEG4File( const char *dsName )
+{
+	ds_cache_entry *entry = getDsCacheEntry( dsName );
+	if ( entry == NULL )
+		return (NULL);
+
+	if ( !entry->meg4Open )
+	{
+		if ( !openMEG4File( dsName, *entry->params, entry->meg4, true ) )
+			return (NULL);
+		entry->meg4Open = true;
+	}
+
+	return ( &entry->meg4 );
+}
+
+#endif
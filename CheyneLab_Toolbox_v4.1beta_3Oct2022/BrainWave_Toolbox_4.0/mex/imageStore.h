@@ -0,0 +1,248 @@
+// *************************************
+// imageStore.h
+//
+// chunked 4D image store (voxels x latencies) for image series from bw_makeEventRelated and bw_makeDifferential.
+//
+// All images of a series are written to a single file (e.g., ds/ANALYSIS/<imageName>.bwimg) instead of one .svl,
+// .txt or .w file per latency.  Image values are stored as floats in chunks of chunkVoxels x chunkLatencies
+// (default 256 x 64 = 64 kB) so that one image (all voxels at one latency) or one voxel time course (all latencies
+// at one voxel) can each be read with a small number of contiguous reads or from a memory-mapped file.
+//
+// file layout (native byte order, endianCheck = 1)
+//		header		img_store_header (128 bytes)
+//		latencies	double [numLatencies]
+//		voxels		double [numVoxels x 6]  (x, y, z, normal x, y, z in cm, as in .vox files)
+//		data		float chunks starting at dataOffset (page aligned), padded to full chunks.
+//					chunk (cl, cv) holds latencies cl * chunkLatencies ... and voxels cv * chunkVoxels ... and
+//					starts at dataOffset + ((cl * numVoxelChunks) + cv) * chunkLatencies * chunkVoxels * 4.
+//					Within a chunk values are in [latency][voxel] order.
+//
+// Images must be written in latency order.  Latencies are buffered until a row of chunks is complete so each
+// row is written with a single fwrite.  writeImageStore() doesn't call mex functions so it can be used as the
+// write function of an image writer thread (imageWriter.h) - errors are reported by closeImageStore().
+// See bw_read_image_store.m to read the file in Matlab.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - write errors are reported by closeImageStore() so images can be written from a writer thread
+//		1.2  - temporary file name includes the process id (see tempFile.h)
+//
+// ************************************
+
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mex.h"
+#include "tempFile.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+
+#define IMG_STORE_IDENT				"BWIMG01"
+#define IMG_STORE_EXT				".bwimg"
+#define IMG_STORE_CHUNK_VOXELS		256
+#define IMG_STORE_CHUNK_LATENCIES	64
+#define IMG_STORE_ALIGN				4096
+
+typedef struct img_store_header
+{
+	char				ident[8];
+	int					endianCheck;
+	int					numVoxels;
+	int					numLatencies;
+	int					chunkVoxels;
+	int					chunkLatencies;
+	int					isSurface;			// 1 = voxels are surface vertices (vox file), 0 = volume (svl grid)
+	int					units;				// SAM_UNIT_* code of image values
+	int					reserved;
+	double				boundingBox[6];		// xMin, xMax, yMin, yMax, zMin, zMax (volumes only)
+	double				stepSize;
+	long long			latencyOffset;
+	long long			voxelOffset;
+	long long			dataOffset;
+	long long			dataBytes;
+} img_store_header;			// 128 bytes
+
+typedef struct img_store
+{
+	char				fileName[1024];
+	char				tmpName[1024];
+	img_store_header	header;
+	FILE				*fp;
+	int					numVoxelChunks;
+	int					numLatencyChunks;
+	float				*row;				// one row of chunks (chunkLatencies x all voxels)
+	int					numWritten;			// latencies written or buffered
+} img_store;
+
+
+static void freeImageStore( img_store &store )
+{
+	if ( store.fp != NULL )
+	{
+		fclose( store.fp );
+		remove( store.tmpName );
+	}
+	free( store.row );
+	store.fp = NULL;
+	store.row = NULL;
+}
+
+// create store for numLatencies images of numVoxels.  Returns false if the file can't be created.
+static bool createImageStore( img_store &store, const char *fileName, int numVoxels, int numLatencies,
+							 double *latencies, vectorCart *voxels, vectorCart *normals, bool isSurface, int units,
+							 double *boundingBox, double stepSize )
+{
+	memset( &store, 0, sizeof(img_store) );
+	memcpy( store.header.ident, IMG_STORE_IDENT, strlen(IMG_STORE_IDENT) );
+	store.header.endianCheck = 1;
+	store.header.numVoxels = numVoxels;
+	store.header.numLatencies = numLatencies;
+	store.header.chunkVoxels = IMG_STORE_CHUNK_VOXELS;
+	store.header.chunkLatencies = IMG_STORE_CHUNK_LATENCIES;
+	store.header.isSurface = isSurface ? 1 : 0;
+	store.header.units = units;
+	for (int k=0; k<6 && boundingBox != NULL; k++)
+		store.header.boundingBox[k] = boundingBox[k];
+	store.header.stepSize = stepSize;
+
+	store.numVoxelChunks = (numVoxels + IMG_STORE_CHUNK_VOXELS - 1) / IMG_STORE_CHUNK_VOXELS;
+	store.numLatencyChunks = (numLatencies + IMG_STORE_CHUNK_LATENCIES - 1) / IMG_STORE_CHUNK_LATENCIES;
+
+	long long offset = sizeof(img_store_header);
+	store.header.latencyOffset = offset;
+	offset += (long long)sizeof(double) * numLatencies;
+	store.header.voxelOffset = offset;
+	offset += (long long)sizeof(double) * 6 * numVoxels;
+	store.header.dataOffset = ( (offset + IMG_STORE_ALIGN - 1) / IMG_STORE_ALIGN ) * IMG_STORE_ALIGN;
+	store.header.dataBytes = (long long)sizeof(float) * store.numLatencyChunks * IMG_STORE_CHUNK_LATENCIES *
+										store.numVoxelChunks * IMG_STORE_CHUNK_VOXELS;
+
+	size_t rowSize = (size_t)IMG_STORE_CHUNK_LATENCIES * store.numVoxelChunks * IMG_STORE_CHUNK_VOXELS;
+	store.row = (float *)calloc( rowSize, sizeof(float) );
+	if ( store.row == NULL )
+	{
+		mexPrintf("memory allocation failed for image store\n");
+		return (false);
+	}
+
+	// write to temporary file and rename when complete so that a partly written file is never read
+	sprintf(store.fileName, "%s", fileName);
+	getTempFileName( fileName, store.tmpName );
+	if ( ( store.fp = fopen( store.tmpName, "wb") ) == NULL )
+	{
+		mexPrintf("could not create image store %s\n", store.tmpName);
+		freeImageStore( store );
+		return (false);
+	}
+
+	bool ok = ( fwrite( &store.header, sizeof(img_store_header), 1, store.fp ) == 1 );
+	if ( ok && numLatencies > 0 )
+		ok = ( fwrite( latencies, sizeof(double), numLatencies, store.fp ) == (size_t)numLatencies );
+	for (int i=0; ok && i<numVoxels; i++)
+	{
+		double v[6];
+		v[0] = voxels[i].x;
+		v[1] = voxels[i].y;
+		v[2] = voxels[i].z;
+		v[3] = normals[i].x;
+		v[4] = normals[i].y;
+		v[5] = normals[i].z;
+		ok = ( fwrite( v, sizeof(double), 6, store.fp ) == 6 );
+	}
+	for (long long k=offset; ok && k<store.header.dataOffset; k++)
+		ok = ( fputc( 0, store.fp ) != EOF );
+
+	if ( !ok )
+	{
+		mexPrintf("error writing image store %s\n", store.tmpName);
+		freeImageStore( store );
+		return (false);
+	}
+	return (true);
+}
+
+// write buffered row of chunks - on a write error the store is abandoned
+static bool flushImageStoreRow( img_store &store )
+{
+	size_t rowSize = (size_t)IMG_STORE_CHUNK_LATENCIES * store.numVoxelChunks * IMG_STORE_CHUNK_VOXELS;
+	if ( fwrite( store.row, sizeof(float), rowSize, store.fp ) != rowSize )
+	{
+		freeImageStore( store );
+		return (false);
+	}
+	memset( store.row, 0, sizeof(float) * rowSize );
+	return (true);
+}
+
+// add the next numImages images (images[i][voxel]) in latency order
+static bool writeImageStore( img_store &store, double **images, int numImages )
+{
+	int CV = IMG_STORE_CHUNK_VOXELS;
+	int CL = IMG_STORE_CHUNK_LATENCIES;
+	int numVoxels = store.header.numVoxels;
+
+	if ( store.fp == NULL )
+		return (false);
+
+	for (int i=0; i<numImages; i++)
+	{
+		if ( store.numWritten >= store.header.numLatencies )
+			return (false);
+
+		float *dst = store.row + (store.numWritten % CL) * CV;
+		double *src = images[i];
+		for (int cv=0; cv<store.numVoxelChunks; cv++)
+		{
+			int v0 = cv * CV;
+			int nv = (numVoxels - v0 < CV) ? numVoxels - v0 : CV;
+			float *chunk = dst + (size_t)cv * CL * CV;
+			for (int v=0; v<nv; v++)
+				chunk[v] = (float)src[v0 + v];
+		}
+		store.numWritten++;
+
+		if ( (store.numWritten % CL) == 0 )
+			if ( !flushImageStoreRow( store ) )
+				return (false);
+	}
+	return (true);
+}
+
+// write last (partial) row of chunks and save store.  Returns false if the store is incomplete or can't be saved.
+static bool closeImageStore( img_store &store )
+{
+	if ( store.fp == NULL )
+	{
+		mexPrintf("error writing image store %s\n", store.tmpName);
+		freeImageStore( store );
+		return (false);
+	}
+
+	bool valid = ( store.numWritten == store.header.numLatencies );
+	if ( valid && (store.numWritten % IMG_STORE_CHUNK_LATENCIES) != 0 )
+		valid = flushImageStoreRow( store );
+	if ( store.fp == NULL )
+	{
+		mexPrintf("error writing image store %s\n", store.tmpName);
+		return (false);
+	}
+
+	if ( fclose( store.fp ) != 0 )
+		valid = false;
+	store.fp = NULL;
+
+	if ( !commitTempFile( store.tmpName, store.fileName, valid ) )
+	{
+		mexPrintf("could not save image store %s\n", store.fileName);
+		valid = false;
+	}
+	freeImageStore( store );
+	return (valid);
+}
+
+#endif
@@ -0,0 +1,192 @@
+// *************************************
+// imageWriter.h
+//
+// bounded producer / consumer pipeline for writing image series to disk.
+//
+// Images are computed in blocks of consecutive latencies (blockSize images of numVoxels) and passed to a
+// background thread that saves them while the next block is computed.  The writer owns a fixed number of
+// block buffers (IMG_WRITER_BUFFERS), so memory used for images depends only on the block size and the number
+// of voxels and not on the number of latencies.  The producer waits for a free buffer if the writer falls behind.
+//
+//		images = getImageWriterBlock( writer );				// free buffer - images[i][voxel], i < blockSize
+//		... compute images for latencies first .. first+count-1 ...
+//		submitImageWriterBlock( writer, first, count );		// write func( first, count, images, arg ) is called
+//		closeImageWriter( writer );							// wait for all blocks to be written
+//
+// Blocks are written in the order they are submitted.  The write function runs in the writer thread and must
+// not call any mex or mx functions - it returns false on error, after which no more blocks are written and
+// getImageWriterBlock() returns NULL.
+//
+// The images of each block buffer are contiguous (images[i] = images[0] + i * numVoxels), so a block can be
+// filled with a single matrix product [numVoxels x blockSize].
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - images of a block are allocated as one contiguous array
+//
+// ************************************
+
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mex.h"
+
+#define IMG_WRITER_BUFFERS			2
+#define IMG_WRITER_BLOCK_SIZE		64		// latencies per block (one row of chunks in imageStore.h)
+
+typedef bool (*image_write_func)( int first, int count, double **images, void *arg );
+
+typedef struct image_writer
+{
+	int					numVoxels;
+	int					blockSize;
+	double				**images[IMG_WRITER_BUFFERS];		// [blockSize][numVoxels] for each buffer
+	double				*data[IMG_WRITER_BUFFERS];			// contiguous image data for each buffer
+	int					first[IMG_WRITER_BUFFERS];
+	int					count[IMG_WRITER_BUFFERS];
+	bool				isFull[IMG_WRITER_BUFFERS];
+	int					nextFill;
+	int					nextWrite;
+	image_write_func	func;
+	void				*arg;
+	bool				threaded;
+	bool				finished;
+	bool				failed;
+	pthread_t			thread;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		changed;
+} image_writer;
+
+
+static void *imageWriterThread( void *arg )
+{
+	image_writer *w = (image_writer *)arg;
+
+	pthread_mutex_lock( &w->mutex );
+	while (1)
+	{
+		int b = w->nextWrite;
+		while ( !w->isFull[b] && !w->finished )
+			pthread_cond_wait( &w->changed, &w->mutex );
+		if ( !w->isFull[b] )
+			break;		// finished and all blocks written
+		pthread_mutex_unlock( &w->mutex );
+
+		bool ok = w->failed ? false : w->func( w->first[b], w->count[b], w->images[b], w->arg );
+
+		pthread_mutex_lock( &w->mutex );
+		if ( !ok )
+			w->failed = true;
+		w->isFull[b] = false;
+		w->nextWrite = (b + 1) % IMG_WRITER_BUFFERS;
+		pthread_cond_broadcast( &w->changed );
+	}
+	pthread_mutex_unlock( &w->mutex );
+
+	return (NULL);
+}
+
+static void freeImageWriter( image_writer &w )
+{
+	for (int b=0; b<IMG_WRITER_BUFFERS; b++)
+	{
+		free( w.images[b] );
+		free( w.data[b] );
+		w.images[b] = NULL;
+		w.data[b] = NULL;
+	}
+}
+
+// allocate buffers and start writer thread.  If the thread can't be started blocks are written in
+// submitImageWriterBlock() instead.
+static bool createImageWriter( image_writer &w, int numVoxels, int blockSize, image_write_func func, void *arg )
+{
+	memset( &w, 0, sizeof(image_writer) );
+	w.numVoxels = numVoxels;
+	w.blockSize = blockSize;
+	w.func = func;
+	w.arg = arg;
+
+	for (int b=0; b<IMG_WRITER_BUFFERS; b++)
+	{
+		w.images[b] = (double **)malloc( sizeof(double *) * blockSize );
+		w.data[b] = (double *)malloc( sizeof(double) * blockSize * numVoxels );
+		if ( w.images[b] == NULL || w.data[b] == NULL )
+		{
+			mexPrintf("memory allocation failed for image writer\n");
+			freeImageWriter( w );
+			return (false);
+		}
+		for (int i=0; i<blockSize; i++)
+			w.images[b][i] = w.data[b] + (size_t)i * numVoxels;
+	}
+
+	pthread_mutex_init( &w.mutex, NULL );
+	pthread_cond_init( &w.changed, NULL );
+	w.threaded = ( pthread_create( &w.thread, NULL, imageWriterThread, (void *)&w ) == 0 );
+
+	return (true);
+}
+
+// next free buffer for blockSize images - waits while the writer is saving previous blocks.
+// Returns NULL if a previous block could not be written.
+static double **getImageWriterBlock( image_writer &w )
+{
+	int b = w.nextFill;
+
+	pthread_mutex_lock( &w.mutex );
+	while ( w.isFull[b] && !w.failed )
+		pthread_cond_wait( &w.changed, &w.mutex );
+	bool failed = w.failed;
+	pthread_mutex_unlock( &w.mutex );
+
+	return ( failed ? NULL : w.images[b] );
+}
+
+// pass buffer returned by getImageWriterBlock() holding images for latencies first .. first+count-1 to the writer
+static void submitImageWriterBlock( image_writer &w, int first, int count )
+{
+	int b = w.nextFill;
+
+	if ( !w.threaded )
+	{
+		if ( !w.failed && !w.func( first, count, w.images[b], w.arg ) )
+			w.failed = true;
+		return;
+	}
+
+	pthread_mutex_lock( &w.mutex );
+	w.first[b] = first;
+	w.count[b] = count;
+	w.isFull[b] = true;
+	w.nextFill = (b + 1) % IMG_WRITER_BUFFERS;
+	pthread_cond_broadcast( &w.changed );
+	pthread_mutex_unlock( &w.mutex );
+}
+
+// wait until all submitted blocks are written, stop writer and free buffers.  Returns false if any block
+// could not be written.
+static bool closeImageWriter( image_writer &w )
+{
+	if ( w.threaded )
+	{
+		pthread_mutex_lock( &w.mutex );
+		w.finished = true;
+		pthread_cond_broadcast( &w.changed );
+		pthread_mutex_unlock( &w.mutex );
+		pthread_join( w.thread, NULL );
+		w.threaded = false;
+	}
+	pthread_mutex_destroy( &w.mutex );
+	pthread_cond_destroy( &w.changed );
+	freeImageWriter( w );
+
+	return ( !w.failed );
+}
+
+#endif
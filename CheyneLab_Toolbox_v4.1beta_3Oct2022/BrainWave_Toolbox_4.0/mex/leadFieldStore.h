@@ -0,0 +1,339 @@
+// *************************************
+// leadFieldStore.h
+//
+// persistent store of forward solutions (lead fields) for a reconstruction grid or vox file.
+//
+// Lead fields depend only on the sensor geometry, head model (sphere origin for each channel), gradient order,
+// the source orientation basis and the voxel list - not on the data or covariance.  The first time an image is
+// computed for a given grid the lead fields are written to a store file as they are computed. Later calls with the
+// same settings memory-map the file read-only and copy the lead fields from it instead of calling
+// computeForwardSolution().  The store is used by every image computed with the beamformer engine - event-related
+// images (bw_makeEventRelated) and all differential images (bw_makeDifferential), including a single active window
+// and band, which was computed by computeDifferential() in bwlib without the store before bw_makeDifferential 3.8.
+//
+// Files are named by a 64 bit hash of all of the settings, so changing the head model, head position (res4) or grid
+// creates a new file.  Since the hash identifies everything the lead fields depend on, the store is kept in a
+// LEADFIELDS directory next to the dataset (e.g., study/LEADFIELDS/leadfield_3f2a....bwlf for study/cond1.ds) and
+// is shared by all datasets in that directory with the same sensor geometry (e.g., conditions epoched from the
+// same raw data).  The header repeats the hash and dimensions and
+// lead fields are stored as doubles in the order [voxel][basis][sensor], which is the column layout of the tile
+// lead field matrix in bfEngine.h.  Delete the files to free disk space (see bw_clearLeadFieldCache.m).
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - key hashes fixed orientations as unit directions - normals are normalized in place when weights are
+//			   computed, so a second call with the same (unnormalized) normals missed the store
+//		1.2  - store is saved in LEADFIELDS directory next to the dataset instead of the dataset ANALYSIS directory
+//			   so it is reused for other datasets with the same geometry.  Temporary file name includes the
+//			   process id (see tempFile.h)
+//
+// ************************************
+
+#ifndef LEADFIELDSTORE_H
+#define LEADFIELDSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "mex.h"
+#include "tempFile.h"
+
+#if _WIN32||WIN64
+	#include <windows.h>
+#else
+	#include <sys/types.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/path.h"
+
+#define LF_STORE_IDENT		"BWLF01"
+#define LF_STORE_EXT		".bwlf"
+#define LF_STORE_DIR		"LEADFIELDS"
+
+typedef struct lf_store_header
+{
+	char				ident[8];
+	unsigned long long	key;
+	int					numSensors;
+	int					numVoxels;
+	int					numBasis;
+	int					gradientOrder;
+	double				sphereOrigin[3];
+	long long			dataBytes;
+} lf_store_header;			// 64 bytes - lead fields start on 8 byte boundary
+
+typedef struct lf_store
+{
+	char				fileName[1024];
+	char				tmpName[1024];
+	lf_store_header		header;
+	const double		*lead;			// mapped lead fields (NULL if not mapped)
+	unsigned char		*mapBase;
+	size_t				mapSize;
+	bool				isMapped;
+	FILE				*fp;			// open while store is being built
+	long long			numWritten;		// lead field columns written
+#if _WIN32||WIN64
+	HANDLE				fileHandle;
+	HANDLE				mapHandle;
+#endif
+} lf_store;
+
+
+// 64 bit FNV-1a hash
+static unsigned long long hashBytes( unsigned long long h, const void *data, size_t numBytes )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i=0; i<numBytes; i++)
+	{
+		h ^= (unsigned long long)p[i];
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
+
+static unsigned long long hashValue( unsigned long long h, double val )
+{
+	return ( hashBytes( h, &val, sizeof(double) ) );
+}
+
+// key for sensor geometry and head model of all channels used by the forward solution, orientation basis and voxels
+static unsigned long long getLeadFieldKey( ds_params &params, int numBasis, double *sphereOrigin, int numVoxels,
+										   vectorCart *voxels, vectorCart *normals )
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	h = hashBytes( h, LF_STORE_IDENT, strlen(LF_STORE_IDENT) );
+	h = hashValue( h, params.numSensors );
+	h = hashValue( h, params.gradientOrder );
+	h = hashValue( h, numBasis );
+	for (int k=0; k<3; k++)
+		h = hashValue( h, sphereOrigin[k] );
+
+	for (int i=0; i<params.numChannels; i++)
+	{
+		channel_rec *ch = &params.channel[i];
+		if ( !ch->isSensor && !ch->isReference && !ch->isBalancingRef )
+			continue;
+		h = hashValue( h, i );
+		h = hashValue( h, ch->numCoils );
+		h = hashValue( h, ch->gradient );
+		h = hashValue( h, ch->xpos );
+		h = hashValue( h, ch->ypos );
+		h = hashValue( h, ch->zpos );
+		h = hashValue( h, ch->xpos2 );
+		h = hashValue( h, ch->ypos2 );
+		h = hashValue( h, ch->zpos2 );
+		h = hashValue( h, ch->p1x );
+		h = hashValue( h, ch->p1y );
+		h = hashValue( h, ch->p1z );
+		h = hashValue( h, ch->p2x );
+		h = hashValue( h, ch->p2y );
+		h = hashValue( h, ch->p2z );
+		h = hashValue( h, ch->sphereX );
+		h = hashValue( h, ch->sphereY );
+		h = hashValue( h, ch->sphereZ );
+	}
+
+	h = hashValue( h, numVoxels );
+	h = hashBytes( h, voxels, sizeof(vectorCart) * numVoxels );
+	// fixed orientations are normalized in place when weights are computed, so hash the direction
+	// (in single precision) rather than the input vector
+	for (int v=0; normals != NULL && v<numVoxels; v++)
+	{
+		double len = sqrt( normals[v].x * normals[v].x + normals[v].y * normals[v].y + normals[v].z * normals[v].z );
+		if (len > 0.0)
+		{
+			h = hashValue( h, (float)(normals[v].x / len) );
+			h = hashValue( h, (float)(normals[v].y / len) );
+			h = hashValue( h, (float)(normals[v].z / len) );
+		}
+		else
+			h = hashValue( h, 0.0 );
+	}
+
+	return (h);
+}
+
+// map store file read-only and check header.  Returns false if file doesn't exist or doesn't match
+static bool mapLeadFieldStore( lf_store &store )
+{
+	long long fileSize = (long long)sizeof(lf_store_header) + store.header.dataBytes;
+	if ( (unsigned long long)fileSize > (unsigned long long)((size_t)-1) )
+		return (false);
+
+#if _WIN32||WIN64
+	LARGE_INTEGER size;
+	store.fileHandle = CreateFileA( store.fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( store.fileHandle == INVALID_HANDLE_VALUE )
+		return (false);
+	if ( !GetFileSizeEx( store.fileHandle, &size ) || (long long)size.QuadPart != fileSize )
+	{
+		CloseHandle( store.fileHandle );
+		return (false);
+	}
+
+	store.mapHandle = CreateFileMappingA( store.fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if ( store.mapHandle == NULL )
+	{
+		CloseHandle( store.fileHandle );
+		return (false);
+	}
+
+	store.mapBase = (unsigned char *)MapViewOfFile( store.mapHandle, FILE_MAP_READ, 0, 0, 0);
+	if ( store.mapBase == NULL )
+	{
+		CloseHandle( store.mapHandle );
+		CloseHandle( store.fileHandle );
+		return (false);
+	}
+#else
+	struct stat		fileInfo;
+	int fd = open( store.fileName, O_RDONLY );
+	if ( fd == -1 )
+		return (false);
+	if ( fstat( fd, &fileInfo ) != 0 || (long long)fileInfo.st_size != fileSize )
+	{
+		close(fd);
+		return (false);
+	}
+
+	void *ptr = mmap( NULL, (size_t)fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);		// mapping remains valid after closing descriptor
+
+	if ( ptr == MAP_FAILED )
+		return (false);
+
+	store.mapBase = (unsigned char *)ptr;
+#endif
+
+	store.mapSize = (size_t)fileSize;
+	store.isMapped = true;
+
+	if ( memcmp( store.mapBase, &store.header, sizeof(lf_store_header) ) )
+		return (false);		// caller closes mapping
+
+	store.lead = (const double *)(store.mapBase + sizeof(lf_store_header));
+	return (true);
+}
+
+static void unmapLeadFieldStore( lf_store &store )
+{
+	if ( store.isMapped )
+	{
+#if _WIN32||WIN64
+		UnmapViewOfFile( store.mapBase );
+		CloseHandle( store.mapHandle );
+		CloseHandle( store.fileHandle );
+#else
+		munmap( store.mapBase, store.mapSize );
+#endif
+	}
+	store.mapBase = NULL;
+	store.mapSize = 0;
+	store.isMapped = false;
+	store.lead = NULL;
+}
+
+// open store for these settings.  If a valid store exists it is mapped and store.lead points to the lead fields,
+// otherwise a new store is opened for writing (store.fp) and must be filled with writeLeadFieldStore() in voxel order.
+// Returns false if the store can be neither read nor written, in which case lead fields must be computed.
+static bool openLeadFieldStore( lf_store &store, const char *dsName, ds_params &params, int numBasis, double *sphereOrigin,
+							   int numVoxels, vectorCart *voxels, vectorCart *normals )
+{
+	char		storeDir[1024];
+
+	memset( &store, 0, sizeof(lf_store) );
+	memcpy( store.header.ident, LF_STORE_IDENT, strlen(LF_STORE_IDENT) );
+	store.header.key = getLeadFieldKey( params, numBasis, sphereOrigin, numVoxels, voxels, normals );
+	store.header.numSensors = params.numSensors;
+	store.header.numVoxels = numVoxels;
+	store.header.numBasis = numBasis;
+	store.header.gradientOrder = params.gradientOrder;
+	for (int k=0; k<3; k++)
+		store.header.sphereOrigin[k] = sphereOrigin[k];
+	store.header.dataBytes = (long long)sizeof(double) * params.numSensors * numBasis * numVoxels;
+
+	// directory containing the dataset - current directory if dsName has no path
+	sprintf(storeDir, "%s", dsName);
+	int len = strlen(storeDir);
+	while ( len > 0 && storeDir[len-1] == FILE_SEPARATOR[0] )
+		storeDir[--len] = '\0';
+	char *s = strrchr( storeDir, FILE_SEPARATOR[0] );
+	if ( s != NULL )
+		sprintf(s, "%s%s", FILE_SEPARATOR, LF_STORE_DIR);
+	else
+		sprintf(storeDir, "%s", LF_STORE_DIR);
+	sprintf(store.fileName, "%s%sleadfield_%016llx%s", storeDir, FILE_SEPARATOR, store.header.key, LF_STORE_EXT);
+
+	if ( mapLeadFieldStore( store ) )
+	{
+		mexPrintf("using lead field store %s\n", store.fileName);
+		return (true);
+	}
+	unmapLeadFieldStore( store );
+
+	// build new store - write to temporary file and rename when complete so that a partly written file is never read
+	createCacheDirectory( storeDir );
+	getTempFileName( store.fileName, store.tmpName );
+	if ( ( store.fp = fopen( store.tmpName, "wb") ) == NULL )
+	{
+		mexPrintf("could not create lead field store %s\n", store.tmpName);
+		return (false);
+	}
+	if ( fwrite( &store.header, sizeof(lf_store_header), 1, store.fp ) != 1 )
+	{
+		fclose( store.fp );
+		store.fp = NULL;
+		remove( store.tmpName );
+		return (false);
+	}
+
+	return (true);
+}
+
+// append lead field columns [numSensors x numColumns] for the next voxels. On a write error the store is
+// abandoned and nothing is saved.
+static void writeLeadFieldStore( lf_store &store, const double *lead, int numColumns )
+{
+	if ( store.fp == NULL )
+		return;
+
+	size_t count = (size_t)store.header.numSensors * numColumns;
+	if ( fwrite( lead, sizeof(double), count, store.fp ) != count )
+	{
+		mexPrintf("error writing lead field store %s\n", store.tmpName);
+		fclose( store.fp );
+		store.fp = NULL;
+		remove( store.tmpName );
+		return;
+	}
+	store.numWritten += numColumns;
+}
+
+// unmap store, or save it if it was built and is complete
+static void closeLeadFieldStore( lf_store &store )
+{
+	unmapLeadFieldStore( store );
+
+	if ( store.fp != NULL )
+	{
+		bool valid = ( store.numWritten == (long long)store.header.numVoxels * store.header.numBasis );
+		if ( fclose( store.fp ) != 0 )
+			valid = false;
+		store.fp = NULL;
+
+		if ( commitTempFile( store.tmpName, store.fileName, valid ) )
+			mexPrintf("saved lead field store %s\n", store.fileName);
+	}
+}
+
+#endif
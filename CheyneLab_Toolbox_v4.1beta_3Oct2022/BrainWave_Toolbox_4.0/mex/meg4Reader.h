@@ -0,0 +1,504 @@
+// *************************************
+// meg4Reader.h
+//
+// routines for direct access to sample data in the CTF .meg4 file
+// and for writing trials to new (possibly segmented) .meg4 files
+//
+// the .meg4 file is memory-mapped where possible so that a range of samples can be decoded
+// (byte swapped and scaled by channel gain) directly into the caller's output array without
+// an intermediate read buffer.  If the file cannot be mapped, falls back to fseek / fread.
+//
+// data layout in the .meg4 file is:
+//		8 byte ID string ("MEG41CP" or "MEG4CPT")
+//		trial 1: channel 1 all samples, channel 2 all samples .... (4 byte big-endian integers)
+//		trial 2: ...
+//
+// datasets larger than 2 GB are split by the CTF software into segments (name.meg4, name.1_meg4,
+// name.2_meg4 ...), each with its own ID string and containing whole trials. All segments are opened
+// and trial numbers are mapped to the segment containing the trial.  All file offsets are 64 bit.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - 64 bit file offsets and support for multi-segment (.1_meg4, .2_meg4 ...) datasets
+//		1.2  - added meg4_output for writing trials - output is split into segments of less than 2 GB
+//			   in the same layout read by openMEG4File so that CTF software can read large datasets
+//
+// ************************************
+
+#ifndef MEG4READER_H
+#define MEG4READER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mex.h"
+
+#if _WIN32||WIN64
+	#include <windows.h>
+#else
+	#include <sys/types.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "../../../ctflib/headers/datasetUtils.h"
+#include "../../../ctflib/headers/path.h"
+
+#define MEG4_HEADER_BYTES	8		// size of ID string at start of each .meg4 file
+#define MAX_MEG4_SEGMENTS	64
+#define MAX_MEG4_SEGMENT_BYTES	2147483647LL	// max. size of each segment written (offsets must fit in an int)
+
+typedef struct meg4_segment
+{
+	char			fileName[256];
+	int				firstTrial;		// first trial stored in this segment
+	int				numTrials;
+	long long		fileSize;
+
+	bool			isMapped;		// true if mapBase is valid, else read using fp
+	unsigned char	*mapBase;
+	size_t			mapSize;
+
+	FILE			*fp;
+
+#if _WIN32||WIN64
+	HANDLE			fileHandle;
+	HANDLE			mapHandle;
+#endif
+} meg4_segment;
+
+typedef struct meg4_file
+{
+	char			fileName[256];	// name of first segment
+	int				numChannels;
+	int				numSamples;
+	int				numTrials;
+
+	int				numSegments;
+	meg4_segment	segment[MAX_MEG4_SEGMENTS];
+
+	int				*sampleBuffer;	// read buffer for unmapped files only
+	int				bufferSize;
+} meg4_file;
+
+typedef struct meg4_output
+{
+	char			fileName[256];	// name of first segment
+	long long		trialBytes;
+	int				trialsPerSegment;
+	int				numSegments;
+	bool			writeError;		// set if any write failed
+
+	FILE			*fp[MAX_MEG4_SEGMENTS];
+	long long		position[MAX_MEG4_SEGMENTS];	// current offset in each segment or -1 if unknown
+} meg4_output;
+
+
+// 64 bit seek - plain fseek() offsets are limited to 2 GB on some platforms
+static int seekMEG4( FILE *fp, long long offset )
+{
+#if _WIN32||WIN64
+	return ( _fseeki64( fp, (__int64)offset, SEEK_SET) );
+#else
+	return ( fseeko( fp, (off_t)offset, SEEK_SET) );
+#endif
+}
+
+static bool getMEG4FileSize( const char *fileName, long long &fileSize )
+{
+#if _WIN32||WIN64
+	struct __stat64		fileInfo;
+	if ( _stat64( fileName, &fileInfo ) != 0 )
+		return (false);
+#else
+	struct stat			fileInfo;
+	if ( stat( fileName, &fileInfo ) != 0 )
+		return (false);
+#endif
+	fileSize = (long long)fileInfo.st_size;
+	return (true);
+}
+
+// map entire segment read-only.  Returns false if mapping not possible
+static bool mapMEG4Segment( meg4_segment &seg )
+{
+	if ( (unsigned long long)seg.fileSize > (unsigned long long)((size_t)-1) )
+		return (false);
+
+#if _WIN32||WIN64
+	seg.fileHandle = CreateFileA( seg.fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( seg.fileHandle == INVALID_HANDLE_VALUE )
+		return (false);
+
+	seg.mapHandle = CreateFileMappingA( seg.fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if ( seg.mapHandle == NULL )
+	{
+		CloseHandle( seg.fileHandle );
+		return (false);
+	}
+
+	seg.mapBase = (unsigned char *)MapViewOfFile( seg.mapHandle, FILE_MAP_READ, 0, 0, 0);
+	if ( seg.mapBase == NULL )
+	{
+		CloseHandle( seg.mapHandle );
+		CloseHandle( seg.fileHandle );
+		return (false);
+	}
+#else
+	int fd = open( seg.fileName, O_RDONLY );
+	if ( fd == -1 )
+		return (false);
+
+	void *ptr = mmap( NULL, (size_t)seg.fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);		// mapping remains valid after closing descriptor
+
+	if ( ptr == MAP_FAILED )
+		return (false);
+
+	seg.mapBase = (unsigned char *)ptr;
+#endif
+
+	seg.mapSize = (size_t)seg.fileSize;
+	seg.isMapped = true;
+	return (true);
+}
+
+static void closeMEG4Segment( meg4_segment &seg )
+{
+	if ( seg.isMapped )
+	{
+#if _WIN32||WIN64
+		UnmapViewOfFile( seg.mapBase );
+		CloseHandle( seg.mapHandle );
+		CloseHandle( seg.fileHandle );
+#else
+		munmap( seg.mapBase, seg.mapSize );
+#endif
+	}
+	seg.mapBase = NULL;
+	seg.mapSize = 0;
+	seg.isMapped = false;
+
+	if ( seg.fp != NULL )
+		fclose( seg.fp );
+	seg.fp = NULL;
+}
+
+// open one segment and check ID string
+static bool openMEG4Segment( meg4_segment &seg, bool useMapping )
+{
+	char	s[8];
+
+	seg.isMapped = false;
+	seg.mapBase = NULL;
+	seg.mapSize = 0;
+	seg.fp = NULL;
+
+	if ( !getMEG4FileSize( seg.fileName, seg.fileSize ) || seg.fileSize < MEG4_HEADER_BYTES )
+		return (false);
+
+	if ( useMapping && mapMEG4Segment( seg ) )
+	{
+		if ( strncmp( (char *)seg.mapBase, "MEG4CPT", 7 ) && strncmp( (char *)seg.mapBase, "MEG41CP", 7 ) )
+		{
+			mexPrintf("%s does not appear to be a valid CTF meg4 file\n", seg.fileName);
+			closeMEG4Segment( seg );
+			return (false);
+		}
+		return (true);
+	}
+
+	// fall back to reading with stdio
+	if ( ( seg.fp = fopen( seg.fileName, "rb") ) == NULL )
+		return (false);
+
+	fread( s, sizeof( char ), 8, seg.fp );
+	if ( strncmp( s, "MEG4CPT", 7 ) && strncmp( s, "MEG41CP", 7 ) )
+	{
+		mexPrintf("%s does not appear to be a valid CTF meg4 file\n", seg.fileName);
+		closeMEG4Segment( seg );
+		return (false);
+	}
+
+	return (true);
+}
+
+static void closeMEG4File( meg4_file &meg4 )
+{
+	for (int i=0; i<meg4.numSegments; i++)
+		closeMEG4Segment( meg4.segment[i] );
+	meg4.numSegments = 0;
+
+	if ( meg4.sampleBuffer != NULL )
+		free( meg4.sampleBuffer );
+	meg4.sampleBuffer = NULL;
+	meg4.bufferSize = 0;
+}
+
+// open .meg4 file (and any additional segments) for dataset.  Set useMapping = false to force fread access
+static bool openMEG4File( const char *dsName, ds_params &dsParams, meg4_file &meg4, bool useMapping )
+{
+	char	baseName[256];
+
+	removeFilePath( (char *)dsName, baseName);
+	baseName[strlen(baseName)-3] = '\0';
+	sprintf(meg4.fileName, "%s%s%s.meg4", dsName, FILE_SEPARATOR, baseName );
+
+	meg4.numChannels = dsParams.numChannels;
+	meg4.numSamples = dsParams.numSamples;
+	meg4.numTrials = 0;
+	meg4.numSegments = 0;
+	meg4.sampleBuffer = NULL;
+	meg4.bufferSize = 0;
+
+	long long trialBytes = (long long)dsParams.numChannels * dsParams.numSamples * sizeof(int);
+	if ( trialBytes <= 0 )
+		return (false);
+
+	while ( meg4.numTrials < dsParams.numTrials && meg4.numSegments < MAX_MEG4_SEGMENTS )
+	{
+		meg4_segment &seg = meg4.segment[meg4.numSegments];
+
+		if ( meg4.numSegments == 0 )
+			sprintf(seg.fileName, "%s", meg4.fileName );
+		else
+			sprintf(seg.fileName, "%s%s%s.%d_meg4", dsName, FILE_SEPARATOR, baseName, meg4.numSegments );
+
+		if ( !openMEG4Segment( seg, useMapping ) )
+		{
+			if ( meg4.numSegments == 0 )
+				mexPrintf("couldn't open meg4 file %s for reading\n", seg.fileName);
+			break;
+		}
+
+		// segments always contain whole trials
+		seg.firstTrial = meg4.numTrials;
+		seg.numTrials = (int)( (seg.fileSize - MEG4_HEADER_BYTES) / trialBytes );
+		if ( seg.firstTrial + seg.numTrials > dsParams.numTrials )
+			seg.numTrials = dsParams.numTrials - seg.firstTrial;
+
+		meg4.numSegments++;
+		meg4.numTrials += seg.numTrials;
+
+		if ( seg.numTrials == 0 )
+			break;
+	}
+
+	if ( meg4.numSegments == 0 )
+		return (false);
+
+	if ( meg4.numTrials < dsParams.numTrials )
+		mexPrintf("warning: %s contains %d of %d trials\n", meg4.fileName, meg4.numTrials, dsParams.numTrials);
+
+	return (true);
+}
+
+// returns segment containing this trial or NULL if not found
+static meg4_segment * getMEG4Segment( meg4_file &meg4, int trial )
+{
+	for (int i=0; i<meg4.numSegments; i++)
+	{
+		if ( trial >= meg4.segment[i].firstTrial && trial < meg4.segment[i].firstTrial + meg4.segment[i].numTrials )
+			return ( &meg4.segment[i] );
+	}
+	return (NULL);
+}
+
+// byte offset of sample for this channel and trial within the segment containing the trial
+static long long getMEG4Offset( meg4_file &meg4, meg4_segment &seg, int trial, int channel, int sample )
+{
+	long long offset = ( (long long)(trial - seg.firstTrial) * meg4.numChannels + channel ) * meg4.numSamples + sample;
+	return ( MEG4_HEADER_BYTES + offset * (long long)sizeof(int) );
+}
+
+// read numSamples for one channel and trial starting at startSample without byte swapping.
+// Output is written to data[0] to data[numSamples-1] in file (big-endian) byte order
+static bool readMEG4RawSamples( meg4_file &meg4, int trial, int channel, int startSample, int numSamples, int *data )
+{
+	if ( channel < 0 || channel >= meg4.numChannels )
+		return (false);
+	if ( startSample < 0 || numSamples < 0 || startSample + numSamples > meg4.numSamples )
+		return (false);
+
+	meg4_segment *seg = getMEG4Segment( meg4, trial );
+	if ( seg == NULL )
+		return (false);
+
+	long long offset = getMEG4Offset( meg4, *seg, trial, channel, startSample );
+	if ( offset + (long long)numSamples * (long long)sizeof(int) > seg->fileSize )
+		return (false);
+
+	if ( seg->isMapped )
+	{
+		memcpy( data, seg->mapBase + offset, sizeof(int) * numSamples );
+		return (true);
+	}
+
+	if ( seekMEG4( seg->fp, offset ) != 0 )
+		return (false);
+	if ( fread( data, sizeof(int), numSamples, seg->fp ) != (size_t)numSamples )
+		return (false);
+
+	return (true);
+}
+
+// read numSamples for one channel and trial starting at startSample, convert to double and divide by gain.
+// Output is written to data[0] to data[numSamples-1]
+static bool readMEG4ChannelSamples( meg4_file &meg4, int trial, int channel, int startSample, int numSamples, double gain, double *data )
+{
+	meg4_segment *seg = getMEG4Segment( meg4, trial );
+	if ( seg == NULL )
+		return (false);
+
+	if ( seg->isMapped )
+	{
+		if ( channel < 0 || channel >= meg4.numChannels )
+			return (false);
+		if ( startSample < 0 || numSamples < 0 || startSample + numSamples > meg4.numSamples )
+			return (false);
+
+		long long offset = getMEG4Offset( meg4, *seg, trial, channel, startSample );
+		if ( offset + (long long)numSamples * (long long)sizeof(int) > seg->fileSize )
+			return (false);
+
+		// decode directly from mapped file
+		const int *src = (const int *)(seg->mapBase + offset);
+		for (int j=0; j<numSamples; j++)
+			data[j] = double( ToHost( (int)src[j] ) ) / gain;
+		return (true);
+	}
+
+	if ( numSamples > meg4.bufferSize )
+	{
+		if ( meg4.sampleBuffer != NULL )
+			free( meg4.sampleBuffer );
+		meg4.sampleBuffer = (int *)malloc( sizeof(int) * numSamples );
+		if ( meg4.sampleBuffer == NULL )
+		{
+			meg4.bufferSize = 0;
+			mexPrintf("memory allocation failed for sampleBuffer array\n");
+			return (false);
+		}
+		meg4.bufferSize = numSamples;
+	}
+
+	if ( !readMEG4RawSamples( meg4, trial, channel, startSample, numSamples, meg4.sampleBuffer ) )
+		return (false);
+
+	for (int j=0; j<numSamples; j++)
+		data[j] = double( ToHost( (int)meg4.sampleBuffer[j] ) ) / gain;
+
+	return (true);
+}
+
+// close all segments of output file.  Returns false if any write failed
+static bool closeMEG4Output( meg4_output &out )
+{
+	for (int i=0; i<out.numSegments; i++)
+	{
+		if ( fclose( out.fp[i] ) != 0 )
+			out.writeError = true;
+		out.fp[i] = NULL;
+	}
+	out.numSegments = 0;
+
+	return ( !out.writeError );
+}
+
+// create .meg4 file for numTrials trials of numChannels x numSamples samples in dataset dsName.
+// If the trials do not fit in one file, additional segments (name.1_meg4, name.2_meg4 ...) are created.
+// Each segment has its own ID string and contains whole trials so it can be read by openMEG4File
+static bool createMEG4Output( const char *dsName, int numChannels, int numSamples, int numTrials, meg4_output &out )
+{
+	char	baseName[256];
+	char	id[8] = "MEG41CP";
+
+	removeFilePath( (char *)dsName, baseName);
+	baseName[strlen(baseName)-3] = '\0';
+	sprintf(out.fileName, "%s%s%s.meg4", dsName, FILE_SEPARATOR, baseName );
+
+	out.numSegments = 0;
+	out.writeError = false;
+	out.trialBytes = (long long)numChannels * numSamples * sizeof(int);
+	if ( out.trialBytes <= 0 )
+		return (false);
+
+	long long segmentTrials = (MAX_MEG4_SEGMENT_BYTES - MEG4_HEADER_BYTES) / out.trialBytes;
+	if ( segmentTrials < 1 )
+	{
+		mexPrintf("trial size (%lld bytes) exceeds maximum meg4 file size\n", out.trialBytes);
+		return (false);
+	}
+	out.trialsPerSegment = (int)segmentTrials;
+
+	int numSegments = 1;
+	if ( numTrials > 0 )
+		numSegments = (int)( ( numTrials + segmentTrials - 1 ) / segmentTrials );
+	if ( numSegments > MAX_MEG4_SEGMENTS )
+	{
+		mexPrintf("%d trials exceed maximum of %d meg4 file segments\n", numTrials, MAX_MEG4_SEGMENTS);
+		return (false);
+	}
+
+	for (int i=0; i<numSegments; i++)
+	{
+		char	fileName[256];
+
+		if ( i == 0 )
+			sprintf(fileName, "%s", out.fileName );
+		else
+			sprintf(fileName, "%s%s%s.%d_meg4", dsName, FILE_SEPARATOR, baseName, i );
+
+		if ( ( out.fp[i] = fopen( fileName, "wb") ) == NULL )
+		{
+			mexPrintf("couldn't open meg4 file %s for writing\n", fileName);
+			closeMEG4Output( out );
+			return (false);
+		}
+		out.numSegments++;
+
+		// write 8 byte header
+		if ( fwrite( id, sizeof( char ), MEG4_HEADER_BYTES, out.fp[i] ) != MEG4_HEADER_BYTES )
+			out.writeError = true;
+		out.position[i] = MEG4_HEADER_BYTES;
+	}
+
+	return (true);
+}
+
+// write numSamples in file (big-endian) byte order starting at sampleOffset samples from the start of trial.
+// Consecutive writes to a segment do not seek
+static bool writeMEG4Samples( meg4_output &out, int trial, long long sampleOffset, const int *data, int numSamples )
+{
+	int segment = trial / out.trialsPerSegment;
+	if ( trial < 0 || segment >= out.numSegments )
+	{
+		out.writeError = true;
+		return (false);
+	}
+
+	long long offset = MEG4_HEADER_BYTES + (long long)(trial - segment * out.trialsPerSegment) * out.trialBytes
+						+ sampleOffset * (long long)sizeof(int);
+
+	if ( offset != out.position[segment] && seekMEG4( out.fp[segment], offset ) != 0 )
+	{
+		out.position[segment] = -1;
+		out.writeError = true;
+		return (false);
+	}
+	if ( fwrite( data, sizeof(int), numSamples, out.fp[segment] ) != (size_t)numSamples )
+	{
+		out.position[segment] = -1;
+		out.writeError = true;
+		return (false);
+	}
+	out.position[segment] = offset + (long long)numSamples * (long long)sizeof(int);
+
+	return (true);
+}
+
+#endif
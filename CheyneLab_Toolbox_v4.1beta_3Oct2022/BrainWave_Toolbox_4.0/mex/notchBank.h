@@ -0,0 +1,220 @@
+// *************************************
+// notchBank.h
+//
+// band-reject (notch) filter bank for removing powerline noise and its harmonics in a single pass.
+//
+// Each notch is a Butterworth band-reject filter designed from the analog prototype (lowpass to bandstop
+// transform, bilinear transform with prewarping) and stored as second order sections.  The sections for
+// all harmonics are combined into one cascade so that each sample passes through every notch in
+// one sweep over the data, instead of filtering and copying the whole buffer once per harmonic.
+//
+// usage:
+//		notch_bank_params	np;
+//		if ( build_line_filter( &np, 60.0, 3.0, sampleRate, true ) == -1 ) ...
+//		applyNotchBank( in, out, numSamples, &np );		// in and out may be the same array
+//
+// build_line_filter() uses the same notch order and number of harmonics for all callers. To design
+// other notches set the fields of np and call build_notch_bank().
+//
+// harmonics with upper band edge at or above the Nyquist frequency are omitted.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - real prototype pole (odd order) is always stored as one section with both of its roots.
+//			   Was dropped when the roots are real (notch wider than 2 x centre frequency)
+//		1.2  - added build_line_filter() - line filter order does not depend on the bandpass filter order
+//			   or direction (was set separately by each caller)
+//
+// ************************************
+
+#ifndef NOTCHBANK_H
+#define NOTCHBANK_H
+
+#include <math.h>
+#include <complex>
+
+#define MAX_NOTCH_SECTIONS	64
+#define LINE_FILTER_ORDER	4		// order of each line filter notch (same as CTF DataEditor)
+#define LINE_FILTER_HARMONICS	4		// number of notches including fundamental
+
+typedef struct notch_bank_params
+{
+	bool		enable;
+	bool		bidirectional;		// if true filter forward and backward (zero phase)
+	double		fs;					// sample rate (Hz)
+	double		lineFreq;			// fundamental frequency (Hz)
+	double		width;				// half-width of each notch (Hz)
+	int			numHarmonics;		// number of notches including fundamental
+	int			order;				// order of each band-reject filter (even, rounded up)
+
+	int			numSections;		// set by build_notch_bank()
+	double		b[MAX_NOTCH_SECTIONS][3];
+	double		a[MAX_NOTCH_SECTIONS][3];	// a[][0] = 1.0
+} notch_bank_params;
+
+
+// add one section with digital poles at the roots of z^2 + a1 z + a2 and zeros on the unit circle (b1)
+static int add_notch_section( notch_bank_params *np, double a1, double a2, double b1 )
+{
+	if ( np->numSections == MAX_NOTCH_SECTIONS )
+		return (-1);
+
+	double *b = np->b[np->numSections];
+	double *a = np->a[np->numSections];
+	a[0] = 1.0;
+	a[1] = a1;
+	a[2] = a2;
+
+	// unity gain at DC
+	double g = ( 1.0 + a[1] + a[2] ) / ( 2.0 + b1 );
+	b[0] = g;
+	b[1] = g * b1;
+	b[2] = g;
+
+	np->numSections++;
+	return (0);
+}
+
+// add second order sections for one Butterworth band-reject filter from lc to hc Hz
+static int add_notch_sections( notch_bank_params *np, double lc, double hc, int protoOrder )
+{
+	double	T2 = 2.0 * np->fs;
+	double	W1 = T2 * tan( M_PI * lc / np->fs );		// prewarped band edges
+	double	W2 = T2 * tan( M_PI * hc / np->fs );
+	double	Bw = W2 - W1;
+	double	w0sq = W1 * W2;
+
+	// digital zeros are on the unit circle at the notch centre frequency
+	double	zeroAngle = 2.0 * atan( sqrt(w0sq) / T2 );
+	double	b1 = -2.0 * cos(zeroAngle);
+
+	// each prototype pole p maps to the roots of s^2 - (Bw/p)s + w0^2 - keep the roots in the
+	// upper half plane, their conjugates are implicit in each section
+	for (int k=0; k<protoOrder; k++)
+	{
+		double theta = M_PI * (2.0 * k + protoOrder + 1) / (2.0 * protoOrder);
+		std::complex<double> p( cos(theta), sin(theta) );
+
+		// real pole at -1 for odd order
+		bool realPole = ( 2 * k + 1 == protoOrder );
+		if ( realPole )
+			p = std::complex<double>( -1.0, 0.0 );
+
+		std::complex<double> c = Bw / p;
+		std::complex<double> d = sqrt( c * c - 4.0 * w0sq );
+		std::complex<double> roots[2] = { (c + d) * 0.5, (c - d) * 0.5 };
+
+		// roots of the real pole are a conjugate pair or, if Bw > 2 w0, both real - one section for both
+		if ( realPole )
+		{
+			std::complex<double> zp0 = ( T2 + roots[0] ) / ( T2 - roots[0] );
+			std::complex<double> zp1 = ( T2 + roots[1] ) / ( T2 - roots[1] );
+			if ( add_notch_section( np, -(zp0 + zp1).real(), (zp0 * zp1).real(), b1 ) == -1 )
+				return (-1);
+			continue;
+		}
+
+		for (int r=0; r<2; r++)
+		{
+			if ( roots[r].imag() <= 0.0 )
+				continue;
+
+			std::complex<double> zp = ( T2 + roots[r] ) / ( T2 - roots[r] );
+			if ( add_notch_section( np, -2.0 * zp.real(), std::norm(zp), b1 ) == -1 )
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+// design filter bank - returns -1 on error (same convention as build_filter)
+static int build_notch_bank( notch_bank_params *np )
+{
+	np->numSections = 0;
+
+	if ( np->fs <= 0.0 || np->lineFreq <= 0.0 || np->width <= 0.0 || np->width >= np->lineFreq || np->order < 1 )
+		return (-1);
+
+	int protoOrder = (np->order + 1) / 2;
+
+	for (int h=1; h<=np->numHarmonics; h++)
+	{
+		double lc = (np->lineFreq * h) - np->width;
+		double hc = (np->lineFreq * h) + np->width;
+		if ( hc >= np->fs * 0.5 )
+			break;
+
+		if ( add_notch_sections( np, lc, hc, protoOrder ) == -1 )
+			return (-1);
+	}
+
+	np->enable = true;
+	return (0);
+}
+
+// design line filter for lineFreq and harmonics with notches of +/- width Hz - returns -1 on error
+// the order is not halved for bidirectional filtering so forward and zero phase filters have the same notches
+static int build_line_filter( notch_bank_params *np, double lineFreq, double width, double fs, bool bidirectional )
+{
+	np->lineFreq = lineFreq;
+	np->width = width;
+	np->numHarmonics = LINE_FILTER_HARMONICS;
+	np->fs = fs;
+	np->order = LINE_FILTER_ORDER;
+	np->bidirectional = bidirectional;
+
+	return ( build_notch_bank( np ) );
+}
+
+// run cascade over data in one direction (step = 1 or -1) in place
+static void runNotchCascade( double *data, int numSamples, notch_bank_params *np, int step )
+{
+	double	z1[MAX_NOTCH_SECTIONS];
+	double	z2[MAX_NOTCH_SECTIONS];
+
+	for (int s=0; s<np->numSections; s++)
+	{
+		z1[s] = 0.0;
+		z2[s] = 0.0;
+	}
+
+	int j = (step > 0) ? 0 : numSamples - 1;
+	for (int n=0; n<numSamples; n++, j+=step)
+	{
+		double x = data[j];
+
+		// transposed direct form II
+		for (int s=0; s<np->numSections; s++)
+		{
+			const double *b = np->b[s];
+			const double *a = np->a[s];
+			double y = b[0] * x + z1[s];
+			z1[s] = b[1] * x - a[1] * y + z2[s];
+			z2[s] = b[2] * x - a[2] * y;
+			x = y;
+		}
+		data[j] = x;
+	}
+}
+
+// filter numSamples from in to out.  in and out may be the same array
+static void applyNotchBank( double *in, double *out, int numSamples, notch_bank_params *np )
+{
+	if ( out != in )
+	{
+		for (int j=0; j<numSamples; j++)
+			out[j] = in[j];
+	}
+
+	if ( !np->enable || np->numSections == 0 )
+		return;
+
+	runNotchCascade( out, numSamples, np, 1 );
+	if ( np->bidirectional )
+		runNotchCascade( out, numSamples, np, -1 );
+}
+
+#endif
@@ -0,0 +1,264 @@
+// *************************************
+// surfaceWriter.h
+//
+// buffered writers for surface (vox file) images.
+//
+// Each image is formatted into one memory buffer and saved with a single fwrite instead of one fprintf or
+// several single byte fwrites per vertex.
+//		.txt	plain text, one value per line (for BrainView) - values are formatted by formatImageValue()
+//				which gives the same text as printf("%g") without calling printf for each vertex
+//		.w		Freesurfer overlay - int16 latency (unused), 3-byte vertex count, then 3-byte vertex index and
+//				float value for each vertex (big-endian)
+//		.f32	raw float32 overlay - one little-endian float per vertex, no header (number of vertices is
+//				file size / 4).  Read with bw_read_surface_image.m
+//
+// The writers don't call mex functions so they can be used from an image writer thread (imageWriter.h).
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//		1.1  - NaN with the sign bit set is written as -nan (same as printf)
+//
+// ************************************
+
+#ifndef SURFACEWRITER_H
+#define SURFACEWRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SURFACE_TEXT_MAX_CHARS		16		// longest value formatted by formatImageValue() plus newline
+
+static const double surfacePow10[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+										 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// x * 10^n - exact power of 10 for |n| <= 22
+static double scalePow10( double x, int n )
+{
+	while (n > 22)
+	{
+		x *= 1e22;
+		n -= 22;
+	}
+	while (n < -22)
+	{
+		x /= 1e22;
+		n += 22;
+	}
+	return ( (n >= 0) ? x * surfacePow10[n] : x / surfacePow10[-n] );
+}
+
+// val * 10^n rounded to integer as printf rounds decimal digits - values close to a half are compared exactly
+// (fma rounds once so the sign of the residual is exact) and exact halves are rounded to even
+static long long roundPow10( double val, int n )
+{
+	double scaled = scalePow10( val, n );
+	double whole = floor( scaled );
+	double frac = scaled - whole;
+	long long m = (long long)whole;
+
+	if ( fabs(frac - 0.5) > 1e-6 || n > 22 || n < -22 )
+		return ( (frac < 0.5) ? m : m + 1 );
+
+	double residual = (n >= 0) ? fma( val, surfacePow10[n], -(whole + 0.5) ) : -fma( whole + 0.5, surfacePow10[-n], -val );
+	if ( residual > 0.0 || (residual == 0.0 && (m & 1)) )
+		return (m + 1);
+	return (m);
+}
+
+// format value as printf("%g") (6 significant digits, trailing zeros removed). Returns number of characters written.
+static int formatImageValue( char *buf, double val )
+{
+	char	*p = buf;
+	char	digits[8];
+
+	if ( signbit(val) )
+	{
+		*p++ = '-';
+		val = -val;
+	}
+	if ( val != val )
+	{
+		memcpy( p, "nan", 3 );
+		return ( (int)(p - buf) + 3 );
+	}
+	if ( val > 1.7976931348623157e308 )
+	{
+		memcpy( p, "inf", 3 );
+		return ( (int)(p - buf) + 3 );
+	}
+	if ( val == 0.0 )
+	{
+		*p++ = '0';
+		return ( (int)(p - buf) );
+	}
+
+	// six digit mantissa and decimal exponent
+	int exponent = (int)floor( log10(val) );
+	long long mantissa = roundPow10( val, 5 - exponent );
+	if (mantissa < 100000)
+	{
+		exponent--;
+		mantissa = roundPow10( val, 5 - exponent );
+	}
+	if (mantissa >= 1000000)
+	{
+		exponent++;
+		mantissa = roundPow10( val, 5 - exponent );
+		if (mantissa >= 1000000)
+			mantissa = 100000;
+	}
+	for (int i=5; i>=0; i--)
+	{
+		digits[i] = (char)('0' + mantissa % 10);
+		mantissa /= 10;
+	}
+	int numDigits = 6;
+	while (numDigits > 1 && digits[numDigits-1] == '0')
+		numDigits--;
+
+	if (exponent >= -4 && exponent < 6)
+	{
+		// fixed notation
+		if (exponent < 0)
+		{
+			*p++ = '0';
+			*p++ = '.';
+			for (int i=0; i<-exponent-1; i++)
+				*p++ = '0';
+			for (int i=0; i<numDigits; i++)
+				*p++ = digits[i];
+		}
+		else
+		{
+			for (int i=0; i<=exponent; i++)
+				*p++ = digits[i];
+			if (numDigits > exponent + 1)
+			{
+				*p++ = '.';
+				for (int i=exponent+1; i<numDigits; i++)
+					*p++ = digits[i];
+			}
+		}
+	}
+	else
+	{
+		// exponential notation (at least two exponent digits)
+		*p++ = digits[0];
+		if (numDigits > 1)
+		{
+			*p++ = '.';
+			for (int i=1; i<numDigits; i++)
+				*p++ = digits[i];
+		}
+		*p++ = 'e';
+		*p++ = (exponent < 0) ? '-' : '+';
+		int e = (exponent < 0) ? -exponent : exponent;
+		if (e >= 100)
+			*p++ = (char)('0' + e / 100);
+		*p++ = (char)('0' + (e / 10) % 10);
+		*p++ = (char)('0' + e % 10);
+	}
+
+	return ( (int)(p - buf) );
+}
+
+// write whole buffer to new file
+static bool writeSurfaceBuffer( const char *fileName, const char *mode, const void *buffer, size_t numBytes )
+{
+	FILE *fp = fopen(fileName, mode);
+	if ( fp == NULL )
+		return (false);
+	bool ok = ( fwrite( buffer, 1, numBytes, fp ) == numBytes );
+	if ( fclose(fp) != 0 )
+		ok = false;
+	return (ok);
+}
+
+// plain text file - one value per line
+static bool saveSurfaceText( const char *fileName, const double *image, int numVertices )
+{
+	char *buffer = (char *)malloc( (size_t)numVertices * SURFACE_TEXT_MAX_CHARS + 1 );
+	if ( buffer == NULL )
+		return (false);
+
+	char *p = buffer;
+	for (int v=0; v<numVertices; v++)
+	{
+		p += formatImageValue( p, image[v] );
+		*p++ = '\n';
+	}
+
+	bool ok = writeSurfaceBuffer( fileName, "w", buffer, (size_t)(p - buffer) );
+	free(buffer);
+	return (ok);
+}
+
+// big-endian 3 byte integer
+static unsigned char *putSurfaceInt24( unsigned char *p, unsigned int num )
+{
+	p[0] = (num >> 16) & 0xff;
+	p[1] = (num >> 8) & 0xff;
+	p[2] = num & 0xff;
+	return (p + 3);
+}
+
+// Freesurfer overlay (.w) file
+static bool saveSurfaceOverlay( const char *fileName, const double *image, int numVertices )
+{
+	size_t numBytes = 5 + (size_t)numVertices * 7;
+	unsigned char *buffer = (unsigned char *)malloc( numBytes );
+	if ( buffer == NULL )
+		return (false);
+
+	// unused latency value type int16
+	unsigned char *p = buffer;
+	*p++ = 0;
+	*p++ = 0;
+	p = putSurfaceInt24( p, (unsigned int)numVertices );
+
+	for (int v=0; v<numVertices; v++)
+	{
+		unsigned int bits;
+		float fval = (float)image[v];
+		memcpy( &bits, &fval, sizeof(float) );
+		p = putSurfaceInt24( p, (unsigned int)v );
+		*p++ = (bits >> 24) & 0xff;
+		*p++ = (bits >> 16) & 0xff;
+		*p++ = (bits >> 8) & 0xff;
+		*p++ = bits & 0xff;
+	}
+
+	bool ok = writeSurfaceBuffer( fileName, "wb", buffer, numBytes );
+	free(buffer);
+	return (ok);
+}
+
+// raw float32 overlay (.f32) - little-endian float per vertex
+static bool saveSurfaceFloat32( const char *fileName, const double *image, int numVertices )
+{
+	unsigned char *buffer = (unsigned char *)malloc( (size_t)numVertices * 4 );
+	if ( buffer == NULL )
+		return (false);
+
+	unsigned char *p = buffer;
+	for (int v=0; v<numVertices; v++)
+	{
+		unsigned int bits;
+		float fval = (float)image[v];
+		memcpy( &bits, &fval, sizeof(float) );
+		*p++ = bits & 0xff;
+		*p++ = (bits >> 8) & 0xff;
+		*p++ = (bits >> 16) & 0xff;
+		*p++ = (bits >> 24) & 0xff;
+	}
+
+	bool ok = writeSurfaceBuffer( fileName, "wb", buffer, (size_t)numVertices * 4 );
+	free(buffer);
+	return (ok);
+}
+
+#endif
@@ -0,0 +1,70 @@
+// *************************************
+// tempFile.h
+//
+// write-then-rename helpers for cache and store files (covCache.h, leadFieldStore.h, imageStore.h).
+//
+// Files are written to a temporary name that includes the process id (e.g., name.bwlf.1234.tmp) and renamed to
+// the final name when complete, so a partly written file is never read and two Matlab sessions building the same
+// file never write to the same temporary file.  If both complete, the last one renamed is kept.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//
+// ************************************
+
+#ifndef TEMPFILE_H
+#define TEMPFILE_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#if _WIN32||WIN64
+	#include <windows.h>
+	#include <direct.h>
+	#include <process.h>
+#else
+	#include <sys/types.h>
+	#include <unistd.h>
+#endif
+
+// temporary name for fileName unique to this process - tmpName must hold strlen(fileName) + 16 characters
+static void getTempFileName( const char *fileName, char *tmpName )
+{
+#if _WIN32||WIN64
+	sprintf(tmpName, "%s.%d.tmp", fileName, (int)_getpid() );
+#else
+	sprintf(tmpName, "%s.%d.tmp", fileName, (int)getpid() );
+#endif
+}
+
+// if valid, replace fileName with the completed temporary file, otherwise delete the temporary file.
+// Returns true if fileName was saved
+static bool commitTempFile( const char *tmpName, const char *fileName, bool valid )
+{
+	if ( valid )
+	{
+#if _WIN32||WIN64
+		valid = ( MoveFileExA( tmpName, fileName, MOVEFILE_REPLACE_EXISTING ) != 0 );
+#else
+		valid = ( rename( tmpName, fileName ) == 0 );		// replaces an existing file in one step
+#endif
+	}
+	if ( !valid )
+		remove( tmpName );
+
+	return (valid);
+}
+
+// create directory for cache or store files if it doesn't exist
+static void createCacheDirectory( const char *dirName )
+{
+#if _WIN32||WIN64
+	mkdir(dirName);
+#else
+	mkdir(dirName, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH );
+#endif
+}
+
+#endif
@@ -0,0 +1,193 @@
+// *************************************
+// threadPool.h
+//
+// portable pool of worker threads for voxel loops (pthreads on all platforms - pthreads-win32 on Windows).
+//
+// The pool is created once and reused for each parallel loop.  runPoolTasks() runs task 0..numTasks-1 using
+// all threads including the calling thread.  Tasks are claimed from a shared counter, so idle threads take the
+// remaining work from slower ones and the load stays balanced when tasks differ in cost.  Each task must write
+// only its own part of the output (e.g., its own voxels) so results do not depend on which thread ran it
+// or in what order.
+//
+// Task functions run in worker threads and must not call any mex or mx functions.
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//
+// ************************************
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if _WIN32||WIN64
+	#include <windows.h>
+#else
+	#include <unistd.h>
+#endif
+
+#define MAX_POOL_THREADS	64
+
+typedef void (*pool_task_func)( int task, int thread, void *arg );
+
+struct thread_pool;
+
+typedef struct pool_worker_arg
+{
+	struct thread_pool	*pool;
+	int					thread;
+} pool_worker_arg;
+
+typedef struct thread_pool
+{
+	int				numThreads;			// including calling thread
+	pthread_t		threads[MAX_POOL_THREADS];
+	pool_worker_arg	workerArgs[MAX_POOL_THREADS];
+	pthread_mutex_t	mutex;
+	pthread_cond_t	workReady;
+	pthread_cond_t	workDone;
+	int				generation;
+	int				numBusy;
+	bool			shutdown;
+	pool_task_func	func;
+	void			*arg;
+	int				numTasks;
+	int				nextTask;
+} thread_pool;
+
+
+static int getNumberOfProcessors()
+{
+	int n = 1;
+#if _WIN32||WIN64
+	SYSTEM_INFO	info;
+	GetSystemInfo( &info );
+	n = (int)info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+	if (n < 1)
+		n = 1;
+	if (n > MAX_POOL_THREADS)
+		n = MAX_POOL_THREADS;
+	return (n);
+}
+
+// claim and run tasks until none are left
+static void runAvailableTasks( thread_pool *pool, int thread )
+{
+	while (1)
+	{
+		pthread_mutex_lock( &pool->mutex );
+		int task = pool->nextTask++;
+		pthread_mutex_unlock( &pool->mutex );
+		if (task >= pool->numTasks)
+			break;
+		pool->func( task, thread, pool->arg );
+	}
+}
+
+static void *poolWorker( void *arg )
+{
+	pool_worker_arg	*w = (pool_worker_arg *)arg;
+	thread_pool		*pool = w->pool;
+	int				seen = 0;
+
+	pthread_mutex_lock( &pool->mutex );
+	while (1)
+	{
+		while ( pool->generation == seen && !pool->shutdown )
+			pthread_cond_wait( &pool->workReady, &pool->mutex );
+		if ( pool->shutdown )
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock( &pool->mutex );
+
+		runAvailableTasks( pool, w->thread );
+
+		pthread_mutex_lock( &pool->mutex );
+		if ( --pool->numBusy == 0 )
+			pthread_cond_signal( &pool->workDone );
+	}
+	pthread_mutex_unlock( &pool->mutex );
+
+	return (NULL);
+}
+
+// start numThreads-1 worker threads (numThreads <= 0 uses all processors). Returns number of threads in pool.
+static int createThreadPool( thread_pool &pool, int numThreads )
+{
+	memset( &pool, 0, sizeof(thread_pool) );
+
+	if (numThreads <= 0)
+		numThreads = getNumberOfProcessors();
+	if (numThreads > MAX_POOL_THREADS)
+		numThreads = MAX_POOL_THREADS;
+
+	pthread_mutex_init( &pool.mutex, NULL );
+	pthread_cond_init( &pool.workReady, NULL );
+	pthread_cond_init( &pool.workDone, NULL );
+
+	pool.numThreads = 1;
+	for (int t=1; t<numThreads; t++)
+	{
+		pool.workerArgs[t].pool = &pool;
+		pool.workerArgs[t].thread = t;
+		if ( pthread_create( &pool.threads[t], NULL, poolWorker, (void *)&pool.workerArgs[t] ) != 0 )
+			break;
+		pool.numThreads++;
+	}
+
+	return (pool.numThreads);
+}
+
+static void destroyThreadPool( thread_pool &pool )
+{
+	pthread_mutex_lock( &pool.mutex );
+	pool.shutdown = true;
+	pthread_cond_broadcast( &pool.workReady );
+	pthread_mutex_unlock( &pool.mutex );
+
+	for (int t=1; t<pool.numThreads; t++)
+		pthread_join( pool.threads[t], NULL );
+
+	pthread_mutex_destroy( &pool.mutex );
+	pthread_cond_destroy( &pool.workReady );
+	pthread_cond_destroy( &pool.workDone );
+	pool.numThreads = 0;
+}
+
+// run func(task, thread, arg) for task = 0..numTasks-1 and wait until all are done.
+// thread is 0..numThreads-1 and can be used to index per-thread buffers. pool may be NULL (run serially)
+static void runPoolTasks( thread_pool *pool, int numTasks, pool_task_func func, void *arg )
+{
+	if ( pool == NULL || pool->numThreads < 2 || numTasks < 2 )
+	{
+		for (int task=0; task<numTasks; task++)
+			func( task, 0, arg );
+		return;
+	}
+
+	pthread_mutex_lock( &pool->mutex );
+	pool->func = func;
+	pool->arg = arg;
+	pool->numTasks = numTasks;
+	pool->nextTask = 0;
+	pool->numBusy = pool->numThreads - 1;
+	pool->generation++;
+	pthread_cond_broadcast( &pool->workReady );
+	pthread_mutex_unlock( &pool->mutex );
+
+	runAvailableTasks( pool, 0 );
+
+	pthread_mutex_lock( &pool->mutex );
+	while ( pool->numBusy > 0 )
+		pthread_cond_wait( &pool->workDone, &pool->mutex );
+	pthread_mutex_unlock( &pool->mutex );
+}
+
+#endif
@@ -0,0 +1,180 @@
+// *************************************
+// voxFile.h
+//
+// read and write voxel (vertex) list files (.vox) - positions and normals (orientations) in cm.
+//
+// Two formats are read and detected automatically from the start of the file:
+//		ASCII		number of voxels on first line, then x y z nx ny nz for each voxel (one per line)
+//		binary		header "BWVOX01" (8 bytes), int endianCheck (= 1), int numVoxels, followed by
+//					double positions [numVoxels x 3] then double normals [numVoxels x 3] (x y z for each voxel)
+// The binary file is read with one fread each into the position and normal (vectorCart) arrays.  Binary files
+// are written by bw_mesh2vox.m (see bw_write_vox_file.m).
+//
+//		(c) Douglas O. Cheyne, 2022  All rights reserved.
+//
+//		revisions:
+//		1.0  - first version
+//
+// ************************************
+
+#ifndef VOXFILE_H
+#define VOXFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mex.h"
+
+#include "../../../ctflib/headers/datasetUtils.h"
+
+#define VOX_FILE_IDENT		"BWVOX01"
+
+typedef struct vox_file_header
+{
+	char		ident[8];
+	int			endianCheck;
+	int			numVoxels;
+} vox_file_header;			// 16 bytes
+
+
+// read numVoxels x,y,z triplets into vectorCart array
+static bool readVoxVectors( FILE *fp, vectorCart *vectors, int numVoxels )
+{
+	if ( sizeof(vectorCart) == 3 * sizeof(double) )
+		return ( fread( vectors, sizeof(vectorCart), numVoxels, fp ) == (size_t)numVoxels );
+
+	for (int i=0; i<numVoxels; i++)
+	{
+		double v[3];
+		if ( fread( v, sizeof(double), 3, fp ) != 3 )
+			return (false);
+		vectors[i].x = v[0];
+		vectors[i].y = v[1];
+		vectors[i].z = v[2];
+	}
+	return (true);
+}
+
+// parse next number in ASCII vox file line
+static double parseVoxValue( char **p )
+{
+	char *end;
+	double val = strtod( *p, &end );
+	*p = end;
+	return (val);
+}
+
+// read vox file (binary or ASCII) and allocate voxel and normal lists.  Returns number of voxels or -1 on error.
+static int readVoxFile( const char *fileName, vectorCart **voxels, vectorCart **normals )
+{
+	vox_file_header		header;
+	char				s[256];
+	int					numVoxels = 0;
+	bool				isBinary;
+
+	*voxels = NULL;
+	*normals = NULL;
+
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == NULL)
+	{
+		mexPrintf("Couldn't open voxfile  %s\n", fileName);
+		return (-1);
+	}
+
+	isBinary = ( fread( &header, sizeof(vox_file_header), 1, fp ) == 1 &&
+				 memcmp( header.ident, VOX_FILE_IDENT, strlen(VOX_FILE_IDENT) + 1 ) == 0 );
+	if (isBinary)
+	{
+		if (header.endianCheck != 1)
+		{
+			mexPrintf("vox file %s was written on a computer with different byte order\n", fileName);
+			fclose(fp);
+			return (-1);
+		}
+		numVoxels = header.numVoxels;
+	}
+	else
+	{
+		rewind(fp);
+		if ( fgets(s, 256, fp) == NULL || sscanf(s, "%d", &numVoxels) != 1 )
+		{
+			mexPrintf("Couldn't read number of voxels from voxfile %s\n", fileName);
+			fclose(fp);
+			return (-1);
+		}
+	}
+	if (numVoxels < 1)
+	{
+		mexPrintf("No voxels in voxfile %s\n", fileName);
+		fclose(fp);
+		return (-1);
+	}
+
+	*voxels = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
+	*normals = (vectorCart *)malloc( sizeof(vectorCart) * numVoxels );
+	if ( *voxels == NULL || *normals == NULL )
+	{
+		mexPrintf("Could not allocate memory for voxel lists\n");
+		free(*voxels);
+		free(*normals);
+		*voxels = NULL;
+		*normals = NULL;
+		fclose(fp);
+		return (-1);
+	}
+
+	bool ok = true;
+	if (isBinary)
+		ok = readVoxVectors( fp, *voxels, numVoxels ) && readVoxVectors( fp, *normals, numVoxels );
+	else
+	{
+		for (int i=0; ok && i<numVoxels; i++)
+		{
+			if ( fgets(s, 256, fp) == NULL )
+			{
+				ok = false;
+				break;
+			}
+			char *p = s;
+			(*voxels)[i].x = parseVoxValue( &p );
+			(*voxels)[i].y = parseVoxValue( &p );
+			(*voxels)[i].z = parseVoxValue( &p );
+			(*normals)[i].x = parseVoxValue( &p );
+			(*normals)[i].y = parseVoxValue( &p );
+			(*normals)[i].z = parseVoxValue( &p );
+		}
+	}
+	fclose(fp);
+
+	if ( !ok )
+	{
+		mexPrintf("Error reading voxfile %s (expected %d voxels)\n", fileName, numVoxels);
+		free(*voxels);
+		free(*normals);
+		*voxels = NULL;
+		*normals = NULL;
+		return (-1);
+	}
+
+	return (numVoxels);
+}
+
+// write ASCII vox file with computed orientations
+static bool writeVoxFile( const char *fileName, int numVoxels, vectorCart *voxels, vectorCart *normals )
+{
+	FILE *fp = fopen(fileName, "w");
+	if ( fp == NULL)
+		return (false);
+
+	fprintf(fp, "%d\n", numVoxels);
+	for (int i=0; i< numVoxels; i++)
+	{
+		fprintf(fp, "%.2f\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\n",
+				voxels[i].x, voxels[i].y, voxels[i].z,
+				normals[i].x, normals[i].y, normals[i].z);
+	}
+	return ( fclose(fp) == 0 );
+}
+
+#endif
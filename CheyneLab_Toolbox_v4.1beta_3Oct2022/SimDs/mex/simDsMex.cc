@@ -1,8 +1,10 @@
 // D. Cheyne March 2020
 //    -edited for release version
 //    -removed checking for bad channels and commented out code
+// Oct 2022 - version 1.5 added optional lineFilterFreq argument - removes line frequency and harmonics
+//    from simulated data using the notch filter bank in notchBank.h
 //
-const double	VERSION_NO = 1.4;
+const double	VERSION_NO = 1.5;
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +18,7 @@ const double	VERSION_NO = 1.4;
 #include "../../../ctflib/headers/BWFilter.h"
 #include "../../../ctflib/headers/sourceUtils.h"
 #include "../../../ctflib/headers/path.h"
+#include "../../BrainWave_Toolbox_4.0/mex/notchBank.h"
 
 // Globals
 
@@ -57,7 +60,7 @@ bool	generateSourceData (double *sourceData, sim_params & params, int numSamples
 bool 	simulation_Ds(int gotData,char dsName[256],int gotGeomFile, char geomFileName[256],int gotSim, char simFileName[256], int gotFile, char newDsName[256],int addBrainNoise,
 		 int hasOrigin, vectorCart sphereOrigin,int addNoise,double	peakNoise,double highPassFreq,double lowPassFreq,int rotateDipoles,int selectedGradient, int gotTrials, int numTrials,
 		 int gotSamples, int numSamples, int gotSampleRate,double sampleRate,int useSingleSphere, char headModelFile[256],int dumpForward, char dumpFileName[256],
-		 int verbose, int forceOverwrite, int computeMagnetic, int writeADC);
+		 int verbose, int forceOverwrite, int computeMagnetic, int writeADC, double lineFilterFreq);
 
 
 extern "C"
@@ -103,6 +106,7 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]){
 	int forceOverwrite;
 	int computeMagnetic;
 	int writeADC;
+	double lineFilterFreq = 0.0;
 
 	int buflen;
 	int status;
@@ -259,6 +263,13 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]){
 	dataPtr = mxGetPr(prhs[30]);
 	writeADC = (int)dataPtr[0];
 	
+	// optional
+	if (nrhs > 31)
+	{
+		dataPtr = mxGetPr(prhs[31]);
+		lineFilterFreq = dataPtr[0];
+	}
+	
 	
 	plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
 	errCode = mxGetPr(plhs[0]);
@@ -267,7 +278,7 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]){
 	err = simulation_Ds(gotData,dsName,gotGeomFile, geomFileName,gotSim, simFileName, gotFile, newDsName,addBrainNoise,
 						hasOrigin, sphereOrigin,addNoise,peakNoise,highPassFreq,lowPassFreq,rotateDipoles,selectedGradient,gotTrials,numTrials,
 						gotSamples, numSamples, gotSampleRate, sampleRate,useSingleSphere, headModelFile,dumpForward, dumpFileName,
-						verbose, forceOverwrite, computeMagnetic, writeADC);
+						verbose, forceOverwrite, computeMagnetic, writeADC, lineFilterFreq);
 
 	errCode[0] = err;
 
@@ -287,7 +298,7 @@ void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[]){
 bool simulation_Ds(int gotData,char dsName[256],int gotGeomFile, char geomFileName[256],int gotSim, char simFileName[256], int gotFile, char newDsName[256],int addBrainNoise,
 		 int hasOrigin, vectorCart sphereOrigin,int addNoise,double peakNoise,double highPassFreq,double lowPassFreq,int rotateDipoles,int selectedGradient, int gotTrials, int numTrials,
 		 int gotSamples, int numSamples, int gotSampleRate,double sampleRate,int useSingleSphere, char headModelFile[256],int dumpForward, char dumpFileName[256],
-		 int verbose, int forceOverwrite, int computeMagnetic, int writeADC)
+		 int verbose, int forceOverwrite, int computeMagnetic, int writeADC, double lineFilterFreq)
 {
     
 	char			basePath[256];
@@ -311,6 +322,7 @@ bool simulation_Ds(int gotData,char dsName[256],int gotGeomFile, char geomFileNa
 	
 	noiseSD = peakNoise/3.0;
 	filter_params	fparams;
+	notch_bank_params	notchParams;
 
 	// defaults
 	
@@ -567,10 +579,21 @@ bool simulation_Ds(int gotData,char dsName[256],int gotGeomFile, char geomFileNa
 		return(0);
 	}
 	
+	if (lineFilterFreq > 0.0)
+	{
+		if (build_line_filter (&notchParams, lineFilterFreq, 3.0, sampleRate, true) == -1)
+		{
+			mexPrintf("Could not build line filter.  Exiting\n");
+			return(0);
+		}
+	}
+	
 	if (addNoise)
 		mexPrintf("Adding Gaussian noise with peak-to-peak amplitude of %g fT (sd = %.1f fT) to simulated data...\n", peakNoise, noiseSD);
 
 	mexPrintf("Bandpass filtering data from %g to %g Hz...\n", highPassFreq, lowPassFreq);
+	if (lineFilterFreq > 0.0)
+		mexPrintf("Notch filtering powerline (%.1f Hz) and harmonics...\n", lineFilterFreq);
 
 	
 	/////// memory allocation //////////
@@ -978,6 +1001,8 @@ bool simulation_Ds(int gotData,char dsName[256],int gotGeomFile, char geomFileNa
 				for (int k=0; k< numSamples; k++)
 					trialBuffer[k] = simulatedTrialData[i][k];
 				applyFilter( trialBuffer, simulatedTrialData[i], numSamples, &fparams);
+				if (lineFilterFreq > 0.0)
+					applyNotchBank( simulatedTrialData[i], simulatedTrialData[i], numSamples, &notchParams);
 			}
 		}
 		